@@ -0,0 +1,417 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file bench.c
+ * This file contains the microbenchmarks of the tracer. All input images are
+ * generated with rastergen(), thus the results are comparable between
+ * different versions. Each benchmark is repeated several times and the
+ * fastest run is reported.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "memimg.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+#define BENCH_SEED 0x5eed
+#define BENCH_LAYERS 16
+#define BENCH_REPS 3
+#define MAXSIZES 16
+
+
+static int reps_ = BENCH_REPS;
+//! number of threads for scan_layer_mt()
+static int threads_;
+//! store the contours as chain code
+static int compact_;
+
+
+static double now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1E9;
+}
+
+
+static void report(const char *name, const char *img, const memimg_t *mem, double t, long vertices)
+{
+   printf("%-16s %-9s %5dx%-5d %10.3f ms %9.2f Mpix/s", name, img, mem->width, mem->height, t * 1E3,
+         t > 0 ? (double) mem->width * mem->height / t / 1E6 : 0);
+   if (vertices >= 0)
+      printf(" %12.0f vertices/s", t > 0 ? vertices / t : 0);
+   printf("\n");
+   fflush(stdout);
+}
+
+
+static int layer_value(int j, int nlayers)
+{
+   return MAXVAL - MAXVAL / (nlayers + 1) * (j + 1);
+}
+
+
+static void free_layers(layer_t *l, int nlayers)
+{
+   for (int j = 0; j < nlayers; j++)
+   {
+      for (int i = 0; i < l[j].plist_cnt; i++)
+      {
+         mt_free(l[j].plist[i]);
+         if (l[j].compact)
+            chain_free(&l[j].chain[i]);
+      }
+      mt_free(l[j].plist);
+      mt_free(l[j].n);
+      mt_free(l[j].chain);
+      memset(&l[j], 0, sizeof(l[j]));
+   }
+}
+
+
+static long count_vertices(const layer_t *l, int nlayers)
+{
+   long n = 0;
+
+   for (int j = 0; j < nlayers; j++)
+      for (int i = 0; i < l[j].plist_cnt; i++)
+         n += l[j].n[i];
+   return n;
+}
+
+
+static void bench_memprep(const memimg_t *src, const char *img)
+{
+   memimg_t mem;
+   double t, tmin = 0;
+
+   for (int r = 0; r < reps_; r++)
+   {
+      if (memimg_copy((memimg_t*) src, &mem) == -1)
+         return;
+      t = now();
+      memprep(&mem, c2grey, NULL);
+      t = now() - t;
+      if (!r || t < tmin)
+         tmin = t;
+      memimg_free(&mem);
+   }
+   report("memprep/c2grey", img, src, tmin, -1);
+}
+
+
+static void bench_memstretch(const memimg_t *src, const char *img)
+{
+   memimg_t mem;
+   double t, tmin = 0;
+
+   for (int r = 0; r < reps_; r++)
+   {
+      if (memimg_copy((memimg_t*) src, &mem) == -1)
+         return;
+      t = now();
+      memstretch(&mem);
+      t = now() - t;
+      if (!r || t < tmin)
+         tmin = t;
+      memimg_free(&mem);
+   }
+   report("memstretch", img, src, tmin, -1);
+}
+
+
+/*! Benchmark next_unvisited() on an image without any marks. Every seed is
+ * skipped like a visited contour in scan_layer().
+ * @param mask Use the threshold mask if 1.
+ */
+static void bench_next_unvisited(memimg_t *mem, const char *img, int mask)
+{
+   double t, tsum, tmin = 0;
+   pos_t p;
+   int v;
+
+   if (mask && memimg_mask_init(mem) == -1)
+      return;
+
+   for (int r = 0; r < reps_; r++)
+   {
+      tsum = 0;
+      for (int j = 0; j < BENCH_LAYERS; j++)
+      {
+         v = layer_value(j, BENCH_LAYERS);
+         if (mask)
+            memimg_mask(mem, v);
+         t = now();
+         memset(&p, 0, sizeof(p));
+         while (next_unvisited(mem, &p, v))
+         {
+            // skip seed and the remaining run of inside pixels
+            for (p.x++; p.x < mem->width && (memimg_get(mem, p.x, p.y) & ~VALL) >= v; p.x++);
+            if (p.x >= mem->width)
+            {
+               p.x = 0;
+               p.y++;
+            }
+         }
+         tsum += now() - t;
+      }
+      t = tsum / BENCH_LAYERS;
+      if (!r || t < tmin)
+         tmin = t;
+   }
+   mem->mask_v = -1;
+   report(mask ? "next_unvisited/mask" : "next_unvisited", img, mem, tmin, -1);
+}
+
+
+static void bench_mask(memimg_t *mem, const char *img)
+{
+   double t, tmin = 0;
+
+   if (memimg_mask_init(mem) == -1)
+      return;
+
+   for (int r = 0; r < reps_; r++)
+   {
+      t = now();
+      for (int j = 0; j < BENCH_LAYERS; j++)
+         memimg_mask(mem, layer_value(j, BENCH_LAYERS));
+      t = (now() - t) / BENCH_LAYERS;
+      if (!r || t < tmin)
+         tmin = t;
+   }
+   mem->mask_v = -1;
+   report("memimg_mask", img, mem, tmin, -1);
+}
+
+
+static void bench_scan_layer(memimg_t *mem, const char *img, layer_t *l, int nthreads)
+{
+   double t, tmin = 0;
+   char buf[32];
+
+   for (int r = 0; r < reps_; r++)
+   {
+      free_layers(l, BENCH_LAYERS);
+      t = now();
+      for (int j = 0; j < BENCH_LAYERS; j++)
+      {
+         l[j].v = layer_value(j, BENCH_LAYERS);
+         l[j].compact = compact_;
+         scan_layer_mt(&l[j], mem, nthreads);
+      }
+      t = now() - t;
+      if (!r || t < tmin)
+         tmin = t;
+   }
+   if (nthreads > 1)
+      snprintf(buf, sizeof(buf), "scan_layer_mt/%d x16%s", nthreads, compact_ ? "c" : "");
+   else
+      snprintf(buf, sizeof(buf), "scan_layer x16%s", compact_ ? "c" : "");
+   report(buf, img, mem, tmin, count_vertices(l, BENCH_LAYERS));
+}
+
+
+static void bench_export(const memimg_t *mem, const char *img, layer_t *l)
+{
+   double t, tmin = 0;
+   long n = count_vertices(l, BENCH_LAYERS);
+
+   for (int r = 0; r < reps_; r++)
+   {
+      t = now();
+      export_osm(l, "/dev/null", BENCH_LAYERS, (memimg_t*) mem);
+      t = now() - t;
+      if (!r || t < tmin)
+         tmin = t;
+   }
+   report("export_osm", img, mem, tmin, n);
+
+   for (int r = 0; r < reps_; r++)
+   {
+      t = now();
+      export_svg(l, "/dev/null", BENCH_LAYERS, (memimg_t*) mem);
+      t = now() - t;
+      if (!r || t < tmin)
+         tmin = t;
+   }
+   report("export_svg", img, mem, tmin, n);
+}
+
+
+/*! Benchmark scan() and reduce() on a single large contour, which is a
+ * filled circle covering most of the image.
+ */
+static void bench_single(int size)
+{
+   memimg_t mem;
+   pos_t p, *plist = NULL, *rlist;
+   double t, tmin = 0, tred = 0;
+   int n = 0, m;
+   long r2 = (long) size * size * 2 / 10;
+
+   mem.width = mem.height = size;
+   if (memimg_init(&mem) == -1)
+      return;
+
+   for (int y = 0; y < size; y++)
+      for (int x = 0; x < size; x++)
+         memimg_put(&mem, x, y, (long) (x - size / 2) * (x - size / 2) + (long) (y - size / 2) * (y - size / 2) < r2 ? MAXVAL : 0);
+
+   for (int r = 0; r < reps_; r++)
+   {
+      mt_free(plist);
+      clear_marks(&mem);
+      memset(&p, 0, sizeof(p));
+      next_unvisited(&mem, &p, MAXVAL / 2);
+      t = now();
+      n = scan(&mem, MAXVAL / 2, &p, &plist);
+      t = now() - t;
+      if (!r || t < tmin)
+         tmin = t;
+   }
+   report("scan/single", "circle", &mem, tmin, n);
+
+   if ((rlist = mt_malloc(MT_CONTOUR, n * sizeof(*rlist))) != NULL)
+   {
+      for (int r = 0; r < reps_; r++)
+      {
+         memcpy(rlist, plist, n * sizeof(*rlist));
+         t = now();
+         m = reduce(rlist, n, 5);
+         t = now() - t;
+         if (!r || t < tred)
+            tred = t;
+      }
+      report("reduce", "circle", &mem, tred, n);
+      mt_free(rlist);
+      (void) m;
+   }
+
+   mt_free(plist);
+   memimg_free(&mem);
+}
+
+
+static void bench_image(int type, int size)
+{
+   memimg_t src, mem;
+   layer_t l[BENCH_LAYERS];
+   const char *img = rastergen_name(type);
+
+   if (rastergen(&src, type, size, size, BENCH_SEED) == -1)
+   {
+      log_msg(LOG_ERR, "rastergen() failed");
+      return;
+   }
+
+   bench_memprep(&src, img);
+   if (memimg_copy(&src, &mem) == -1)
+      return;
+   memprep(&mem, c2grey, NULL);
+   bench_memstretch(&mem, img);
+   bench_mask(&mem, img);
+   bench_next_unvisited(&mem, img, 0);
+   bench_next_unvisited(&mem, img, 1);
+
+   memset(l, 0, sizeof(l));
+   if (threads_ > 1)
+      bench_scan_layer(&mem, img, l, threads_);
+   bench_scan_layer(&mem, img, l, 1);
+   bench_export(&mem, img, l);
+   free_layers(l, BENCH_LAYERS);
+
+   memimg_free(&mem);
+   memimg_free(&src);
+}
+
+
+static void usage(const char *s)
+{
+   printf("usage: %s [OPTIONS] [<size> ...]\n"
+          "   OPTIONS\n"
+          "      -c ............ Store the contours as chain code.\n"
+          "      -h ............ Print this message.\n"
+          "      -j <n> ........ Additionally benchmark scan_layer_mt() with <n> threads.\n"
+          "      -r <n> ........ Number of repetitions (default = %d).\n"
+          "      -t <type> ..... Benchmark only images of <type>.\n", s, BENCH_REPS);
+}
+
+
+int main(int argc, char **argv)
+{
+   int sizes[MAXSIZES] = {256, 1024};
+   int nsizes = 2, type = -1, n;
+
+   init_log("stderr", LOG_WARN);
+
+   while ((n = getopt(argc, argv, "chj:r:t:")) != -1)
+      switch (n)
+      {
+         case 'c':
+            compact_ = 1;
+            break;
+
+         case 'j':
+            threads_ = atoi(optarg);
+            break;
+
+         case 'r':
+            if ((reps_ = atoi(optarg)) <= 0)
+               reps_ = 1;
+            break;
+
+         case 't':
+            if ((type = rastergen_type(optarg)) == -1)
+            {
+               log_msg(LOG_ERR, "unknown image type '%s'", optarg);
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+      }
+
+   if (optind < argc)
+      for (nsizes = 0; optind < argc && nsizes < MAXSIZES; optind++)
+         if ((sizes[nsizes] = atoi(argv[optind])) > 0)
+            nsizes++;
+
+   printf("# %-14s %-9s %11s %13s %16s %23s\n", "benchmark", "image", "size", "time", "throughput", "");
+   for (int s = 0; s < nsizes; s++)
+   {
+      for (int t = 0; t < RG_MAX; t++)
+         if (type == -1 || type == t)
+            bench_image(t, sizes[s]);
+      bench_single(sizes[s]);
+   }
+
+   return 0;
+}
+
@@ -0,0 +1,502 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file bezier.c
+ * This file contains the fitting of cubic Bezier curves to the contours.
+ * First the corners are detected, these are the vertices at which the
+ * direction of the contour changes by more than BEZ_CORNER. Directions are
+ * measured to the vertices at a distance of BEZ_WINDOW, thus the steps of
+ * pixel edges are not taken as corners, and of several neighbouring
+ * candidates just the sharpest one is a corner. The pieces
+ * between the corners are fitted by least squares with the algorithm of
+ * Schneider (Graphics Gems, 1990): the vertices are parameterized by chord
+ * length and a curve with the tangents of the ends is fitted. If the
+ * distance of a vertex to the curve exceeds the error, the parameters are
+ * improved by Newton-Raphson iteration, or the piece is split at the
+ * vertex of the largest error with a common tangent.
+ * The curves pass through the corners and the ends of the contours, a
+ * closed contour without corners is smooth at its first vertex. A piece of
+ * a single edge is a straight line, its control points are its ends.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! minimum change of direction of a corner (in degrees)
+#define BEZ_CORNER 60
+//! distance (in pixels) of the vertices which define the directions
+#define BEZ_WINDOW 3
+//! maximum number of reparameterizations before a piece is split
+#define BEZ_ITER 4
+
+
+typedef struct vec
+{
+   double x, y;
+} vec_t;
+
+//! state of the fitting of one contour
+typedef struct bezfit
+{
+   //! vertices of the contour
+   const vec_t *d;
+   int n, closed;
+   //! parameters of the vertices of the current piece
+   double *u;
+   //! square of the maximum distance
+   double err2;
+   curve_t *c;
+} bezfit_t;
+
+
+static vec_t v_sub(vec_t a, vec_t b)
+{
+   return (vec_t) {a.x - b.x, a.y - b.y};
+}
+
+
+static vec_t v_add(vec_t a, vec_t b)
+{
+   return (vec_t) {a.x + b.x, a.y + b.y};
+}
+
+
+static vec_t v_scale(vec_t a, double s)
+{
+   return (vec_t) {a.x * s, a.y * s};
+}
+
+
+static double v_dot(vec_t a, vec_t b)
+{
+   return a.x * b.x + a.y * b.y;
+}
+
+
+/*! Normalize a vector, a null vector is returned unchanged.
+ */
+static vec_t v_norm(vec_t a)
+{
+   double l = hypot(a.x, a.y);
+
+   return l > 0 ? v_scale(a, 1 / l) : a;
+}
+
+
+/*! Find the first vertex from vertex i in direction dir (-1 or 1) with a
+ * distance of at least BEZ_WINDOW. Closed contours wrap around, the search
+ * stops at the ends of open contours.
+ */
+static int bez_reach(const bezfit_t *bf, int i, int dir)
+{
+   int j = i;
+
+   for (int k = 0; k < bf->n - 1; k++)
+   {
+      j += dir;
+      // the first and the last vertex of a closed contour are the same
+      if (j < 0)
+         j = bf->closed ? bf->n - 2 : 0;
+      else if (j > bf->n - 1)
+         j = bf->closed ? 1 : bf->n - 1;
+      if (hypot(bf->d[j].x - bf->d[i].x, bf->d[j].y - bf->d[i].y) >= BEZ_WINDOW || (!bf->closed && (!j || j == bf->n - 1)))
+         break;
+   }
+   return j;
+}
+
+
+/*! Tangent of the contour at vertex i in direction dir (-1 or 1).
+ */
+static vec_t bez_tangent(const bezfit_t *bf, int i, int dir)
+{
+   return v_norm(v_sub(bf->d[bez_reach(bf, i, dir)], bf->d[i]));
+}
+
+
+/*! Cosine of the change of direction at vertex i.
+ */
+static double bez_turn(const bezfit_t *bf, int i)
+{
+   return -v_dot(bez_tangent(bf, i, -1), bez_tangent(bf, i, 1));
+}
+
+
+/*! Test if vertex i is a corner, i.e. its change of direction is sharp and
+ * larger than that of the vertices within BEZ_WINDOW.
+ * @param cs Cosines of the changes of direction of all vertices.
+ */
+static int bez_corner(const bezfit_t *bf, const double *cs, int i)
+{
+   if (cs[i] >= cos(BEZ_CORNER * M_PI / 180))
+      return 0;
+
+   for (int dir = -1; dir <= 1; dir += 2)
+      for (int k = 0, j = i + dir; k < bf->n - 1; k++, j += dir)
+      {
+         if (j < 0)
+            j = bf->closed ? bf->n - 2 : 0;
+         else if (j > bf->n - 1)
+            j = bf->closed ? 1 : bf->n - 1;
+         if (j == i || hypot(bf->d[j].x - bf->d[i].x, bf->d[j].y - bf->d[i].y) >= BEZ_WINDOW)
+            break;
+         // the last vertex of a closed contour is the first one
+         if (cs[j] < cs[i] || (cs[j] == cs[i] && (bf->closed && j == bf->n - 1 ? 0 : j) < i))
+            return 0;
+         if (!bf->closed && (!j || j == bf->n - 1))
+            break;
+      }
+   return 1;
+}
+
+
+/*! Evaluate a Bezier curve of degree deg <= 3 at t with de Casteljau.
+ */
+static vec_t bez_eval(const vec_t *b, int deg, double t)
+{
+   vec_t v[4];
+
+   memcpy(v, b, (deg + 1) * sizeof(*v));
+   for (int i = 1; i <= deg; i++)
+      for (int j = 0; j <= deg - i; j++)
+         v[j] = v_add(v_scale(v[j], 1 - t), v_scale(v[j + 1], t));
+   return v[0];
+}
+
+
+/*! Improve the parameter u of the point p of the curve b with one step of
+ * Newton-Raphson. The result is limited to the curve, i.e. 0 <= u <= 1.
+ */
+static double newton(const vec_t *b, vec_t p, double u)
+{
+   vec_t d1[3], d2[2], q, q1, q2;
+   double num, den;
+
+   for (int i = 0; i < 3; i++)
+      d1[i] = v_scale(v_sub(b[i + 1], b[i]), 3);
+   for (int i = 0; i < 2; i++)
+      d2[i] = v_scale(v_sub(d1[i + 1], d1[i]), 2);
+
+   q = v_sub(bez_eval(b, 3, u), p);
+   q1 = bez_eval(d1, 2, u);
+   q2 = bez_eval(d2, 1, u);
+   num = v_dot(q, q1);
+   den = v_dot(q1, q1) + v_dot(q, q2);
+   if (den != 0)
+      u -= num / den;
+   return u < 0 ? 0 : u > 1 ? 1 : u;
+}
+
+
+/*! Fit a curve with the tangents t1 and t2 at the ends to the vertices
+ * first to last by least squares.
+ */
+static void bez_generate(const bezfit_t *bf, int first, int last, vec_t t1, vec_t t2, vec_t *b)
+{
+   const vec_t *d = bf->d;
+   double c00 = 0, c01 = 0, c11 = 0, x0 = 0, x1 = 0, det, al, ar, seg, u, v;
+   vec_t a0, a1, tmp;
+
+   for (int i = first; i <= last; i++)
+   {
+      u = bf->u[i - first];
+      v = 1 - u;
+      a0 = v_scale(t1, 3 * u * v * v);
+      a1 = v_scale(t2, 3 * u * u * v);
+      c00 += v_dot(a0, a0);
+      c01 += v_dot(a0, a1);
+      c11 += v_dot(a1, a1);
+      tmp = v_sub(d[i], v_add(v_scale(d[first], v * v * (v + 3 * u)), v_scale(d[last], u * u * (u + 3 * v))));
+      x0 += v_dot(a0, tmp);
+      x1 += v_dot(a1, tmp);
+   }
+
+   det = c00 * c11 - c01 * c01;
+   al = det != 0 ? (x0 * c11 - x1 * c01) / det : 0;
+   ar = det != 0 ? (c00 * x1 - c01 * x0) / det : 0;
+
+   // the heuristic of Wu/Barsky if the solution is degenerated
+   seg = hypot(d[last].x - d[first].x, d[last].y - d[first].y);
+   if (al < 1E-6 * seg || ar < 1E-6 * seg)
+      al = ar = seg / 3;
+
+   b[0] = d[first];
+   b[1] = v_add(d[first], v_scale(t1, al));
+   b[2] = v_add(d[last], v_scale(t2, ar));
+   b[3] = d[last];
+}
+
+
+/*! Find the vertex with the largest distance to the curve.
+ * @param split Pointer to a variable which receives the index of the vertex.
+ * @return The square of the distance, it is infinite if the curve is
+ * degenerated.
+ */
+static double max_error(const bezfit_t *bf, int first, int last, const vec_t *b, int *split)
+{
+   double max = 0, e;
+   vec_t p;
+
+   *split = (first + last + 1) / 2;
+   for (int i = first + 1; i < last; i++)
+   {
+      p = v_sub(bez_eval(b, 3, bf->u[i - first]), bf->d[i]);
+      if (isnan(e = v_dot(p, p)))
+         e = HUGE_VAL;
+      if (e >= max)
+      {
+         max = e;
+         *split = i;
+      }
+   }
+   return max;
+}
+
+
+static void bez_add(bezfit_t *bf, const vec_t *b, int last)
+{
+   double *p = bf->c->p + 2 + 6 * bf->c->n;
+
+   for (int i = 1; i < 4; i++)
+   {
+      *p++ = b[i].x;
+      *p++ = b[i].y;
+   }
+   bf->c->idx[bf->c->n++] = last;
+}
+
+
+/*! Fit curves to the vertices first to last.
+ * @param t1 Tangent at first in the direction of the contour.
+ * @param t2 Tangent at last in the opposite direction.
+ */
+static void bez_fit(bezfit_t *bf, int first, int last, vec_t t1, vec_t t2)
+{
+   const vec_t *d = bf->d;
+   vec_t b[4], tc;
+   double e;
+   int split;
+
+   // a single edge is a straight line
+   if (last - first == 1)
+   {
+      b[0] = b[1] = d[first];
+      b[2] = b[3] = d[last];
+      bez_add(bf, b, last);
+      return;
+   }
+
+   // parameters by chord length
+   bf->u[0] = 0;
+   for (int i = first + 1; i <= last; i++)
+      bf->u[i - first] = bf->u[i - first - 1] + hypot(d[i].x - d[i - 1].x, d[i].y - d[i - 1].y);
+   for (int i = first + 1; i <= last; i++)
+      bf->u[i - first] = bf->u[last - first] > 0 ? bf->u[i - first] / bf->u[last - first] : (double) (i - first) / (last - first);
+
+   bez_generate(bf, first, last, t1, t2, b);
+   e = max_error(bf, first, last, b, &split);
+   if (e < bf->err2)
+   {
+      bez_add(bf, b, last);
+      return;
+   }
+
+   // the parameters are improved if the error is not too large
+   for (int k = 0; k < BEZ_ITER && e < 4 * bf->err2; k++)
+   {
+      for (int i = first + 1; i < last; i++)
+         bf->u[i - first] = newton(b, d[i], bf->u[i - first]);
+      bez_generate(bf, first, last, t1, t2, b);
+      if ((e = max_error(bf, first, last, b, &split)) < bf->err2)
+      {
+         bez_add(bf, b, last);
+         return;
+      }
+   }
+
+   tc = v_norm(v_sub(bez_tangent(bf, split, -1), bez_tangent(bf, split, 1)));
+   bez_fit(bf, first, split, t1, tc);
+   bez_fit(bf, split, last, v_scale(tc, -1), t2);
+}
+
+
+/*! Fit cubic Bezier curves to the vertices of a contour.
+ * @param p Pointer to the vertices.
+ * @param n Number of vertices.
+ * @param closed 1 if the last vertex equals the first one.
+ * @param err Maximum distance of the vertices to the curves in pixels.
+ * @param c Pointer to the curves which are initialized, they must be freed
+ * with curve_free().
+ * @return The number of curve segments or -1 on error.
+ */
+int bezier_fit(const pos_t *p, int n, int closed, double err, curve_t *c)
+{
+   bezfit_t bf;
+   vec_t *d, t1, t2;
+   double *cs;
+   int *brk, nbrk = 0, c0 = 0;
+
+   memset(c, 0, sizeof(*c));
+   c->closed = closed;
+   if (n < 2)
+      return 0;
+
+   if ((d = mt_malloc(MT_OTHER, n * sizeof(*d))) == NULL)
+      return -1;
+   bf.u = mt_malloc(MT_OTHER, n * sizeof(*bf.u));
+   cs = mt_malloc(MT_OTHER, n * sizeof(*cs));
+   brk = mt_malloc(MT_OTHER, n * sizeof(*brk));
+   c->p = mt_malloc(MT_CONTOUR, (2 + 6 * (n - 1)) * sizeof(*c->p));
+   c->idx = mt_malloc(MT_CONTOUR, (n - 1) * sizeof(*c->idx));
+   if (bf.u == NULL || cs == NULL || brk == NULL || c->p == NULL || c->idx == NULL)
+   {
+      mt_free(d);
+      mt_free(bf.u);
+      mt_free(cs);
+      mt_free(brk);
+      curve_free(c);
+      return -1;
+   }
+
+   for (int i = 0; i < n; i++)
+      d[i] = (vec_t) {p[i].xf, p[i].yf};
+   bf.d = d;
+   bf.n = n;
+   // a closed contour with less than 3 different vertices has ends
+   bf.closed = closed && n > 3;
+   bf.err2 = err * err;
+   bf.c = c;
+   c->p[0] = d[0].x;
+   c->p[1] = d[0].y;
+
+   for (int i = 0; i < n - bf.closed; i++)
+      cs[i] = !bf.closed && (!i || i == n - 1) ? 1 : bez_turn(&bf, i);
+   if (bf.closed)
+   {
+      cs[n - 1] = cs[0];
+      c0 = bez_corner(&bf, cs, 0);
+   }
+
+   // the ends of open contours and the corners break the contour, the
+   // first vertex of a closed contour is a smooth break unless it is a
+   // corner
+   for (int i = 0; i < n; i++)
+      if (!i || i == n - 1)
+         brk[nbrk++] = !bf.closed || c0 ? i : -1 - i;
+      else if (bez_corner(&bf, cs, i))
+         brk[nbrk++] = i;
+
+   for (int k = 0; k < nbrk - 1; k++)
+   {
+      // smooth breaks (negative) get the tangent of both sides
+      if (brk[k] < 0)
+         t1 = v_norm(v_sub(bez_tangent(&bf, 0, 1), bez_tangent(&bf, 0, -1)));
+      else
+         t1 = bez_tangent(&bf, brk[k], 1);
+      if (brk[k + 1] < 0)
+         t2 = v_scale(v_norm(v_sub(bez_tangent(&bf, 0, 1), bez_tangent(&bf, 0, -1))), -1);
+      else
+         t2 = bez_tangent(&bf, brk[k + 1], -1);
+      bez_fit(&bf, brk[k] < 0 ? -1 - brk[k] : brk[k], brk[k + 1] < 0 ? -1 - brk[k + 1] : brk[k + 1], t1, t2);
+   }
+
+   mt_free(brk);
+   mt_free(cs);
+   mt_free(bf.u);
+   mt_free(d);
+   return c->n;
+}
+
+
+/*! Free the curves of a contour.
+ */
+void curve_free(curve_t *c)
+{
+   mt_free(c->p);
+   mt_free(c->idx);
+   memset(c, 0, sizeof(*c));
+}
+
+
+/*! Fit curves to all contours of a layer into l->curve.
+ * @param err Maximum distance of the vertices to the curves in pixels.
+ * @return 0 on success, -1 on error.
+ */
+int bezier_layer(layer_t *l, double err)
+{
+   chain_iter_t it;
+   pos_t *buf = NULL, *p;
+   int size = 0;
+
+   if (l->curve != NULL || !l->plist_cnt)
+      return 0;
+   if ((l->curve = mt_calloc(MT_CONTOUR, l->plist_cnt, sizeof(*l->curve))) == NULL)
+      return -1;
+
+   for (int i = 0; i < l->plist_cnt; i++)
+   {
+      // chain code is decoded into a temporary vertex list
+      if (l->compact)
+      {
+         if (l->n[i] > size)
+         {
+            size = l->n[i];
+            mt_free(buf);
+            if ((buf = mt_malloc(MT_OTHER, size * sizeof(*buf))) == NULL)
+               goto bezier_layer_err;
+         }
+         contour_iter(&it, l, i);
+         for (p = buf; contour_next(&it, p); p++);
+         p = buf;
+      }
+      else
+         p = l->plist[i];
+
+      if (bezier_fit(p, l->n[i], contour_closed(l, i), err, &l->curve[i]) == -1)
+         goto bezier_layer_err;
+   }
+
+   mt_free(buf);
+   return 0;
+
+bezier_layer_err:
+   log_msg(LOG_ERR, "cannot allocate memory for curves");
+   mt_free(buf);
+   bezier_free(l);
+   return -1;
+}
+
+
+/*! Free the curves of all contours of a layer.
+ */
+void bezier_free(layer_t *l)
+{
+   if (l->curve == NULL)
+      return;
+   for (int i = 0; i < l->plist_cnt; i++)
+      curve_free(&l->curve[i]);
+   mt_free(l->curve);
+   l->curve = NULL;
+}
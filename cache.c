@@ -0,0 +1,556 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file cache.c
+ * This file contains the result cache. The contours of all layers are
+ * stored in a file in the cache directory. Its name is a 64 bit hash of the
+ * input file and of all options which change the contours, thus the
+ * contours can be exported again without decoding and tracing the image.
+ * Additionally it contains the state file of incremental tracing, which
+ * holds the prepared image together with its contours.
+ * The files are in native byte order.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+#define CACHE_MAGIC "TRCA"
+#define CACHE_VERSION 1
+#define CACHE_BUFSIZE 65536
+#define STATE_MAGIC "TRST"
+#define STATE_VERSION 1
+
+
+//! header of a cache file
+typedef struct cachehdr
+{
+   char magic[4];
+   int version;
+   int width, height;
+   int nlayers;
+} cachehdr_t;
+
+//! header of a state file, it is followed by the parameters, the pixels,
+//! and the layers
+typedef struct statehdr
+{
+   char magic[4];
+   int version;
+   int width, height;
+   int nlayers;
+   //! length of the parameter string
+   int plen;
+} statehdr_t;
+
+//! journal entry of a state file, p is an offset into the image
+typedef struct statejent
+{
+   long p;
+   int f, c;
+} statejent_t;
+
+//! header of a layer, it is followed by the contours
+typedef struct cachelayer
+{
+   int v;
+   int compact;
+   int cnt;
+} cachelayer_t;
+
+//! header of a contour, it is followed by the vertices or the chain code
+typedef struct cachecont
+{
+   int n;
+   //! value of the pixel of a single point contour
+   int peak;
+} cachecont_t;
+
+
+static uint64_t rotl(uint64_t x, int r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+
+
+static uint64_t hash_word(uint64_t h, uint64_t w)
+{
+   w *= 0x87c37b91114253d5ULL;
+   w = rotl(w, 31);
+   w *= 0x4cf5ad432745937fULL;
+   h ^= w;
+   return rotl(h, 27) * 5 + 0x52dce729;
+}
+
+
+/*! Hash a block of bytes. The length should be a multiple of 8 except for
+ * the last block.
+ */
+static uint64_t hash_block(uint64_t h, const unsigned char *b, size_t len)
+{
+   uint64_t w;
+   size_t i;
+
+   for (i = 0; i + 8 <= len; i += 8)
+   {
+      memcpy(&w, b + i, sizeof(w));
+      h = hash_word(h, w);
+   }
+   if (i < len)
+   {
+      w = 0;
+      memcpy(&w, b + i, len - i);
+      h = hash_word(h, w ^ (len - i));
+   }
+   return h;
+}
+
+
+static uint64_t hash_final(uint64_t h, uint64_t len)
+{
+   h ^= len;
+   h ^= h >> 33;
+   h *= 0xff51afd7ed558ccdULL;
+   h ^= h >> 33;
+   h *= 0xc4ceb9fe1a85ec53ULL;
+   h ^= h >> 33;
+   return h;
+}
+
+
+/*! Calculate the cache key.
+ * @param s Name of the input file.
+ * @param param Options which change the contours.
+ * @param plen Length of param.
+ * @param key Destination buffer for the key as a hex string.
+ * @param size Size of key, should be CACHE_KEYLEN.
+ * @return 0 on success, -1 if the input cannot be read.
+ */
+int cache_key(const char *s, const void *param, size_t plen, char *key, size_t size)
+{
+   unsigned char *buf;
+   uint64_t h = 0, len = 0;
+   size_t n;
+   FILE *f;
+
+   if ((f = fopen(s, "r")) == NULL)
+      return -1;
+
+   if ((buf = mt_malloc(MT_OTHER, CACHE_BUFSIZE)) == NULL)
+   {
+      fclose(f);
+      return -1;
+   }
+
+   while ((n = fread(buf, 1, CACHE_BUFSIZE, f)) > 0)
+   {
+      h = hash_block(h, buf, n);
+      len += n;
+   }
+   mt_free(buf);
+
+   if (ferror(f))
+   {
+      fclose(f);
+      return -1;
+   }
+   fclose(f);
+
+   h = hash_block(h, param, plen);
+   snprintf(key, size, "%016lx", (unsigned long) hash_final(h, len + plen));
+   return 0;
+}
+
+
+static void cache_path(char *buf, size_t size, const char *dir, const char *key)
+{
+   snprintf(buf, size, "%s/%s.trc", dir, key);
+}
+
+
+static int write_layer(FILE *f, const layer_t *l, const memimg_t *mem)
+{
+   cachelayer_t lh;
+   cachecont_t ch;
+   const pos_t *p;
+
+   lh.v = l->v;
+   lh.compact = l->compact;
+   lh.cnt = l->plist_cnt;
+   if (fwrite(&lh, sizeof(lh), 1, f) != 1)
+      return -1;
+
+   for (int i = 0; i < l->plist_cnt; i++)
+   {
+      ch.n = l->n[i];
+      ch.peak = 0;
+      if (ch.n == 1)
+      {
+         p = l->compact ? &(pos_t) {l->chain[i].x, l->chain[i].y, 0, 0} : l->plist[i];
+         ch.peak = memimg_get(mem, p->x, p->y) & ~VALL;
+      }
+      if (fwrite(&ch, sizeof(ch), 1, f) != 1)
+         return -1;
+
+      if (l->compact)
+      {
+         if (fwrite(&l->chain[i], sizeof(l->chain[i]), 1, f) != 1
+               || fwrite(l->chain[i].code, 1, l->chain[i].len, f) != (size_t) l->chain[i].len)
+            return -1;
+      }
+      else if (fwrite(l->plist[i], sizeof(*l->plist[i]), ch.n, f) != (size_t) ch.n)
+         return -1;
+   }
+
+   return 0;
+}
+
+
+/*! Save the contours to the cache. The file is written to a temporary file
+ * first and renamed afterwards, thus concurrent runs never see a partial
+ * file.
+ * @return 0 on success, -1 on error.
+ */
+int cache_save(const char *dir, const char *key, const layer_t *l, int nlayers, const memimg_t *mem)
+{
+   char path[1024], tmp[1040];
+   cachehdr_t hdr;
+   FILE *f;
+   int err = 0;
+
+   cache_path(path, sizeof(path), dir, key);
+   snprintf(tmp, sizeof(tmp), "%s.%d", path, (int) getpid());
+   if ((f = fopen(tmp, "w")) == NULL)
+   {
+      log_errno(LOG_WARN, "fopen()");
+      return -1;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic));
+   hdr.version = CACHE_VERSION;
+   hdr.width = mem->width;
+   hdr.height = mem->height;
+   hdr.nlayers = nlayers;
+
+   if (fwrite(&hdr, sizeof(hdr), 1, f) != 1)
+      err = -1;
+   for (int j = 0; j < nlayers && !err; j++)
+      err = write_layer(f, &l[j], mem);
+
+   if (fclose(f) == EOF)
+      err = -1;
+   if (!err && rename(tmp, path) == -1)
+   {
+      log_errno(LOG_WARN, "rename()");
+      err = -1;
+   }
+   if (err)
+      unlink(tmp);
+
+   return err;
+}
+
+
+static int read_layer(FILE *f, layer_t *l, memimg_t *mem)
+{
+   cachelayer_t lh;
+   cachecont_t ch;
+   chain_t *c;
+   int i;
+
+   memset(l, 0, sizeof(*l));
+   if (fread(&lh, sizeof(lh), 1, f) != 1 || lh.cnt < 0)
+      return -1;
+
+   l->v = lh.v;
+   l->compact = lh.compact;
+   for (i = 0; i < lh.cnt; i++)
+   {
+      if (fread(&ch, sizeof(ch), 1, f) != 1 || ch.n <= 0 || add_plist(l) == -1)
+         return -1;
+      l->n[i] = ch.n;
+      l->plist[i] = NULL;
+      if (l->compact)
+         memset(&l->chain[i], 0, sizeof(l->chain[i]));
+
+      if (l->compact)
+      {
+         c = &l->chain[i];
+         if (fread(c, sizeof(*c), 1, f) != 1 || c->len < 0 || c->n != ch.n)
+         {
+            memset(c, 0, sizeof(*c));
+            return -1;
+         }
+         // the code is decoded without bounds checks later
+         if ((c->code = mt_malloc(MT_LAYER, c->len)) == NULL || fread(c->code, 1, c->len, f) != (size_t) c->len
+               || chain_check(c) == -1)
+            return -1;
+         if (ch.n == 1 && memimg_put(mem, c->x, c->y, ch.peak) == -1)
+            return -1;
+      }
+      else
+      {
+         if ((l->plist[i] = mt_malloc(MT_CONTOUR, ch.n * sizeof(*l->plist[i]))) == NULL
+               || fread(l->plist[i], sizeof(*l->plist[i]), ch.n, f) != (size_t) ch.n)
+            return -1;
+         if (ch.n == 1 && memimg_put(mem, l->plist[i][0].x, l->plist[i][0].y, ch.peak) == -1)
+            return -1;
+      }
+   }
+
+   return 0;
+}
+
+
+/*! Load the contours from the cache.
+ * @param l Pointer to an array of MAXL layers.
+ * @param mem Pointer to an image which is initialized with the size of
+ * the original image. It contains only the values of the single point
+ * contours, which are all the exporters need.
+ * @return The number of layers or -1 if there is no valid entry.
+ */
+int cache_load(const char *dir, const char *key, layer_t *l, memimg_t *mem)
+{
+   char path[1024];
+   cachehdr_t hdr;
+   FILE *f;
+   int j;
+
+   cache_path(path, sizeof(path), dir, key);
+   if ((f = fopen(path, "r")) == NULL)
+      return -1;
+
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, CACHE_MAGIC, sizeof(hdr.magic))
+         || hdr.version != CACHE_VERSION || hdr.nlayers < 0 || hdr.nlayers > MAXL)
+   {
+      log_msg(LOG_WARN, "invalid cache file %s", path);
+      fclose(f);
+      return -1;
+   }
+
+   mem->width = hdr.width;
+   mem->height = hdr.height;
+   if (memimg_init(mem) == -1)
+   {
+      fclose(f);
+      return -1;
+   }
+
+   for (j = 0; j < hdr.nlayers; j++)
+      if (read_layer(f, &l[j], mem) == -1)
+      {
+         log_msg(LOG_WARN, "cache file %s truncated or invalid", path);
+         for (; j >= 0; j--)
+            free_layer(&l[j]);
+         memimg_free(mem);
+         fclose(f);
+         return -1;
+      }
+
+   fclose(f);
+   return hdr.nlayers;
+}
+
+
+/*! Write the recorded seeds of a layer. The pixel pointers of the journal
+ * are stored as offsets into the image.
+ */
+static int write_rec(FILE *f, const layerrec_t *rec, const memimg_t *mem)
+{
+   statejent_t je;
+
+   if (fwrite(&rec->cnt, sizeof(rec->cnt), 1, f) != 1 || fwrite(rec->r, sizeof(*rec->r), rec->cnt, f) != (size_t) rec->cnt
+         || fwrite(&rec->j.n, sizeof(rec->j.n), 1, f) != 1)
+      return -1;
+
+   memset(&je, 0, sizeof(je));
+   for (long i = 0; i < rec->j.n; i++)
+   {
+      je.p = rec->j.e[i].p - mem->mem;
+      je.f = rec->j.e[i].f;
+      je.c = rec->j.e[i].c;
+      if (fwrite(&je, sizeof(je), 1, f) != 1)
+         return -1;
+   }
+   return 0;
+}
+
+
+static int read_rec(FILE *f, layerrec_t *rec, memimg_t *mem)
+{
+   long npix = (long) mem->width * mem->height;
+   statejent_t je;
+
+   if (fread(&rec->cnt, sizeof(rec->cnt), 1, f) != 1 || rec->cnt < 0)
+      return -1;
+   rec->size = rec->cnt;
+   if ((rec->r = mt_malloc(MT_LAYER, (rec->cnt + 1) * sizeof(*rec->r))) == NULL
+         || fread(rec->r, sizeof(*rec->r), rec->cnt, f) != (size_t) rec->cnt
+         || fread(&rec->j.n, sizeof(rec->j.n), 1, f) != 1 || rec->j.n < 0)
+   {
+      rec->j.n = 0;
+      return -1;
+   }
+
+   rec->j.size = rec->j.n;
+   if ((rec->j.e = mt_malloc(MT_OTHER, (rec->j.n + 1) * sizeof(*rec->j.e))) == NULL)
+   {
+      rec->j.n = rec->j.size = 0;
+      return -1;
+   }
+   for (long i = 0; i < rec->j.n; i++)
+   {
+      if (fread(&je, sizeof(je), 1, f) != 1 || je.p < 0 || je.p >= npix)
+         return -1;
+      rec->j.e[i].p = mem->mem + je.p;
+      rec->j.e[i].f = je.f;
+      rec->j.e[i].c = je.c;
+   }
+   return 0;
+}
+
+
+/*! Save the prepared image, its contours, and the recorded seeds for
+ * incremental tracing. Like cache_save() the file is replaced atomically.
+ * All layers must have been traced with recording.
+ * @param s Name of the state file.
+ * @param param Options which change the contours.
+ * @return 0 on success, -1 on error.
+ */
+int state_save(const char *s, const char *param, const layer_t *l, int nlayers, const memimg_t *mem)
+{
+   char tmp[1040];
+   statehdr_t hdr;
+   size_t npix;
+   FILE *f;
+   int err = 0;
+
+   snprintf(tmp, sizeof(tmp), "%s.%d", s, (int) getpid());
+   if ((f = fopen(tmp, "w")) == NULL)
+   {
+      log_errno(LOG_WARN, "fopen()");
+      return -1;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, STATE_MAGIC, sizeof(hdr.magic));
+   hdr.version = STATE_VERSION;
+   hdr.width = mem->width;
+   hdr.height = mem->height;
+   hdr.nlayers = nlayers;
+   hdr.plen = strlen(param);
+   npix = (size_t) mem->width * mem->height;
+
+   if (fwrite(&hdr, sizeof(hdr), 1, f) != 1 || fwrite(param, 1, hdr.plen, f) != (size_t) hdr.plen
+         || fwrite(mem->mem, sizeof(*mem->mem), npix, f) != npix)
+      err = -1;
+   for (int j = 0; j < nlayers && !err; j++)
+      if ((err = write_layer(f, &l[j], mem)) != -1)
+         err = write_rec(f, l[j].rec, mem);
+
+   if (fclose(f) == EOF)
+      err = -1;
+   if (!err && rename(tmp, s) == -1)
+   {
+      log_errno(LOG_WARN, "rename()");
+      err = -1;
+   }
+   if (err)
+      unlink(tmp);
+
+   return err;
+}
+
+
+/*! Load a state file saved with state_save(). The journals of the layers
+ * point into the loaded image.
+ * @param s Name of the state file.
+ * @param param Options which change the contours, they must be the same as
+ * those of the state file.
+ * @param l Pointer to an array of MAXL layers.
+ * @param mem Pointer to the destination image.
+ * @return The number of layers or -1 if there is no valid state.
+ */
+int state_load(const char *s, const char *param, layer_t *l, memimg_t *mem)
+{
+   char buf[MAXL * 24 + 256];
+   statehdr_t hdr;
+   size_t npix;
+   FILE *f;
+   int j;
+
+   if ((f = fopen(s, "r")) == NULL)
+      return -1;
+
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, STATE_MAGIC, sizeof(hdr.magic))
+         || hdr.version != STATE_VERSION || hdr.nlayers < 0 || hdr.nlayers > MAXL)
+   {
+      log_msg(LOG_WARN, "invalid state file %s", s);
+      fclose(f);
+      return -1;
+   }
+
+   if (hdr.plen != (int) strlen(param) || hdr.plen >= (int) sizeof(buf)
+         || fread(buf, 1, hdr.plen, f) != (size_t) hdr.plen || memcmp(buf, param, hdr.plen))
+   {
+      log_msg(LOG_NOTICE, "state file %s was traced with different options", s);
+      fclose(f);
+      return -1;
+   }
+
+   mem->width = hdr.width;
+   mem->height = hdr.height;
+   if (memimg_init(mem) == -1)
+   {
+      fclose(f);
+      return -1;
+   }
+
+   npix = (size_t) mem->width * mem->height;
+   if (fread(mem->mem, sizeof(*mem->mem), npix, f) != npix)
+   {
+      log_msg(LOG_WARN, "state file %s truncated", s);
+      memimg_free(mem);
+      fclose(f);
+      return -1;
+   }
+
+   for (j = 0; j < hdr.nlayers; j++)
+      if (read_layer(f, &l[j], mem) == -1 || (l[j].rec = mt_calloc(MT_LAYER, 1, sizeof(*l[j].rec))) == NULL
+            || read_rec(f, l[j].rec, mem) == -1)
+      {
+         log_msg(LOG_WARN, "state file %s truncated", s);
+         for (; j >= 0; j--)
+            free_layer(&l[j]);
+         memimg_free(mem);
+         fclose(f);
+         return -1;
+      }
+
+   fclose(f);
+
+   return hdr.nlayers;
+}
@@ -34,20 +34,38 @@
 #include "smlog.h"
 
 
-static int nodelistpath(cairo_t *ctx, const pos_t *p, int n, double c)
+static int nodelistpath(cairo_t *ctx, const layer_t *l, int k, double c)
 {
-   int i;
+   chain_iter_t it;
+   const double *p;
+   pos_t v;
+   int i, n = l->n[k];
 
    // safety check
-   if (ctx == NULL || p == NULL)
+   if (ctx == NULL || l == NULL)
       return -1;
 
    if (n <= 1)
       return 0;
 
    cairo_new_path(ctx);
-   for (i = 1; i < n; i++, p++)
-      cairo_line_to(ctx, p->xf, p->yf);
+   if (l->curve != NULL)
+   {
+      // straight segments are written as lines, the others as curves
+      p = l->curve[k].p;
+      cairo_move_to(ctx, p[0], p[1]);
+      for (i = 0, p += 2; i < l->curve[k].n; i++, p += 6)
+         if (p[0] == p[-2] && p[1] == p[-1] && p[2] == p[4] && p[3] == p[5])
+            cairo_line_to(ctx, p[4], p[5]);
+         else
+            cairo_curve_to(ctx, p[0], p[1], p[2], p[3], p[4], p[5]);
+   }
+   else
+   {
+      contour_iter(&it, l, k);
+      for (i = 1; i < n && contour_next(&it, &v); i++)
+         cairo_line_to(ctx, v.xf, v.yf);
+   }
    cairo_close_path(ctx);
    cairo_set_source_rgb(ctx, 0, 0, 0);
 #ifndef FILLING
@@ -62,13 +80,25 @@ static int nodelistpath(cairo_t *ctx, const pos_t *p, int n, double c)
 }
 
 
+#ifdef CAIRO_HAS_SVG_SURFACE
+static cairo_status_t svg_write(void *f, const unsigned char *data, unsigned int len)
+{
+   return fwrite(data, 1, len, f) == len ? CAIRO_STATUS_SUCCESS : CAIRO_STATUS_WRITE_ERROR;
+}
+#endif
+
+
 int export_svg(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
 {
 #ifdef CAIRO_HAS_SVG_SURFACE
    cairo_surface_t *sfc, *svg;
    cairo_t *ctx;
+   FILE *f;
    int i, j;
 
+   if ((f = out_open(s)) == NULL)
+      return -1;
+
    sfc = cairo_recording_surface_create(CAIRO_CONTENT_COLOR_ALPHA, NULL);
    ctx = cairo_create(sfc);
    cairo_set_line_width(ctx, .3);
@@ -77,7 +107,7 @@ int export_svg(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
    {
       cairo_push_group(ctx);
       for (i = 0; i < l[j].plist_cnt; i++)
-         nodelistpath(ctx, l[j].plist[i], l[j].n[i], (double) (nlayers - 1 - j) / nlayers);
+         nodelistpath(ctx, &l[j], i, (double) (nlayers - 1 - j) / nlayers);
       cairo_pop_group_to_source(ctx);
       cairo_paint(ctx);
    }
@@ -85,13 +115,16 @@ int export_svg(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
    cairo_destroy(ctx);
 
    // FIXME: size not correct
-   svg = cairo_svg_surface_create(s, (double) mem->width * 72 / 300, (double) mem->height * 72 / 300);
+   svg = cairo_svg_surface_create_for_stream(svg_write, f, (double) mem->width * 72 / 300, (double) mem->height * 72 / 300);
    ctx = cairo_create(svg);
    cairo_set_source_surface(ctx, sfc, 0, 0);
    cairo_paint(ctx);
    cairo_destroy(ctx);
    cairo_surface_destroy(svg);
    cairo_surface_destroy(sfc);
+
+   if (fclose(f) == EOF)
+      return -1;
 #else
    log_msg(LOG_NOTICE, "cairo compiled without SVG support");
 #endif
@@ -0,0 +1,308 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file chain.c
+ * This file contains the compact chain code representation of contours.
+ * A chain starts with the integer coordinates of the first vertex. Each
+ * vertex is encoded as the step from the previous vertex followed by two
+ * bytes holding the subpixel offsets xf - x and yf - y quantised to
+ * 1/CHAIN_SUBPIX, or the full doubles if they are out of range.
+ * A step along one axis (which is what the walkers produce) is a single
+ * varint (len - 1) << 3 | dir with dir being LEFT, DOWN, RIGHT, or UP, thus
+ * it takes one byte up to a length of 16. Any other step is the varint
+ * zigzag(dx) << 3 | CHAIN_ANY followed by the varint zigzag(dy).
+ * The chains are decoded lazily with contour_next().
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! subpixel offsets are multiples of 1/CHAIN_SUBPIX
+#define CHAIN_SUBPIX 127
+//! code of a step which is not along an axis
+#define CHAIN_ANY 4
+//! escape code of a subpixel offset which does not fit into a byte
+#define CHAIN_ESC -128
+//! maximum number of bytes of an encoded vertex
+#define CHAIN_MAXV 28
+
+
+static uint8_t *put_varint(uint8_t *b, unsigned v)
+{
+   for (; v >= 0x80; v >>= 7)
+      *b++ = v | 0x80;
+   *b++ = v;
+   return b;
+}
+
+
+static const uint8_t *get_varint(const uint8_t *b, unsigned *v)
+{
+   int s;
+
+   for (*v = 0, s = 0; *b & 0x80; b++, s += 7)
+      *v |= (unsigned) (*b & 0x7f) << s;
+   *v |= (unsigned) *b++ << s;
+   return b;
+}
+
+
+static unsigned zigzag(int v)
+{
+   return ((unsigned) v << 1) ^ (unsigned) (v >> 31);
+}
+
+
+static int unzigzag(unsigned v)
+{
+   return (int) (v >> 1) ^ -(int) (v & 1);
+}
+
+
+/*! Store a subpixel offset d. Offsets which are out of range (they occur
+ * if the interpolation used the value of a marked pixel) are stored as
+ * CHAIN_ESC followed by the double itself.
+ */
+static uint8_t *put_subpix(uint8_t *b, double d)
+{
+   double q = round(d * CHAIN_SUBPIX);
+
+   if (q >= -CHAIN_SUBPIX && q <= CHAIN_SUBPIX)
+   {
+      *b++ = (int8_t) q;
+      return b;
+   }
+
+   *b++ = (uint8_t) CHAIN_ESC;
+   memcpy(b, &d, sizeof(d));
+   return b + sizeof(d);
+}
+
+
+static const uint8_t *get_subpix(const uint8_t *b, double *d)
+{
+   if (*b != (uint8_t) CHAIN_ESC)
+   {
+      *d = (double) (int8_t) *b / CHAIN_SUBPIX;
+      return b + 1;
+   }
+
+   memcpy(d, b + 1, sizeof(*d));
+   return b + 1 + sizeof(*d);
+}
+
+
+static uint8_t *put_step(uint8_t *b, int dx, int dy)
+{
+   if (!dy && dx)
+      return put_varint(b, (unsigned) (abs(dx) - 1) << 3 | (dx < 0 ? LEFT : RIGHT));
+   if (!dx && dy)
+      return put_varint(b, (unsigned) (abs(dy) - 1) << 3 | (dy < 0 ? DOWN : UP));
+
+   b = put_varint(b, zigzag(dx) << 3 | CHAIN_ANY);
+   return put_varint(b, zigzag(dy));
+}
+
+
+/*! Encode a list of vertices as chain code.
+ * @param c Pointer to the destination chain.
+ * @param p Pointer to the vertices.
+ * @param n Number of vertices.
+ * @return 0 on success, -1 on error.
+ */
+int chain_encode(chain_t *c, const pos_t *p, int n)
+{
+   uint8_t *b, *code;
+
+   memset(c, 0, sizeof(*c));
+   if (n <= 0)
+      return 0;
+
+   if ((code = mt_malloc(MT_LAYER, (size_t) n * CHAIN_MAXV)) == NULL)
+      return -1;
+
+   c->x = p[0].x;
+   c->y = p[0].y;
+   c->n = n;
+   c->closed = n > 1 && p[0].x == p[n - 1].x && p[0].y == p[n - 1].y;
+
+   b = code;
+   for (int i = 0; i < n; i++)
+   {
+      if (i)
+         b = put_step(b, p[i].x - p[i - 1].x, p[i].y - p[i - 1].y);
+      b = put_subpix(b, p[i].xf - p[i].x);
+      b = put_subpix(b, p[i].yf - p[i].y);
+   }
+   c->len = b - code;
+
+   // shrink to the actual size
+   if ((c->code = mt_realloc(MT_LAYER, code, c->len)) == NULL)
+      c->code = code;
+
+   return 0;
+}
+
+
+void chain_free(chain_t *c)
+{
+   mt_free(c->code);
+   memset(c, 0, sizeof(*c));
+}
+
+
+/*! Test if the code of a chain holds exactly its c->n vertices, i.e. if it
+ * can be decoded with contour_next() without reading past its end.
+ * @return 0 if the code is valid, otherwise -1.
+ */
+int chain_check(const chain_t *c)
+{
+   const uint8_t *b = c->code, *end = c->code + c->len;
+   int k, nv;
+
+   if (c->n <= 0 || c->len < 0 || (c->len && c->code == NULL))
+      return -1;
+
+   for (int i = 0; i < c->n; i++)
+   {
+      // a step, the varint of dy follows a step of CHAIN_ANY
+      nv = !i ? 0 : b < end && (*b & 7) == CHAIN_ANY ? 2 : 1;
+      for (k = 0; k < nv; k++)
+      {
+         for (int s = 0; b < end && *b & 0x80; b++, s++)
+            if (s >= 4)
+               return -1;
+         if (b++ >= end)
+            return -1;
+      }
+      // the subpixel offsets
+      for (k = 0; k < 2; k++)
+      {
+         if (b >= end)
+            return -1;
+         b += *b == (uint8_t) CHAIN_ESC ? 1 + sizeof(double) : 1;
+      }
+      if (b > end)
+         return -1;
+   }
+
+   return b == end ? 0 : -1;
+}
+
+
+/*! Start iterating over the vertices of contour i of layer l, independent of
+ * its representation.
+ */
+void contour_iter(chain_iter_t *it, const layer_t *l, int i)
+{
+   memset(it, 0, sizeof(*it));
+   it->n = l->n[i];
+   if (l->compact)
+   {
+      it->c = &l->chain[i];
+      it->b = it->c->code;
+      it->cur.x = it->c->x;
+      it->cur.y = it->c->y;
+   }
+   else
+      it->p = l->plist[i];
+}
+
+
+/*! Get the next vertex of a contour.
+ * @param it Pointer to iterator initialized with contour_iter().
+ * @param p Pointer to the destination vertex.
+ * @return 1 if a vertex was returned, 0 at the end of the contour.
+ */
+int contour_next(chain_iter_t *it, pos_t *p)
+{
+   unsigned v, u;
+   double d;
+
+   if (it->i >= it->n)
+      return 0;
+
+   if (it->c == NULL)
+   {
+      *p = it->p[it->i++];
+      return 1;
+   }
+
+   if (it->i++)
+   {
+      it->b = get_varint(it->b, &v);
+      switch (v & 7)
+      {
+         case LEFT:
+            it->cur.x -= (v >> 3) + 1;
+            break;
+         case RIGHT:
+            it->cur.x += (v >> 3) + 1;
+            break;
+         case DOWN:
+            it->cur.y -= (v >> 3) + 1;
+            break;
+         case UP:
+            it->cur.y += (v >> 3) + 1;
+            break;
+         default:
+            it->b = get_varint(it->b, &u);
+            it->cur.x += unzigzag(v >> 3);
+            it->cur.y += unzigzag(u);
+      }
+   }
+
+   it->b = get_subpix(it->b, &d);
+   it->cur.xf = it->cur.x + d;
+   it->b = get_subpix(it->b, &d);
+   it->cur.yf = it->cur.y + d;
+   *p = it->cur;
+   return 1;
+}
+
+
+/*! Test if the last vertex of contour i of layer l equals the first one.
+ */
+int contour_closed(const layer_t *l, int i)
+{
+   if (l->compact)
+      return l->chain[i].closed;
+
+   return l->n[i] > 1 && l->plist[i][0].x == l->plist[i][l->n[i] - 1].x && l->plist[i][0].y == l->plist[i][l->n[i] - 1].y;
+}
+
+
+/*! Convert contour i of layer l into chain code and free its vertex list.
+ * @return 0 on success, -1 on error.
+ */
+int layer_compact(layer_t *l, int i)
+{
+   if (chain_encode(&l->chain[i], l->plist[i], l->n[i]) == -1)
+      return -1;
+
+   mt_free(l->plist[i]);
+   l->plist[i] = NULL;
+   return 0;
+}
@@ -0,0 +1,145 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file imgprep.c
+ * This file contains the functions which convert the pixels of the memory
+ * image to the values which are traced.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "scan.h"
+#include "memimg.h"
+#include "smlog.h"
+
+
+//! maximum value of the image, MAXVAL or MAXVAL16
+int maxval_ = MAXVAL;
+//! conversion of the values to real units, real = value * scale + offset
+double val_scale_ = 1, val_offset_ = 0;
+
+
+static double cold(int c, int s)
+{
+   return ((double) ((c >> s) & 0xff)) / 255;
+}
+
+
+int c2grey(int c, void * UNUSED(res))
+{
+   double cl, cf;
+
+   cl = 0.2126 * cold(c, 16) + 0.7152 * cold(c, 8) + 0.0722 * cold(c, 0);
+   if (cl <= 0.0031308)
+      cf = 12.92 * cl;
+   else
+      cf = 1.055 * pow(cl, 1 / 2.4) - 0.055;
+
+   return cf * maxval_;
+}
+
+
+int cdirect(int c, void * UNUSED(res))
+{
+   return c & 0xffffff;
+}
+
+
+int cinvert(int c, void * UNUSED(res))
+{
+   return maxval_ - (c & 0xffffff);
+}
+
+
+void memprep(memimg_t *mem, int (*colfunc)(int, void*), void *res)
+{
+   int x, y;
+
+   for (y = 0; y < mem->height; y++)
+      for (x = 0; x < mem->width; x++)
+         memimg_put(mem, x, y, colfunc(memimg_get(mem, x, y), res));
+}
+
+
+static int cmax(int c, void *res)
+{
+   if (res != NULL && *(int*)res < c)
+      *(int*)res = c;
+   return c;
+}
+
+
+static int cmin(int c, void *res)
+{
+   if (res != NULL && *(int*)res > c)
+      *(int*)res = c;
+   return c;
+}
+
+
+struct minmax
+{
+   int min, max;
+};
+
+
+static int cstretch(int c, void *res)
+{
+   double d;
+
+   // safety check
+   if (res == NULL)
+      return c;
+
+   d = ((struct minmax*) res)->max - ((struct minmax*) res)->min;
+   return round((c - ((struct minmax*) res)->min) * maxval_ / d);
+}
+
+
+void memstretch(memimg_t *mem)
+{
+   struct minmax mm;
+
+   mm.min = mm.max = memimg_get(mem, 0, 0);
+   memprep(mem, cmax, &mm.max);
+   memprep(mem, cmin, &mm.min);
+   log_debug("min = %d, max = %d", mm.min, mm.max);
+   memprep(mem, cstretch, &mm);
+}
+
+
+
+/*! Convert a value of the image to real units.
+ */
+double val_real(int v)
+{
+   return v * val_scale_ + val_offset_;
+}
+
+
+/*! Convert a level in real units to the least value of the image which is
+ * at or above the level.
+ */
+int val_level(double r)
+{
+   return ceil((r - val_offset_) / val_scale_ - 1E-9);
+}
@@ -16,7 +16,8 @@
  */
 
 /*! \file layer.c
- * This file contains helper functions for the layer_t structure.
+ * This file contains helper functions for the layer_t structure and the
+ * function which traces a complete layer.
  *
  * @author Bernhard R. Fischer
  * @version 2020/02/26
@@ -26,15 +27,25 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
 
 #include "scan.h"
+#include "smlog.h"
+#include "stats.h"
+#include "memtrack.h"
+
+
+//! vertices closer than this distance (in pixels) are removed by reduce()
+int reduce_dist_ = 5;
 
 
 layer_t *new_layer(int v)
 {
    layer_t *nl;
 
-   if ((nl = calloc(1, sizeof(*nl))) == NULL)
+   if ((nl = mt_calloc(MT_LAYER, 1, sizeof(*nl))) == NULL)
       return NULL;
 
    nl->v = v;
@@ -42,20 +53,1178 @@ layer_t *new_layer(int v)
 }
 
 
+/*! Free all contours of a layer and reset it.
+ */
+void free_layer(layer_t *l)
+{
+   lod_free(l);
+   bezier_free(l);
+   for (int i = 0; i < l->plist_cnt; i++)
+   {
+      mt_free(l->plist[i]);
+      if (l->compact)
+         chain_free(&l->chain[i]);
+   }
+   mt_free(l->plist);
+   mt_free(l->n);
+   mt_free(l->chain);
+   if (l->rec != NULL)
+   {
+      mt_free(l->rec->r);
+      journal_free(&l->rec->j);
+      mt_free(l->rec);
+   }
+   memset(l, 0, sizeof(*l));
+}
+
+
 int add_plist(layer_t *l)
 {
    pos_t **plist;
    int *n;
 
-   if ((plist = realloc(l->plist, (l->plist_cnt + 1) * sizeof(*plist))) == NULL)
+   if ((plist = mt_realloc(MT_LAYER, l->plist, (l->plist_cnt + 1) * sizeof(*plist))) == NULL)
       return -1;
    l->plist = plist;
 
-   if ((n = realloc(l->n, (l->plist_cnt + 1) * sizeof(*n))) == NULL)
+   if ((n = mt_realloc(MT_LAYER, l->n, (l->plist_cnt + 1) * sizeof(*n))) == NULL)
       return -1;
    l->n = n;
 
+   if (l->compact)
+   {
+      chain_t *chain;
+
+      if ((chain = mt_realloc(MT_LAYER, l->chain, (l->plist_cnt + 1) * sizeof(*chain))) == NULL)
+         return -1;
+      l->chain = chain;
+   }
+
    l->plist_cnt++;
    return l->plist_cnt;
 }
 
+
+//! minimum height of a strip in scan_layer_mt()
+#define MINSTRIP 16
+//! initial size of the hash table of the steps of a strip
+#define HASH_INIT 1024
+//! MAXW is just here to prevent memory overflows
+#define MAXW 10000
+
+
+//! contour of a previous trace, see retrace_layer()
+typedef struct traced
+{
+   //! seed pixel from which the contour was traced
+   pos_t seed;
+   //! lower corner found from the seed, i.e. the first vertex
+   pos_t corner;
+   //! vertices, NULL if the contour was visited already
+   pos_t *p;
+   //! number of vertices before and after reduce()
+   int n0, n;
+   //! marks set by the contour in the journal of the strip
+   long j0, jn;
+   shape_t sh;
+} traced_t;
+
+//! position and direction of a walker
+typedef struct wstate
+{
+   int x, y, dir;
+} wstate_t;
+
+//! step of a walker recorded by a strip, see trace_step()
+typedef struct fstep
+{
+   //! state before the step, which is the key of the hash table
+   wstate_t s;
+   //! state after the step
+   wstate_t e;
+   //! set if the step was stopped at the border of the strip
+   int midrun;
+   //! index of the following step, -1 if the walker left the strip
+   long next;
+   //! recipe of the coordinate changed by the step
+   interp_t ip;
+} fstep_t;
+
+typedef struct strip
+{
+   //! image and rows of the strip
+   memimg_t *mem;
+   int y0, y1;
+   int v;
+   int err;
+   //! contours in the order of their seeds
+   traced_t *t;
+   int cnt, size;
+   journal_t j;
+   //! steps walked in the rows of the strip
+   fstep_t *step;
+   long nstep, ssize;
+   //! hash table of the steps, index + 1 or 0 if the slot is empty
+   long *hash;
+   long hsize;
+   //! bit of each pixel of the strip, it is set if a step starts there
+   uint64_t *vis;
+   //! states at which the walkers left the strip
+   wstate_t *out;
+   int nout, osize;
+   //! states of walkers entering the strip, which are continued
+   wstate_t *in;
+   int nin, isize;
+   //! 0 to build the threshold mask, 1 to walk from the lower corners, then
+   //! to continue at the states in in
+   int round;
+   layer_stat_t ls;
+   pthread_t th;
+   int running;
+} strip_t;
+
+//! contours and steps of all strips, used by trace_layer() in the order of
+//! the seeds
+typedef struct strips
+{
+   strip_t *st;
+   int nstrips;
+   //! current strip and contour
+   int k, i;
+   //! set if the strips recorded the steps of the walkers
+   int frag;
+   //! strip of the last replayed step and index of the step which follows
+   //! it, or -1
+   int h;
+   long next;
+} strips_t;
+
+
+/*! Return the next contour traced by the strips if its seed is pos. All
+ * contours with a seed before pos are freed because the serial tracer will
+ * never find them from these seeds.
+ * @param s Pointer to strips or NULL.
+ * @param pos Seed pixel.
+ * @return Pointer to contour or NULL.
+ */
+static traced_t *next_traced(strips_t *s, const pos_t *pos)
+{
+   traced_t *t;
+
+   for (; s != NULL && s->k < s->nstrips; s->k++, s->i = 0)
+      for (; s->i < s->st[s->k].cnt; s->i++)
+      {
+         t = &s->st[s->k].t[s->i];
+         if (t->seed.y > pos->y || (t->seed.y == pos->y && t->seed.x > pos->x))
+            return NULL;
+         if (t->seed.y == pos->y && t->seed.x == pos->x)
+            return t;
+         mt_free(t->p);
+         t->p = NULL;
+      }
+
+   return NULL;
+}
+
+
+/*! Release the unused memory of a vertex list after reduce().
+ */
+static void shrink_plist(pos_t **plist, int n)
+{
+   pos_t *p;
+
+   if ((p = mt_realloc(MT_CONTOUR, *plist, n * sizeof(*p))) != NULL)
+      *plist = p;
+}
+
+
+/*! Take over a contour traced by a strip instead of scanning it again. This
+ * does the same as scan() on the same seed.
+ * @param rec Journal to which the replayed marks are appended, or NULL.
+ * @return The number of vertices (after reduce()), 0 if the contour was
+ * visited already, or -1 if the contour has to be traced again because the
+ * marks of the surrounding pixels differ.
+ */
+static int reuse_traced(memimg_t *mem, strip_t *st, traced_t *t, pos_t **plist, journal_t *rec)
+{
+   if (t->p != NULL)
+   {
+      if (memimg_get(mem, t->corner.x, t->corner.y) & VALL)
+         return 0;
+
+      if (journal_replay(&st->j, t->j0, t->jn) == -1)
+         return -1;
+
+      journal_copy(rec, &st->j, t->j0, t->jn);
+      *plist = t->p;
+      t->p = NULL;
+      return t->n;
+   }
+
+   // find_lowercorner() may set marks on the lowest row before scan()
+   // detects that the contour was visited
+   if (journal_replay(&st->j, t->j0, t->jn) == -1)
+      return -1;
+
+   if (memimg_get(mem, t->corner.x, t->corner.y) & VALL)
+   {
+      journal_copy(rec, &st->j, t->j0, t->jn);
+      return 0;
+   }
+
+   journal_undo(&st->j, t->j0, t->jn);
+   return -1;
+}
+
+
+/*! Test if a contour is below the minimum area or perimeter of the layer.
+ * Both are measured on the polygon through the centres of the border
+ * pixels, i.e. a 3x3 square has an area of 4.
+ */
+static int too_small(const layer_t *l, const shape_t *sh)
+{
+   return labs(sh->area2) < 2 * l->min_area || sh->perim < l->min_perim;
+}
+
+
+/*! Append a seed to the record of a layer.
+ * @param rec Pointer to the record.
+ * @param seed Seed pixel.
+ * @param corner Lower corner found from the seed.
+ * @param sh Shape of the contour or NULL if it was visited already.
+ * @param j0 Index of the first mark of the seed in rec->j.
+ * @return 0 on success, -1 on error.
+ */
+static int add_seedrec(layerrec_t *rec, const pos_t *seed, const pos_t *corner, int idx, int n0, const shape_t *sh, long j0)
+{
+   seedrec_t *r;
+
+   if (rec->cnt >= rec->size)
+   {
+      if ((r = mt_realloc(MT_LAYER, rec->r, (rec->size ? rec->size * 2 : 64) * sizeof(*r))) == NULL)
+         return -1;
+      rec->r = r;
+      rec->size = rec->size ? rec->size * 2 : 64;
+   }
+
+   r = &rec->r[rec->cnt++];
+   r->sx = seed->x;
+   r->sy = seed->y;
+   r->cx = corner->x;
+   r->cy = corner->y;
+   r->idx = idx;
+   r->n0 = n0;
+   if (sh != NULL)
+      r->sh = *sh;
+   else
+   {
+      memset(&r->sh, 0, sizeof(r->sh));
+      r->sh.x0 = corner->x;
+      r->sh.y0 = corner->y;
+      r->sh.x1 = seed->x;
+      r->sh.y1 = seed->y;
+   }
+   r->j0 = j0;
+   r->jn = rec->j.n - j0;
+   return 0;
+}
+
+
+static unsigned long step_hash(int x, int y, int dir)
+{
+   // all bits of the key are mixed into the low bits because neighbouring
+   // steps would otherwise fill runs of slots of the open addressing
+   unsigned long h = (unsigned long) x << 32 ^ (unsigned long) y << 2 ^ dir;
+
+   h = (h ^ h >> 30) * 0xbf58476d1ce4e5b9UL;
+   h = (h ^ h >> 27) * 0x94d049bb133111ebUL;
+   return h ^ h >> 31;
+}
+
+
+/*! Find the step of a strip which starts at x/y into direction dir.
+ * @return Index of the step or -1 if there is none.
+ */
+static long find_step(const strip_t *st, int x, int y, int dir)
+{
+   const fstep_t *f;
+
+   if (!st->hsize)
+      return -1;
+
+   for (unsigned long h = step_hash(x, y, dir); st->hash[h & (st->hsize - 1)]; h++)
+   {
+      f = &st->step[st->hash[h & (st->hsize - 1)] - 1];
+      if (f->s.x == x && f->s.y == y && f->s.dir == dir)
+         return f - st->step;
+   }
+
+   return -1;
+}
+
+
+/*! Test if a step of a strip starts at pixel x/y. This is much faster than
+ * find_step() if there is none.
+ */
+static int visited(const strip_t *st, int x, int y)
+{
+   long i = (long) (y - st->y0) * st->mem->width + x;
+
+   return st->vis[i >> 6] >> (i & 63) & 1;
+}
+
+
+/*! Append a new step starting at x/y into direction dir to a strip.
+ * @return Index of the step or -1 on error.
+ */
+static long add_step(strip_t *st, int x, int y, int dir)
+{
+   unsigned long h;
+   fstep_t *f;
+   long *hash, i;
+
+   if (st->nstep >= st->ssize)
+   {
+      if ((f = mt_realloc(MT_OTHER, st->step, (st->ssize ? st->ssize * 2 : HASH_INIT / 2) * sizeof(*f))) == NULL)
+         return -1;
+      st->step = f;
+      st->ssize = st->ssize ? st->ssize * 2 : HASH_INIT / 2;
+   }
+
+   // the table is kept at most half full
+   if (2 * (st->nstep + 1) > st->hsize)
+   {
+      if ((hash = mt_calloc(MT_OTHER, st->hsize ? st->hsize * 2 : HASH_INIT, sizeof(*hash))) == NULL)
+         return -1;
+      mt_free(st->hash);
+      st->hash = hash;
+      st->hsize = st->hsize ? st->hsize * 2 : HASH_INIT;
+      for (i = 0; i < st->nstep; i++)
+      {
+         for (h = step_hash(st->step[i].s.x, st->step[i].s.y, st->step[i].s.dir); hash[h & (st->hsize - 1)]; h++);
+         hash[h & (st->hsize - 1)] = i + 1;
+      }
+   }
+
+   for (h = step_hash(x, y, dir); st->hash[h & (st->hsize - 1)]; h++);
+   st->hash[h & (st->hsize - 1)] = st->nstep + 1;
+   i = (long) (y - st->y0) * st->mem->width + x;
+   st->vis[i >> 6] |= (uint64_t) 1 << (i & 63);
+
+   f = &st->step[st->nstep];
+   f->s.x = x;
+   f->s.y = y;
+   f->s.dir = dir;
+   f->next = -1;
+   return st->nstep++;
+}
+
+
+/*! Move the walker by one step like trace_step(). If the step was recorded
+ * by the strip of its row, it is replayed instead of walking it again.
+ * @param arg Pointer to the strips.
+ */
+static int frag_step(memimg_t *mem, int v, pos_t *pos, int *dir, void *arg)
+{
+   strips_t *s = arg;
+   const fstep_t *f;
+   pos_t from = *pos;
+   long i = s->next;
+   int h = s->h;
+
+   for (; pos->y < s->st[s->h].y0; s->h--);
+   for (; pos->y >= s->st[s->h].y1; s->h++);
+   // the steps of a walk are followed without a lookup until it leaves
+   // the strip
+   if (i != -1 && h == s->h)
+   {
+      f = &s->st[s->h].step[i];
+      if (f->s.x != pos->x || f->s.y != pos->y || f->s.dir != *dir)
+         i = -1;
+   }
+   else
+      i = -1;
+
+   if (i == -1 && (i = find_step(&s->st[s->h], pos->x, pos->y, *dir)) == -1)
+   {
+      s->next = -1;
+      return trace_step(mem, v, pos, dir, NULL);
+   }
+
+   f = &s->st[s->h].step[i];
+   pos->x = f->e.x;
+   pos->y = f->e.y;
+   replay_step(mem, *dir, &from, pos, f->midrun, &f->ip);
+   *dir = f->e.dir;
+   s->next = f->next;
+   return f->midrun;
+}
+
+
+/*! Trace a contour from a seed like scan0(). If bot is set, the lower corner
+ * is found from the lowest rows of the columns, see column_bottom(). If the
+ * strips recorded the steps of the walkers, they are replayed.
+ * @param bot Lowest rows of the columns or NULL.
+ * @param s Pointer to strips or NULL.
+ */
+static int trace_seed(memimg_t *mem, int v, pos_t *pos, const int *bot, strips_t *s, pos_t **plist, crossing_t **cross, shape_t *sh)
+{
+   int dir;
+
+   if (bot == NULL)
+      return scan0(mem, v, pos, plist, cross, sh);
+
+   find_lowercorner_at(mem, v, pos, &dir, bot[pos->x]);
+   if (memimg_get(mem, pos->x, pos->y) & VALL)
+      return 0;
+
+   return scan_corner(mem, v, pos, dir, s != NULL && s->frag ? frag_step : NULL, s, plist, cross, sh);
+}
+
+
+/*! Trace all unvisited contours of a layer and append them to l.
+ * @param l Pointer to layer.
+ * @param mem Pointer to image.
+ * @param ls Pointer to statistics of the layer or NULL.
+ * @param s Contours which were already traced before or steps recorded by
+ * strips, or NULL. The contours are used if the seed matches.
+ * If l->rec is set, all seeds and the marks they set are recorded.
+ * @return 0 on success, -1 on error.
+ */
+static int trace_layer(layer_t *l, memimg_t *mem, layer_stat_t *ls, strips_t *s)
+{
+   journal_t *rj = l->rec != NULL ? &l->rec->j : NULL;
+   pos_t p, scan_pos, corner, *plist;
+   crossing_t *cross;
+   traced_t *t;
+   shape_t sh;
+   int i, n, n0, err = 0, discarded = 0;
+   int *bot = NULL, boty = mem->y0;
+   long j0 = 0;
+
+   // the seeds are found in the order of the rows, thus the lowest rows of
+   // the columns are updated along with them
+   if (mem->mask_v == l->v)
+      bot = mt_malloc(MT_OTHER, mem->width * sizeof(*bot));
+
+   tracer_journal(rj);
+   scan_pos.x = 0;
+   scan_pos.y = mem->y0;
+   for (i = l->plist_cnt; i < MAXW; i++)
+   {
+      if (!next_unvisited(mem, &scan_pos, l->v))
+         break;
+
+      if (bot != NULL && boty <= scan_pos.y)
+      {
+         column_bottom(mem, bot, boty, scan_pos.y + 1);
+         boty = scan_pos.y + 1;
+      }
+
+      if (rj != NULL)
+         j0 = rj->n;
+
+      if (ls != NULL)
+         ls->seeds++;
+
+      if ((t = next_traced(s, &scan_pos)) != NULL && (n = reuse_traced(mem, &s->st[s->k], t, &plist, rj)) != -1)
+      {
+         sh = t->sh;
+         corner = t->corner;
+         n0 = t->n0;
+      }
+      else
+      {
+         p = scan_pos;
+         if ((n = trace_seed(mem, l->v, &p, bot, s, &plist, &cross, &sh)) == -1)
+         {
+            log_errno(LOG_ERR, "scan0() failed");
+            err = -1;
+            break;
+         }
+         t = NULL;
+         corner = n ? plist[0] : p;
+         n0 = n;
+      }
+
+      if (!n)
+      {
+         if (l->rec != NULL && add_seedrec(l->rec, &scan_pos, &corner, -1, 0, NULL, j0) == -1)
+         {
+            log_errno(LOG_ERR, "add_seedrec() failed");
+            err = -1;
+            break;
+         }
+
+         // index i is still free
+         i--;
+
+         scan_pos.x++;
+         if (scan_pos.x >= mem->width)
+         {
+            scan_pos.x = 0;
+            scan_pos.y++;
+         }
+         continue;
+      }
+
+      // the layer gets a new contour only if a seed yields one, which is
+      // rare compared to the seeds
+      if (add_plist(l) == -1)
+      {
+         log_errno(LOG_ERR, "add_plist() failed");
+         if (t == NULL)
+            mt_free(cross);
+         mt_free(plist);
+         err = -1;
+         break;
+      }
+      l->plist[i] = plist;
+      l->n[i] = n;
+      log_debug("plist %d, x = %d, y = %d, %d points", i, scan_pos.x, scan_pos.y, l->n[i]);
+      if (l->rec != NULL && !too_small(l, &sh) && add_seedrec(l->rec, &scan_pos, &corner, i, n0, &sh, j0) == -1)
+      {
+         log_errno(LOG_ERR, "add_seedrec() failed");
+         if (t == NULL)
+            mt_free(cross);
+         mt_free(l->plist[i]);
+         l->plist_cnt--;
+         err = -1;
+         break;
+      }
+      scan_pos.x = 0;
+      scan_pos.y++;
+
+      if (too_small(l, &sh))
+      {
+         // the seed is not recorded, thus it is traced again by
+         // retrace_layer()
+         if (rj != NULL)
+            rj->n = j0;
+         if (t == NULL)
+            mt_free(cross);
+         mt_free(l->plist[i]);
+         i--;
+         l->plist_cnt--;
+         discarded++;
+         if (ls != NULL)
+            ls->discarded++;
+         continue;
+      }
+
+      // contours of the previous trace are already reduced
+      if (t != NULL)
+      {
+         if (ls != NULL)
+         {
+            ls->contours++;
+            ls->points += t->n0;
+            ls->reduced += t->n;
+         }
+      }
+      else
+      {
+         stats_start(ST_REDUCE);
+         if (ls != NULL)
+         {
+            ls->contours++;
+            ls->points += l->n[i];
+         }
+         l->n[i] = reduce(l->plist[i], l->n[i], reduce_dist_);
+         if (ls != NULL)
+            ls->reduced += l->n[i];
+         interpolate(mem, l->v, l->plist[i], l->n[i], cross);
+         mt_free(cross);
+         shrink_plist(&l->plist[i], l->n[i]);
+         stats_stop(ST_REDUCE);
+         log_debug("reduced plist %d points", l->n[i]);
+
+//#define GEN_DEBUG_PNG
+#ifdef GEN_DEBUG_PNG
+         char buf[32];
+         snprintf(buf, sizeof(buf), "XY_%03d%03d.png", l->v, i);
+         memcairo(mem, buf);
+#endif
+      }
+
+      if (l->compact && layer_compact(l, i) == -1)
+      {
+         log_errno(LOG_ERR, "layer_compact() failed");
+         mt_free(l->plist[i]);
+         l->plist_cnt--;
+         err = -1;
+         break;
+      }
+   }
+
+   tracer_journal(NULL);
+   mt_free(bot);
+   if (rj != NULL && rj->err)
+   {
+      log_msg(LOG_ERR, "mark journal incomplete");
+      err = -1;
+   }
+
+   if (i == MAXW)
+      log_msg(LOG_NOTICE, "max iteration count %d reached. You may increase MAXW and recompile", MAXW);
+
+   if (discarded)
+      log_msg(LOG_INFO, "layer v = %d, %d contours below minimum area or perimeter discarded", l->v, discarded);
+
+   return err;
+}
+
+
+/*! Get the view of the rows of an image which contain the pixels of a
+ * layer, see layer_t. It includes the row below and the row above them,
+ * thus the walkers read the same pixels as on the whole image. The view
+ * shares the pixels and the threshold mask with the image.
+ * @param l Pointer to the layer.
+ * @param mem Pointer to the image.
+ * @param view Pointer to the destination view.
+ */
+static void layer_rows(const layer_t *l, const memimg_t *mem, memimg_t *view)
+{
+   *view = *mem;
+   if (l->y1 <= 0)
+      return;
+
+   if (l->y0 - 1 > view->y0)
+      view->y0 = l->y0 - 1;
+   if (l->y1 + 1 < view->height)
+      view->height = l->y1 + 1;
+   log_debug("layer v = %d is in rows %d - %d", l->v, view->y0, view->height - 1);
+}
+
+
+int scan_layer(layer_t *l, memimg_t *img)
+{
+   layer_stat_t *ls;
+   memimg_t mem;
+   int err;
+
+   //safety check
+   if (l == NULL || img == NULL)
+      return -1;
+
+   log_debug("scanning layer v = %d", l->v);
+   stats_start(ST_SCAN);
+   ls = stats_layer_start(l->v);
+   // without mask the tracer works on the values directly
+   memimg_mask_init(img);
+   layer_rows(l, img, &mem);
+   if (mem.mask != NULL)
+      memimg_mask(&mem, l->v);
+   err = trace_layer(l, &mem, ls, NULL);
+   stats_start(ST_CLEAR);
+   clear_marks(&mem);
+   stats_stop(ST_CLEAR);
+   stats_layer_stop(ls);
+   stats_stop(ST_SCAN);
+
+   return err;
+}
+
+
+/*! Append a new contour to the list of a strip.
+ * @return Pointer to the new contour or NULL on error.
+ */
+static traced_t *add_traced(strip_t *st)
+{
+   traced_t *t;
+
+   if (st->cnt >= st->size)
+   {
+      if ((t = mt_realloc(MT_LAYER, st->t, (st->size ? st->size * 2 : 64) * sizeof(*t))) == NULL)
+         return NULL;
+      st->t = t;
+      st->size = st->size ? st->size * 2 : 64;
+   }
+
+   t = &st->t[st->cnt++];
+   memset(t, 0, sizeof(*t));
+   return t;
+}
+
+
+/*! Append a walker state to a list.
+ * @return 0 on success, -1 on error.
+ */
+static int add_state(wstate_t **list, int *n, int *size, const pos_t *pos, int dir)
+{
+   wstate_t *w;
+
+   if (*n >= *size)
+   {
+      if ((w = mt_realloc(MT_OTHER, *list, (*size ? *size * 2 : 64) * sizeof(*w))) == NULL)
+         return -1;
+      *list = w;
+      *size = *size ? *size * 2 : 64;
+   }
+
+   w = &(*list)[(*n)++];
+   w->x = pos->x;
+   w->y = pos->y;
+   w->dir = dir;
+   return 0;
+}
+
+
+/*! Walk from a state and record all steps in the rows of the strip, until
+ * the walker reaches a step which was recorded already, or until it leaves
+ * the rows. In the latter case its state is appended to the states which
+ * are continued by the neighbouring strip. Each step is linked to the step
+ * which follows it, thus the replay looks up only the first step of a walk.
+ * @return 0 on success, -1 on error.
+ */
+static int frag_walk(strip_t *st, pos_t pos, int dir)
+{
+   fstep_t *f;
+   long i, prev = -1;
+
+   while (pos.y >= st->y0 && pos.y < st->y1)
+   {
+      if (visited(st, pos.x, pos.y) && (i = find_step(st, pos.x, pos.y, dir)) != -1)
+      {
+         if (prev != -1)
+            st->step[prev].next = i;
+         return 0;
+      }
+
+      if ((i = add_step(st, pos.x, pos.y, dir)) == -1)
+         return -1;
+      if (prev != -1)
+         st->step[prev].next = i;
+
+      f = &st->step[i];
+      f->midrun = trace_step(st->mem, st->v, &pos, &dir, &f->ip);
+      f->e.x = pos.x;
+      f->e.y = pos.y;
+      f->e.dir = dir;
+      prev = i;
+   }
+
+   return add_state(&st->out, &st->nout, &st->osize, &pos, dir);
+}
+
+
+/*! Walk from the seeds of the rows of a strip in the order of trace_layer().
+ * It traces at most one contour per row, from the first run of the row
+ * whose contour was not traced before. The marks of the contours are not
+ * known here, thus a run counts as traced if the steps of its lower corner
+ * were recorded, and a contour which leaves the strip downwards may have
+ * been traced from a lower strip already. Contours which trace_layer()
+ * finds nevertheless are traced by it without replay.
+ * @return 0 on success, -1 on error.
+ */
+static int frag_seeds(strip_t *st)
+{
+   const memimg_t *mem = st->mem;
+   pos_t pos, corner;
+   int *bot, end, dir, n, err = 0;
+
+   if ((bot = mt_malloc(MT_OTHER, mem->width * sizeof(*bot))) == NULL)
+      return -1;
+   // runs which start below the strip
+   for (int x = 0; x < mem->width; x++)
+      bot[x] = st->y0 - 1;
+
+   for (pos.y = st->y0; pos.y < st->y1 && !err; pos.y++)
+   {
+      column_bottom(mem, bot, pos.y, pos.y + 1);
+      for (pos.x = 0; next_run(mem, &pos, &end) && !err; pos.x = end)
+      {
+         // On the lowest row, find_lowercorner() marks the corner itself,
+         // unless it is the first pixel of the row (see scan_inside_left()).
+         if (pos.y == mem->y0 && pos.x)
+            break;
+         if (bot[pos.x] < st->y0)
+            continue;
+
+         corner = pos;
+         find_lowercorner_at(mem, st->v, &corner, &dir, bot[pos.x]);
+         if (visited(st, corner.x, corner.y) && find_step(st, corner.x, corner.y, dir) != -1)
+            continue;
+
+         n = st->nout;
+         err = frag_walk(st, corner, dir);
+         if (st->nout == n || st->out[n].y >= st->y1)
+            break;
+      }
+   }
+
+   mt_free(bot);
+   return err;
+}
+
+
+/*! Record the steps of the walkers of a strip. The walkers do not change the
+ * image (see tracer_fragment()) and they are limited to the rows of the
+ * strip. In the first round they start at the seeds of the rows, see
+ * frag_seeds(). Then they continue at the states at which the walkers of the
+ * neighbouring strips entered the rows of the strip, which is repeated until
+ * no walker leaves its strip anymore. Contours which meander across a seam
+ * need a round for each crossing. The steps are then replayed by
+ * trace_layer() in the order of the seeds.
+ */
+static void *frag_worker(void *p)
+{
+   strip_t *st = p;
+   memimg_t mem;
+   pos_t pos;
+   hwcnt_t hw0, hw1;
+   int hw[HW_MAX];
+
+   // the counters of the main thread do not count this thread
+   perfctr_open(hw);
+   perfctr_read_fd(hw, &hw0);
+
+   switch (st->round)
+   {
+      case 0:
+         mem = *st->mem;
+         mem.y0 = st->y0;
+         mem.height = st->y1;
+         memimg_mask(&mem, st->v);
+         if ((st->vis = mt_calloc(MT_OTHER, ((size_t) (st->y1 - st->y0) * mem.width + 63) / 64, sizeof(*st->vis))) == NULL)
+            st->err = -1;
+         break;
+
+      case 1:
+         tracer_fragment(st->y0, st->y1);
+         st->err = frag_seeds(st);
+         tracer_fragment(0, 0);
+         break;
+
+      default:
+         tracer_fragment(st->y0, st->y1);
+         for (int i = 0; i < st->nin && !st->err; i++)
+         {
+            pos.x = st->in[i].x;
+            pos.y = st->in[i].y;
+            st->err = frag_walk(st, pos, st->in[i].dir);
+         }
+         tracer_fragment(0, 0);
+   }
+
+   perfctr_read_fd(hw, &hw1);
+   perfctr_add(&st->ls.hw, &hw0, &hw1);
+   perfctr_close_fd(hw);
+
+   return NULL;
+}
+
+
+/*! Run a round of frag_worker() on all strips which have work in parallel.
+ * @param s Pointer to strips.
+ * @param round Number of the round.
+ * @return The number of strips which worked.
+ */
+static int frag_round(strips_t *s, int round)
+{
+   strip_t *st;
+   hwcnt_t hw;
+   int k, n;
+
+   for (k = n = 0; k < s->nstrips; k++)
+      n += round < 2 || s->st[k].nin;
+
+   for (k = 0; k < s->nstrips; k++)
+   {
+      st = &s->st[k];
+      st->round = round;
+      if (round >= 2 && !st->nin)
+         continue;
+
+      if (n > 1 && !(errno = pthread_create(&st->th, NULL, frag_worker, st)))
+      {
+         st->running = 1;
+         continue;
+      }
+
+      if (n > 1)
+         log_errno(LOG_WARN, "pthread_create()");
+      // the main thread is counted by its own counters
+      hw = st->ls.hw;
+      frag_worker(st);
+      st->ls.hw = hw;
+   }
+
+   for (k = 0; k < s->nstrips; k++)
+      if (s->st[k].running)
+      {
+         pthread_join(s->st[k].th, NULL);
+         s->st[k].running = 0;
+      }
+
+   return n;
+}
+
+
+/*! Pass the states at which the walkers left their strips to the strips of
+ * their rows.
+ * @return 0 on success, -1 on error.
+ */
+static int frag_pass(strips_t *s)
+{
+   strip_t *st;
+   pos_t pos;
+   int k, m;
+
+   for (k = 0; k < s->nstrips; k++)
+      s->st[k].nin = 0;
+
+   for (k = 0; k < s->nstrips; k++)
+   {
+      st = &s->st[k];
+      for (int i = 0; i < st->nout; i++)
+      {
+         pos.x = st->out[i].x;
+         pos.y = st->out[i].y;
+         m = pos.y < st->y0 ? k - 1 : k + 1;
+         if (add_state(&s->st[m].in, &s->st[m].nin, &s->st[m].isize, &pos, st->out[i].dir) == -1)
+            return -1;
+      }
+      st->nout = 0;
+   }
+
+   return 0;
+}
+
+
+/*! Trace a layer with several threads. The image is split into horizontal
+ * strips and the walkers record the steps of the contours of each strip in
+ * parallel, see frag_worker(). A walker which leaves its strip is continued
+ * by the neighbouring strip in the next round. Then the seeds of the image
+ * are scanned serially in the same way as scan_layer() does it, but the
+ * lower corners are found without walking down (see column_bottom()) and
+ * the steps of each contour are replayed in its order, i.e. the contours
+ * crossing the seams are stitched together from the steps of several
+ * strips. Steps which were not recorded are walked by the main thread. The
+ * replay sets the same marks and reads the same pixels as the walkers, thus
+ * the result is identical to scan_layer().
+ * @param l Pointer to layer.
+ * @param mem Pointer to image.
+ * @param nthreads Number of threads.
+ * @return 0 on success, -1 on error.
+ */
+int scan_layer_mt(layer_t *l, memimg_t *img, int nthreads)
+{
+   layer_stat_t *ls, sls;
+   memimg_t view, *mem = &view;
+   strips_t s;
+   int err = 0, h;
+
+   //safety check
+   if (l == NULL || img == NULL)
+      return -1;
+
+   memset(&s, 0, sizeof(s));
+   // the walkers of the strips rely on the threshold mask
+   if (memimg_mask_init(img) == -1)
+      return scan_layer(l, img);
+   layer_rows(l, img, &view);
+   h = mem->height - mem->y0;
+   if ((s.nstrips = nthreads < h / MINSTRIP ? nthreads : h / MINSTRIP) < 2)
+      return scan_layer(l, img);
+
+   if ((s.st = mt_calloc(MT_OTHER, s.nstrips, sizeof(*s.st))) == NULL)
+      return -1;
+
+   log_debug("scanning layer v = %d with %d strips", l->v, s.nstrips);
+   stats_start(ST_SCAN);
+   ls = stats_layer_start(l->v);
+
+   for (int k = 0; k < s.nstrips; k++)
+   {
+      s.st[k].mem = mem;
+      s.st[k].y0 = mem->y0 + (long) h * k / s.nstrips;
+      s.st[k].y1 = mem->y0 + (long) h * (k + 1) / s.nstrips;
+      s.st[k].v = l->v;
+   }
+
+   for (int round = 0; !err && frag_round(&s, round); round++)
+   {
+      for (int k = 0; k < s.nstrips; k++)
+         if (s.st[k].err)
+         {
+            log_errno(LOG_ERR, "frag_worker() failed");
+            err = -1;
+         }
+      if (!err && round)
+         err = frag_pass(&s);
+   }
+
+   // only the hardware counters of the strips are accounted, the counters
+   // of the contours are added by trace_layer()
+   memset(&sls, 0, sizeof(sls));
+   for (int k = 0; k < s.nstrips; k++)
+      perfctr_add(&sls.hw, &(hwcnt_t) {{0}}, &s.st[k].ls.hw);
+   if (ls != NULL)
+      stats_layer_add(ls, &sls);
+   stats_add_hw(ST_SCAN, &sls.hw);
+
+   mem->mask_v = l->v;
+   s.frag = 1;
+   s.next = -1;
+   if (!err)
+      err = trace_layer(l, mem, ls, &s);
+   mem->mask_v = -1;
+
+   for (int k = 0; k < s.nstrips; k++)
+   {
+      mt_free(s.st[k].step);
+      mt_free(s.st[k].hash);
+      mt_free(s.st[k].vis);
+      mt_free(s.st[k].in);
+      mt_free(s.st[k].out);
+   }
+   mt_free(s.st);
+
+   stats_start(ST_CLEAR);
+   clear_marks(mem);
+   stats_stop(ST_CLEAR);
+   stats_layer_stop(ls);
+   stats_stop(ST_SCAN);
+
+   return err;
+}
+
+
+/*! Test if the pixels which were read while tracing from a recorded seed
+ * intersect the changed tiles. The walkers read the neighbours of the
+ * pixels between the seed and the lower corner and of the vertices before
+ * reduce(), thus the bounding box of these is extended by RETRACE_MARGIN.
+ */
+static int seedrec_hit(const tilemap_t *tm, const seedrec_t *r)
+{
+   int x0 = r->sh.x0, y0 = r->sh.y0, x1 = r->sh.x1, y1 = r->sh.y1;
+
+   if (r->sx < x0) x0 = r->sx;
+   if (r->sx > x1) x1 = r->sx;
+   if (r->sy < y0) y0 = r->sy;
+   if (r->sy > y1) y1 = r->sy;
+   if (r->cx < x0) x0 = r->cx;
+   if (r->cx > x1) x1 = r->cx;
+   if (r->cy < y0) y0 = r->cy;
+   if (r->cy > y1) y1 = r->cy;
+
+   return tiles_hit(tm, x0 - RETRACE_MARGIN, y0 - RETRACE_MARGIN, x1 + RETRACE_MARGIN, y1 + RETRACE_MARGIN);
+}
+
+
+/*! Take the vertices of contour i of layer l. A chain is decoded.
+ * @return Pointer to the vertices or NULL on error.
+ */
+static pos_t *take_plist(layer_t *l, int i)
+{
+   chain_iter_t it;
+   pos_t *p;
+
+   if (!l->compact)
+   {
+      p = l->plist[i];
+      l->plist[i] = NULL;
+      return p;
+   }
+
+   if ((p = mt_malloc(MT_CONTOUR, l->n[i] * sizeof(*p))) == NULL)
+      return NULL;
+   contour_iter(&it, l, i);
+   for (int k = 0; contour_next(&it, &p[k]); k++);
+   return p;
+}
+
+
+/*! Trace a layer of a new version of an image incrementally from the
+ * recorded seeds of the previous version. This works like scan_layer_mt()
+ * with the previous trace in place of the strips: The seeds are scanned
+ * serially and each contour of the previous trace which was found from the
+ * same seed is taken over together with its marks, if none of the pixels it
+ * depends on changed. Only the contours in the changed tiles are traced
+ * again, thus the result is identical to scan_layer() on the new image.
+ * The seeds of l are recorded if l->rec is set.
+ * @param l Pointer to the layer.
+ * @param prev Pointer to the layer of the same value of the previous image,
+ * it must have been traced with recording. Contours which are taken over
+ * are removed from it.
+ * @param mem Pointer to the image. The journal of prev must point to it,
+ * see journal_rebase().
+ * @param tm Tiles which changed since the previous image.
+ * @return 0 on success, -1 on error.
+ */
+int retrace_layer(layer_t *l, layer_t *prev, memimg_t *mem, const tilemap_t *tm)
+{
+   layer_stat_t *ls;
+   strips_t s;
+   strip_t st;
+   seedrec_t *r;
+   traced_t *t;
+   int err = 0, reused = 0;
+
+   //safety check
+   if (l == NULL || prev == NULL || prev->rec == NULL || mem == NULL)
+      return -1;
+
+   memset(&st, 0, sizeof(st));
+   memset(&s, 0, sizeof(s));
+   s.st = &st;
+   s.nstrips = 1;
+   st.j = prev->rec->j;
+   memset(&prev->rec->j, 0, sizeof(prev->rec->j));
+
+   for (int i = 0; i < prev->rec->cnt && !err; i++)
+   {
+      r = &prev->rec->r[i];
+      if (r->idx >= prev->plist_cnt || seedrec_hit(tm, r))
+         continue;
+
+      if ((t = add_traced(&st)) == NULL)
+      {
+         log_errno(LOG_ERR, "realloc()");
+         err = -1;
+         break;
+      }
+      t->seed.x = r->sx;
+      t->seed.y = r->sy;
+      t->corner.x = r->cx;
+      t->corner.y = r->cy;
+      t->sh = r->sh;
+      t->n0 = r->n0;
+      t->j0 = r->j0;
+      t->jn = r->jn;
+      if (r->idx != -1)
+      {
+         t->n = prev->n[r->idx];
+         if ((t->p = take_plist(prev, r->idx)) == NULL)
+         {
+            log_errno(LOG_ERR, "take_plist()");
+            err = -1;
+         }
+         reused++;
+      }
+   }
+
+   log_debug("retracing layer v = %d, %d of %d seeds unchanged", l->v, st.cnt, prev->rec->cnt);
+   stats_start(ST_SCAN);
+   ls = stats_layer_start(l->v);
+   if (memimg_mask_init(mem) != -1)
+      memimg_mask(mem, l->v);
+   if (!err)
+      err = trace_layer(l, mem, ls, &s);
+   mem->mask_v = -1;
+
+   for (int i = 0; i < st.cnt; i++)
+      mt_free(st.t[i].p);
+   mt_free(st.t);
+   journal_free(&st.j);
+
+   stats_start(ST_CLEAR);
+   clear_marks(mem);
+   stats_stop(ST_CLEAR);
+   stats_layer_stop(ls);
+   stats_stop(ST_SCAN);
+
+   log_msg(LOG_INFO, "layer v = %d, %d of %d contours unchanged", l->v, reused, prev->plist_cnt);
+   return err;
+}
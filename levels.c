@@ -0,0 +1,198 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file levels.c
+ * This file contains the selection of the layer values. They are derived
+ * from the histogram of the image, which is calculated once. Levels which
+ * would result in no contours or in the same contours as the previous level
+ * are skipped.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+
+/*! Calculate the histogram of an image. Values outside of 0 - maxval_ are
+ * counted in the first and last bin respectively, which does not change the
+ * number of pixels >= v for any level v in 1 - maxval_.
+ * @param mem Pointer to image.
+ * @param hist Pointer to an array of maxval_ + 1 elements.
+ */
+void memhist(const memimg_t *mem, long *hist)
+{
+   int c;
+
+   memset(hist, 0, (maxval_ + 1) * sizeof(*hist));
+   for (int y = 0; y < mem->height; y++)
+      for (int x = 0; x < mem->width; x++)
+      {
+         c = memimg_get(mem, x, y) & ~VALL;
+         hist[c < 0 ? 0 : c > maxval_ ? maxval_ : c]++;
+      }
+}
+
+
+/*! Parse the argument of the --levels option.
+ * @param s Either "equal", "quantile", or a comma separated list of values
+ * in real units (see val_real()).
+ * @param v Pointer to an array of MAXL elements which receives the values
+ * of a list.
+ * @param n Pointer to a variable which receives the number of values.
+ * @return The mode LEVELS_xxx or -1 on error.
+ */
+int levels_parse(const char *s, double *v, int *n)
+{
+   char *end;
+   double d;
+
+   if (!strcasecmp(s, "equal"))
+      return LEVELS_EQUAL;
+   if (!strcasecmp(s, "quantile"))
+      return LEVELS_QUANTILE;
+
+   for (*n = 0; *s != '\0'; s = *end == ',' ? end + 1 : end)
+   {
+      d = strtod(s, &end);
+      if (end == s || (*end != ',' && *end != '\0'))
+      {
+         log_msg(LOG_ERR, "illegal level list");
+         return -1;
+      }
+      if (*n >= MAXL)
+      {
+         log_msg(LOG_ERR, "too many levels, maximum is %d", MAXL);
+         return -1;
+      }
+      v[(*n)++] = d;
+   }
+
+   return *n ? LEVELS_LIST : -1;
+}
+
+
+/*! Calculate the levels at all multiples of an interval in real units
+ * between the minimum and the maximum value of an image.
+ * @param hist Histogram of the image as calculated by memhist().
+ * @param d Interval in real units.
+ * @param v Pointer to an array of MAXL elements which receives the values.
+ * @return The number of levels or -1 if there are more than MAXL.
+ */
+int levels_interval(const long *hist, double d, int *v)
+{
+   int min, max, n = 0;
+
+   for (min = 1; min < maxval_ && !hist[min]; min++);
+   for (max = maxval_; max > min && !hist[max]; max--);
+
+   for (long k = ceil(val_real(min) / d - 1E-9); k * d <= val_real(max) + 1E-9; k++)
+   {
+      if (val_level(k * d) < min || val_level(k * d) > max)
+         continue;
+      if (n >= MAXL)
+      {
+         log_msg(LOG_ERR, "interval %g results in more than %d levels", d, MAXL);
+         return -1;
+      }
+      v[n++] = val_level(k * d);
+   }
+
+   return n;
+}
+
+
+static int cmpdesc(const void *a, const void *b)
+{
+   return *(const int*) b - *(const int*) a;
+}
+
+
+/*! Select the layer values.
+ * @param hist Histogram of the image as calculated by memhist().
+ * @param mode LEVELS_EQUAL spaces the levels evenly, LEVELS_QUANTILE
+ * selects them such that the bands between them contain the same number
+ * of pixels, LEVELS_LIST uses the values in v.
+ * @param n Number of levels.
+ * @param v Pointer to an array of at least n elements which receives the
+ * values in descending order.
+ * @return The number of levels in v. This may be less than n because levels
+ * above the maximum value of the image and levels with the same set of
+ * pixels as the previous level are removed.
+ */
+int select_levels(const long *hist, int mode, int n, int *v)
+{
+   long *ge, target;
+   int i, j, k;
+
+   if ((ge = mt_malloc(MT_OTHER, (maxval_ + 2) * sizeof(*ge))) == NULL)
+      return 0;
+
+   ge[maxval_ + 1] = 0;
+   for (i = maxval_; i >= 0; i--)
+      ge[i] = ge[i + 1] + hist[i];
+
+   switch (mode)
+   {
+      case LEVELS_QUANTILE:
+         for (i = maxval_, j = 0; j < n; j++)
+         {
+            target = ge[0] * (j + 1) / (n + 1);
+            for (; i > 0 && ge[i] < target; i--);
+            v[j] = i;
+         }
+         break;
+
+      case LEVELS_LIST:
+         qsort(v, n, sizeof(*v), cmpdesc);
+         break;
+
+      default:
+         for (j = 0; j < n; j++)
+            v[j] = maxval_ - maxval_ / (n + 1) * (j + 1);
+   }
+
+   for (j = 0, k = 0; j < n; j++)
+   {
+      if (v[j] < 1 || v[j] > maxval_)
+      {
+         log_msg(LOG_INFO, "skipping level %d, out of range 1 - %d", v[j], maxval_);
+         continue;
+      }
+      if (!ge[v[j]])
+      {
+         log_msg(LOG_INFO, "skipping level %d, no pixels", v[j]);
+         continue;
+      }
+      if (k && ge[v[j]] == ge[v[k - 1]])
+      {
+         log_msg(LOG_INFO, "skipping level %d, same as level %d", v[j], v[k - 1]);
+         continue;
+      }
+      v[k++] = v[j];
+   }
+
+   mt_free(ge);
+   return k;
+}
@@ -0,0 +1,291 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file lod.c
+ * This file contains the level-of-detail simplification of contours. For
+ * each vertex the effective area of Visvalingam-Whyatt is calculated once,
+ * i.e. the area of the triangle of the vertex and its neighbours at the
+ * time at which it is removed. The areas increase in the order of removal,
+ * thus keeping the vertices with an area >= t gives the same result as
+ * simplifying the contour with the tolerance t, and the contours can be
+ * output at any number of tolerances without tracing or simplifying them
+ * again.
+ * The end points of open contours and the first (and last) vertex of
+ * closed contours are never removed, closed contours keep at least 3
+ * different vertices.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+
+//! binary min-heap of the vertices ordered by their current area
+typedef struct lod_heap
+{
+   //! vertices of the heap, position of each vertex in the heap
+   int *h, *pos;
+   //! current area of each vertex
+   const double *a;
+   int cnt;
+} lod_heap_t;
+
+
+/*! Area of the triangle of the vertices a, b, and c.
+ */
+static double tri_area(const pos_t *a, const pos_t *b, const pos_t *c)
+{
+   return fabs((b->xf - a->xf) * (c->yf - a->yf) - (c->xf - a->xf) * (b->yf - a->yf)) / 2;
+}
+
+
+/*! Order of the heap, vertices of equal area are ordered by their index,
+ * thus the result does not depend on the implementation of the heap.
+ */
+static int hless(const lod_heap_t *hp, int i, int j)
+{
+   return hp->a[i] < hp->a[j] || (hp->a[i] == hp->a[j] && i < j);
+}
+
+
+static void hswap(lod_heap_t *hp, int k, int l)
+{
+   int t = hp->h[k];
+
+   hp->h[k] = hp->h[l];
+   hp->h[l] = t;
+   hp->pos[hp->h[k]] = k;
+   hp->pos[hp->h[l]] = l;
+}
+
+
+static void sift_up(lod_heap_t *hp, int k)
+{
+   for (; k > 0 && hless(hp, hp->h[k], hp->h[(k - 1) / 2]); k = (k - 1) / 2)
+      hswap(hp, k, (k - 1) / 2);
+}
+
+
+static void sift_down(lod_heap_t *hp, int k)
+{
+   for (int c; (c = 2 * k + 1) < hp->cnt; k = c)
+   {
+      if (c + 1 < hp->cnt && hless(hp, hp->h[c + 1], hp->h[c]))
+         c++;
+      if (!hless(hp, hp->h[c], hp->h[k]))
+         break;
+      hswap(hp, k, c);
+   }
+}
+
+
+/*! Calculate the effective areas of the vertices of a contour.
+ * @param p Pointer to the vertices.
+ * @param n Number of vertices.
+ * @param closed 1 if the last vertex equals the first one.
+ * @param area Pointer to n areas which receive the results, vertices which
+ * are never removed get HUGE_VALF.
+ * @return 0 on success, -1 on error.
+ */
+int lod_areas(const pos_t *p, int n, int closed, float *area)
+{
+   lod_heap_t hp;
+   int *prev, *next, i, j, keep = closed ? 2 : 0;
+   double *a, max = 0;
+
+   for (i = 0; i < n; i++)
+      area[i] = HUGE_VALF;
+   if (n - 2 <= keep)
+      return 0;
+
+   if ((prev = mt_malloc(MT_OTHER, 4 * n * sizeof(*prev))) == NULL)
+      return -1;
+   if ((a = mt_malloc(MT_OTHER, n * sizeof(*a))) == NULL)
+   {
+      mt_free(prev);
+      return -1;
+   }
+   next = prev + n;
+   hp.h = prev + 2 * n;
+   hp.pos = prev + 3 * n;
+   hp.a = a;
+
+   // the interior vertices 1 to n - 2 are removable
+   for (i = 1, hp.cnt = 0; i < n - 1; i++, hp.cnt++)
+   {
+      prev[i] = i - 1;
+      next[i] = i + 1;
+      a[i] = tri_area(&p[i - 1], &p[i], &p[i + 1]);
+      hp.h[hp.cnt] = i;
+      hp.pos[i] = hp.cnt;
+   }
+   for (int k = hp.cnt / 2 - 1; k >= 0; k--)
+      sift_down(&hp, k);
+
+   while (hp.cnt > keep)
+   {
+      i = hp.h[0];
+      hswap(&hp, 0, --hp.cnt);
+      sift_down(&hp, 0);
+
+      // a vertex is never removed before its neighbours which were
+      // removed earlier
+      if (a[i] > max)
+         max = a[i];
+      area[i] = max;
+
+      next[prev[i]] = next[i];
+      prev[next[i]] = prev[i];
+      for (int k = 0; k < 2; k++)
+      {
+         j = k ? next[i] : prev[i];
+         if (j <= 0 || j >= n - 1)
+            continue;
+         a[j] = tri_area(&p[prev[j]], &p[j], &p[next[j]]);
+         sift_up(&hp, hp.pos[j]);
+         sift_down(&hp, hp.pos[j]);
+      }
+   }
+
+   mt_free(a);
+   mt_free(prev);
+   return 0;
+}
+
+
+/*! Calculate the effective areas of all vertices of all contours of a
+ * layer into l->lod.
+ * @return 0 on success, -1 on error.
+ */
+int lod_layer(layer_t *l)
+{
+   chain_iter_t it;
+   pos_t *buf = NULL, *p;
+   int size = 0;
+
+   if (l->lod != NULL || !l->plist_cnt)
+      return 0;
+   if ((l->lod = mt_calloc(MT_CONTOUR, l->plist_cnt, sizeof(*l->lod))) == NULL)
+      return -1;
+
+   for (int i = 0; i < l->plist_cnt; i++)
+   {
+      if ((l->lod[i] = mt_malloc(MT_CONTOUR, l->n[i] * sizeof(**l->lod))) == NULL)
+         goto lod_layer_err;
+
+      // chain code is decoded into a temporary vertex list
+      if (l->compact)
+      {
+         if (l->n[i] > size)
+         {
+            size = l->n[i];
+            mt_free(buf);
+            if ((buf = mt_malloc(MT_OTHER, size * sizeof(*buf))) == NULL)
+               goto lod_layer_err;
+         }
+         contour_iter(&it, l, i);
+         for (p = buf; contour_next(&it, p); p++);
+         p = buf;
+      }
+      else
+         p = l->plist[i];
+
+      if (lod_areas(p, l->n[i], contour_closed(l, i), l->lod[i]) == -1)
+         goto lod_layer_err;
+   }
+
+   mt_free(buf);
+   return 0;
+
+lod_layer_err:
+   log_msg(LOG_ERR, "cannot allocate memory for effective areas");
+   mt_free(buf);
+   lod_free(l);
+   return -1;
+}
+
+
+/*! Free the effective areas of a layer.
+ */
+void lod_free(layer_t *l)
+{
+   if (l->lod == NULL)
+      return;
+   for (int i = 0; i < l->plist_cnt; i++)
+      mt_free(l->lod[i]);
+   mt_free(l->lod);
+   l->lod = NULL;
+}
+
+
+/*! Copy the layers with just the vertices of an effective area >= tol. The
+ * effective areas must be calculated with lod_layer() before.
+ * @param src Pointer to the source layers.
+ * @param dst Pointer to the destination layers, they are initialized and
+ * must be freed with free_layer().
+ * @param nlayers Number of layers.
+ * @param tol Tolerance in square pixels.
+ * @return 0 on success, -1 on error.
+ */
+int lod_filter(const layer_t *src, layer_t *dst, int nlayers, double tol)
+{
+   chain_iter_t it;
+   pos_t p;
+   int n;
+
+   memset(dst, 0, nlayers * sizeof(*dst));
+   for (int j = 0; j < nlayers; j++)
+   {
+      dst[j].v = src[j].v;
+      if (!src[j].plist_cnt)
+         continue;
+
+      if (src[j].lod == NULL
+            || (dst[j].plist = mt_calloc(MT_LAYER, src[j].plist_cnt, sizeof(*dst[j].plist))) == NULL
+            || (dst[j].n = mt_calloc(MT_LAYER, src[j].plist_cnt, sizeof(*dst[j].n))) == NULL)
+         goto lod_filter_err;
+      dst[j].plist_cnt = src[j].plist_cnt;
+
+      for (int i = 0; i < src[j].plist_cnt; i++)
+      {
+         for (int k = n = 0; k < src[j].n[i]; k++)
+            n += src[j].lod[i][k] >= tol;
+         if ((dst[j].plist[i] = mt_malloc(MT_CONTOUR, n * sizeof(*dst[j].plist[i]))) == NULL)
+            goto lod_filter_err;
+
+         contour_iter(&it, &src[j], i);
+         for (int k = n = 0; contour_next(&it, &p); k++)
+            if (src[j].lod[i][k] >= tol)
+               dst[j].plist[i][n++] = p;
+         dst[j].n[i] = n;
+      }
+   }
+   return 0;
+
+lod_filter_err:
+   log_msg(LOG_ERR, "cannot filter contours");
+   for (int j = 0; j < nlayers; j++)
+      free_layer(&dst[j]);
+   return -1;
+}
@@ -0,0 +1,385 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file maxtree.c
+ * This file contains the max-tree index of an image. Each node of the tree
+ * is a connected component (8-connectivity, like the walkers) of the pixels
+ * >= its level. The parent of a node is the component at the next lower
+ * level which contains it. The tree is built with union-find on the pixels
+ * sorted by a counting sort in descending order.
+ * The index is saved together with the prepared image, thus a saved index
+ * can be traced again at any level without decoding the original image.
+ * The tree tells the rows of the components of each level, thus only these
+ * rows are traced (see layer_rows()).
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+#define MT_FILE_MAGIC "TRMT"
+#define MT_FILE_VERSION 3
+
+
+//! header of an index file, it is followed by the pixels and the nodes
+typedef struct mtfile
+{
+   char magic[4];
+   int version;
+   int width, height;
+   int nnodes;
+   //! maximum value of the image, see maxval_
+   int maxval;
+   //! key of the input file and the options of the preparation, see
+   //! cache_key(), empty if it is unknown
+   char key[CACHE_KEYLEN];
+} mtfile_t;
+
+
+static int clampval(int c)
+{
+   c &= ~VALL;
+   return c < 0 ? 0 : c > maxval_ ? maxval_ : c;
+}
+
+
+static int find_root(int *zpar, int p)
+{
+   int r, q;
+
+   for (r = p; zpar[r] != r; r = zpar[r]);
+   // path compression
+   for (; zpar[p] != r; p = q)
+   {
+      q = zpar[p];
+      zpar[p] = r;
+   }
+   return r;
+}
+
+
+/*! Sort the pixel indices by value in descending order.
+ */
+static int sort_pixels(const memimg_t *mem, int *s)
+{
+   int n = mem->width * mem->height;
+   long *cnt;
+
+   if ((cnt = mt_calloc(MT_OTHER, maxval_ + 2, sizeof(*cnt))) == NULL)
+      return -1;
+
+   for (int i = 0; i < n; i++)
+      cnt[maxval_ - clampval(mem->mem[i]) + 1]++;
+   for (int i = 1; i <= maxval_ + 1; i++)
+      cnt[i] += cnt[i - 1];
+   for (int i = 0; i < n; i++)
+      s[cnt[maxval_ - clampval(mem->mem[i])]++] = i;
+
+   mt_free(cnt);
+   return 0;
+}
+
+
+/*! Build the max-tree of an image.
+ * @param mt Pointer to the destination tree.
+ * @param mem Pointer to the image.
+ * @return 0 on success, -1 on error.
+ */
+int maxtree_build(maxtree_t *mt, const memimg_t *mem)
+{
+   int *s, *parent, *zpar, *node;
+   int n, i, j, p, q, r, x, y, k;
+   mtnode_t *nd;
+
+   memset(mt, 0, sizeof(*mt));
+   n = mem->width * mem->height;
+   s = mt_malloc(MT_OTHER, n * sizeof(*s));
+   parent = mt_malloc(MT_OTHER, n * sizeof(*parent));
+   zpar = mt_malloc(MT_OTHER, n * sizeof(*zpar));
+   if (s == NULL || parent == NULL || zpar == NULL)
+   {
+      mt_free(s);
+      mt_free(parent);
+      mt_free(zpar);
+      return -1;
+   }
+
+   if (sort_pixels(mem, s) == -1)
+   {
+      mt_free(s);
+      mt_free(parent);
+      mt_free(zpar);
+      return -1;
+   }
+
+   // union-find from the highest to the lowest value
+   for (i = 0; i < n; i++)
+      parent[i] = -1;
+   for (i = 0; i < n; i++)
+   {
+      p = s[i];
+      parent[p] = zpar[p] = p;
+      x = p % mem->width;
+      y = p / mem->width;
+      for (int dy = -1; dy <= 1; dy++)
+         for (int dx = -1; dx <= 1; dx++)
+         {
+            if ((!dx && !dy) || x + dx < 0 || x + dx >= mem->width || y + dy < 0 || y + dy >= mem->height)
+               continue;
+            q = p + dy * mem->width + dx;
+            if (parent[q] == -1 || (r = find_root(zpar, q)) == p)
+               continue;
+            parent[r] = zpar[r] = p;
+         }
+   }
+
+   // canonicalize, afterwards parent[p] is the canonical element of the
+   // node of p, or of its parent node if p is canonical
+   for (i = n - 1; i >= 0; i--)
+   {
+      p = s[i];
+      q = parent[p];
+      if (clampval(mem->mem[parent[q]]) == clampval(mem->mem[q]))
+         parent[p] = parent[q];
+   }
+
+   // number the nodes in the order of the sort, zpar is reused as map of
+   // canonical elements to node ids
+   node = zpar;
+   for (i = 0, k = 0; i < n; i++)
+   {
+      p = s[i];
+      if (parent[p] == p || clampval(mem->mem[parent[p]]) != clampval(mem->mem[p]))
+         node[p] = k++;
+   }
+
+   if ((mt->node = mt_calloc(MT_OTHER, k, sizeof(*mt->node))) == NULL)
+   {
+      mt_free(s);
+      mt_free(parent);
+      mt_free(zpar);
+      return -1;
+   }
+   mt->nnodes = k;
+   mt->width = mem->width;
+   mt->height = mem->height;
+
+   for (i = 0; i < n; i++)
+   {
+      p = s[i];
+      x = p % mem->width;
+      y = p / mem->width;
+      if (parent[p] == p || clampval(mem->mem[parent[p]]) != clampval(mem->mem[p]))
+      {
+         nd = &mt->node[node[p]];
+         nd->level = clampval(mem->mem[p]);
+         nd->parent = parent[p] == p ? -1 : node[parent[p]];
+         j = node[p];
+      }
+      else
+         j = node[parent[p]];
+
+      // add pixel to its node
+      nd = &mt->node[j];
+      if (!nd->area)
+      {
+         nd->x0 = nd->x1 = x;
+         nd->y0 = nd->y1 = y;
+      }
+      nd->area++;
+      if (x < nd->x0) nd->x0 = x;
+      if (x > nd->x1) nd->x1 = x;
+      if (y < nd->y0) nd->y0 = y;
+      if (y > nd->y1) nd->y1 = y;
+   }
+
+   // the parent of a node is numbered after the node, thus the area and
+   // the bounding box are complete when they are added to the parent
+   for (i = 0; i < mt->nnodes; i++)
+   {
+      if ((j = mt->node[i].parent) == -1)
+         continue;
+      nd = &mt->node[j];
+      nd->area += mt->node[i].area;
+      if (mt->node[i].x0 < nd->x0) nd->x0 = mt->node[i].x0;
+      if (mt->node[i].x1 > nd->x1) nd->x1 = mt->node[i].x1;
+      if (mt->node[i].y0 < nd->y0) nd->y0 = mt->node[i].y0;
+      if (mt->node[i].y1 > nd->y1) nd->y1 = mt->node[i].y1;
+   }
+
+   mt_free(s);
+   mt_free(parent);
+   mt_free(zpar);
+
+   log_debug("max-tree of %dx%d pixels has %d nodes", mt->width, mt->height, mt->nnodes);
+   return 0;
+}
+
+
+void maxtree_free(maxtree_t *mt)
+{
+   mt_free(mt->node);
+   memset(mt, 0, sizeof(*mt));
+}
+
+
+/*! Get the connected components of the pixels >= v.
+ * @param mt Pointer to the tree.
+ * @param v Level.
+ * @param area Pointer to a variable which receives the total number of
+ * pixels of the components, may be NULL.
+ * @param y0 Pointer to a variable which receives the first row of the
+ * components, may be NULL.
+ * @param y1 Pointer to a variable which receives the last row of the
+ * components, may be NULL.
+ * @return The number of components.
+ */
+int maxtree_query(const maxtree_t *mt, int v, long *area, int *y0, int *y1)
+{
+   const mtnode_t *nd;
+   int n = 0, ymin = mt->height, ymax = -1;
+   long a = 0;
+
+   for (int i = 0; i < mt->nnodes; i++)
+   {
+      nd = &mt->node[i];
+      if (nd->level < v || (nd->parent != -1 && mt->node[nd->parent].level >= v))
+         continue;
+
+      n++;
+      a += nd->area;
+      if (nd->y0 < ymin)
+         ymin = nd->y0;
+      if (nd->y1 > ymax)
+         ymax = nd->y1;
+   }
+
+   if (area != NULL)
+      *area = a;
+   if (y0 != NULL)
+      *y0 = ymin;
+   if (y1 != NULL)
+      *y1 = ymax;
+   return n;
+}
+
+
+/*! Save the tree together with the image.
+ * @param key Key of the input from which the image was prepared, may be
+ * NULL.
+ * @return 0 on success, -1 on error.
+ */
+int maxtree_save(const maxtree_t *mt, const memimg_t *mem, const char *key, const char *s)
+{
+   mtfile_t hdr;
+   FILE *f;
+   int err = 0;
+
+   if ((f = fopen(s, "w")) == NULL)
+   {
+      log_errno(LOG_ERR, "fopen()");
+      return -1;
+   }
+
+   memset(&hdr, 0, sizeof(hdr));
+   memcpy(hdr.magic, MT_FILE_MAGIC, sizeof(hdr.magic));
+   hdr.version = MT_FILE_VERSION;
+   hdr.width = mt->width;
+   hdr.height = mt->height;
+   hdr.nnodes = mt->nnodes;
+   hdr.maxval = maxval_;
+   if (key != NULL)
+      snprintf(hdr.key, sizeof(hdr.key), "%s", key);
+
+   if (fwrite(&hdr, sizeof(hdr), 1, f) != 1
+         || fwrite(mem->mem, sizeof(*mem->mem), (size_t) mem->width * mem->height, f) != (size_t) mem->width * mem->height
+         || fwrite(mt->node, sizeof(*mt->node), mt->nnodes, f) != (size_t) mt->nnodes)
+   {
+      log_errno(LOG_ERR, "fwrite()");
+      err = -1;
+   }
+
+   if (fclose(f) == EOF)
+      err = -1;
+   return err;
+}
+
+
+/*! Load a tree and its image saved with maxtree_save().
+ * @param mt Pointer to the destination tree.
+ * @param mem Pointer to the destination image.
+ * @param key Buffer of CACHE_KEYLEN bytes which receives the key of the
+ * input, it is empty if the key is unknown.
+ * @return 0 on success, -1 on error.
+ */
+int maxtree_load(maxtree_t *mt, memimg_t *mem, char *key, const char *s)
+{
+   mtfile_t hdr;
+   FILE *f;
+
+   memset(mt, 0, sizeof(*mt));
+   if ((f = fopen(s, "r")) == NULL)
+      return -1;
+
+   if (fread(&hdr, sizeof(hdr), 1, f) != 1 || memcmp(hdr.magic, MT_FILE_MAGIC, sizeof(hdr.magic)) || hdr.version != MT_FILE_VERSION)
+   {
+      log_msg(LOG_ERR, "%s is not an index file of this version", s);
+      fclose(f);
+      return -1;
+   }
+   if (hdr.maxval != maxval_)
+   {
+      log_msg(LOG_ERR, "index %s has values of 0 - %d, not 0 - %d", s, hdr.maxval, maxval_);
+      fclose(f);
+      return -1;
+   }
+
+   hdr.key[sizeof(hdr.key) - 1] = '\0';
+   snprintf(key, CACHE_KEYLEN, "%s", hdr.key);
+
+   mem->width = hdr.width;
+   mem->height = hdr.height;
+   if (memimg_init(mem) == -1)
+   {
+      fclose(f);
+      return -1;
+   }
+
+   mt->width = hdr.width;
+   mt->height = hdr.height;
+   mt->nnodes = hdr.nnodes;
+   if ((mt->node = mt_malloc(MT_OTHER, hdr.nnodes * sizeof(*mt->node))) == NULL
+         || fread(mem->mem, sizeof(*mem->mem), (size_t) mem->width * mem->height, f) != (size_t) mem->width * mem->height
+         || fread(mt->node, sizeof(*mt->node), mt->nnodes, f) != (size_t) mt->nnodes)
+   {
+      log_msg(LOG_ERR, "index file %s truncated", s);
+      maxtree_free(mt);
+      memimg_free(mem);
+      fclose(f);
+      return -1;
+   }
+
+   fclose(f);
+   return 0;
+}
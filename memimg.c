@@ -26,8 +26,12 @@
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "memimg.h"
+#include "memtrack.h"
 
 
 int memimg_init(memimg_t *mi)
@@ -36,7 +40,10 @@ int memimg_init(memimg_t *mi)
    if (mi == NULL || mi->width <= 0 || mi->height <= 0)
       return -1;
 
-   if ((mi->mem = calloc(mi->width * mi->height, sizeof(*mi->mem))) == NULL)
+   mi->y0 = 0;
+   mi->mask = NULL;
+   mi->mask_v = -1;
+   if ((mi->mem = mt_calloc(MT_RASTER, (size_t) mi->width * mi->height, sizeof(*mi->mem))) == NULL)
       return -1;
 
    return 0;
@@ -49,8 +56,11 @@ void memimg_free(memimg_t *mi)
    if (mi == NULL)
       return;
 
-   free(mi->mem);
+   mt_free(mi->mem);
    mi->mem = NULL;
+   mt_free(mi->mask);
+   mi->mask = NULL;
+   mi->mask_v = -1;
 }
 
 
@@ -63,8 +73,10 @@ int memimg_copy(memimg_t *src, memimg_t *dst)
       return -1;
 
    memcpy(dst, src, sizeof(*dst));
-   len = dst->width * dst->height * sizeof(*dst->mem);
-   if ((dst->mem = malloc(len)) == NULL)
+   dst->mask = NULL;
+   dst->mask_v = -1;
+   len = (size_t) dst->width * dst->height * sizeof(*dst->mem);
+   if ((dst->mem = mt_malloc(MT_RASTER, len)) == NULL)
       return -1;
 
    memcpy(dst->mem, src->mem, len);
@@ -75,7 +87,7 @@ int memimg_copy(memimg_t *src, memimg_t *dst)
 int memimg_get(const memimg_t *mi, int x, int y)
 {
    // safety check
-   if (x < 0 || x >= mi->width || y < 0 || y >= mi->height)
+   if (x < 0 || x >= mi->width || y < mi->y0 || y >= mi->height)
    {
       errno = EFAULT;
       return -1;
@@ -90,7 +102,7 @@ int memimg_put(memimg_t *mi, int x, int y, int f)
    int tf;
 
    // safety check
-   if (x < 0 || x >= mi->width || y < 0 || y >= mi->height)
+   if (x < 0 || x >= mi->width || y < mi->y0 || y >= mi->height)
    {
       errno = EFAULT;
       return -1;
@@ -120,7 +132,7 @@ int memimg_op(memimg_t *mi, int x, int y, int f, int (*op)(int, int))
    int tf;
 
    // safety check
-   if (x < 0 || x >= mi->width || y < 0 || y >= mi->height)
+   if (x < 0 || x >= mi->width || y < mi->y0 || y >= mi->height)
    {
       errno = EFAULT;
       return -1;
@@ -144,3 +156,58 @@ int memimg_and(memimg_t *mi, int x, int y, int f)
    return memimg_op(mi, x, y, f, f_and);
 }
 
+
+/*! Allocate the threshold mask if it does not exist yet.
+ *  @return 0 on success, -1 on error.
+ */
+int memimg_mask_init(memimg_t *mi)
+{
+   if (mi->mask != NULL)
+      return 0;
+
+   mi->mstride = (mi->width + 63) / 64;
+   if ((mi->mask = mt_malloc(MT_RASTER, (size_t) mi->mstride * mi->height * sizeof(*mi->mask))) == NULL)
+      return -1;
+
+   mi->mask_v = -1;
+   return 0;
+}
+
+
+/*! Build the threshold mask of the rows y0 to height - 1, i.e. set the bits
+ * of all pixels >= v. The values are compared including their upper bits,
+ * thus the tracer's marks have to be cleared before.
+ *  @param mi Pointer to image, the mask has to be allocated with
+ *  memimg_mask_init().
+ *  @param v Threshold.
+ */
+void memimg_mask(memimg_t *mi, int v)
+{
+   const int *src;
+   uint64_t *dst;
+   int x;
+
+   for (int y = mi->y0; y < mi->height; y++)
+   {
+      src = mi->mem + (size_t) y * mi->width;
+      dst = mi->mask + (size_t) y * mi->mstride;
+      memset(dst, 0, mi->mstride * sizeof(*dst));
+      x = 0;
+#ifdef __SSE2__
+      // 16 pixels per iteration, the bits never cross a word boundary
+      const __m128i t = _mm_set1_epi32(v - 1);
+      for (; x + 16 <= mi->width; x += 16)
+      {
+         unsigned b = _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (src + x)), t)))
+            | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (src + x + 4)), t))) << 4
+            | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (src + x + 8)), t))) << 8
+            | _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(_mm_loadu_si128((const __m128i*) (src + x + 12)), t))) << 12;
+         dst[x >> 6] |= (uint64_t) b << (x & 63);
+      }
+#endif
+      for (; x < mi->width; x++)
+         if (src[x] >= v)
+            dst[x >> 6] |= (uint64_t) 1 << (x & 63);
+   }
+   mi->mask_v = v;
+}
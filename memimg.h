@@ -25,12 +25,22 @@
 #ifndef MEMIMG_H
 #define MEMIMG_H
 
+#include <stdint.h>
 
 typedef struct memimg
 {
    int *mem;
    int width;
    int height;
+   //! first row, it is greater than 0 if the image is a view into the rows
+   //! y0 to height - 1 of a larger image
+   int y0;
+   //! threshold mask, bit x of row y is set if the pixel is >= mask_v
+   uint64_t *mask;
+   //! number of words per row of the mask
+   int mstride;
+   //! threshold of the mask, -1 if the mask is not valid
+   int mask_v;
 } memimg_t;
 
 
@@ -41,6 +51,19 @@ int memimg_get(const memimg_t *mi, int x, int y);
 int memimg_put(memimg_t *mi, int x, int y, int f);
 int memimg_or(memimg_t *mi, int x, int y, int f);
 int memimg_and(memimg_t *mi, int x, int y, int f);
+int memimg_mask_init(memimg_t *mi);
+void memimg_mask(memimg_t *mi, int v);
+
+
+/*! Return the bit of pixel x/y of the threshold mask.
+ */
+static inline int memimg_mask_get(const memimg_t *mi, int x, int y)
+{
+   if (x < 0 || x >= mi->width || y < mi->y0 || y >= mi->height)
+      return 0;
+
+   return (mi->mask[(size_t) y * mi->mstride + (x >> 6)] >> (x & 63)) & 1;
+}
 
 
 #endif
@@ -0,0 +1,269 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file memtrack.c
+ * This file contains wrappers for malloc(), calloc(), realloc() and free()
+ * which account all allocations per subsystem (tag). Each block is prefixed
+ * by a small header holding its size and tag, thus memory allocated with
+ * these functions must be freed with mt_free(). Memory which is allocated
+ * by third party libraries (e.g. cairo surfaces) or by other allocators
+ * (e.g. posix_memalign()) can be accounted with mt_account(), which applies
+ * the budget as well.
+ * The counters are updated atomically, thus the functions may be called from
+ * multiple threads.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <syslog.h>
+
+#include "memtrack.h"
+#include "smlog.h"
+
+
+typedef struct mt_hdr
+{
+   size_t size;
+   int tag;
+   int magic;
+} mt_hdr_t;
+
+#define MT_MAGIC 0x4d544b52
+
+static const char *mtname_[MT_MAX] = {"raster", "contour", "layer", "export", "cairo", "other"};
+static mt_stat_t mt_[MT_MAX];
+//! total number of bytes allocated and its maximum
+static long live_, peak_;
+//! maximum number of bytes which may be allocated, 0 means unlimited
+static long budget_;
+
+
+const char *mt_name(int tag)
+{
+   return tag >= 0 && tag < MT_MAX ? mtname_[tag] : "total";
+}
+
+
+static void update_peak(long *peak, long live)
+{
+   long p = __atomic_load_n(peak, __ATOMIC_RELAXED);
+
+   while (live > p && !__atomic_compare_exchange_n(peak, &p, live, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+
+/*! Account size bytes to tag. Size may be negative.
+ */
+static void account(int tag, long size)
+{
+   long live;
+
+   if (tag < 0 || tag >= MT_MAX)
+      tag = MT_OTHER;
+
+   if (size > 0)
+      __atomic_add_fetch(&mt_[tag].calls, 1, __ATOMIC_RELAXED);
+
+   live = __atomic_add_fetch(&mt_[tag].live, size, __ATOMIC_RELAXED);
+   update_peak(&mt_[tag].peak, live);
+   live = __atomic_add_fetch(&live_, size, __ATOMIC_RELAXED);
+   update_peak(&peak_, live);
+}
+
+
+/*! Set the memory budget.
+ *  @param budget Maximum number of bytes which may be allocated in total
+ *  through the mt_xxx() functions, the program is aborted if an allocation
+ *  exceeds it. 0 disables the limit.
+ */
+void mt_set_budget(size_t budget)
+{
+   budget_ = budget;
+}
+
+
+/*! Check if additional size bytes fit into the budget. If they do not, the
+ *  allocations of all tags are logged and the program is aborted, because
+ *  the callers cannot continue with a partial result.
+ */
+static void mt_check(int tag, long size)
+{
+   if (!budget_ || size <= 0 || __atomic_load_n(&live_, __ATOMIC_RELAXED) + size <= budget_)
+      return;
+
+   log_msg(LOG_ERR, "memory budget of %ld bytes exceeded by %s allocation of %ld bytes", budget_, mt_name(tag), size);
+   mt_log(LOG_ERR);
+   exit(EXIT_FAILURE);
+}
+
+
+/*! Account size bytes of memory which was not allocated by the mt_xxx()
+ *  functions to tag. Size may be negative. The budget is checked like on
+ *  mt_malloc(), thus it should be called before the memory is allocated.
+ */
+void mt_account(int tag, long size)
+{
+   mt_check(tag, size);
+   account(tag, size);
+}
+
+
+void *mt_malloc(int tag, size_t size)
+{
+   mt_hdr_t *h;
+
+   mt_check(tag, size);
+   if ((h = malloc(sizeof(*h) + size)) == NULL)
+      return NULL;
+
+   h->size = size;
+   h->tag = tag;
+   h->magic = MT_MAGIC;
+   account(tag, size);
+
+   return h + 1;
+}
+
+
+void *mt_calloc(int tag, size_t nmemb, size_t size)
+{
+   mt_hdr_t *h;
+
+   // safety check
+   if (size && nmemb > (~(size_t) 0 - sizeof(*h)) / size)
+   {
+      errno = ENOMEM;
+      return NULL;
+   }
+
+   mt_check(tag, nmemb * size);
+   if ((h = calloc(1, sizeof(*h) + nmemb * size)) == NULL)
+      return NULL;
+
+   h->size = nmemb * size;
+   h->tag = tag;
+   h->magic = MT_MAGIC;
+   account(tag, h->size);
+
+   return h + 1;
+}
+
+
+void *mt_realloc(int tag, void *ptr, size_t size)
+{
+   mt_hdr_t *h;
+   size_t osize;
+
+   if (ptr == NULL)
+      return mt_malloc(tag, size);
+
+   h = (mt_hdr_t*) ptr - 1;
+   if (h->magic != MT_MAGIC)
+   {
+      log_msg(LOG_EMERG, "mt_realloc() on untracked memory %p", ptr);
+      abort();
+   }
+
+   osize = h->size;
+   if (size > osize)
+      mt_check(tag, size - osize);
+
+   if ((h = realloc(h, sizeof(*h) + size)) == NULL)
+      return NULL;
+
+   // the tag of the original allocation is kept
+   h->size = size;
+   account(h->tag, (long) size - (long) osize);
+
+   return h + 1;
+}
+
+
+void mt_free(void *ptr)
+{
+   mt_hdr_t *h;
+
+   if (ptr == NULL)
+      return;
+
+   h = (mt_hdr_t*) ptr - 1;
+   if (h->magic != MT_MAGIC)
+   {
+      log_msg(LOG_EMERG, "mt_free() on untracked memory %p", ptr);
+      abort();
+   }
+
+   h->magic = 0;
+   account(h->tag, -(long) h->size);
+   free(h);
+}
+
+
+/*! Get the counters of a tag.
+ *  @param tag Allocation tag. If tag is MT_MAX the totals are returned.
+ *  @param ms Pointer to destination.
+ */
+void mt_get(int tag, mt_stat_t *ms)
+{
+   if (tag >= 0 && tag < MT_MAX)
+   {
+      *ms = mt_[tag];
+      return;
+   }
+
+   memset(ms, 0, sizeof(*ms));
+   for (int i = 0; i < MT_MAX; i++)
+      ms->calls += mt_[i].calls;
+   ms->live = live_;
+   ms->peak = peak_;
+}
+
+
+void mt_json(FILE *f)
+{
+   mt_stat_t ms;
+
+   fprintf(f, "{\"budget\": %ld", budget_);
+   for (int i = 0; i <= MT_MAX; i++)
+   {
+      mt_get(i, &ms);
+      fprintf(f, ", \"%s\": {\"calls\": %ld, \"live\": %ld, \"peak\": %ld}", mt_name(i), ms.calls, ms.live, ms.peak);
+   }
+   fprintf(f, "}");
+}
+
+
+/*! Log the allocation summary.
+ *  @param lf Log level.
+ */
+void mt_log(int lf)
+{
+   mt_stat_t ms;
+
+   for (int i = 0; i <= MT_MAX; i++)
+   {
+      mt_get(i, &ms);
+      if (ms.calls)
+         log_msg(lf, "memory %-8s calls = %ld, live = %ld, peak = %ld", mt_name(i), ms.calls, ms.live, ms.peak);
+   }
+}
+
@@ -0,0 +1,59 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file memtrack.h
+ * This file contains the declarations of the tracked memory allocation
+ * functions.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#ifndef MEMTRACK_H
+#define MEMTRACK_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+
+//! allocation tags, i.e. the subsystem which owns the memory
+enum {MT_RASTER, MT_CONTOUR, MT_LAYER, MT_EXPORT, MT_CAIRO, MT_OTHER, MT_MAX};
+
+typedef struct mt_stat
+{
+   //! number of allocation calls (malloc, calloc, realloc)
+   long calls;
+   //! number of bytes currently allocated
+   long live;
+   //! maximum of live
+   long peak;
+} mt_stat_t;
+
+
+void *mt_malloc(int tag, size_t size);
+void *mt_calloc(int tag, size_t nmemb, size_t size);
+void *mt_realloc(int tag, void *ptr, size_t size);
+void mt_free(void *ptr);
+void mt_account(int tag, long size);
+void mt_set_budget(size_t budget);
+void mt_get(int tag, mt_stat_t *ms);
+const char *mt_name(int tag);
+void mt_json(FILE *f);
+void mt_log(int lf);
+
+#endif
+
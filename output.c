@@ -0,0 +1,631 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file output.c
+ * This file contains the output files of the exporters. The compression is
+ * selected by the extension of the file name, ".gz" is gzip and ".zst" is
+ * zstd (if compiled with HAVE_ZSTD).
+ * Compressed output is collected in blocks of OUT_BLKSIZE bytes. If compiled
+ * with WITH_THREADS, each full block is compressed by one of a set of worker
+ * threads while the exporter formats the next block, and the compressed
+ * blocks are written in their original order. Every block is compressed
+ * independently into a gzip member or a zstd frame. Concatenated members
+ * and frames are valid files for gzip and zstd.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "scan.h"
+#include "stats.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! size of an uncompressed block
+#define OUT_BLKSIZE (1L << 20)
+//! size and alignment of the write buffers
+#define OUT_WBUFSIZE (4L << 20)
+#define OUT_ALIGN 4096
+//! maximum number of compression threads
+#define OUT_MAXTHREADS 16
+//! compression levels
+#define OUT_GZLEVEL 6
+#define OUT_ZSTDLEVEL 3
+
+enum {OUT_PLAIN, OUT_GZIP, OUT_ZSTD};
+enum {BLK_FREE, BLK_FULL, BLK_BUSY, BLK_DONE};
+
+
+typedef struct outblk
+{
+   //! uncompressed data
+   char *buf;
+   size_t len;
+   //! compressed data, zlen is -1 on error
+   char *zbuf;
+   size_t zsize;
+   long zlen;
+   int state;
+} outblk_t;
+
+//! double buffered writer of a file
+typedef struct outwriter
+{
+   int fd;
+   //! the file supports pwrite(), otherwise write() is used (e.g. pipes)
+   int seekable;
+   off_t off;
+   //! buffer cur is filled by the exporter
+   char *buf[2];
+   size_t len[2];
+   int cur;
+   //! buffer which is written by the writer thread, -1 if none
+   int pend;
+   //! time the exporter waited for the writer in ns, and number of writes
+   long stall, writes;
+   int err;
+#ifdef WITH_THREADS
+   int running, stop;
+   pthread_t th;
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+#endif
+} outwriter_t;
+
+typedef struct outfile
+{
+   outwriter_t w;
+   int comp;
+   outblk_t *blk;
+   int nblk;
+   //! sequence numbers of the block being filled, of the next block to be
+   //! compressed, and of the next block to be written
+   long fill, next, wr;
+   int err;
+#ifdef WITH_THREADS
+   int nth, stop;
+   pthread_t th[OUT_MAXTHREADS];
+   pthread_mutex_t mutex;
+   pthread_cond_t cond;
+#endif
+} outfile_t;
+
+
+static long ns_now(void)
+{
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+
+/*! Write buffer i to the file.
+ */
+static void wr_data(outwriter_t *w, int i)
+{
+   ssize_t n;
+
+   for (size_t pos = 0; pos < w->len[i] && !w->err; pos += n)
+   {
+      n = w->seekable ? pwrite(w->fd, w->buf[i] + pos, w->len[i] - pos, w->off + pos) : write(w->fd, w->buf[i] + pos, w->len[i] - pos);
+      if (n == -1)
+      {
+         if (errno == EINTR)
+         {
+            n = 0;
+            continue;
+         }
+         log_errno(LOG_ERR, w->seekable ? "pwrite()" : "write()");
+         __atomic_store_n(&w->err, -1, __ATOMIC_RELAXED);
+      }
+   }
+   w->off += w->len[i];
+   w->len[i] = 0;
+   w->writes++;
+}
+
+
+#ifdef WITH_THREADS
+static void *wr_thread(void *p)
+{
+   outwriter_t *w = p;
+   int i;
+
+   pthread_mutex_lock(&w->mutex);
+   for (;;)
+   {
+      while (!w->stop && w->pend == -1)
+         pthread_cond_wait(&w->cond, &w->mutex);
+      if (w->pend == -1)
+         break;
+
+      i = w->pend;
+      pthread_mutex_unlock(&w->mutex);
+      wr_data(w, i);
+      pthread_mutex_lock(&w->mutex);
+      w->pend = -1;
+      pthread_cond_broadcast(&w->cond);
+   }
+   pthread_mutex_unlock(&w->mutex);
+
+   return NULL;
+}
+
+
+/*! Wait until the writer thread is idle. The mutex must be locked.
+ */
+static void wr_wait(outwriter_t *w)
+{
+   long t;
+
+   if (w->pend == -1)
+      return;
+
+   t = ns_now();
+   while (w->pend != -1)
+      pthread_cond_wait(&w->cond, &w->mutex);
+   w->stall += ns_now() - t;
+}
+#endif
+
+
+/*! Pass the current buffer to the writer and continue with the other one.
+ */
+static void wr_submit(outwriter_t *w)
+{
+   long t;
+
+#ifdef WITH_THREADS
+   if (w->running)
+   {
+      pthread_mutex_lock(&w->mutex);
+      wr_wait(w);
+      w->pend = w->cur;
+      pthread_cond_signal(&w->cond);
+      pthread_mutex_unlock(&w->mutex);
+      w->cur ^= 1;
+      return;
+   }
+#endif
+
+   t = ns_now();
+   wr_data(w, w->cur);
+   w->stall += ns_now() - t;
+}
+
+
+static void wr_write(outwriter_t *w, const char *data, size_t size)
+{
+   size_t n;
+
+   for (size_t pos = 0; pos < size; pos += n)
+   {
+      n = OUT_WBUFSIZE - w->len[w->cur] < size - pos ? OUT_WBUFSIZE - w->len[w->cur] : size - pos;
+      memcpy(w->buf[w->cur] + w->len[w->cur], data + pos, n);
+      w->len[w->cur] += n;
+      if (w->len[w->cur] == OUT_WBUFSIZE)
+         wr_submit(w);
+   }
+}
+
+
+static int wr_init(outwriter_t *w, int fd)
+{
+   memset(w, 0, sizeof(*w));
+   w->fd = fd;
+   w->pend = -1;
+   w->seekable = lseek(fd, 0, SEEK_CUR) != -1;
+#ifdef WITH_THREADS
+   // initialized first because wr_close() destroys them on error
+   pthread_mutex_init(&w->mutex, NULL);
+   pthread_cond_init(&w->cond, NULL);
+#endif
+   for (int i = 0; i < 2; i++)
+   {
+      // accounted first because the budget is checked there
+      mt_account(MT_EXPORT, OUT_WBUFSIZE);
+      if ((errno = posix_memalign((void**) &w->buf[i], OUT_ALIGN, OUT_WBUFSIZE)))
+      {
+         log_errno(LOG_ERR, "posix_memalign()");
+         mt_account(MT_EXPORT, -OUT_WBUFSIZE);
+         w->buf[i] = NULL;
+         return -1;
+      }
+   }
+
+#ifdef WITH_THREADS
+   // without the thread the buffers are written synchronously
+   w->running = !pthread_create(&w->th, NULL, wr_thread, w);
+#endif
+   return 0;
+}
+
+
+/*! Write the remaining data, stop the writer, and close the file.
+ * @return 0 on success, -1 on error.
+ */
+static int wr_close(outwriter_t *w)
+{
+   if (w->len[w->cur])
+      wr_submit(w);
+
+#ifdef WITH_THREADS
+   if (w->running)
+   {
+      pthread_mutex_lock(&w->mutex);
+      wr_wait(w);
+      w->stop = 1;
+      pthread_cond_signal(&w->cond);
+      pthread_mutex_unlock(&w->mutex);
+      pthread_join(w->th, NULL);
+   }
+   pthread_mutex_destroy(&w->mutex);
+   pthread_cond_destroy(&w->cond);
+#endif
+
+   for (int i = 0; i < 2; i++)
+      if (w->buf[i] != NULL)
+      {
+         free(w->buf[i]);
+         mt_account(MT_EXPORT, -OUT_WBUFSIZE);
+      }
+   if (close(w->fd) == -1)
+      w->err = -1;
+
+   stats_output(w->stall, w->writes);
+   return w->err;
+}
+
+
+/*! Compress a block into its zbuf.
+ */
+static void out_compress(int comp, outblk_t *b)
+{
+   z_stream zs;
+
+   switch (comp)
+   {
+      case OUT_GZIP:
+         memset(&zs, 0, sizeof(zs));
+         // window bits + 16 writes a gzip header
+         if (deflateInit2(&zs, OUT_GZLEVEL, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+         {
+            b->zlen = -1;
+            return;
+         }
+         zs.next_in = (Bytef*) b->buf;
+         zs.avail_in = b->len;
+         zs.next_out = (Bytef*) b->zbuf;
+         zs.avail_out = b->zsize;
+         b->zlen = deflate(&zs, Z_FINISH) == Z_STREAM_END ? (long) zs.total_out : -1;
+         deflateEnd(&zs);
+         break;
+
+#ifdef HAVE_ZSTD
+      case OUT_ZSTD:
+         b->zlen = ZSTD_compress(b->zbuf, b->zsize, b->buf, b->len, OUT_ZSTDLEVEL);
+         if (ZSTD_isError(b->zlen))
+            b->zlen = -1;
+         break;
+#endif
+   }
+}
+
+
+/*! Write the compressed data of a block to the file and free the block.
+ */
+static void out_flush(outfile_t *o, outblk_t *b)
+{
+   if (b->zlen == -1)
+   {
+      log_msg(LOG_ERR, "compression failed");
+      o->err = -1;
+   }
+   else
+      wr_write(&o->w, b->zbuf, b->zlen);
+   b->len = 0;
+   b->state = BLK_FREE;
+}
+
+
+#ifdef WITH_THREADS
+static void *out_worker(void *p)
+{
+   outfile_t *o = p;
+   outblk_t *b;
+
+   pthread_mutex_lock(&o->mutex);
+   for (;;)
+   {
+      while (!o->stop && o->next >= o->fill)
+         pthread_cond_wait(&o->cond, &o->mutex);
+      if (o->next >= o->fill)
+         break;
+
+      b = &o->blk[o->next++ % o->nblk];
+      b->state = BLK_BUSY;
+      pthread_mutex_unlock(&o->mutex);
+
+      out_compress(o->comp, b);
+
+      pthread_mutex_lock(&o->mutex);
+      b->state = BLK_DONE;
+      pthread_cond_broadcast(&o->cond);
+   }
+   pthread_mutex_unlock(&o->mutex);
+
+   return NULL;
+}
+
+
+/*! Write the compressed blocks in order. The mutex must be locked.
+ * @param wait Wait until the block of sequence number wait is written.
+ */
+static void out_drain(outfile_t *o, long wait)
+{
+   outblk_t *b;
+
+   while (o->wr < o->fill)
+   {
+      b = &o->blk[o->wr % o->nblk];
+      if (b->state != BLK_DONE)
+      {
+         if (o->wr > wait)
+            break;
+         pthread_cond_wait(&o->cond, &o->mutex);
+         continue;
+      }
+
+      pthread_mutex_unlock(&o->mutex);
+      out_flush(o, b);
+      pthread_mutex_lock(&o->mutex);
+      o->wr++;
+   }
+}
+#endif
+
+
+/*! Pass the block being filled to the compression and write the blocks
+ * which are complete. Without threads the block is compressed and written
+ * immediately.
+ */
+static void out_submit(outfile_t *o)
+{
+   outblk_t *b = &o->blk[o->fill % o->nblk];
+
+#ifdef WITH_THREADS
+   if (o->nth)
+   {
+      pthread_mutex_lock(&o->mutex);
+      b->state = BLK_FULL;
+      o->fill++;
+      pthread_cond_broadcast(&o->cond);
+      // the next block to be filled is the oldest one if all are in use
+      out_drain(o, o->blk[o->fill % o->nblk].state != BLK_FREE ? o->wr : -1);
+      pthread_mutex_unlock(&o->mutex);
+      return;
+   }
+#endif
+
+   out_compress(o->comp, b);
+   out_flush(o, b);
+   o->fill++;
+   o->wr++;
+}
+
+
+static ssize_t out_write(void *cookie, const char *buf, size_t size)
+{
+   outfile_t *o = cookie;
+   outblk_t *b;
+   size_t n;
+
+   if (o->comp == OUT_PLAIN)
+   {
+      wr_write(&o->w, buf, size);
+      return __atomic_load_n(&o->w.err, __ATOMIC_RELAXED) ? -1 : (ssize_t) size;
+   }
+
+   for (size_t pos = 0; pos < size; pos += n)
+   {
+      b = &o->blk[o->fill % o->nblk];
+      n = OUT_BLKSIZE - b->len < size - pos ? OUT_BLKSIZE - b->len : size - pos;
+      memcpy(b->buf + b->len, buf + pos, n);
+      b->len += n;
+      if (b->len == OUT_BLKSIZE)
+         out_submit(o);
+   }
+
+   return o->err || __atomic_load_n(&o->w.err, __ATOMIC_RELAXED) ? -1 : (ssize_t) size;
+}
+
+
+static void out_free(outfile_t *o)
+{
+   for (int i = 0; o->blk != NULL && i < o->nblk; i++)
+   {
+      mt_free(o->blk[i].buf);
+      mt_free(o->blk[i].zbuf);
+   }
+   mt_free(o->blk);
+   mt_free(o);
+}
+
+
+static int out_cookie_close(void *cookie)
+{
+   outfile_t *o = cookie;
+   int err;
+
+   // an empty file still gets one member
+   if (o->comp != OUT_PLAIN && (o->blk[o->fill % o->nblk].len || !o->fill))
+      out_submit(o);
+
+#ifdef WITH_THREADS
+   if (o->comp != OUT_PLAIN && o->nth)
+   {
+      pthread_mutex_lock(&o->mutex);
+      out_drain(o, o->fill);
+      o->stop = 1;
+      pthread_cond_broadcast(&o->cond);
+      pthread_mutex_unlock(&o->mutex);
+      for (int i = 0; i < o->nth; i++)
+         pthread_join(o->th[i], NULL);
+   }
+   pthread_mutex_destroy(&o->mutex);
+   pthread_cond_destroy(&o->cond);
+#endif
+
+   err = o->err;
+   if (wr_close(&o->w) == -1)
+      err = -1;
+   out_free(o);
+   return err;
+}
+
+
+static int out_ext(const char *s, const char *ext)
+{
+   size_t len = strlen(s), elen = strlen(ext);
+
+   return len > elen && !strcmp(s + len - elen, ext);
+}
+
+
+/*! Open an output file. It is compressed if the name ends with ".gz" or
+ * ".zst".
+ * @param s Name of the file, "-" is standard output.
+ * @return A stream which is closed with fclose(), or NULL on error.
+ */
+FILE *out_open(const char *s)
+{
+   cookie_io_functions_t io = {NULL, out_write, NULL, out_cookie_close};
+   outfile_t *o;
+   FILE *f;
+   int comp, fd, nth = 0;
+
+   if (out_ext(s, ".gz"))
+      comp = OUT_GZIP;
+   else if (out_ext(s, ".zst"))
+   {
+#ifdef HAVE_ZSTD
+      comp = OUT_ZSTD;
+#else
+      log_msg(LOG_ERR, "compiled without zstd support, cannot write %s", s);
+      return NULL;
+#endif
+   }
+   else
+      comp = OUT_PLAIN;
+
+   // standard output is duplicated because the writer closes its descriptor
+   if (!strcmp(s, "-"))
+   {
+      if ((fd = dup(STDOUT_FILENO)) == -1)
+      {
+         log_errno(LOG_ERR, "dup()");
+         return NULL;
+      }
+   }
+   else if ((fd = open(s, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+   {
+      log_errno(LOG_ERR, "open()");
+      return NULL;
+   }
+
+   if ((o = mt_calloc(MT_EXPORT, 1, sizeof(*o))) == NULL)
+   {
+      close(fd);
+      return NULL;
+   }
+   if (wr_init(&o->w, fd) == -1)
+   {
+      wr_close(&o->w);
+      out_free(o);
+      return NULL;
+   }
+   // standard output may be a file opened for appending or at any offset
+   if (!strcmp(s, "-"))
+      o->w.seekable = 0;
+   o->comp = comp;
+
+#ifdef WITH_THREADS
+   if (comp != OUT_PLAIN && (nth = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+      nth = 1;
+   if (nth > OUT_MAXTHREADS)
+      nth = OUT_MAXTHREADS;
+#endif
+
+   o->nblk = nth ? 2 * nth : 1;
+   if (comp != OUT_PLAIN && (o->blk = mt_calloc(MT_EXPORT, o->nblk, sizeof(*o->blk))) == NULL)
+      goto out_open_err;
+   for (int i = 0; o->blk != NULL && i < o->nblk; i++)
+   {
+      o->blk[i].zsize = comp == OUT_GZIP ? compressBound(OUT_BLKSIZE) + 32 :
+#ifdef HAVE_ZSTD
+         ZSTD_compressBound(OUT_BLKSIZE);
+#else
+         0;
+#endif
+      if ((o->blk[i].buf = mt_malloc(MT_EXPORT, OUT_BLKSIZE)) == NULL
+            || (o->blk[i].zbuf = mt_malloc(MT_EXPORT, o->blk[i].zsize)) == NULL)
+         goto out_open_err;
+   }
+
+#ifdef WITH_THREADS
+   pthread_mutex_init(&o->mutex, NULL);
+   pthread_cond_init(&o->cond, NULL);
+   for (; o->nth < nth; o->nth++)
+      if (pthread_create(&o->th[o->nth], NULL, out_worker, o))
+         break;
+   // without any worker the blocks are compressed synchronously
+   if (comp != OUT_PLAIN && !o->nth)
+      log_msg(LOG_WARN, "cannot create compression threads");
+#endif
+
+   if ((f = fopencookie(o, "w", io)) == NULL)
+   {
+      out_cookie_close(o);
+      return NULL;
+   }
+   // the data is buffered by the writer
+   setvbuf(f, NULL, _IOFBF, 1L << 16);
+   return f;
+
+out_open_err:
+   log_msg(LOG_ERR, "cannot allocate output buffers");
+   wr_close(&o->w);
+   out_free(o);
+   return NULL;
+}
@@ -0,0 +1,208 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file perfctr.c
+ * This file contains the code for reading the hardware performance counters
+ * through perf_event_open(2). The counters are opened once as a group for
+ * the calling thread and are read at the beginning and the end of each
+ * stage. Worker threads open their own groups with perfctr_open(), their
+ * counts are added to those of the main thread by the caller. If the kernel
+ * does not allow access to the counters (e.g. perf_event_paranoid or missing
+ * PMU in a VM) the counters are disabled and the statistics fall back to
+ * timing only.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "perfctr.h"
+#include "smlog.h"
+
+
+static const char *hwname_[HW_MAX] = {"cycles", "instructions", "llc_misses", "branch_misses"};
+//! file descriptors of the counters, the first one is the group leader
+static int fd_[HW_MAX] = {-1, -1, -1, -1};
+
+
+const char *perfctr_name(int i)
+{
+   return i >= 0 && i < HW_MAX ? hwname_[i] : "";
+}
+
+
+int perfctr_enabled(void)
+{
+   return fd_[0] != -1;
+}
+
+
+void perfctr_close_fd(int *fd)
+{
+   for (int i = HW_MAX - 1; i >= 0; i--)
+      if (fd[i] != -1)
+      {
+         close(fd[i]);
+         fd[i] = -1;
+      }
+}
+
+
+void perfctr_close(void)
+{
+   perfctr_close_fd(fd_);
+}
+
+
+#ifdef __linux__
+static int perf_open(uint64_t config, int group)
+{
+   struct perf_event_attr pe;
+
+   memset(&pe, 0, sizeof(pe));
+   pe.type = PERF_TYPE_HARDWARE;
+   pe.size = sizeof(pe);
+   pe.config = config;
+   pe.disabled = group == -1;
+   pe.exclude_kernel = 1;
+   pe.exclude_hv = 1;
+   pe.read_format = PERF_FORMAT_GROUP;
+
+   return syscall(__NR_perf_event_open, &pe, 0, -1, group, 0);
+}
+#endif
+
+
+/*! Open a group of counters for the calling thread.
+ *  @param fd Array of HW_MAX file descriptors which receives the group.
+ *  @return Returns 0 on success, otherwise -1 and all descriptors are -1.
+ */
+static int perf_group(int *fd)
+{
+#ifdef __linux__
+   static const uint64_t cfg[HW_MAX] = {PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES, PERF_COUNT_HW_BRANCH_MISSES};
+
+   for (int i = 0; i < HW_MAX; i++)
+      fd[i] = -1;
+   for (int i = 0; i < HW_MAX; i++)
+   {
+      if ((fd[i] = perf_open(cfg[i], fd[0])) == -1)
+      {
+         perfctr_close_fd(fd);
+         return -1;
+      }
+   }
+
+   ioctl(fd[0], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+   ioctl(fd[0], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+   return 0;
+#else
+   for (int i = 0; i < HW_MAX; i++)
+      fd[i] = -1;
+   errno = ENOSYS;
+   return -1;
+#endif
+}
+
+
+/*! Open the hardware counters.
+ *  @return Returns 0 on success, otherwise -1. In the latter case the
+ *  counters are unavailable and perfctr_read() returns zeros.
+ */
+int perfctr_init(void)
+{
+   if (perfctr_enabled())
+      return 0;
+
+   if (perf_group(fd_) == -1)
+   {
+      log_errno(LOG_NOTICE, "perf_event_open() failed, hardware counters disabled");
+      return -1;
+   }
+   log_debug("hardware counters enabled");
+   return 0;
+}
+
+
+/*! Open the counters for the calling thread if the counters of the main
+ *  thread are enabled. They are read with perfctr_read_fd() and must be
+ *  closed with perfctr_close_fd().
+ *  @param fd Array of HW_MAX file descriptors which receives the group.
+ *  @return Returns 0 on success, otherwise -1.
+ */
+int perfctr_open(int *fd)
+{
+   if (!perfctr_enabled())
+   {
+      for (int i = 0; i < HW_MAX; i++)
+         fd[i] = -1;
+      return -1;
+   }
+   return perf_group(fd);
+}
+
+
+/*! Read the current values of a group of counters.
+ *  @param fd Group opened with perfctr_open().
+ *  @param hc Pointer to the destination. It is zeroed if the counters are not
+ *  available.
+ */
+void perfctr_read_fd(const int *fd, hwcnt_t *hc)
+{
+   // layout of PERF_FORMAT_GROUP: nr followed by one value per counter
+   uint64_t buf[HW_MAX + 1];
+
+   memset(hc, 0, sizeof(*hc));
+   if (fd[0] == -1)
+      return;
+
+   if (read(fd[0], buf, sizeof(buf)) < (ssize_t) sizeof(buf))
+      return;
+
+   for (int i = 0; i < HW_MAX && i < (int) buf[0]; i++)
+      hc->c[i] = buf[i + 1];
+}
+
+
+/*! Read the current values of the counters of the main thread.
+ *  @param hc Pointer to the destination. It is zeroed if the counters are not
+ *  available.
+ */
+void perfctr_read(hwcnt_t *hc)
+{
+   perfctr_read_fd(fd_, hc);
+}
+
+
+/*! Add the difference of two readings to an accumulator.
+ */
+void perfctr_add(hwcnt_t *dst, const hwcnt_t *start, const hwcnt_t *end)
+{
+   for (int i = 0; i < HW_MAX; i++)
+      dst->c[i] += end->c[i] - start->c[i];
+}
+
@@ -0,0 +1,50 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file perfctr.h
+ * This file contains the declarations for the hardware performance counters.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#ifndef PERFCTR_H
+#define PERFCTR_H
+
+#include <stdint.h>
+
+
+enum {HW_CYCLES, HW_INSTR, HW_LLC_MISS, HW_BRANCH_MISS, HW_MAX};
+
+typedef struct hwcnt
+{
+   uint64_t c[HW_MAX];
+} hwcnt_t;
+
+
+int perfctr_init(void);
+int perfctr_enabled(void);
+void perfctr_read(hwcnt_t *hc);
+void perfctr_add(hwcnt_t *dst, const hwcnt_t *start, const hwcnt_t *end);
+const char *perfctr_name(int i);
+void perfctr_close(void);
+int perfctr_open(int *fd);
+void perfctr_read_fd(const int *fd, hwcnt_t *hc);
+void perfctr_close_fd(int *fd);
+
+#endif
+
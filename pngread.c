@@ -0,0 +1,348 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file pngread.c
+ * This file contains the PNG decoder which writes the values directly into
+ * the image. It uses the progressive reader of libpng, each row is
+ * converted as soon as it is decoded, thus there is no intermediate ARGB
+ * surface like with cairomem() followed by memprep().
+ * The pixels are converted to the same ARGB values which cairo would
+ * produce (8 bit per channel, premultiplied alpha) before the color
+ * function is applied. Grey images are converted with a table of all 256
+ * levels. If the image has 16 bit values (maxval_ > MAXVAL), grey samples
+ * are not gamma corrected but scaled linearly to 0 - maxval_ with their
+ * full precision.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <png.h>
+
+#include "scan.h"
+#include "memimg.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! number of bytes read from the file at once
+#define PNG_BUFSIZE 65536
+
+
+//! state of the decoder
+typedef struct pngctx
+{
+   memimg_t *mem;
+   int (*colfunc)(int, void*);
+   void *res;
+   void (*rowfunc)(const memimg_t*, int, void*);
+   void *arg;
+   //! number of channels and bytes per channel of the decoded rows
+   int channels, bytes;
+   //! the values of the grey levels if lut_valid is set
+   int lut[256], lut_valid;
+   //! grey samples are scaled linearly to 0 - maxval_
+   int linear;
+   //! rows of all passes of an interlaced image, NULL otherwise
+   png_bytep *rows;
+   size_t rowbytes;
+   //! set by pngcb_end() after the last chunk
+   int done;
+   int err;
+} pngctx_t;
+
+
+/*! Multiply a color channel by alpha like cairo does.
+ */
+static inline int premul(int c, int a)
+{
+   int t = c * a + 0x80;
+   return ((t >> 8) + t) >> 8;
+}
+
+
+/*! Scale a 16 bit channel to 8 bits like png_set_scale_16().
+ */
+static inline int scale16(const png_byte *b)
+{
+   return (((b[0] << 8) | b[1]) * 255 + 32895) >> 16;
+}
+
+
+/*! Convert the channels of one pixel to a premultiplied ARGB value.
+ */
+static inline int argb(int r, int g, int b, int a)
+{
+   if (a == 0)
+      return 0;
+   if (a != 0xff)
+   {
+      r = premul(r, a);
+      g = premul(g, a);
+      b = premul(b, a);
+   }
+   return (int) ((unsigned) a << 24 | r << 16 | g << 8 | b);
+}
+
+
+/*! Scale the grey samples of a row linearly to 0 - maxval_. The grey
+ * value is multiplied by alpha.
+ */
+static void linear_row(pngctx_t *ctx, png_const_bytep row, int *dst)
+{
+   long m = ctx->bytes == 2 ? 65535 : 255, v;
+
+   for (int x = 0; x < ctx->mem->width; x++, row += ctx->channels * ctx->bytes)
+   {
+      v = ctx->bytes == 2 ? row[0] << 8 | row[1] : row[0];
+      if (ctx->channels == 2)
+         v = v * (ctx->bytes == 2 ? row[2] << 8 | row[3] : row[1]) / m;
+      dst[x] = (v * maxval_ + m / 2) / m;
+   }
+}
+
+
+/*! Convert one decoded row to values and store it in row y of the image.
+ */
+static void convert_row(pngctx_t *ctx, png_const_bytep row, int y)
+{
+   int *dst = ctx->mem->mem + (size_t) y * ctx->mem->width;
+   int ch[4], a;
+
+   for (int x = 0; x < ctx->mem->width && !ctx->linear; x++, row += ctx->channels * ctx->bytes)
+   {
+      for (int i = 0; i < ctx->channels; i++)
+         ch[i] = ctx->bytes == 2 ? scale16(row + 2 * i) : row[i];
+
+      switch (ctx->channels)
+      {
+         case 1:
+            dst[x] = ctx->lut[ch[0]];
+            break;
+
+         case 2:
+            if ((a = ch[1]) == 0xff)
+               dst[x] = ctx->lut[ch[0]];
+            else
+               dst[x] = ctx->colfunc(argb(ch[0], ch[0], ch[0], a), ctx->res);
+            break;
+
+         case 3:
+            dst[x] = ctx->colfunc(argb(ch[0], ch[1], ch[2], 0xff), ctx->res);
+            break;
+
+         default:
+            dst[x] = ctx->colfunc(argb(ch[0], ch[1], ch[2], ch[3]), ctx->res);
+      }
+   }
+
+   if (ctx->linear)
+      linear_row(ctx, row, dst);
+
+   if (ctx->rowfunc != NULL)
+      ctx->rowfunc(ctx->mem, y, ctx->arg);
+}
+
+
+static void pngcb_info(png_structp png, png_infop info)
+{
+   pngctx_t *ctx = png_get_progressive_ptr(png);
+   int color_type, depth, interlace;
+   double gamma;
+
+   color_type = png_get_color_type(png, info);
+   depth = png_get_bit_depth(png, info);
+   interlace = png_get_interlace_type(png, info);
+
+   // The transformations are those of cairo except that grey images are
+   // not expanded to RGB and 16 bit channels are scaled by convert_row().
+   ctx->linear = maxval_ > MAXVAL && !(color_type & PNG_COLOR_MASK_COLOR);
+   if (color_type == PNG_COLOR_TYPE_PALETTE)
+      png_set_palette_to_rgb(png);
+   if (color_type == PNG_COLOR_TYPE_GRAY)
+      png_set_expand_gray_1_2_4_to_8(png);
+   if (png_get_valid(png, info, PNG_INFO_tRNS))
+      png_set_tRNS_to_alpha(png);
+   if (depth < 8)
+      png_set_packing(png);
+   if (!ctx->linear && !png_get_gAMA(png, info, &gamma))
+      gamma = 0.45455;
+   if (!ctx->linear)
+      png_set_gamma(png, 2.2, gamma);
+   if (interlace != PNG_INTERLACE_NONE)
+      png_set_interlace_handling(png);
+   png_read_update_info(png, info);
+
+   ctx->channels = png_get_channels(png, info);
+   ctx->bytes = png_get_bit_depth(png, info) == 16 ? 2 : 1;
+   ctx->rowbytes = png_get_rowbytes(png, info);
+
+   ctx->mem->width = png_get_image_width(png, info);
+   ctx->mem->height = png_get_image_height(png, info);
+   if (memimg_init(ctx->mem) == -1)
+   {
+      ctx->err = -1;
+      png_error(png, "memimg_init() failed");
+   }
+
+   if (ctx->channels <= 2 && !ctx->linear && !ctx->lut_valid)
+   {
+      for (int i = 0; i < 256; i++)
+         ctx->lut[i] = ctx->colfunc(argb(i, i, i, 0xff), ctx->res);
+      ctx->lut_valid = 1;
+   }
+
+   if (interlace != PNG_INTERLACE_NONE)
+   {
+      if ((ctx->rows = mt_calloc(MT_CAIRO, ctx->mem->height, sizeof(*ctx->rows))) == NULL)
+      {
+         ctx->err = -1;
+         png_error(png, "calloc() failed");
+      }
+      for (int y = 0; y < ctx->mem->height; y++)
+         if ((ctx->rows[y] = mt_calloc(MT_CAIRO, 1, ctx->rowbytes)) == NULL)
+         {
+            ctx->err = -1;
+            png_error(png, "calloc() failed");
+         }
+   }
+}
+
+
+static void pngcb_row(png_structp png, png_bytep row, png_uint_32 y, int UNUSED(pass))
+{
+   pngctx_t *ctx = png_get_progressive_ptr(png);
+
+   // row is NULL if it did not change in this pass
+   if (row == NULL || (int) y >= ctx->mem->height)
+      return;
+
+   if (ctx->rows != NULL)
+      png_progressive_combine_row(png, ctx->rows[y], row);
+   else
+      convert_row(ctx, row, y);
+}
+
+
+static void pngcb_end(png_structp png, png_infop UNUSED(info))
+{
+   pngctx_t *ctx = png_get_progressive_ptr(png);
+
+   ctx->done = 1;
+}
+
+
+/*! Decode a PNG file into an image and convert the pixels with a color
+ * function.
+ * @param mem Pointer to the destination image, it is initialized with the
+ * size of the PNG.
+ * @param s Name of the file, "-" is standard input.
+ * @param colfunc Color function (see memprep()) which is applied to the
+ * ARGB value of each pixel. For grey images it is called once per grey
+ * level, thus it must not have side effects.
+ * @param res Argument of colfunc.
+ * @param rowfunc Function which is called after each row is complete, or
+ * NULL. Rows of interlaced images are complete only after the last pass.
+ * @param arg Argument of rowfunc.
+ * @return 0 on success, -1 on error.
+ */
+int pngmem(memimg_t *mem, const char *s, int (*colfunc)(int, void*), void *res, void (*rowfunc)(const memimg_t*, int, void*), void *arg)
+{
+   png_structp png;
+   png_infop info;
+   pngctx_t ctx;
+   png_byte *buf;
+   size_t n;
+   FILE *f;
+
+   // safety check
+   if (mem == NULL || s == NULL || colfunc == NULL)
+      return -1;
+
+   if (!strcmp(s, "-"))
+      f = stdin;
+   else if ((f = fopen(s, "r")) == NULL)
+   {
+      log_errno(LOG_ERR, "fopen()");
+      return -1;
+   }
+
+   memset(&ctx, 0, sizeof(ctx));
+   memset(mem, 0, sizeof(*mem));
+   ctx.mem = mem;
+   ctx.colfunc = colfunc;
+   ctx.res = res;
+   ctx.rowfunc = rowfunc;
+   ctx.arg = arg;
+
+   png = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+   info = png != NULL ? png_create_info_struct(png) : NULL;
+   buf = mt_malloc(MT_OTHER, PNG_BUFSIZE);
+   if (png == NULL || info == NULL || buf == NULL)
+   {
+      png_destroy_read_struct(&png, &info, NULL);
+      mt_free(buf);
+      if (f != stdin)
+         fclose(f);
+      return -1;
+   }
+
+   if (setjmp(png_jmpbuf(png)))
+   {
+      log_msg(LOG_ERR, "cannot decode PNG file %s", s);
+      ctx.err = -1;
+   }
+   else
+   {
+      png_set_progressive_read_fn(png, &ctx, pngcb_info, pngcb_row, pngcb_end);
+      while ((n = fread(buf, 1, PNG_BUFSIZE, f)) > 0)
+         png_process_data(png, info, buf, n);
+      if (ferror(f))
+      {
+         log_errno(LOG_ERR, "fread()");
+         ctx.err = -1;
+      }
+      else if (!ctx.done)
+      {
+         log_msg(LOG_ERR, "PNG file %s truncated", s);
+         ctx.err = -1;
+      }
+   }
+
+   // interlaced rows are complete now
+   if (ctx.rows != NULL)
+   {
+      for (int y = 0; y < mem->height; y++)
+      {
+         if (!ctx.err && ctx.rows[y] != NULL)
+            convert_row(&ctx, ctx.rows[y], y);
+         mt_free(ctx.rows[y]);
+      }
+      mt_free(ctx.rows);
+   }
+
+   png_destroy_read_struct(&png, &info, NULL);
+   mt_free(buf);
+   if (f != stdin)
+      fclose(f);
+
+   if (ctx.err)
+      memimg_free(mem);
+   return ctx.err;
+}
@@ -0,0 +1,212 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file rastergen.c
+ * This file contains a generator for synthetic test images. The images are
+ * deterministic for a given seed, thus they can be used for benchmarks and
+ * for comparing different tracing implementations. The pixels are generated
+ * as grey ARGB values as they are returned by the PNG decoder.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+
+#include "scan.h"
+#include "memimg.h"
+
+
+static const char *rgname_[RG_MAX] = {"flat", "gradient", "radial", "fractal", "checker", "noise"};
+
+
+const char *rastergen_name(int type)
+{
+   return type >= 0 && type < RG_MAX ? rgname_[type] : "unknown";
+}
+
+
+/*! Return the generator type of its name.
+ *  @return The type RG_xxx or -1 if the name is unknown.
+ */
+int rastergen_type(const char *s)
+{
+   for (int i = 0; i < RG_MAX; i++)
+      if (!strcasecmp(s, rgname_[i]))
+         return i;
+   return -1;
+}
+
+
+//! simple xorshift PRNG, it returns a number within [0, 1[
+static double rnd(uint32_t *state)
+{
+   *state ^= *state << 13;
+   *state ^= *state >> 17;
+   *state ^= *state << 5;
+   return (double) *state / 4294967296.0;
+}
+
+
+//! hash of a lattice point for the value noise, returns a number within [0, 1[
+static double lattice(int x, int y, uint32_t seed)
+{
+   uint32_t h = seed ^ (uint32_t) x * 0x27d4eb2d ^ (uint32_t) y * 0x165667b1;
+
+   h ^= h >> 15;
+   h *= 0x85ebca6b;
+   h ^= h >> 13;
+   h *= 0xc2b2ae35;
+   h ^= h >> 16;
+   return (double) h / 4294967296.0;
+}
+
+
+static double smooth(double t)
+{
+   return t * t * (3 - 2 * t);
+}
+
+
+//! bilinear interpolated value noise at position x/y with the given grid size
+static double vnoise(double x, double y, uint32_t seed)
+{
+   int ix = floor(x), iy = floor(y);
+   double fx = smooth(x - ix), fy = smooth(y - iy);
+   double a, b;
+
+   a = lattice(ix, iy, seed) * (1 - fx) + lattice(ix + 1, iy, seed) * fx;
+   b = lattice(ix, iy + 1, seed) * (1 - fx) + lattice(ix + 1, iy + 1, seed) * fx;
+   return a * (1 - fy) + b * fy;
+}
+
+
+/*! Fractal noise with several octaves. This gives a DEM-like image with many
+ * nested contours of various sizes.
+ */
+static double fractal(int x, int y, int size, uint32_t seed)
+{
+   double v = 0, amp = 0.5, f = 4.0 / size;
+
+   for (int i = 0; i < 6; i++, amp /= 2, f *= 2)
+      v += amp * vnoise(x * f, y * f, seed + i);
+
+   // normalize to [0, 1[, the sum of the amplitudes is 1 - 2 * amp
+   return v / (1 - amp * 2);
+}
+
+
+#define NPEAKS 16
+
+struct peak
+{
+   double x, y, r, h;
+};
+
+
+static int grey(double v)
+{
+   int g;
+
+   g = round(v * 255);
+   if (g < 0)
+      g = 0;
+   else if (g > 255)
+      g = 255;
+
+   return 0xff000000 | g << 16 | g << 8 | g;
+}
+
+
+/*! Generate a synthetic image.
+ *  @param mem Pointer to memory image. The memory is allocated by this
+ *  function and has to be freed with memimg_free().
+ *  @param type Type of image, RG_xxx.
+ *  @param width Width of the image.
+ *  @param height Height of the image.
+ *  @param seed Seed for the random generator.
+ *  @return 0 on success, otherwise -1.
+ */
+int rastergen(memimg_t *mem, int type, int width, int height, unsigned seed)
+{
+   struct peak pk[NPEAKS];
+   uint32_t state = seed | 1;
+   int size = width > height ? width : height;
+   double v, d;
+
+   // safety check
+   if (mem == NULL || type < 0 || type >= RG_MAX)
+      return -1;
+
+   memset(mem, 0, sizeof(*mem));
+   mem->width = width;
+   mem->height = height;
+   if (memimg_init(mem) == -1)
+      return -1;
+
+   for (int i = 0; i < NPEAKS; i++)
+   {
+      pk[i].x = rnd(&state) * width;
+      pk[i].y = rnd(&state) * height;
+      pk[i].r = (0.03 + rnd(&state) * 0.15) * size;
+      pk[i].h = 0.3 + rnd(&state) * 0.7;
+   }
+
+   for (int y = 0; y < height; y++)
+      for (int x = 0; x < width; x++)
+      {
+         switch (type)
+         {
+            case RG_FLAT:
+               v = 0.5;
+               break;
+
+            case RG_GRADIENT:
+               v = width > 1 ? (double) x / (width - 1) : 0;
+               break;
+
+            case RG_RADIAL:
+               v = 0;
+               for (int i = 0; i < NPEAKS; i++)
+               {
+                  d = ((x - pk[i].x) * (x - pk[i].x) + (y - pk[i].y) * (y - pk[i].y)) / (pk[i].r * pk[i].r);
+                  v += pk[i].h * exp(-d);
+               }
+               break;
+
+            case RG_FRACTAL:
+               v = fractal(x, y, size, seed);
+               break;
+
+            case RG_CHECKER:
+               v = (x ^ y) & 1;
+               break;
+
+            case RG_NOISE:
+            default:
+               v = rnd(&state);
+         }
+         memimg_put(mem, x, y, grey(v));
+      }
+
+   return 0;
+}
+
@@ -0,0 +1,372 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file rawread.c
+ * This file contains the loaders of binary PGM/PPM files and of raw rasters
+ * without header. The file is mapped into memory and the samples are
+ * converted directly from the mapping into the image, thus the file is
+ * neither copied into a buffer nor decoded twice.
+ * The samples are scaled to 8 bits and converted to ARGB values before the
+ * color function is applied, thus a PGM gives the same values as a PNG
+ * with the same pixels. If the image has 16 bit values (maxval_ > MAXVAL),
+ * one channel samples are scaled linearly to 0 - maxval_ instead, which
+ * keeps the full precision of elevation models.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "scan.h"
+#include "memimg.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! number of bytes converted before the pages are released
+#define RAW_CHUNK (4L << 20)
+
+
+static const struct
+{
+   const char *name;
+   int channels, bytes, bigendian;
+} rawtype_[] =
+{
+   {"u8", 1, 1, 0},
+   {"u16", 1, 2, 0},
+   {"u16be", 1, 2, 1},
+   {"rgb", 3, 1, 0},
+   {"rgb16be", 3, 2, 1},
+};
+
+
+/*! Parse the format of a raw raster.
+ * @param s Format string "<width>x<height>[:<type>]", <type> is one of
+ * u8 (default), u16 (little endian), u16be, rgb, or rgb16be.
+ * @param fmt Pointer to the format which is filled in.
+ * @return 0 on success, -1 on error.
+ */
+int raw_parse(const char *s, rawfmt_t *fmt)
+{
+   char *end;
+
+   memset(fmt, 0, sizeof(*fmt));
+   fmt->width = strtol(s, &end, 10);
+   if (*end != 'x' || fmt->width <= 0)
+      goto raw_parse_err;
+   fmt->height = strtol(end + 1, &end, 10);
+   if ((*end != ':' && *end != '\0') || fmt->height <= 0)
+      goto raw_parse_err;
+
+   if (*end == '\0')
+      end = "u8";
+   else
+      end++;
+   for (fmt->type = 0; fmt->type < RAW_MAX && strcasecmp(end, rawtype_[fmt->type].name); fmt->type++);
+   if (fmt->type >= RAW_MAX)
+      goto raw_parse_err;
+
+   fmt->maxval = rawtype_[fmt->type].bytes == 2 ? 65535 : 255;
+   return 0;
+
+raw_parse_err:
+   log_msg(LOG_ERR, "illegal raw format '%s'", s);
+   return -1;
+}
+
+
+/*! Test if a file is a binary PGM or PPM file. Of standard input ("-") only
+ * the first character is tested, because it cannot be read twice.
+ * @return 1 if it is, otherwise 0.
+ */
+int pnm_file(const char *s)
+{
+   char buf[2];
+   FILE *f;
+   int n;
+
+   if (!strcmp(s, "-"))
+   {
+      if ((n = getc(stdin)) == EOF)
+         return 0;
+      ungetc(n, stdin);
+      return n == 'P';
+   }
+
+   if ((f = fopen(s, "r")) == NULL)
+      return 0;
+   n = fread(buf, 1, sizeof(buf), f);
+   fclose(f);
+
+   return n == 2 && buf[0] == 'P' && (buf[1] == '5' || buf[1] == '6');
+}
+
+
+/*! Parse the next number of a PNM header. Whitespace and comments in front
+ * of the number are skipped.
+ * @return The number or -1 on error.
+ */
+static long pnm_number(const uint8_t *b, size_t len, size_t *pos)
+{
+   long v = 0;
+   int d = 0;
+
+   for (;;)
+   {
+      for (; *pos < len && isspace(b[*pos]); (*pos)++);
+      if (*pos >= len || b[*pos] != '#')
+         break;
+      for (; *pos < len && b[*pos] != '\n'; (*pos)++);
+   }
+
+   for (; *pos < len && isdigit(b[*pos]) && v < 1L << 24; (*pos)++, d++)
+      v = v * 10 + b[*pos] - '0';
+
+   return d ? v : -1;
+}
+
+
+/*! Parse the header of a binary PGM or PPM file.
+ * @return 0 on success, -1 on error.
+ */
+static int pnm_header(const uint8_t *b, size_t len, rawfmt_t *fmt)
+{
+   size_t pos = 2;
+   long w, h, m;
+
+   memset(fmt, 0, sizeof(*fmt));
+   if (len < 3 || b[0] != 'P' || (b[1] != '5' && b[1] != '6'))
+      return -1;
+
+   w = pnm_number(b, len, &pos);
+   h = pnm_number(b, len, &pos);
+   m = pnm_number(b, len, &pos);
+   // exactly one whitespace character follows the maximum value
+   if (w <= 0 || h <= 0 || m <= 0 || m > 65535 || pos >= len || !isspace(b[pos]))
+      return -1;
+
+   fmt->width = w;
+   fmt->height = h;
+   fmt->maxval = m;
+   fmt->offset = pos + 1;
+   if (b[1] == '5')
+      fmt->type = m > 255 ? RAW_U16BE : RAW_U8;
+   else
+      fmt->type = m > 255 ? RAW_RGB16BE : RAW_RGB;
+   return 0;
+}
+
+
+/*! Map a file into memory. Standard input ("-") is read into a buffer
+ * instead, because it may be a pipe.
+ * @param size Pointer to a variable which receives the size of the data.
+ * @return Pointer to the data or NULL on error.
+ */
+static uint8_t *raw_map(const char *s, size_t *size)
+{
+   struct stat st;
+   uint8_t *map, *p;
+   size_t n;
+   int fd;
+
+   if (!strcmp(s, "-"))
+   {
+      for (map = NULL, *size = 0, n = RAW_CHUNK; ; n *= 2)
+      {
+         if ((p = mt_realloc(MT_RASTER, map, n)) == NULL)
+         {
+            mt_free(map);
+            return NULL;
+         }
+         map = p;
+         *size += fread(map + *size, 1, n - *size, stdin);
+         if (*size < n)
+            break;
+      }
+      if (ferror(stdin) || !*size)
+      {
+         log_msg(LOG_ERR, "cannot read standard input");
+         mt_free(map);
+         return NULL;
+      }
+      return map;
+   }
+
+   if ((fd = open(s, O_RDONLY)) == -1)
+   {
+      log_errno(LOG_ERR, "open()");
+      return NULL;
+   }
+   if (fstat(fd, &st) == -1 || st.st_size == 0)
+   {
+      log_msg(LOG_ERR, "cannot stat %s or file empty", s);
+      close(fd);
+      return NULL;
+   }
+   *size = st.st_size;
+   map = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+   close(fd);
+   if (map == MAP_FAILED)
+   {
+      log_errno(LOG_ERR, "mmap()");
+      return NULL;
+   }
+   madvise(map, *size, MADV_SEQUENTIAL);
+   madvise(map, *size, MADV_WILLNEED);
+   return map;
+}
+
+
+static void raw_unmap(const char *s, uint8_t *map, size_t size)
+{
+   if (!strcmp(s, "-"))
+      mt_free(map);
+   else
+      munmap(map, size);
+}
+
+
+/*! Convert the samples of the mapped file into the image.
+ * @param map Pointer to the first sample.
+ * @param base Offset of the first sample in the mapping, or -1 if the data
+ * is not mapped (standard input), in which case no pages are released.
+ * @param lut Table of the values of all grey levels of 1 channel formats,
+ * or of the 8 bit value of all samples of 3 channel formats.
+ */
+static void raw_convert(memimg_t *mem, const uint8_t *map, long base, const rawfmt_t *fmt, const int *lut,
+      int (*colfunc)(int, void*), void *res)
+{
+   int ch = rawtype_[fmt->type].channels, bytes = rawtype_[fmt->type].bytes, be = rawtype_[fmt->type].bigendian;
+   size_t rowbytes = (size_t) fmt->width * ch * bytes, done = 0, end;
+   long pgsize = sysconf(_SC_PAGESIZE);
+   const uint8_t *row;
+   int s[3], *dst;
+
+   for (int y = 0; y < mem->height; y++)
+   {
+      row = map + (size_t) y * rowbytes;
+      dst = mem->mem + (size_t) y * mem->width;
+      for (int x = 0; x < mem->width; x++)
+      {
+         for (int i = 0; i < ch; i++, row += bytes)
+         {
+            if (bytes == 1)
+               s[i] = row[0];
+            else
+               s[i] = be ? row[0] << 8 | row[1] : row[1] << 8 | row[0];
+            if (s[i] > fmt->maxval)
+               s[i] = fmt->maxval;
+         }
+
+         if (ch == 1)
+            dst[x] = lut[s[0]];
+         else
+            dst[x] = colfunc((int) (0xffu << 24 | lut[s[0]] << 16 | lut[s[1]] << 8 | lut[s[2]]), res);
+      }
+
+      // release the pages which were converted, they are not read again
+      if (base != -1 && base + (row - map) - done >= RAW_CHUNK)
+      {
+         end = (base + (row - map)) & ~(pgsize - 1);
+         madvise((uint8_t*) map - base + done, end - done, MADV_DONTNEED);
+         done = end;
+      }
+   }
+}
+
+
+/*! Load a binary PGM/PPM file or a raw raster into an image. The file is
+ * mapped and the samples are scaled to 8 bits and converted by the color
+ * function.
+ * @param mem Pointer to the destination image, it is initialized with the
+ * size of the raster.
+ * @param s Name of the file, "-" is standard input.
+ * @param fmt Format of a raw raster or NULL if the file is a PGM/PPM file.
+ * @param colfunc Color function (see memprep()). For 1 channel formats it
+ * is called once per level, thus it must not have side effects. It is not
+ * used for 1 channel formats if the image has 16 bit values.
+ * @param res Argument of colfunc.
+ * @return 0 on success, -1 on error.
+ */
+int rawmem(memimg_t *mem, const char *s, const rawfmt_t *fmt, int (*colfunc)(int, void*), void *res)
+{
+   rawfmt_t pnm;
+   uint8_t *map;
+   size_t size;
+   int *lut, c;
+
+   // safety check
+   if (mem == NULL || s == NULL || colfunc == NULL)
+      return -1;
+
+   if ((map = raw_map(s, &size)) == NULL)
+      return -1;
+
+   if (fmt == NULL)
+   {
+      if (pnm_header(map, size, &pnm) == -1)
+      {
+         log_msg(LOG_ERR, "%s is not a binary PGM/PPM file", s);
+         raw_unmap(s, map, size);
+         return -1;
+      }
+      fmt = &pnm;
+   }
+
+   if (fmt->offset + (size_t) fmt->width * fmt->height * rawtype_[fmt->type].channels * rawtype_[fmt->type].bytes > size)
+   {
+      log_msg(LOG_ERR, "%s too short for %dx%d:%s", s, fmt->width, fmt->height, rawtype_[fmt->type].name);
+      raw_unmap(s, map, size);
+      return -1;
+   }
+
+   memset(mem, 0, sizeof(*mem));
+   mem->width = fmt->width;
+   mem->height = fmt->height;
+   if ((lut = mt_malloc(MT_OTHER, (fmt->maxval + 1) * sizeof(*lut))) == NULL || memimg_init(mem) == -1)
+   {
+      log_msg(LOG_ERR, "cannot allocate image");
+      mt_free(lut);
+      raw_unmap(s, map, size);
+      return -1;
+   }
+
+   for (int i = 0; i <= fmt->maxval; i++)
+   {
+      c = (i * 255 + fmt->maxval / 2) / fmt->maxval;
+      if (rawtype_[fmt->type].channels > 1)
+         lut[i] = c;
+      else if (maxval_ > MAXVAL)
+         lut[i] = ((long) i * maxval_ + fmt->maxval / 2) / fmt->maxval;
+      else
+         lut[i] = colfunc((int) (0xffu << 24 | c << 16 | c << 8 | c), res);
+   }
+
+   raw_convert(mem, map + fmt->offset, strcmp(s, "-") ? (long) fmt->offset : -1, fmt, lut, colfunc, res);
+
+   mt_free(lut);
+   raw_unmap(s, map, size);
+   return 0;
+}
@@ -24,18 +24,70 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <limits.h>
 #include <string.h>
-#include <math.h>
 #include <unistd.h>
+#include <getopt.h>
 
 #include "scan.h"
 #include "memimg.h"
 #include "smlog.h"
+#include "stats.h"
+#include "perfctr.h"
+#include "memtrack.h"
 
 #define LAYERS 16
-#define VERSION_STRING "'scan' image tracer (c) 2020 Bernhard R. Fischer, <bf@abenteuerland.at>"
+//! maximum number of tolerances of --lod
+#define LODS 16
+//! default maximum distance of --bezier
+#define BEZ_ERR 1.0
+#define VERSION_STRING "'scan' image tracer " TRACER_VERSION " (c) 2020 Bernhard R. Fischer, <bf@abenteuerland.at>"
 
 enum {MODE_DIRECT, MODE_GREY};
+enum {FMT_OSM, FMT_SVG, FMT_GEOJSON, FMT_WKB, FMT_HEXWKB, FMT_FGB, FMT_MVT, FMT_MAX};
+
+
+//! exporters of the output formats
+static const struct
+{
+   const char *ext;
+   int (*export)(const layer_t*, const char*, int, memimg_t*);
+   int stage;
+} format_[FMT_MAX] =
+{
+   {".osm", export_osm, ST_EXPORT_OSM},
+   {".svg", export_svg, ST_EXPORT_SVG},
+   {".geojsonl", export_geojson, ST_EXPORT_GEOJSON},
+   {".wkb", export_wkb, ST_EXPORT_WKB},
+   {".hexwkb", export_hexwkb, ST_EXPORT_WKB},
+   {".fgb", export_fgb, ST_EXPORT_FGB},
+   {".mbtiles", export_mvt, ST_EXPORT_MVT},
+};
+
+
+//! command line options
+static struct
+{
+   //! input image, index file, cache directory, and state file
+   char *s, *index, *cache, *state;
+   //! output file of each format, NULL if it is not written
+   char *out[FMT_MAX];
+   int nlayers, mode, stretch, nthreads, compact, levels, query;
+   //! level list of --levels in real units
+   double v[MAXL];
+   //! level interval of --interval in real units
+   double interval;
+   double min_area, min_perim;
+   //! format of --raw, width is 0 if the input is not a raw raster
+   rawfmt_t raw;
+   //! effective areas are calculated if lod is set, the outputs are written
+   //! once for each of the nlod tolerances
+   int lod, nlod;
+   double tol[LODS];
+   //! maximum distance of the Bezier curves of the SVG output, 0 if the
+   //! contours are written as polygons
+   double bezier;
+} opt_ = {"a.png", NULL, NULL, NULL, {"a.osm", "a.svg", NULL, NULL, NULL, NULL, NULL}, LAYERS, MODE_GREY, 0, 1, 0, LEVELS_EQUAL, 0, {0}, 0, 0, 0, {0, 0, 0, 0, 0}, 0, 0, {0}, 0};
 
 
 void txtout(const memimg_t *mem)
@@ -64,204 +116,678 @@ void txtout(const memimg_t *mem)
 }
 
 
-static double cold(int c, int s)
+void usage(const char *s)
 {
-   return ((double) ((c >> s) & 0xff)) / 255;
+   printf("%s\nusage: %s [OPTIONS] [<filename>]\n"
+          "   <filename> is a PNG, PGM, PPM, or raw image (default = a.png), '-' is\n"
+          "   standard input.\n", VERSION_STRING, s);
+   printf("   OPTIONS\n"
+          "      -c ............ Store contours as chain code (subpixel precision 1/127).\n"
+          "      -h ............ Print this message.\n"
+          "      -m <mode> ..... Scan mode, 'direct' or 'grey'.\n"
+          "      -n <layers> ... Number of layers to scan (default = %d).\n"
+          "      -r <dist> ..... Remove vertices closer than <dist> pixels while tracing\n"
+          "                      (default = %d).\n"
+          "      -o <file> ..... Write output to <file> (default = a.osm and a.svg). The\n"
+          "                      defaults are dropped if -o, --svg or --mvt is given,\n"
+          "                      several outputs are selected by repeating them. The\n"
+          "                      format is selected by the extension of <file>: .svg,\n"
+          "                      .geojsonl (GeoJSON sequence), .wkb (binary COPY with\n"
+          "                      WKB for PostGIS), .hexwkb (text COPY with hex WKB),\n"
+          "                      .fgb (FlatGeobuf), .mbtiles (vector tiles), otherwise\n"
+          "                      OSM. If <file> ends with .gz or .zst it is compressed.\n"
+          "                      '-' is standard output.\n"
+          "      -s ............ Stretch color values from 0 - MAXVAL.\n"
+          "      -t <threads> .. Trace each layer in horizontal strips with <threads> threads.\n"
+          "                      A contour crossing the border of a strip is walked\n"
+          "                      piecewise, one more round per crossing, and its pieces\n"
+          "                      are joined on the main thread. Images with many long\n"
+          "                      contours crossing the strips gain little.\n"
+          "      -x <factor> ... Scaling factor for geo coordinates (default = 1.0).\n"
+          "      --svg=<file> .. Write SVG output to <file>.\n"
+          "      --mvt=<dir> ... Write vector tiles into the directory tree <dir>/z/x/y.pbf,\n"
+          "                      or into an MBTiles file if <dir> ends with .mbtiles.\n"
+          "      --zoom=<min>[-<max>]\n"
+          "                      Zoom levels of the vector tiles (default = 0 to about\n"
+          "                      256 pixels of the image per tile).\n"
+          "      --lod[=<area>[,<area>...]]\n"
+          "                      Calculate the effective area (Visvalingam) of each vertex\n"
+          "                      and write the outputs once for each tolerance <area> in\n"
+          "                      square pixels, e.g. a.osm as a-4.osm if several are\n"
+          "                      given. Vector tiles are simplified for each zoom level.\n"
+          "      --bezier[=<err>]\n"
+          "                      Write the contours of the SVG output as cubic Bezier\n"
+          "                      curves with a distance of at most <err> pixels to the\n"
+          "                      vertices (default = %g).\n"
+          "      --no-osm, --no-svg\n"
+          "                      Do not write the default OSM or SVG output.\n"
+          "      --stats=<fmt> . Output run-time statistics, <fmt> is 'text' or 'json'.\n"
+          "      --perf ........ Add hardware performance counters to the statistics.\n"
+          "      --mem-budget=<MB>\n"
+          "                      Abort with a report of the allocations of each subsystem\n"
+          "                      if more than <MB> megabytes are allocated.\n"
+          "      --levels=<mode>\n"
+          "                      Select the layer values, <mode> is 'equal' (default),\n"
+          "                      'quantile' (same number of pixels between the layers),\n"
+          "                      or a comma separated list of values in real units.\n"
+          "      --interval=<d>\n"
+          "                      Trace a layer at every multiple of <d> real units.\n"
+          "      --bits=<n> .... Values of the image have <n> = 8 (default) or 16 bits.\n"
+          "                      Grey samples are scaled linearly to 16 bits without\n"
+          "                      gamma correction.\n"
+          "      --scale=<f>, --offset=<o>\n"
+          "                      Real units of the values are value * <f> + <o>, e.g.\n"
+          "                      meters of an elevation model (default 1 and 0).\n"
+          "      --index=<file>\n"
+          "                      Load the prepared image and its max-tree from <file>. If\n"
+          "                      it does not exist, or if it was created from another\n"
+          "                      image or with other options -m or -s, it is created\n"
+          "                      from <filename>. Each level is traced only in the rows\n"
+          "                      of its components.\n"
+          "      --query ....... Output the number of connected components and pixels of\n"
+          "                      each level and exit without tracing.\n"
+          "      --min-area=<px>\n"
+          "                      Discard contours with an area of less than <px> square\n"
+          "                      pixels. It is the area of the polygon through the\n"
+          "                      centres of the border pixels, e.g. a 3x3 square has an\n"
+          "                      area of 4, single pixels and lines have an area of 0.\n"
+          "      --min-perimeter=<px>\n"
+          "                      Discard contours with a perimeter of this polygon of less\n"
+          "                      than <px> pixels.\n"
+          "      --cache=<dir>\n"
+          "                      Keep the contours in <dir> and reuse them if the same\n"
+          "                      image is traced again with the same options.\n"
+          "      --incremental=<file>\n"
+          "                      Keep the prepared image and its contours in <file> and\n"
+          "                      trace only the changed parts of the next version of the\n"
+          "                      image.\n"
+          "      --raw=<w>x<h>[:<type>]\n"
+          "                      The input is a raw raster without header of <w> x <h>\n"
+          "                      samples, <type> is 'u8' (default), 'u16' (little endian),\n"
+          "                      'u16be', 'rgb', or 'rgb16be'. Binary PGM and PPM files\n"
+          "                      are detected automatically.\n"
+          "\n", LAYERS, reduce_dist_, BEZ_ERR);
 }
 
 
-static int c2grey(int c, void * UNUSED(res))
+/*! Length of a file name without the compression extension ".gz" or
+ * ".zst".
+ */
+static size_t out_len(const char *s)
 {
-   double cl, cf;
-
-   cl = 0.2126 * cold(c, 16) + 0.7152 * cold(c, 8) + 0.0722 * cold(c, 0);
-   if (cl <= 0.0031308)
-      cf = 12.92 * cl;
-   else
-      cf = 1.055 * pow(cl, 1 / 2.4) - 0.055;
+   size_t len = strlen(s);
 
-   return cf * MAXVAL;
+   if (len > 3 && !strcasecmp(s + len - 3, ".gz"))
+      len -= 3;
+   else if (len > 4 && !strcasecmp(s + len - 4, ".zst"))
+      len -= 4;
+   return len;
 }
 
 
-static int cdirect(int c, void * UNUSED(res))
+/*! Determine the output format of a file by its extension. A compression
+ * extension is skipped.
+ * @return The format, OSM if the extension is unknown.
+ */
+static int out_format(const char *s)
 {
-   return c & 0xffffff;
+   size_t len = out_len(s), n;
+
+   for (int i = 0; i < FMT_MAX; i++)
+      if (len > (n = strlen(format_[i].ext)) && !strncasecmp(s + len - n, format_[i].ext, n))
+         return i;
+   return FMT_OSM;
 }
 
 
-static int cinvert(int c, void * UNUSED(res))
+/*! Drop the default outputs a.osm and a.svg once on the first output which
+ * is given on the command line.
+ */
+static void default_outputs(void)
 {
-   return MAXVAL - (c & 0xffffff);
+   static int done;
+
+   if (done++)
+      return;
+   for (int i = 0; i < FMT_MAX; i++)
+      opt_.out[i] = NULL;
 }
 
 
-void memprep(memimg_t *mem, int (*colfunc)(int, void*), void *res)
+/*! Insert the tolerance of --lod into a file name in front of its
+ * extension, e.g. a.osm.gz becomes a-4.osm.gz.
+ * @return Pointer to the name.
+ */
+static const char *lod_name(const char *s, double tol, char *buf, size_t size)
 {
-   int x, y;
+   size_t len = out_len(s), e;
 
-   for (y = 0; y < mem->height; y++)
-      for (x = 0; x < mem->width; x++)
-         memimg_put(mem, x, y, colfunc(memimg_get(mem, x, y), res));
+   if (!strcmp(s, "-"))
+      return s;
+
+   for (e = len; e > 0 && s[e - 1] != '.' && s[e - 1] != '/'; e--);
+   if (!e || s[e - 1] != '.')
+      e = len;
+   else
+      e--;
+   snprintf(buf, size, "%.*s-%g%s", (int) e, s, tol, s + e);
+   return buf;
 }
 
 
-static int cmax(int c, void *res)
+/*! Decode and prepare the image. The color function is applied while the
+ * rows are decoded.
+ */
+static void load_image(memimg_t *mem, const char *s, int mode, int stretch)
 {
-   if (res != NULL && *(int*)res < c)
-      *(int*)res = c;
-   return c;
-}
+   int (*colfunc)(int, void*);
 
+   switch (mode)
+   {
+      case MODE_DIRECT:
+         colfunc = cdirect;
+         break;
 
-static int cmin(int c, void *res)
-{
-   if (res != NULL && *(int*)res > c)
-      *(int*)res = c;
-   return c;
+      case MODE_GREY:
+         colfunc = c2grey;
+         break;
+
+      default:
+         log_msg(LOG_EMERG, "this should never happen, mode = %d", mode);
+         exit(1);
+   }
+
+   stats_start(ST_DECODE);
+   if (opt_.raw.width || pnm_file(s))
+   {
+      if (rawmem(mem, s, opt_.raw.width ? &opt_.raw : NULL, colfunc, NULL) == -1)
+      {
+         log_msg(LOG_ERR, "rawmem() failed");
+         exit(1);
+      }
+   }
+   else if (pngmem(mem, s, colfunc, NULL, NULL, NULL) == -1)
+   {
+      log_msg(LOG_ERR, "pngmem() failed");
+      exit(1);
+   }
+   stats_stop(ST_DECODE);
+
+   if (stretch)
+   {
+      stats_start(ST_STRETCH);
+      memstretch(mem);
+      stats_stop(ST_STRETCH);
+   }
 }
 
 
-struct minmax
+/*! Write all options which change the contours into buf.
+ * @return The length of the string.
+ */
+static int scan_params(char *buf, size_t size)
 {
-   int min, max;
-};
+   int len;
 
+   len = snprintf(buf, size, "%s m=%d n=%d s=%d c=%d r=%d levels=%d area=%g perim=%g index=%s raw=%dx%d:%d "
+         "max=%d scale=%g offset=%g interval=%g v=",
+         TRACER_VERSION, opt_.mode, opt_.nlayers, opt_.stretch, opt_.compact, reduce_dist_, opt_.levels,
+         opt_.min_area, opt_.min_perim, opt_.index != NULL ? "yes" : "no",
+         opt_.raw.width, opt_.raw.height, opt_.raw.type, maxval_, val_scale_, val_offset_, opt_.interval);
+   for (int j = 0; opt_.levels == LEVELS_LIST && j < opt_.nlayers; j++)
+      len += snprintf(buf + len, size - len, "%g,", opt_.v[j]);
+
+   return len;
+}
 
-static int cstretch(int c, void *res)
+
+/*! Load the state of the previous image and compare it to the current one.
+ * @param prev Pointer to an array of MAXL layers which receives the
+ * contours of the previous image.
+ * @param tm Pointer to the tile map which receives the changed tiles.
+ * @return The number of layers of prev or -1 if there is no usable state.
+ */
+static int load_state(layer_t *prev, tilemap_t *tm, const memimg_t *mem, const char *param)
 {
-   double d;
+   memimg_t pmem;
+   int n, nprev;
+
+   if ((nprev = state_load(opt_.state, param, prev, &pmem)) == -1)
+      return -1;
 
-   // safety check
-   if (res == NULL)
-      return c;
+   if (tiles_init(tm, mem->width, mem->height, TILESIZE) == -1 || (n = tiles_diff(tm, &pmem, mem)) == -1)
+   {
+      log_msg(LOG_NOTICE, "size of image changed, tracing all");
+      for (int j = 0; j < nprev; j++)
+         free_layer(&prev[j]);
+      tiles_free(tm);
+      memimg_free(&pmem);
+      return -1;
+   }
 
-   d = ((struct minmax*) res)->max - ((struct minmax*) res)->min;
-   return round((c - ((struct minmax*) res)->min) * MAXVAL / d);
+   log_msg(LOG_INFO, "%d of %d tiles changed", n, tm->tw * tm->th);
+   for (int j = 0; j < nprev; j++)
+      journal_rebase(&prev[j].rec->j, pmem.mem, mem->mem);
+   memimg_free(&pmem);
+   return nprev;
 }
 
 
-void memstretch(memimg_t *mem)
+/*! Calculate the key of the input image and of the options which change the
+ * prepared image, see maxtree_save().
+ * @return 0 on success, -1 if the input cannot be read.
+ */
+static int index_key(char *key, size_t size)
 {
-   struct minmax mm;
+   char buf[128];
+   int len;
+
+   // standard input cannot be read twice
+   if (!strcmp(opt_.s, "-"))
+      return -1;
 
-   mm.min = mm.max = memimg_get(mem, 0, 0);
-   memprep(mem, cmax, &mm.max);
-   memprep(mem, cmin, &mm.min);
-   log_debug("min = %d, max = %d", mm.min, mm.max);
-   memprep(mem, cstretch, &mm);
+   len = snprintf(buf, sizeof(buf), "m=%d s=%d raw=%dx%d:%d max=%d", opt_.mode, opt_.stretch,
+         opt_.raw.width, opt_.raw.height, opt_.raw.type, maxval_);
+   return cache_key(opt_.s, buf, len, key, size);
 }
 
 
-int scan_layer(layer_t *l, memimg_t *mem)
+/*! Load the image and trace all layers.
+ * @param l Pointer to array of MAXL layers.
+ * @param mem Pointer to the destination image.
+ * @return The number of layers or -1 if the program should exit (after
+ * --query).
+ */
+static int trace_image(layer_t *l, memimg_t *mem)
 {
-//! MAXW is just here to prevent memory overflows
-#define MAXW 10000
-   pos_t p, scan_pos;
-   int i;
+   char param[MAXL * 24 + 256], key[CACHE_KEYLEN], ikey[CACHE_KEYLEN];
+   layer_t prev[MAXL];
+   tilemap_t tm;
+   maxtree_t mt;
+   int nlayers, nprev = -1, k, v[MAXL], y0[MAXL], y1[MAXL], haskey = 0, loaded = 0;
+   long *hist;
+
+   memset(&mt, 0, sizeof(mt));
+   if (opt_.index != NULL)
+   {
+      haskey = index_key(key, sizeof(key)) != -1;
+      if ((loaded = maxtree_load(&mt, mem, ikey, opt_.index) != -1))
+      {
+         if (haskey && strcmp(key, ikey))
+         {
+            log_msg(LOG_WARN, "index %s was created from another image or with other options, creating it again", opt_.index);
+            maxtree_free(&mt);
+            memimg_free(mem);
+            loaded = 0;
+         }
+         else if (!strcmp(opt_.s, "-"))
+            log_msg(LOG_WARN, "image loaded from index %s, standard input is ignored", opt_.index);
+         else
+            log_msg(LOG_INFO, "image loaded from index %s", opt_.index);
+      }
+   }
 
-   //safety check
-   if (l == NULL || mem == NULL)
-      return -1;
+   if (!loaded)
+   {
+      load_image(mem, opt_.s, opt_.mode, opt_.stretch);
+      if (opt_.index != NULL || opt_.query)
+      {
+         if (maxtree_build(&mt, mem) == -1)
+         {
+            log_msg(LOG_ERR, "maxtree_build() failed");
+            exit(1);
+         }
+         if (opt_.index != NULL && maxtree_save(&mt, mem, haskey ? key : NULL, opt_.index) == -1)
+            log_msg(LOG_ERR, "cannot save index to %s", opt_.index);
+      }
+   }
 
-   log_debug("scanning layer v = %d", l->v);
-   scan_pos.x = scan_pos.y = 0;
-   for (i = l->plist_cnt; i < MAXW; i++)
+   if ((hist = mt_malloc(MT_OTHER, (maxval_ + 1) * sizeof(*hist))) == NULL)
    {
-      if (!next_unvisited(mem, &scan_pos, l->v))
-         break;
+      log_errno(LOG_ERR, "malloc()");
+      exit(1);
+   }
+   memhist(mem, hist);
+   if (opt_.levels == LEVELS_INTERVAL)
+   {
+      if ((nlayers = levels_interval(hist, opt_.interval, v)) == -1)
+         exit(1);
+      nlayers = select_levels(hist, LEVELS_LIST, nlayers, v);
+   }
+   else
+   {
+      for (int j = 0; opt_.levels == LEVELS_LIST && j < opt_.nlayers; j++)
+         v[j] = val_level(opt_.v[j]);
+      nlayers = select_levels(hist, opt_.levels, opt_.nlayers, v);
+   }
+   mt_free(hist);
+
+   if (opt_.query)
+   {
+      long area;
+      int n;
 
-      if (add_plist(l) == -1)
+      printf("# level components pixels\n");
+      for (int j = 0; j < nlayers; j++)
       {
-         log_errno(LOG_ERR, "add_plist() failed");
-         break;
+         n = maxtree_query(&mt, v[j], &area, NULL, NULL);
+         printf("%g %d %ld\n", val_real(v[j]), n, area);
       }
+      maxtree_free(&mt);
+      return -1;
+   }
 
-      p = scan_pos;
-      if (!(l->n[i] = scan(mem, l->v, &p, &l->plist[i])))
+   // the rows of the components of each level, all rows without tree
+   for (int j = 0; j < nlayers; j++)
+   {
+      y0[j] = y1[j] = 0;
+      if (mt.node != NULL)
       {
-         // reuse current plist
-         i--;
-         l->plist_cnt--;
+         maxtree_query(&mt, v[j], NULL, &y0[j], &y1[j]);
+         y1[j]++;
+      }
+   }
+   maxtree_free(&mt);
 
-         scan_pos.x++;
-         if (scan_pos.x >= mem->width)
+   if (opt_.state != NULL)
+   {
+      scan_params(param, sizeof(param));
+      nprev = load_state(prev, &tm, mem, param);
+   }
+
+   for (int j = 0; j < nlayers; j++)
+   {
+      memset(&l[j], 0, sizeof(l[j]));
+      l[j].v = v[j];
+      l[j].compact = opt_.compact;
+      l[j].min_area = opt_.min_area;
+      l[j].min_perim = opt_.min_perim;
+      l[j].y0 = y0[j];
+      l[j].y1 = y1[j];
+      if (opt_.state != NULL && (l[j].rec = mt_calloc(MT_LAYER, 1, sizeof(*l[j].rec))) == NULL)
+      {
+         log_errno(LOG_ERR, "calloc()");
+         exit(1);
+      }
+
+      log_msg(LOG_INFO, "layer %d", j);
+      for (k = 0; k < nprev && prev[k].v != v[j]; k++);
+      if (k < nprev)
+      {
+         if (retrace_layer(&l[j], &prev[k], mem, &tm) == -1)
          {
-            scan_pos.x = 0;
-            scan_pos.y++;
+            log_msg(LOG_ERR, "retrace_layer() failed");
+            exit(1);
          }
-         continue;
       }
-      log_debug("plist %d, x = %d, y = %d, %d points", i, scan_pos.x, scan_pos.y, l->n[i]);
-      scan_pos.x = 0;
-      scan_pos.y++;
-
-      l->n[i] = reduce(l->plist[i], l->n[i], 5);
-      log_debug("reduced plist %d points", l->n[i]);
-
-//#define GEN_DEBUG_PNG
-#ifdef GEN_DEBUG_PNG
-      char buf[32];
-      snprintf(buf, sizeof(buf), "XY_%03d%03d.png", l->v, i);
-      memcairo(mem, buf);
-#endif
+      else if (scan_layer_mt(&l[j], mem, opt_.nthreads) == -1)
+      {
+         log_msg(LOG_ERR, "scan_layer() failed");
+         exit(1);
+      }
    }
-   clear_marks(mem);
 
-   if (i == MAXW)
-      log_msg(LOG_NOTICE, "max iteration count %d reached. You may increase MAXW and recompile", MAXW);
+   if (nprev != -1)
+   {
+      for (k = 0; k < nprev; k++)
+         free_layer(&prev[k]);
+      tiles_free(&tm);
+   }
+
+   if (opt_.state != NULL && state_save(opt_.state, param, l, nlayers, mem) == -1)
+      log_msg(LOG_WARN, "cannot save state to %s", opt_.state);
 
-   return 0;
+   return nlayers;
 }
 
 
-void usage(const char *s)
+/*! Calculate the cache key of the input and all options which change the
+ * contours.
+ * @return 0 on success, -1 if the input cannot be read.
+ */
+static int scan_cache_key(char *key, size_t size)
 {
-   printf("%s\nusage: %s [OPTIONS] [<filename>]\n", VERSION_STRING, s);
-   printf("   OPTIONS\n"
-          "      -h ............ Print this message.\n"
-          "      -m <mode> ..... Scan mode, 'direct' or 'grey'.\n"
-          "      -n <layers> ... Number of layers to scan (default = %d).\n"
-          "      -s ............ Stretch color values from 0 - MAXVAL.\n"
-          "      -x <factor> ... Scaling factor for geo coordinates (default = 1.0).\n"
-          "\n", LAYERS);
+   char buf[MAXL * 24 + 256];
+   int len;
+
+   // standard input cannot be read twice
+   if (!strcmp(opt_.s, "-"))
+      return -1;
+
+   len = scan_params(buf, sizeof(buf));
+   // without image file the index is the input
+   return cache_key(access(opt_.s, R_OK) || opt_.index == NULL ? opt_.s : opt_.index, buf, len, key, size);
 }
 
 
 int main(int argc, char **argv)
 {
-   char *s = "a.png";
-   int nlayers = LAYERS, n, mode = MODE_GREY, stretch = 0;
+   int nlayers, n, stats = STATS_NONE, hit = 0, failed = 0;
+   char key[CACHE_KEYLEN], name[PATH_MAX];
+   const char *s;
    memimg_t mem;
-   layer_t l[MAXL];
+   // ll are the layers of a level of detail
+   layer_t l[MAXL], ll[MAXL];
+   static const struct option lopt[] =
+   {
+      {"stats", required_argument, NULL, 'S'},
+      {"perf", no_argument, NULL, 'P'},
+      {"mem-budget", required_argument, NULL, 'B'},
+      {"min-area", required_argument, NULL, 'A'},
+      {"min-perimeter", required_argument, NULL, 'L'},
+      {"levels", required_argument, NULL, 'V'},
+      {"index", required_argument, NULL, 'I'},
+      {"query", no_argument, NULL, 'Q'},
+      {"cache", required_argument, NULL, 'C'},
+      {"incremental", required_argument, NULL, 'U'},
+      {"raw", required_argument, NULL, 'R'},
+      {"svg", required_argument, NULL, 'G'},
+      {"no-osm", no_argument, NULL, 'W'},
+      {"no-svg", no_argument, NULL, 'N'},
+      {"mvt", required_argument, NULL, 'M'},
+      {"zoom", required_argument, NULL, 'Z'},
+      {"bits", required_argument, NULL, 'D'},
+      {"scale", required_argument, NULL, 'K'},
+      {"offset", required_argument, NULL, 'O'},
+      {"interval", required_argument, NULL, 'E'},
+      {"lod", optional_argument, NULL, 'Y'},
+      {"bezier", optional_argument, NULL, 'J'},
+      {NULL, 0, NULL, 0}
+   };
 
    init_log("stderr", LOG_INFO);
 
-   while ((n = getopt(argc, argv, "hm:n:sx:")) != -1)
+   while ((n = getopt_long(argc, argv, "chm:n:o:r:st:x:", lopt, NULL)) != -1)
       switch (n)
       {
+         case 'S':
+            if (!strcasecmp(optarg, "json"))
+               stats = STATS_JSON;
+            else if (!strcasecmp(optarg, "text"))
+               stats = STATS_TEXT;
+            else
+               log_msg(LOG_NOTICE, "unknown statistics format '%s', ignoring", optarg);
+            break;
+
+         case 'P':
+            perfctr_init();
+            break;
+
+         case 'B':
+            mt_set_budget(atol(optarg) * 1024L * 1024L);
+            break;
+
+         case 'c':
+            opt_.compact = 1;
+            break;
+
+         case 'A':
+            opt_.min_area = atof(optarg);
+            break;
+
+         case 'L':
+            opt_.min_perim = atof(optarg);
+            break;
+
+         case 'I':
+            opt_.index = optarg;
+            break;
+
+         case 'Q':
+            opt_.query = 1;
+            break;
+
+         case 'C':
+            opt_.cache = optarg;
+            break;
+
+         case 'U':
+            opt_.state = optarg;
+            break;
+
+         case 'R':
+            if (raw_parse(optarg, &opt_.raw) == -1)
+               exit(EXIT_FAILURE);
+            break;
+
+         case 'D':
+            if (atoi(optarg) == 16)
+               maxval_ = MAXVAL16;
+            else if (atoi(optarg) == 8)
+               maxval_ = MAXVAL;
+            else
+            {
+               log_msg(LOG_ERR, "number of bits must be 8 or 16");
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'K':
+            if ((val_scale_ = atof(optarg)) <= 0)
+            {
+               log_msg(LOG_ERR, "scale must be greater than 0");
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'O':
+            val_offset_ = atof(optarg);
+            break;
+
+         case 'E':
+            if ((opt_.interval = atof(optarg)) <= 0)
+            {
+               log_msg(LOG_ERR, "interval must be greater than 0");
+               exit(EXIT_FAILURE);
+            }
+            opt_.levels = LEVELS_INTERVAL;
+            break;
+
+         case 'V':
+            if ((opt_.levels = levels_parse(optarg, opt_.v, &n)) == -1)
+               exit(EXIT_FAILURE);
+            if (opt_.levels == LEVELS_LIST)
+               opt_.nlayers = n;
+            break;
+
          case 'm':
             if (!strcasecmp(optarg, "direct"))
-               mode = MODE_DIRECT;
+               opt_.mode = MODE_DIRECT;
             else if (!strcasecmp(optarg, "grey"))
-               mode = MODE_GREY;
+               opt_.mode = MODE_GREY;
             else
             {
                log_msg(LOG_NOTICE, "unknown mode '%s', defaulting to greyscale", optarg);
-               mode = MODE_GREY;
+               opt_.mode = MODE_GREY;
             }
             break;
 
          case 'n':
-            if ((nlayers = atoi(optarg)) <= 0)
+            if (opt_.levels == LEVELS_LIST || opt_.levels == LEVELS_INTERVAL)
+               log_msg(LOG_NOTICE, "option -n ignored, levels given");
+            else if ((opt_.nlayers = atoi(optarg)) <= 0)
+            {
+               opt_.nlayers = 1;
+               log_msg(LOG_NOTICE, "number of layers reset to %d", opt_.nlayers);
+            }
+            else if (opt_.nlayers > MAXL)
             {
-               nlayers = 1;
-               log_msg(LOG_NOTICE, "number of layers reset to %d", nlayers);
+               opt_.nlayers = MAXL;
+               log_msg(LOG_NOTICE, "number of layers reset to %d", opt_.nlayers);
             }
             break;
 
+         case 'o':
+            default_outputs();
+            opt_.out[out_format(optarg)] = optarg;
+            break;
+
+         case 'G':
+            default_outputs();
+            opt_.out[FMT_SVG] = optarg;
+            break;
+
+         case 'W':
+            opt_.out[FMT_OSM] = NULL;
+            break;
+
+         case 'M':
+            default_outputs();
+            opt_.out[FMT_MVT] = optarg;
+            break;
+
+         case 'Z':
+            n = sscanf(optarg, "%d-%d", &mvt_minzoom_, &mvt_maxzoom_);
+            if (n < 1 || mvt_minzoom_ < 0 || (n == 2 && mvt_maxzoom_ < mvt_minzoom_))
+            {
+               log_msg(LOG_ERR, "illegal zoom levels '%s'", optarg);
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'N':
+            opt_.out[FMT_SVG] = NULL;
+            break;
+
          case 's':
-            stretch = 1;
+            opt_.stretch = 1;
+            break;
+
+         case 'r':
+            if ((reduce_dist_ = atoi(optarg)) < 0)
+            {
+               reduce_dist_ = 0;
+               log_msg(LOG_NOTICE, "distance reset to %d", reduce_dist_);
+            }
+            break;
+
+         case 'J':
+            if ((opt_.bezier = optarg != NULL ? atof(optarg) : BEZ_ERR) <= 0)
+            {
+               log_msg(LOG_ERR, "maximum distance must be greater than 0");
+               exit(EXIT_FAILURE);
+            }
+            break;
+
+         case 'Y':
+            opt_.lod = 1;
+            for (char *s = optarg, *end; s != NULL && *s; s = *end ? end + 1 : end)
+            {
+               if (opt_.nlod >= LODS || (opt_.tol[opt_.nlod] = strtod(s, &end)) < 0 || end == s || (*end && *end != ','))
+               {
+                  log_msg(LOG_ERR, "illegal tolerances '%s'", optarg);
+                  exit(EXIT_FAILURE);
+               }
+               opt_.nlod++;
+            }
+            break;
+
+         case 't':
+            if ((opt_.nthreads = atoi(optarg)) <= 0)
+            {
+               opt_.nthreads = 1;
+               log_msg(LOG_NOTICE, "number of threads reset to %d", opt_.nthreads);
+            }
             break;
 
          case 'x':
@@ -274,47 +800,96 @@ int main(int argc, char **argv)
       }
 
    if (argv[optind] != NULL)
-      s = argv[optind];
+      opt_.s = argv[optind];
 
-   if (cairomem(&mem, s) == -1)
+   if (opt_.cache != NULL && !opt_.query)
    {
-      log_msg(LOG_ERR, "cairo_mem() failed");
-      exit(1);
+      if (scan_cache_key(key, sizeof(key)) == -1)
+      {
+         log_msg(LOG_NOTICE, "cannot read input, cache disabled");
+         opt_.cache = NULL;
+      }
+      else if ((nlayers = cache_load(opt_.cache, key, l, &mem)) != -1)
+      {
+         log_msg(LOG_INFO, "cache hit %s", key);
+         hit = 1;
+      }
+      else
+         log_msg(LOG_INFO, "cache miss %s", key);
    }
 
-   switch (mode)
+   if (!hit)
    {
-      case MODE_DIRECT:
-         memprep(&mem, cdirect, NULL);
-         break;
-
-      case MODE_GREY:
-         memprep(&mem, c2grey, NULL);
-         break;
-
-      default:
-         log_msg(LOG_EMERG, "this should never happen, mode = %d", mode);
-         exit(1);
+      if ((nlayers = trace_image(l, &mem)) == -1)
+      {
+         memimg_free(&mem);
+         return 0;
+      }
+      if (opt_.cache != NULL && cache_save(opt_.cache, key, l, nlayers, &mem) == -1)
+         log_msg(LOG_WARN, "cannot save contours to cache %s", opt_.cache);
    }
+   stats_.width = mem.width;
+   stats_.height = mem.height;
 
-   if (stretch)
-      memstretch(&mem);
+   if (opt_.lod)
+   {
+      stats_start(ST_LOD);
+      for (int j = 0; j < nlayers; j++)
+         if (lod_layer(&l[j]) == -1)
+            exit(1);
+      stats_stop(ST_LOD);
+   }
 
-   for (int j = 0; j < nlayers; j++)
+   for (int k = 0; k < (opt_.nlod ? opt_.nlod : 1); k++)
    {
-      memset(&l[j], 0, sizeof(l[j]));
-      l[j].v = MAXVAL - MAXVAL / (nlayers + 1) * (j + 1);
+      if (opt_.nlod)
+      {
+         stats_start(ST_LOD);
+         n = lod_filter(l, ll, nlayers, opt_.tol[k]);
+         stats_stop(ST_LOD);
+         if (n == -1)
+            exit(1);
+      }
 
-      log_msg(LOG_INFO, "layer %d", j);
-      scan_layer(&l[j], &mem);
+      if (opt_.bezier > 0 && opt_.out[FMT_SVG] != NULL)
+      {
+         stats_start(ST_BEZIER);
+         for (int j = 0; j < nlayers; j++)
+            if (bezier_layer(opt_.nlod ? &ll[j] : &l[j], opt_.bezier) == -1)
+               exit(1);
+         stats_stop(ST_BEZIER);
+      }
+
+      for (int i = 0; i < FMT_MAX; i++)
+      {
+         if (opt_.out[i] == NULL)
+            continue;
+         // vector tiles select the tolerance of each zoom level themselves
+         if (i == FMT_MVT && k)
+            continue;
+         s = opt_.nlod > 1 && i != FMT_MVT ? lod_name(opt_.out[i], opt_.tol[k], name, sizeof(name)) : opt_.out[i];
+         stats_start(format_[i].stage);
+         if (format_[i].export(opt_.nlod && i != FMT_MVT ? ll : l, s, nlayers, &mem) == -1)
+         {
+            log_msg(LOG_ERR, "cannot write %s", s);
+            failed++;
+         }
+         stats_stop(format_[i].stage);
+         if (strcmp(s, "-"))
+            stats_file_bytes(format_[i].stage, s);
+      }
+
+      for (int j = 0; opt_.nlod && j < nlayers; j++)
+         free_layer(&ll[j]);
    }
 
-   export_osm(l, "a.osm", nlayers, &mem);
-   export_svg(l, "a.svg", nlayers, &mem);
+   // the log may be written asynchronously to the same stream
+   log_flush();
+   stats_report(stderr, stats);
+   perfctr_close();
 
-   free(l->plist);
+   mt_free(l->plist);
    memimg_free(&mem);
 
-   return 0;
+   return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
-
@@ -25,6 +25,9 @@
 #ifndef SCAN_H
 #define SCAN_H
 
+#include <stdio.h>
+#include <stdint.h>
+
 #include "memimg.h"
 
 #ifdef UNUSED
@@ -36,7 +39,11 @@
 # define UNUSED(x) x
 #endif
 
+#define TRACER_VERSION "0.2"
+
 #define MAXVAL 255
+//! maximum value of 16 bit images
+#define MAXVAL16 65535
 
 #define VLEFT (1 << 30)
 #define VRIGHT (1 << 29)
@@ -45,6 +52,12 @@
 #define VALL (VLEFT | VDOWN | VRIGHT | VUP)
 
 #define MAXL 256
+//! length of a cache key including the terminating \0
+#define CACHE_KEYLEN 17
+//! edge length of the tiles of incremental tracing
+#define TILESIZE 32
+//! distance up to which a changed pixel may change a contour, see layer.c
+#define RETRACE_MARGIN 2
 
 
 typedef struct pos
@@ -55,14 +68,209 @@ typedef struct pos
    double yf;
 } pos_t;
 
+//! contour in chain code, see chain.c
+typedef struct chain
+{
+   //! first vertex
+   int x, y;
+   //! number of vertices
+   int n;
+   //! 1 if the last vertex equals the first one
+   int closed;
+   //! number of bytes of code
+   int len;
+   uint8_t *code;
+} chain_t;
+
+//! contour as cubic Bezier curves, see bezier.c
+typedef struct curve
+{
+   //! number of curve segments
+   int n;
+   //! 1 if the contour is closed
+   int closed;
+   //! start point followed by the 2 control points and the end point of
+   //! each segment, x and y of each point. The control points of straight
+   //! lines are equal to their ends.
+   double *p;
+   //! index of the vertex of the contour at the end of each segment
+   int *idx;
+} curve_t;
+
 typedef struct layer
 {
    int v;
    int plist_cnt;
    pos_t **plist;
    int *n;
+   //! contours are stored in chain instead of plist if set
+   int compact;
+   chain_t *chain;
+   //! contours with a smaller area or perimeter (in pixels) of the polygon
+   //! through the centres of their border pixels are discarded (see shape_t)
+   double min_area, min_perim;
+   //! effective area of each vertex of each contour, NULL if it was not
+   //! calculated, see lod.c
+   float **lod;
+   //! curves of each contour, NULL if they were not fitted, see bezier.c
+   curve_t *curve;
+   //! seeds and marks of the layer are recorded if not NULL
+   struct layerrec *rec;
+   //! the pixels >= v are in the rows y0 to y1 - 1 (see maxtree_query()),
+   //! all rows are traced if y1 is 0
+   int y0, y1;
 } layer_t;
 
+//! iterator over the vertices of a contour
+typedef struct chain_iter
+{
+   //! chain, or NULL if the contour is a vertex list p
+   const chain_t *c;
+   const pos_t *p;
+   //! next byte of the chain
+   const uint8_t *b;
+   //! index of the next vertex and number of vertices
+   int i, n;
+   pos_t cur;
+} chain_iter_t;
+
+//! entry of the journal, f are the marks set at p, or if f is 0, c is the
+//! value which was read at p
+typedef struct jentry
+{
+   int *p;
+   int f;
+   int c;
+} jentry_t;
+
+typedef struct journal
+{
+   jentry_t *e;
+   long n, size;
+   //! set to -1 if an entry could not be recorded
+   int err;
+} journal_t;
+
+//! shape of a contour, accumulated while it is traced
+typedef struct shape
+{
+   //! bounding box of the vertices
+   int x0, y0, x1, y1;
+   //! twice the signed area of the polygon through the vertices
+   long area2;
+   //! length of the polygon
+   long perim;
+} shape_t;
+
+//! seed of a layer, recorded for retrace_layer()
+typedef struct seedrec
+{
+   //! seed pixel and lower corner found from it
+   int sx, sy, cx, cy;
+   //! index of the contour in the layer, -1 if it was visited already
+   int idx;
+   //! number of vertices before reduce()
+   int n0;
+   //! shape of the contour, just the bounding box of the seed and the
+   //! corner if it was visited already
+   shape_t sh;
+   //! marks set from this seed in the journal
+   long j0, jn;
+} seedrec_t;
+
+//! seeds of a layer in the order in which they were found
+typedef struct layerrec
+{
+   seedrec_t *r;
+   int cnt, size;
+   journal_t j;
+} layerrec_t;
+
+//! recipe of a subpixel coordinate which is base + sign * (v - c) / (g - c)
+typedef struct interp
+{
+   int base;
+   //! -1 or 1, 0 if there is no crossing, i.e. the coordinate is base
+   int sign;
+   //! c is the value of the pixel if cval is set, otherwise its index
+   int cval;
+   long c;
+   //! index of the inside pixel g
+   long g;
+} interp_t;
+
+//! recipes of both coordinates of a vertex
+typedef struct crossing
+{
+   interp_t x, y;
+} crossing_t;
+
+//! function which moves a walker by one step, see trace_step()
+typedef int (*step_func_t)(memimg_t *mem, int v, pos_t *pos, int *dir, void *arg);
+
+//! node of the max-tree, i.e. a connected component of the pixels >= level
+typedef struct mtnode
+{
+   int level;
+   //! parent node, -1 at the root
+   int parent;
+   //! number of pixels of the component
+   long area;
+   //! bounding box of the component
+   int x0, y0, x1, y1;
+} mtnode_t;
+
+typedef struct maxtree
+{
+   int width, height;
+   int nnodes;
+   //! nodes, the parent of a node always has a greater index
+   mtnode_t *node;
+} maxtree_t;
+
+//! flags of the tiles of an image
+typedef struct tilemap
+{
+   //! edge length of a tile
+   int size;
+   //! number of tiles per row and column
+   int tw, th;
+   uint8_t *t;
+} tilemap_t;
+
+//! iterator over the geo coordinates of a feature, see wgis.c
+typedef struct geo_iter
+{
+   chain_iter_t it;
+   const memimg_t *mem;
+   //! index of the next vertex, number of vertices, and number of vertices
+   //! of the contour without the closing one
+   int i, n, m;
+   //! first vertex, it is repeated at the end of closed contours
+   pos_t first;
+} geo_iter_t;
+
+//! format of a raw raster, see rawread.c
+typedef struct rawfmt
+{
+   int width, height;
+   //! sample type, RAW_U8...
+   int type;
+   //! maximum value of a sample
+   int maxval;
+   //! offset of the first sample in the file
+   size_t offset;
+} rawfmt_t;
+
+//! modes of select_levels(), LEVELS_INTERVAL is resolved by levels_interval()
+enum {LEVELS_EQUAL, LEVELS_QUANTILE, LEVELS_LIST, LEVELS_INTERVAL};
+
+//! types of synthetic images of rastergen()
+enum {RG_FLAT, RG_GRADIENT, RG_RADIAL, RG_FRACTAL, RG_CHECKER, RG_NOISE, RG_MAX};
+
+//! sample types of raw rasters
+enum {RAW_U8, RAW_U16LE, RAW_U16BE, RAW_RGB, RAW_RGB16BE, RAW_MAX};
+
 /* LEFT and DOWN means decreasing coordinates, RIGHT and UP increasing. */
 enum {LEFT, DOWN, RIGHT, UP};
 
@@ -71,23 +279,133 @@ enum {LEFT, DOWN, RIGHT, UP};
 void memcairo(const memimg_t *mem, const char *s);
 int cairomem(memimg_t *mem, const char *s);
 
+/* chain.c */
+int chain_encode(chain_t *c, const pos_t *p, int n);
+void chain_free(chain_t *c);
+int chain_check(const chain_t *c);
+void contour_iter(chain_iter_t *it, const layer_t *l, int i);
+int contour_next(chain_iter_t *it, pos_t *p);
+int contour_closed(const layer_t *l, int i);
+int layer_compact(layer_t *l, int i);
+
+/* cache.c */
+int cache_key(const char *s, const void *param, size_t plen, char *key, size_t size);
+int cache_save(const char *dir, const char *key, const layer_t *l, int nlayers, const memimg_t *mem);
+int cache_load(const char *dir, const char *key, layer_t *l, memimg_t *mem);
+int state_save(const char *s, const char *param, const layer_t *l, int nlayers, const memimg_t *mem);
+int state_load(const char *s, const char *param, layer_t *l, memimg_t *mem);
+
 /* cairoexport.c */
 int export_svg(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
 
 /* tracer.c */
 int next_unvisited(const memimg_t *mem, pos_t *p, int v);
+int scan0(memimg_t *mem, int v, pos_t *pos, pos_t **plist, crossing_t **cross, shape_t *sh);
 int scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist);
+void interpolate(const memimg_t *mem, int v, pos_t *p, int n, const crossing_t *cross);
 void clear_marks(memimg_t *mem);
+int is_inside(const memimg_t *mem, int v, const pos_t *pos);
 int reduce(pos_t *pos, int n, int m);
+void tracer_journal(journal_t *j);
+int journal_replay(journal_t *j, long from, long n);
+void journal_undo(journal_t *j, long from, long n);
+void journal_copy(journal_t *dst, const journal_t *src, long from, long n);
+void journal_rebase(journal_t *j, const int *from, int *to);
+void journal_free(journal_t *j);
+void find_lowercorner(const memimg_t *mem, int v, pos_t *pos, int *scan_dir);
+void find_lowercorner_at(const memimg_t *mem, int v, pos_t *pos, int *scan_dir, int bottom);
+void column_bottom(const memimg_t *mem, int *bot, int y0, int y1);
+int next_run(const memimg_t *mem, pos_t *p, int *end);
+void tracer_fragment(int y0, int y1);
+int trace_step(const memimg_t *mem, int v, pos_t *pos, int *dir, interp_t *ip);
+void replay_step(memimg_t *mem, int dir, const pos_t *from, const pos_t *to, int midrun, const interp_t *ip);
+int scan_corner(memimg_t *mem, int v, pos_t *pos, int scan_dir, step_func_t step, void *arg, pos_t **plist, crossing_t **cross, shape_t *sh);
+
+/* bezier.c */
+int bezier_fit(const pos_t *p, int n, int closed, double err, curve_t *c);
+void curve_free(curve_t *c);
+int bezier_layer(layer_t *l, double err);
+void bezier_free(layer_t *l);
+
+/* lod.c */
+int lod_areas(const pos_t *p, int n, int closed, float *area);
+int lod_layer(layer_t *l);
+void lod_free(layer_t *l);
+int lod_filter(const layer_t *src, layer_t *dst, int nlayers, double tol);
 
 /* layer.c */
 layer_t *new_layer(int v);
+void free_layer(layer_t *l);
 int add_plist(layer_t *l);
+int scan_layer(layer_t *l, memimg_t *mem);
+int scan_layer_mt(layer_t *l, memimg_t *mem, int nthreads);
+int retrace_layer(layer_t *l, layer_t *prev, memimg_t *mem, const tilemap_t *tm);
+
+/* imgprep.c */
+int c2grey(int c, void *res);
+int cdirect(int c, void *res);
+int cinvert(int c, void *res);
+void memprep(memimg_t *mem, int (*colfunc)(int, void*), void *res);
+void memstretch(memimg_t *mem);
+double val_real(int v);
+int val_level(double r);
+
+/* levels.c */
+void memhist(const memimg_t *mem, long *hist);
+int levels_parse(const char *s, double *v, int *n);
+int levels_interval(const long *hist, double d, int *v);
+int select_levels(const long *hist, int mode, int n, int *v);
+
+/* maxtree.c */
+int maxtree_build(maxtree_t *mt, const memimg_t *mem);
+void maxtree_free(maxtree_t *mt);
+int maxtree_query(const maxtree_t *mt, int v, long *area, int *y0, int *y1);
+int maxtree_save(const maxtree_t *mt, const memimg_t *mem, const char *key, const char *s);
+int maxtree_load(maxtree_t *mt, memimg_t *mem, char *key, const char *s);
+
+/* output.c */
+FILE *out_open(const char *s);
+
+/* pngread.c */
+int pngmem(memimg_t *mem, const char *s, int (*colfunc)(int, void*), void *res, void (*rowfunc)(const memimg_t*, int, void*), void *arg);
+
+/* rastergen.c */
+int rastergen(memimg_t *mem, int type, int width, int height, unsigned seed);
+const char *rastergen_name(int type);
+int rastergen_type(const char *s);
+
+/* rawread.c */
+int raw_parse(const char *s, rawfmt_t *fmt);
+int pnm_file(const char *s);
+int rawmem(memimg_t *mem, const char *s, const rawfmt_t *fmt, int (*colfunc)(int, void*), void *res);
+
+/* tiles.c */
+int tiles_init(tilemap_t *tm, int width, int height, int size);
+void tiles_free(tilemap_t *tm);
+int tiles_hit(const tilemap_t *tm, int x0, int y0, int x1, int y1);
+int tiles_diff(tilemap_t *tm, const memimg_t *a, const memimg_t *b);
+
+/* wgis.c */
+int geo_iter(geo_iter_t *g, const layer_t *l, int k, const memimg_t *mem);
+int geo_next(geo_iter_t *g, double *x, double *y);
+double geo_ele(const layer_t *l, int k, int n, const memimg_t *mem);
+int export_geojson(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
+int export_wkb(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
+int export_hexwkb(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
+int export_fgb(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
+
+/* wmvt.c */
+int export_mvt(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
 
 /* wosm.c */
+void osm_coord(const pos_t *p, const memimg_t *mem, double *lon, double *lat);
 int export_osm(const layer_t *l, const char *s, int nlayers, memimg_t *mem);
 
 extern double osm_scale_;
+extern int mvt_minzoom_, mvt_maxzoom_;
+extern int reduce_dist_;
+extern int maxval_;
+extern double val_scale_, val_offset_;
 
 
 #endif
@@ -19,6 +19,12 @@
 /*! \file smlog.c
  * This file simply contains the logging functions. It was originally written
  * for OnionCat and was adapted to be used for smrender.
+ * If compiled with WITH_THREADS, messages are logged asynchronously. Each
+ * thread owns a lock-free single-producer/single-consumer ring buffer into
+ * which the message text is formatted. A background thread takes the
+ * messages out of all rings, adds the time stamp and writes them to the log.
+ * Thus a logging thread never waits for I/O or for a lock, unless its ring
+ * is full.
  * 
  * @author Bernhard R. Fischer
  * @version 2020/02/20
@@ -38,8 +44,11 @@
 #include <sys/time.h>
 #ifdef WITH_THREADS
 #include <pthread.h>
+#include <sched.h>
 #endif
 
+#include "smlog.h"
+
 
 // Define the following macro if log_msg() should preserve errno.
 #define PRESERVE_ERRNO
@@ -47,29 +56,78 @@
 #define SIZE_1K 1024
 #define TIMESTRLEN 64
 #define CBUFLEN SIZE_1K
+//! maximum length of a single message
+#define LOGMSGLEN 512
+//! number of messages per ring, must be a power of 2
+#define LOGRING 256
+//! maximum time in ms the writer thread sleeps if it was not woken up
+#define LOGSLEEP 100
 
 #ifndef LOG_PRI
 #define LOG_PRI(p) ((p) & LOG_PRIMASK)
 #endif
 
-//int sm_thread_id(void);
+typedef struct logrec
+{
+   struct timeval tv;
+   int level;
+   char msg[LOGMSGLEN];
+} logrec_t;
+
+//! cache of the formatted time, it is updated only once per second
+struct timecache
+{
+   time_t t;
+   char str[TIMESTRLEN];
+};
 
 static const char *flty_[8] = {"emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"};
 //! FILE pointer to log
 static FILE *log_ = NULL;
-static int level_ = LOG_INFO;
+//! log level, it is global because log_msg() checks it inline
+int log_level_ = LOG_INFO;
+//! time of the previous message and cached time string
+static struct timeval last_;
+static struct timecache tc_;
+
+#ifdef WITH_THREADS
+typedef struct logring
+{
+   struct logring *next;
+   //! id of the ring, it is logged as thread id
+   int id;
+   //! ring is owned by a thread
+   int used;
+   //! head is written by the producer, tail by the consumer
+   unsigned head, tail;
+   logrec_t rec[LOGRING];
+} logring_t;
+
+//! ring of the current thread
+static __thread logring_t *ring_;
+//! list of all rings, it only grows
+static logring_t *rings_;
+static int nrings_;
+static pthread_mutex_t mutex_ = PTHREAD_MUTEX_INITIALIZER;
+//! serializes the output of the writer thread and synchronous messages
+static pthread_mutex_t wmutex_ = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cond_ = PTHREAD_COND_INITIALIZER;
+static pthread_once_t once_ = PTHREAD_ONCE_INIT;
+static pthread_key_t key_;
+static pthread_t writer_;
+static int running_, stop_, sleeping_;
+#endif
 
 
 void __attribute__((constructor)) init_log0(void)
 {
    log_ = stderr; 
-   //(void) sm_thread_id();
 }
 
 
 FILE *init_log(const char *s, int level)
 {
-   level_ = level;
+   log_level_ = level;
 
    if (!strcmp(s, "stderr"))
       log_ = stderr;
@@ -80,87 +138,314 @@ FILE *init_log(const char *s, int level)
 }
 
 
-/*! Log a message to a file or syslogd.
+static const char *timestr(struct timecache *tc, time_t t)
+{
+   struct tm tm;
+
+   if (tc->t != t || !*tc->str)
+   {
+      tc->t = t;
+      if (localtime_r(&t, &tm) != NULL)
+         (void) strftime(tc->str, TIMESTRLEN, "%H:%M:%S", &tm);
+   }
+   return tc->str;
+}
+
+
+/*! Write a formatted message to a file or syslogd.
  *  @param out Open FILE pointer or NULL. In the latter case it will log to
  *  syslogd.
- *  @param lf Logging priority (equal to syslog)
- *  @param fmt Format string
- *  @param ap Variable parameter list
+ *  @param id Thread id.
+ *  @param lr Message.
  *  @return Returns the number of bytes effectively written.
  */
-int vlog_msgf(FILE *out, int lf, const char *fmt, va_list ap)
+static int log_write(FILE *out, int id, const logrec_t *lr)
 {
-#ifdef WITH_THREADS
-   static pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-#endif
-   static struct timeval tv_stat = {0, 0};
-   struct timeval tv, tr;
-   struct tm *tm;
-   time_t t;
-   char timestr[TIMESTRLEN] = "", timez[TIMESTRLEN] = "";
-   int level = LOG_PRI(lf);
-   char buf[SIZE_1K];
+   struct timeval tr;
    int len;
 
-   if (level_ < level) return 0;
-
-   //t = time(NULL);
-   if (gettimeofday(&tv, NULL) == -1)
-      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, strerror(errno)), exit(EXIT_FAILURE);
-
-   if (!tv_stat.tv_sec) tv_stat = tv;
+   if (!last_.tv_sec) last_ = lr->tv;
 
-   tr.tv_sec = tv.tv_sec - tv_stat.tv_sec;
-   tr.tv_usec = tv.tv_usec - tv_stat.tv_usec;
+   tr.tv_sec = lr->tv.tv_sec - last_.tv_sec;
+   tr.tv_usec = lr->tv.tv_usec - last_.tv_usec;
    if (tr.tv_usec < 0)
    {
       tr.tv_usec += 1000000;
       tr.tv_sec--;
    }
+   last_ = lr->tv;
 
-   t = tv.tv_sec;
-   if ((tm = localtime(&t)))
+   if (out == NULL)
    {
-      //(void) strftime(timestr, TIMESTRLEN, "%a, %d %b %Y %H:%M:%S", tm);
-      (void) strftime(timestr, TIMESTRLEN, "%H:%M:%S", tm);
-      //(void) strftime(timez, TIMESTRLEN, "%z", tm);
+      // log to syslog if no output stream is available
+      syslog(lr->level | LOG_DAEMON, "%s", lr->msg);
+      return strlen(lr->msg);
    }
 
-   if (out != NULL)
-   {
 #ifdef WITH_THREADS
-      int id = 0; //sm_thread_id();
-      pthread_mutex_lock(&mutex);
-      len = fprintf(out, "%s.%03d %s (+%2d.%03d) %d:[%7s] ", timestr, (int) (tv.tv_usec / 1000), timez, (int) tr.tv_sec, (int) (tr.tv_usec / 1000), id, flty_[level]);
+   len = fprintf(out, "%s.%03d  (+%2d.%03d) %d:[%7s] %s\n", timestr(&tc_, lr->tv.tv_sec), (int) (lr->tv.tv_usec / 1000),
+         (int) tr.tv_sec, (int) (tr.tv_usec / 1000), id, flty_[lr->level], lr->msg);
 #else
-      len = fprintf(out, "%s.%03d %s (+%2d.%03d) [%7s] ", timestr, (int) (tv.tv_usec / 1000), timez, (int) tr.tv_sec, (int) (tr.tv_usec / 1000), flty_[level]);
+   (void) id;
+   len = fprintf(out, "%s.%03d  (+%2d.%03d) [%7s] %s\n", timestr(&tc_, lr->tv.tv_sec), (int) (lr->tv.tv_usec / 1000),
+         (int) tr.tv_sec, (int) (tr.tv_usec / 1000), flty_[lr->level], lr->msg);
 #endif
-      len += vfprintf(out, fmt, ap);
-      len += fprintf(out, "\n");
+   return len;
+}
+
+
+/*! Format a message into a log record.
+ */
+static void log_format(logrec_t *lr, int level, const char *fmt, va_list ap)
+{
+   if (gettimeofday(&lr->tv, NULL) == -1)
+      fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, strerror(errno)), exit(EXIT_FAILURE);
+   lr->level = level;
+   (void) vsnprintf(lr->msg, sizeof(lr->msg), fmt, ap);
+}
+
+
 #ifdef WITH_THREADS
-      pthread_mutex_unlock(&mutex);
-#endif
+/*! Write all messages which are currently in the rings.
+ *  @return Number of messages written.
+ */
+static int log_drain(void)
+{
+   logring_t *r;
+   unsigned head;
+   int cnt = 0;
+
+   pthread_mutex_lock(&wmutex_);
+   for (r = __atomic_load_n(&rings_, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+   {
+      head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+      for (; r->tail != head; cnt++)
+      {
+         log_write(log_, r->id, &r->rec[r->tail & (LOGRING - 1)]);
+         __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+      }
    }
-   else
+
+   if (cnt && log_ != NULL)
+      fflush(log_);
+   pthread_mutex_unlock(&wmutex_);
+
+   return cnt;
+}
+
+
+static void *log_writer(void * UNUSED(p))
+{
+   struct timespec ts;
+
+   for (;;)
    {
-      // log to syslog if no output stream is available
-      //vsyslog(level | LOG_DAEMON, fmt, ap);
-      len = vsnprintf(buf, SIZE_1K, fmt, ap);
-      syslog(level | LOG_DAEMON, "%s", buf);
+      if (log_drain())
+         continue;
+
+      pthread_mutex_lock(&mutex_);
+      if (stop_)
+      {
+         pthread_mutex_unlock(&mutex_);
+         break;
+      }
+      __atomic_store_n(&sleeping_, 1, __ATOMIC_SEQ_CST);
+      clock_gettime(CLOCK_REALTIME, &ts);
+      ts.tv_nsec += LOGSLEEP * 1000000L;
+      ts.tv_sec += ts.tv_nsec / 1000000000L;
+      ts.tv_nsec %= 1000000000L;
+      pthread_cond_timedwait(&cond_, &mutex_, &ts);
+      __atomic_store_n(&sleeping_, 0, __ATOMIC_SEQ_CST);
+      pthread_mutex_unlock(&mutex_);
+   }
+
+   // write the remaining messages
+   log_drain();
+   return NULL;
+}
+
+
+static void log_wakeup(void)
+{
+   if (!__atomic_load_n(&sleeping_, __ATOMIC_SEQ_CST))
+      return;
+
+   pthread_mutex_lock(&mutex_);
+   pthread_cond_signal(&cond_);
+   pthread_mutex_unlock(&mutex_);
+}
+
+
+/*! Stop the writer thread. All pending messages are written.
+ */
+static void log_stop(void)
+{
+   if (!running_)
+      return;
+
+   // messages logged from now on are written synchronously
+   running_ = 0;
+   pthread_mutex_lock(&mutex_);
+   stop_ = 1;
+   pthread_cond_signal(&cond_);
+   pthread_mutex_unlock(&mutex_);
+   pthread_join(writer_, NULL);
+}
+
+
+//! thread destructor, the ring of a terminated thread may be reused
+static void log_release(void *p)
+{
+   __atomic_store_n(&((logring_t*) p)->used, 0, __ATOMIC_RELEASE);
+}
+
+
+static void log_start(void)
+{
+   (void) pthread_key_create(&key_, log_release);
+   if (pthread_create(&writer_, NULL, log_writer, NULL))
+      return;
+   running_ = 1;
+   atexit(log_stop);
+}
+
 
+/*! Return the ring of the current thread. A new ring is created or an
+ * unused ring is taken over if the thread does not have one yet.
+ * @return Pointer to ring or NULL if it could not be created or if there is
+ * no writer thread.
+ */
+static logring_t *log_ring(void)
+{
+   logring_t *r;
+   int used;
+
+   if (ring_ != NULL)
+      return running_ ? ring_ : NULL;
+
+   (void) pthread_once(&once_, log_start);
+   if (!running_)
+      return NULL;
+
+   for (r = __atomic_load_n(&rings_, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+   {
+      used = 0;
+      if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE)
+            && __atomic_compare_exchange_n(&r->used, &used, 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+         break;
+   }
+
+   if (r == NULL)
+   {
+      if ((r = calloc(1, sizeof(*r))) == NULL)
+         return NULL;
+
+      r->used = 1;
+      pthread_mutex_lock(&mutex_);
+      r->id = nrings_++;
+      r->next = rings_;
+      __atomic_store_n(&rings_, r, __ATOMIC_RELEASE);
+      pthread_mutex_unlock(&mutex_);
    }
-   tv_stat = tv;
+
+   (void) pthread_setspecific(key_, r);
+   return ring_ = r;
+}
+
+
+/*! Wait until all messages of all rings are written.
+ */
+void log_flush(void)
+{
+   logring_t *r;
+
+   if (!running_)
+      return;
+
+   for (r = __atomic_load_n(&rings_, __ATOMIC_ACQUIRE); r != NULL; r = r->next)
+      while (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE))
+      {
+         log_wakeup();
+         sched_yield();
+      }
+
+   // the writer flushes the stream only after advancing the tails
+   pthread_mutex_lock(&wmutex_);
+   if (log_ != NULL)
+      fflush(log_);
+   pthread_mutex_unlock(&wmutex_);
+}
+#else
+void log_flush(void)
+{
+   if (log_ != NULL)
+      fflush(log_);
+}
+#endif
+
+
+/*! Log a message to a file or syslogd.
+ *  @param out Open FILE pointer or NULL. In the latter case it will log to
+ *  syslogd.
+ *  @param lf Logging priority (equal to syslog)
+ *  @param fmt Format string
+ *  @param ap Variable parameter list
+ *  @return Returns the number of bytes of the message. If the message is
+ *  logged asynchronously, it is the number of bytes put into the ring.
+ */
+int vlog_msgf(FILE *out, int lf, const char *fmt, va_list ap)
+{
+   int level = LOG_PRI(lf);
+   logrec_t lr;
+#ifdef WITH_THREADS
+   logring_t *r;
+   unsigned head;
+   int len;
+
+   if (log_level_ < level) return 0;
+
+   // critical messages are written synchronously in case the program dies
+   if (level > LOG_CRIT && out == log_ && (r = log_ring()) != NULL)
+   {
+      head = r->head;
+      while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= LOGRING)
+      {
+         log_wakeup();
+         sched_yield();
+      }
+      log_format(&r->rec[head & (LOGRING - 1)], level, fmt, ap);
+      len = strlen(r->rec[head & (LOGRING - 1)].msg);
+      __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+      log_wakeup();
+      return len;
+   }
+
+   log_flush();
+   log_format(&lr, level, fmt, ap);
+   pthread_mutex_lock(&wmutex_);
+   len = log_write(out, ring_ != NULL ? ring_->id : 0, &lr);
+   if (out != NULL)
+      fflush(out);
+   pthread_mutex_unlock(&wmutex_);
    return len;
+#else
+   if (log_level_ < level) return 0;
+
+   log_format(&lr, level, fmt, ap);
+   return log_write(out, 0, &lr);
+#endif
 }
 
 
 /*! Log a message. This function automatically determines
- *  to which streams the message is logged.
+ *  to which streams the message is logged. It is usually called through the
+ *  macro log_msg() which checks the log level before evaluating the
+ *  arguments.
  *  @param lf Log priority.
  *  @param fmt Format string.
  *  @param ... arguments
  */
-int log_msg(int lf, const char *fmt, ...)
+int log_msg0(int lf, const char *fmt, ...)
 {
    va_list ap;
    int len;
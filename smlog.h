@@ -31,13 +31,29 @@
 #include <syslog.h>
 
 
+#ifndef LOG_PRI
+#define LOG_PRI(p) ((p) & LOG_PRIMASK)
+#endif
+
+#ifdef UNUSED
+#elif defined(__GNUC__)
+# define UNUSED(x) UNUSED_ ## x __attribute__((unused))
+#else
+# define UNUSED(x) x
+#endif
+
 #define LOG_WARN LOG_WARNING
+//! the level is checked before the arguments are evaluated
+#define log_msg(lf, x...) (LOG_PRI(lf) <= log_level_ ? log_msg0(lf, ## x) : 0)
 #define log_debug(fmt, x...) log_msg(LOG_DEBUG, "%s() " fmt, __func__, ## x)
 #define log_warn(x...) log_msg(LOG_WARN, ## x)
 
+extern int log_level_;
+
 FILE *init_log(const char *s, int level);
-int log_msg(int, const char*, ...) __attribute__((format (printf, 2, 3)));
+int log_msg0(int, const char*, ...) __attribute__((format (printf, 2, 3)));
 int log_errno(int , const char *);
+void log_flush(void);
 
 #endif
 
@@ -0,0 +1,335 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file stats.c
+ * This file contains the code to collect timing and counters of the
+ * individual stages and to output them as a report.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+
+#include "scan.h"
+#include "stats.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+
+stats_t stats_;
+__thread layer_stat_t *stats_cur_;
+
+static const char *stname_[ST_MAX] = {"decode", "memprep", "memstretch", "scan_layer", "reduce", "clear_marks", "lod", "bezier", "export_osm", "export_svg",
+   "export_geojson", "export_wkb", "export_fgb", "export_mvt"};
+
+
+static double tsdiff(const struct timespec *a, const struct timespec *b)
+{
+   return (double) (b->tv_sec - a->tv_sec) + (double) (b->tv_nsec - a->tv_nsec) / 1E9;
+}
+
+
+static void tsnow(struct timespec *wall, struct timespec *cpu)
+{
+   clock_gettime(CLOCK_MONOTONIC, wall);
+   clock_gettime(CLOCK_PROCESS_CPUTIME_ID, cpu);
+}
+
+
+/*! Mark the beginning of a stage.
+ *  @param stage Stage number ST_xxx.
+ */
+void stats_start(int stage)
+{
+   if (stage < 0 || stage >= ST_MAX)
+      return;
+
+   stats_.stage[stage].calls++;
+   tsnow(&stats_.stage[stage].wall0, &stats_.stage[stage].cpu0);
+   perfctr_read(&stats_.stage[stage].hw0);
+}
+
+
+/*! Mark the end of a stage and accumulate its time.
+ *  @param stage Stage number ST_xxx.
+ */
+void stats_stop(int stage)
+{
+   struct timespec wall, cpu;
+   hwcnt_t hw;
+
+   if (stage < 0 || stage >= ST_MAX)
+      return;
+
+   perfctr_read(&hw);
+   tsnow(&wall, &cpu);
+   perfctr_add(&stats_.stage[stage].hw, &stats_.stage[stage].hw0, &hw);
+   stats_.stage[stage].wall += tsdiff(&stats_.stage[stage].wall0, &wall);
+   stats_.stage[stage].cpu += tsdiff(&stats_.stage[stage].cpu0, &cpu);
+}
+
+
+/*! Start the statistics of a new layer. The layer becomes the current layer
+ * to which the counters of the tracer are added.
+ * @param v Layer value.
+ * @return Pointer to the layer statistics or NULL on error.
+ */
+layer_stat_t *stats_layer_start(int v)
+{
+   layer_stat_t *ls;
+
+   if ((ls = mt_realloc(MT_OTHER, stats_.layer, (stats_.nlayers + 1) * sizeof(*ls))) == NULL)
+   {
+      log_errno(LOG_ERR, "realloc()");
+      return stats_cur_ = NULL;
+   }
+   stats_.layer = ls;
+   ls = &stats_.layer[stats_.nlayers++];
+   memset(ls, 0, sizeof(*ls));
+   ls->v = v;
+   tsnow(&ls->wall0, &ls->cpu0);
+   perfctr_read(&ls->hw0);
+
+   return stats_cur_ = ls;
+}
+
+
+void stats_layer_stop(layer_stat_t *ls)
+{
+   struct timespec wall, cpu;
+   hwcnt_t hw;
+
+   if (ls == NULL)
+      return;
+
+   perfctr_read(&hw);
+   tsnow(&wall, &cpu);
+   perfctr_add(&ls->hw, &ls->hw0, &hw);
+   ls->wall += tsdiff(&ls->wall0, &wall);
+   ls->cpu += tsdiff(&ls->cpu0, &cpu);
+   stats_cur_ = NULL;
+}
+
+
+/*! Record the size of the file written by a stage.
+ *  @param stage Stage number.
+ *  @param s Name of the file.
+ */
+void stats_file_bytes(int stage, const char *s)
+{
+   struct stat st;
+
+   if (stage < 0 || stage >= ST_MAX)
+      return;
+
+   if (stat(s, &st) == -1)
+   {
+      log_errno(LOG_WARN, "stat()");
+      return;
+   }
+   // directories are accounted by the exporter with stats_add_bytes()
+   if (S_ISREG(st.st_mode))
+      stats_.stage[stage].bytes += st.st_size;
+}
+
+
+/*! Add bytes written by a stage, e.g. the size of a directory of files.
+ * The function is thread safe.
+ */
+void stats_add_bytes(int stage, long bytes)
+{
+   if (stage < 0 || stage >= ST_MAX)
+      return;
+   __atomic_add_fetch(&stats_.stage[stage].bytes, bytes, __ATOMIC_RELAXED);
+}
+
+
+/*! Add hardware counters of other threads to a stage, the counters of the
+ * stages are read in the main thread only.
+ */
+void stats_add_hw(int stage, const hwcnt_t *hw)
+{
+   if (stage < 0 || stage >= ST_MAX)
+      return;
+   perfctr_add(&stats_.stage[stage].hw, &(hwcnt_t) {{0}}, hw);
+}
+
+
+/*! Add the counters of an output file.
+ *  @param stall Time in ns the exporter waited for the writer.
+ *  @param writes Number of buffers written.
+ */
+void stats_output(long stall, long writes)
+{
+   __atomic_add_fetch(&stats_.out_stall, stall, __ATOMIC_RELAXED);
+   __atomic_add_fetch(&stats_.out_writes, writes, __ATOMIC_RELAXED);
+}
+
+
+/*! Add the counters of src to dst.
+ */
+void stats_layer_add(layer_stat_t *dst, const layer_stat_t *src)
+{
+   dst->pixels += src->pixels;
+   dst->seeds += src->seeds;
+   dst->contours += src->contours;
+   dst->discarded += src->discarded;
+   dst->points += src->points;
+   dst->reduced += src->reduced;
+   perfctr_add(&dst->hw, &(hwcnt_t) {{0}}, &src->hw);
+}
+
+
+static void stats_total(layer_stat_t *tot)
+{
+   memset(tot, 0, sizeof(*tot));
+   for (int i = 0; i < stats_.nlayers; i++)
+      stats_layer_add(tot, &stats_.layer[i]);
+}
+
+
+static double rate(uint64_t a, long b)
+{
+   return b > 0 ? (double) a / b : 0;
+}
+
+
+/*! Output the hardware counters as JSON members together with the rates per
+ * pixel and per vertex.
+ */
+static void json_hw(FILE *f, const hwcnt_t *hw, long pixels, long vertices)
+{
+   if (!perfctr_enabled())
+      return;
+
+   for (int i = 0; i < HW_MAX; i++)
+      fprintf(f, ", \"%s\": %lu", perfctr_name(i), (unsigned long) hw->c[i]);
+   fprintf(f, ", \"ipc\": %.3f", rate(hw->c[HW_INSTR], hw->c[HW_CYCLES]));
+   for (int i = 0; i < HW_MAX; i++)
+      fprintf(f, ", \"%s_per_pixel\": %.4f", perfctr_name(i), rate(hw->c[i], pixels));
+   if (vertices >= 0)
+      for (int i = 0; i < HW_MAX; i++)
+         fprintf(f, ", \"%s_per_vertex\": %.2f", perfctr_name(i), rate(hw->c[i], vertices));
+}
+
+
+static void json_layer(FILE *f, const layer_stat_t *ls)
+{
+   fprintf(f, "\"pixels\": %ld, \"seeds\": %ld, \"contours\": %ld, \"discarded\": %ld, \"points\": %ld, \"reduced\": %ld",
+         ls->pixels, ls->seeds, ls->contours, ls->discarded, ls->points, ls->reduced);
+}
+
+
+static void stats_json(FILE *f)
+{
+   layer_stat_t tot;
+   int i;
+
+   stats_total(&tot);
+   fprintf(f, "{\n  \"version\": \"%s\",\n  \"width\": %d,\n  \"height\": %d,\n  \"hwcounters\": %s,\n  \"stages\": {\n",
+         TRACER_VERSION, stats_.width, stats_.height, perfctr_enabled() ? "true" : "false");
+   for (i = 0; i < ST_MAX; i++)
+   {
+      fprintf(f, "    \"%s\": {\"calls\": %ld, \"wall\": %.6f, \"cpu\": %.6f, \"bytes\": %ld",
+            stname_[i], stats_.stage[i].calls, stats_.stage[i].wall, stats_.stage[i].cpu, stats_.stage[i].bytes);
+      json_hw(f, &stats_.stage[i].hw, (long) stats_.width * stats_.height, i == ST_REDUCE ? tot.points : -1);
+      fprintf(f, "}%s\n", i < ST_MAX - 1 ? "," : "");
+   }
+
+   fprintf(f, "  },\n  \"output\": {\"stall\": %.6f, \"writes\": %ld},\n  \"layers\": [\n",
+         stats_.out_stall / 1E9, stats_.out_writes);
+   for (i = 0; i < stats_.nlayers; i++)
+   {
+      fprintf(f, "    {\"v\": %d, \"wall\": %.6f, \"cpu\": %.6f, ", stats_.layer[i].v, stats_.layer[i].wall, stats_.layer[i].cpu);
+      json_layer(f, &stats_.layer[i]);
+      json_hw(f, &stats_.layer[i].hw, stats_.layer[i].pixels, stats_.layer[i].points);
+      fprintf(f, "}%s\n", i < stats_.nlayers - 1 ? "," : "");
+   }
+
+   fprintf(f, "  ],\n  \"total\": {");
+   json_layer(f, &tot);
+   json_hw(f, &tot.hw, tot.pixels, tot.points);
+   fprintf(f, "},\n  \"memory\": ");
+   mt_json(f);
+   fprintf(f, "\n}\n");
+}
+
+
+static void text_hw(const hwcnt_t *hw, long pixels, long vertices)
+{
+   if (!perfctr_enabled())
+      return;
+
+   log_msg(LOG_INFO, "   ipc = %.2f, cycles/pixel = %.2f, llc misses/pixel = %.4f, branch misses/pixel = %.4f, cycles/vertex = %.1f",
+         rate(hw->c[HW_INSTR], hw->c[HW_CYCLES]), rate(hw->c[HW_CYCLES], pixels), rate(hw->c[HW_LLC_MISS], pixels),
+         rate(hw->c[HW_BRANCH_MISS], pixels), rate(hw->c[HW_CYCLES], vertices));
+}
+
+
+static void stats_text(void)
+{
+   layer_stat_t tot;
+   int i;
+
+   log_msg(LOG_INFO, "image %dx%d", stats_.width, stats_.height);
+   for (i = 0; i < ST_MAX; i++)
+      if (stats_.stage[i].calls)
+         log_msg(LOG_INFO, "%-12s calls = %ld, wall = %.3fs, cpu = %.3fs, bytes = %ld",
+               stname_[i], stats_.stage[i].calls, stats_.stage[i].wall, stats_.stage[i].cpu, stats_.stage[i].bytes);
+   if (stats_.out_writes)
+      log_msg(LOG_INFO, "output       writes = %ld, stall = %.3fs", stats_.out_writes, stats_.out_stall / 1E9);
+
+   for (i = 0; i < stats_.nlayers; i++)
+   {
+      log_msg(LOG_INFO, "layer v = %3d, wall = %.3fs, pixels = %ld, seeds = %ld, contours = %ld, discarded = %ld, points = %ld/%ld",
+            stats_.layer[i].v, stats_.layer[i].wall, stats_.layer[i].pixels, stats_.layer[i].seeds,
+            stats_.layer[i].contours, stats_.layer[i].discarded, stats_.layer[i].reduced, stats_.layer[i].points);
+      text_hw(&stats_.layer[i].hw, stats_.layer[i].pixels, stats_.layer[i].points);
+   }
+
+   stats_total(&tot);
+   log_msg(LOG_INFO, "total pixels = %ld, seeds = %ld, contours = %ld, discarded = %ld, points = %ld/%ld",
+         tot.pixels, tot.seeds, tot.contours, tot.discarded, tot.reduced, tot.points);
+   text_hw(&tot.hw, tot.pixels, tot.points);
+   mt_log(LOG_INFO);
+}
+
+
+/*! Output the statistics.
+ *  @param f Output stream for the JSON format.
+ *  @param fmt Output format, either STATS_TEXT (which is logged) or
+ *  STATS_JSON.
+ */
+void stats_report(FILE *f, int fmt)
+{
+   switch (fmt)
+   {
+      case STATS_TEXT:
+         stats_text();
+         break;
+
+      case STATS_JSON:
+         stats_json(f);
+         break;
+   }
+}
+
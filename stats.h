@@ -0,0 +1,104 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file stats.h
+ * This file contains the declarations for the run-time statistics of the
+ * individual stages of the tracer.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <time.h>
+
+#include "perfctr.h"
+
+
+enum {ST_DECODE, ST_MEMPREP, ST_STRETCH, ST_SCAN, ST_REDUCE, ST_CLEAR, ST_LOD, ST_BEZIER, ST_EXPORT_OSM, ST_EXPORT_SVG,
+   ST_EXPORT_GEOJSON, ST_EXPORT_WKB, ST_EXPORT_FGB, ST_EXPORT_MVT, ST_MAX};
+
+enum {STATS_NONE, STATS_TEXT, STATS_JSON};
+
+
+typedef struct stage_stat
+{
+   //! number of times the stage was entered
+   long calls;
+   //! accumulated wall clock and cpu time in seconds
+   double wall, cpu;
+   //! number of bytes produced by the stage (exporters only)
+   long bytes;
+   //! hardware counters
+   hwcnt_t hw;
+   //! start time and counters of the current call
+   struct timespec wall0, cpu0;
+   hwcnt_t hw0;
+} stage_stat_t;
+
+typedef struct layer_stat
+{
+   int v;
+   double wall, cpu;
+   //! number of pixels visited by next_unvisited()
+   long pixels;
+   //! number of seed pixels handed to scan()
+   long seeds;
+   //! number of contours stored
+   long contours;
+   //! number of contours discarded because of their size
+   long discarded;
+   //! number of points before and after reduce()
+   long points, reduced;
+   hwcnt_t hw;
+   //! start time and counters of the layer
+   struct timespec wall0, cpu0;
+   hwcnt_t hw0;
+} layer_stat_t;
+
+typedef struct stats
+{
+   int width, height;
+   stage_stat_t stage[ST_MAX];
+   //! time the exporters waited for the output writer in ns, and number
+   //! of buffers written
+   long out_stall, out_writes;
+   layer_stat_t *layer;
+   int nlayers;
+} stats_t;
+
+
+extern stats_t stats_;
+//! layer currently scanned by this thread, NULL outside of scan_layer()
+extern __thread layer_stat_t *stats_cur_;
+
+void stats_start(int stage);
+void stats_stop(int stage);
+layer_stat_t *stats_layer_start(int v);
+void stats_layer_stop(layer_stat_t *ls);
+void stats_layer_add(layer_stat_t *dst, const layer_stat_t *src);
+void stats_file_bytes(int stage, const char *s);
+void stats_add_bytes(int stage, long bytes);
+void stats_add_hw(int stage, const hwcnt_t *hw);
+void stats_output(long stall, long writes);
+void stats_report(FILE *f, int fmt);
+
+#endif
+
@@ -0,0 +1,1706 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file difftest.c
+ * This file contains the differential test of the tracing engines. Each
+ * engine traces the same images as the frozen reference implementation of
+ * reftrace.c and the results are compared vertex by vertex. The images are
+ * generated by rastergen() and by a random fuzzer, additionally the image
+ * files given on the command line are used.
+ * Before comparison the contours are canonicalized, i.e. they are sorted by
+ * layer and start point, thus engines which find the contours in a different
+ * order (e.g. parallel engines) can be validated as well.
+ * The effective areas of lod_areas() are compared to a naive implementation
+ * of Visvalingam-Whyatt on the contours of the reference. The FlatGeobuf and
+ * COPY exports are parsed back and compared to the vertices of geo_next(),
+ * the vector tiles are decoded. The images are written as PGM/PPM and raw
+ * files and loaded with rawmem() again.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include <unistd.h>
+#include <limits.h>
+#include <dirent.h>
+
+#include "scan.h"
+#include "memimg.h"
+#include "smlog.h"
+#include "memtrack.h"
+#include "reftrace.h"
+#include "stats.h"
+
+#define FUZZ_CNT 300
+#define FUZZ_MAXSIZE 48
+#define TOLERANCE 1E-6
+//! number of threads of the strip engine
+#define STRIPS 4
+//! maximum error of the Bezier curves
+#define BEZ_ERR 1.0
+//! number of segments of the polyline of a Bezier curve
+#define BEZ_SAMPLES 256
+//! coordinate range and buffer of a vector tile, see wmvt.c
+#define MVT_EXTENT 4096
+#define MVT_BUFFER 64
+
+
+typedef struct engine
+{
+   const char *name;
+   //! trace all layers, the values l[].v are already set
+   int (*trace)(layer_t *l, int nlayers, memimg_t *mem);
+   //! tolerance of the subpixel coordinates, 0 means the default
+   double tol;
+} engine_t;
+
+typedef struct contour
+{
+   int layer;
+   int n;
+   pos_t *p;
+} contour_t;
+
+
+static double tol_ = TOLERANCE;
+static int verbose_;
+
+
+static int eng_scan_layer(layer_t *l, int nlayers, memimg_t *mem)
+{
+   for (int j = 0; j < nlayers; j++)
+      if (scan_layer(&l[j], mem) == -1)
+         return -1;
+   return 0;
+}
+
+
+static int eng_strips(layer_t *l, int nlayers, memimg_t *mem)
+{
+   for (int j = 0; j < nlayers; j++)
+      if (scan_layer_mt(&l[j], mem, STRIPS) == -1)
+         return -1;
+   return 0;
+}
+
+
+/*! The strip engine with as many strips as the height of the image allows,
+ * i.e. with a seam every few rows.
+ */
+static int eng_strips_max(layer_t *l, int nlayers, memimg_t *mem)
+{
+   for (int j = 0; j < nlayers; j++)
+      if (scan_layer_mt(&l[j], mem, mem->height) == -1)
+         return -1;
+   return 0;
+}
+
+
+/*! The strip engine on the rows of the components of each level only, see
+ * layer_rows().
+ */
+static int eng_maxtree(layer_t *l, int nlayers, memimg_t *mem)
+{
+   maxtree_t mt;
+   int err = 0;
+
+   if (maxtree_build(&mt, mem) == -1)
+      return -1;
+
+   for (int j = 0; j < nlayers && !err; j++)
+   {
+      maxtree_query(&mt, l[j].v, NULL, &l[j].y0, &l[j].y1);
+      l[j].y1++;
+      err = scan_layer_mt(&l[j], mem, STRIPS);
+   }
+
+   maxtree_free(&mt);
+   return err;
+}
+
+
+static int eng_chain(layer_t *l, int nlayers, memimg_t *mem)
+{
+   for (int j = 0; j < nlayers; j++)
+   {
+      l[j].compact = 1;
+      if (scan_layer(&l[j], mem) == -1)
+         return -1;
+   }
+   return 0;
+}
+
+
+/*! Trace a modified copy of the image first and then the image itself
+ * incrementally from the contours of the copy. The copy differs in a block
+ * of pixels in the middle of the image.
+ */
+static int eng_retrace(layer_t *l, int nlayers, memimg_t *mem)
+{
+   layer_t prev[MAXL];
+   memimg_t pmem;
+   tilemap_t tm;
+   int err = 0;
+
+   if (memimg_copy(mem, &pmem) == -1)
+      return -1;
+   for (int y = pmem.height / 3; y < pmem.height / 2; y++)
+      for (int x = pmem.width / 3; x < pmem.width / 2; x++)
+         memimg_put(&pmem, x, y, maxval_ - memimg_get(&pmem, x, y));
+
+   memcpy(prev, l, nlayers * sizeof(*l));
+   for (int j = 0; j < nlayers && !err; j++)
+   {
+      if ((prev[j].rec = mt_calloc(MT_LAYER, 1, sizeof(*prev[j].rec))) == NULL)
+         err = -1;
+      else
+      {
+         err = scan_layer(&prev[j], &pmem);
+         journal_rebase(&prev[j].rec->j, pmem.mem, mem->mem);
+      }
+   }
+
+   if (!err && (err = tiles_init(&tm, mem->width, mem->height, 8)) != -1)
+   {
+      tiles_diff(&tm, &pmem, mem);
+      for (int j = 0; j < nlayers && !err; j++)
+         err = retrace_layer(&l[j], &prev[j], mem, &tm);
+      tiles_free(&tm);
+   }
+
+   for (int j = 0; j < nlayers; j++)
+      free_layer(&prev[j]);
+   memimg_free(&pmem);
+   return err;
+}
+
+
+/*! Store the traced layers in the cache and load them again. The values of
+ * the single point contours must be restored in the image of cache_load().
+ */
+static int cache_roundtrip(layer_t *l, int nlayers, memimg_t *mem)
+{
+   char dir[] = "/tmp/difftestXXXXXX", path[64];
+   layer_t c[MAXL];
+   chain_iter_t it;
+   memimg_t cmem;
+   pos_t p;
+   int err = 0;
+
+   if (mkdtemp(dir) == NULL)
+      return -1;
+   if (cache_save(dir, "difftest", l, nlayers, mem) == -1 || cache_load(dir, "difftest", c, &cmem) != nlayers)
+      err = -1;
+   snprintf(path, sizeof(path), "%s/difftest.trc", dir);
+   unlink(path);
+   rmdir(dir);
+   if (err)
+      return -1;
+
+   for (int j = 0; j < nlayers; j++)
+      for (int i = 0; i < c[j].plist_cnt; i++)
+      {
+         contour_iter(&it, &c[j], i);
+         if (c[j].n[i] == 1 && contour_next(&it, &p)
+               && memimg_get(&cmem, p.x, p.y) != (memimg_get(mem, p.x, p.y) & ~VALL))
+            err = -1;
+      }
+
+   for (int j = 0; j < nlayers; j++)
+      free_layer(&l[j]);
+   memcpy(l, c, nlayers * sizeof(*l));
+   memimg_free(&cmem);
+   return err;
+}
+
+
+static int eng_cache(layer_t *l, int nlayers, memimg_t *mem)
+{
+   return eng_scan_layer(l, nlayers, mem) == -1 ? -1 : cache_roundtrip(l, nlayers, mem);
+}
+
+
+static int eng_cache_chain(layer_t *l, int nlayers, memimg_t *mem)
+{
+   return eng_chain(l, nlayers, mem) == -1 ? -1 : cache_roundtrip(l, nlayers, mem);
+}
+
+
+//! list of engines which are compared to the reference
+static const engine_t engine_[] =
+{
+   {"scan_layer", eng_scan_layer, 0},
+   {"strips", eng_strips, 0},
+   {"strips_max", eng_strips_max, 0},
+   {"maxtree", eng_maxtree, 0},
+   // subpixel offsets are quantised to 1/127
+   {"chain", eng_chain, 0.5 / 127 + TOLERANCE},
+   {"retrace", eng_retrace, 0},
+   {"cache", eng_cache, 0},
+   {"cache_chain", eng_cache_chain, 0.5 / 127 + TOLERANCE},
+   {NULL, NULL, 0}
+};
+
+
+static void free_layers(layer_t *l, int nlayers)
+{
+   for (int j = 0; j < nlayers; j++)
+   {
+      for (int i = 0; i < l[j].plist_cnt; i++)
+      {
+         mt_free(l[j].plist[i]);
+         if (l[j].compact)
+            chain_free(&l[j].chain[i]);
+      }
+      mt_free(l[j].plist);
+      mt_free(l[j].n);
+      mt_free(l[j].chain);
+   }
+}
+
+
+static int poscmp(const pos_t *a, const pos_t *b)
+{
+   if (a->y != b->y)
+      return a->y < b->y ? -1 : 1;
+   if (a->x != b->x)
+      return a->x < b->x ? -1 : 1;
+   return 0;
+}
+
+
+static int ccmp(const void *a, const void *b)
+{
+   const contour_t *c = a, *d = b;
+   int r;
+
+   if (c->layer != d->layer)
+      return c->layer - d->layer;
+   if (c->n && d->n && (r = poscmp(c->p, d->p)))
+      return r;
+   if (c->n != d->n)
+      return c->n - d->n;
+   for (int i = 1; i < c->n; i++)
+      if ((r = poscmp(&c->p[i], &d->p[i])))
+         return r;
+   return 0;
+}
+
+
+/*! Rotate a closed contour such that it starts at its lowest left vertex.
+ * The duplicate closing vertex is kept at the end.
+ */
+static void rotate(contour_t *c)
+{
+   pos_t *t;
+   int i, m, n;
+
+   if (c->n < 3 || poscmp(&c->p[0], &c->p[c->n - 1]))
+      return;
+
+   n = c->n - 1;
+   for (m = 0, i = 1; i < n; i++)
+      if (poscmp(&c->p[i], &c->p[m]) < 0)
+         m = i;
+
+   if (!m || (t = malloc(n * sizeof(*t))) == NULL)
+      return;
+
+   for (i = 0; i < n; i++)
+      t[i] = c->p[(i + m) % n];
+   memcpy(c->p, t, n * sizeof(*t));
+   c->p[n] = c->p[0];
+   free(t);
+}
+
+
+/*! Copy all contours of all layers into a sorted list of canonical contours.
+ *  @return Number of contours or -1 on error.
+ */
+static int canonicalize(const layer_t *l, int nlayers, contour_t **cl)
+{
+   chain_iter_t it;
+   int i, j, n, k, m;
+
+   for (n = 0, j = 0; j < nlayers; j++)
+      n += l[j].plist_cnt;
+
+   if ((*cl = calloc(n + 1, sizeof(**cl))) == NULL)
+      return -1;
+
+   for (k = 0, j = 0; j < nlayers; j++)
+      for (i = 0; i < l[j].plist_cnt; i++, k++)
+      {
+         (*cl)[k].layer = j;
+         (*cl)[k].n = l[j].n[i];
+         if (((*cl)[k].p = malloc(((*cl)[k].n + 1) * sizeof(pos_t))) == NULL)
+            return -1;
+         contour_iter(&it, &l[j], i);
+         for (m = 0; contour_next(&it, &(*cl)[k].p[m]); m++);
+         rotate(&(*cl)[k]);
+      }
+
+   qsort(*cl, n, sizeof(**cl), ccmp);
+   return n;
+}
+
+
+static void free_contours(contour_t *cl, int n)
+{
+   for (int i = 0; i < n && cl != NULL; i++)
+      free(cl[i].p);
+   free(cl);
+}
+
+
+/*! Compare two canonical contour lists.
+ *  @param tol Tolerance of the subpixel coordinates.
+ *  @return 0 if they are equal, otherwise -1. The first difference is
+ *  reported.
+ */
+static int compare(const char *name, const contour_t *ref, int nref, const contour_t *cl, int n, double tol)
+{
+   int i, k;
+
+   if (nref != n)
+   {
+      printf("FAIL %s: %d contours, reference has %d\n", name, n, nref);
+      return -1;
+   }
+
+   for (i = 0; i < n; i++)
+   {
+      if (ref[i].layer != cl[i].layer || ref[i].n != cl[i].n)
+      {
+         printf("FAIL %s: contour %d: layer %d, %d points, reference layer %d, %d points\n",
+               name, i, cl[i].layer, cl[i].n, ref[i].layer, ref[i].n);
+         return -1;
+      }
+
+      for (k = 0; k < cl[i].n; k++)
+      {
+         if (poscmp(&ref[i].p[k], &cl[i].p[k]) || fabs(ref[i].p[k].xf - cl[i].p[k].xf) > tol || fabs(ref[i].p[k].yf - cl[i].p[k].yf) > tol)
+         {
+            printf("FAIL %s: contour %d (layer %d), vertex %d: %d/%d (%f/%f), reference %d/%d (%f/%f)\n",
+                  name, i, cl[i].layer, k, cl[i].p[k].x, cl[i].p[k].y, cl[i].p[k].xf, cl[i].p[k].yf,
+                  ref[i].p[k].x, ref[i].p[k].y, ref[i].p[k].xf, ref[i].p[k].yf);
+            return -1;
+         }
+      }
+   }
+
+   return 0;
+}
+
+
+static void set_levels(layer_t *l, int nlayers)
+{
+   memset(l, 0, nlayers * sizeof(*l));
+   for (int j = 0; j < nlayers; j++)
+      l[j].v = maxval_ - maxval_ / (nlayers + 1) * (j + 1);
+}
+
+
+/*! Count the 8-connected components of the pixels >= v by flood filling.
+ */
+static int count_components(const memimg_t *mem, int v, long *area)
+{
+   int n = mem->width * mem->height, *stack, *seen, sp, p, x, y, cnt = 0;
+
+   *area = 0;
+   stack = malloc(n * sizeof(*stack));
+   seen = calloc(n, sizeof(*seen));
+   if (stack == NULL || seen == NULL)
+   {
+      free(stack);
+      free(seen);
+      return -1;
+   }
+
+   for (int i = 0; i < n; i++)
+   {
+      if (seen[i] || mem->mem[i] < v)
+         continue;
+      cnt++;
+      seen[i] = 1;
+      for (stack[0] = i, sp = 1; sp;)
+      {
+         p = stack[--sp];
+         (*area)++;
+         x = p % mem->width;
+         y = p / mem->width;
+         for (int dy = -1; dy <= 1; dy++)
+            for (int dx = -1; dx <= 1; dx++)
+            {
+               if (x + dx < 0 || x + dx >= mem->width || y + dy < 0 || y + dy >= mem->height)
+                  continue;
+               p = (y + dy) * mem->width + x + dx;
+               if (!seen[p] && mem->mem[p] >= v)
+               {
+                  seen[p] = 1;
+                  stack[sp++] = p;
+               }
+            }
+      }
+   }
+
+   free(stack);
+   free(seen);
+   return cnt;
+}
+
+
+/*! Compare the components of the max-tree to the flood filled components.
+ * @return 0 if they are equal, otherwise -1.
+ */
+static int check_maxtree(const char *name, const memimg_t *src, int nlayers)
+{
+   layer_t l[MAXL];
+   maxtree_t mt;
+   long area, rarea;
+   int n, rn, y0, y1, ry0, ry1, err = 0;
+
+   if (maxtree_build(&mt, src) == -1)
+   {
+      printf("FAIL maxtree/%s: maxtree_build() failed\n", name);
+      return -1;
+   }
+
+   set_levels(l, nlayers);
+   for (int j = 0; j < nlayers && !err; j++)
+   {
+      n = maxtree_query(&mt, l[j].v, &area, &y0, &y1);
+      rn = count_components(src, l[j].v, &rarea);
+      if (n != rn || area != rarea)
+      {
+         printf("FAIL maxtree/%s: level %d: %d components, %ld pixels, flood fill %d components, %ld pixels\n",
+               name, l[j].v, n, area, rn, rarea);
+         err = -1;
+      }
+
+      ry0 = src->height;
+      ry1 = -1;
+      for (int i = 0; i < src->width * src->height; i++)
+         if (src->mem[i] >= l[j].v)
+         {
+            if (i / src->width < ry0)
+               ry0 = i / src->width;
+            ry1 = i / src->width;
+         }
+      if (!err && (y0 != ry0 || y1 != ry1))
+      {
+         printf("FAIL maxtree/%s: level %d: rows %d - %d, pixels in rows %d - %d\n", name, l[j].v, y0, y1, ry0, ry1);
+         err = -1;
+      }
+   }
+
+   maxtree_free(&mt);
+   return err;
+}
+
+
+/*! Calculate the effective areas of a contour naively with O(n^2): the
+ * vertex of the smallest triangle (the first one if several are equal) is
+ * removed until 2 vertices (4 if the contour is closed) are left.
+ */
+static int naive_areas(const pos_t *p, int n, int closed, float *area)
+{
+   int *prev, *next, m, best;
+   double a, ba, max = 0;
+
+   for (int i = 0; i < n; i++)
+      area[i] = HUGE_VALF;
+   if ((prev = malloc(2 * n * sizeof(*prev))) == NULL)
+      return -1;
+   next = prev + n;
+   for (int i = 0; i < n; i++)
+   {
+      prev[i] = i - 1;
+      next[i] = i + 1;
+   }
+
+   for (m = n - 2; m > (closed ? 2 : 0); m--)
+   {
+      best = -1;
+      ba = 0;
+      for (int i = next[0]; i < n - 1; i = next[i])
+      {
+         a = fabs((p[i].xf - p[prev[i]].xf) * (p[next[i]].yf - p[prev[i]].yf)
+               - (p[next[i]].xf - p[prev[i]].xf) * (p[i].yf - p[prev[i]].yf)) / 2;
+         if (best == -1 || a < ba)
+         {
+            best = i;
+            ba = a;
+         }
+      }
+      if (ba > max)
+         max = ba;
+      area[best] = max;
+      next[prev[best]] = next[best];
+      prev[next[best]] = prev[best];
+   }
+
+   free(prev);
+   return 0;
+}
+
+
+/*! Compare the effective areas of lod_areas() to those of naive_areas().
+ * @return 0 if they are equal, otherwise -1.
+ */
+static int check_lod(const char *name, const contour_t *cl, int n)
+{
+   float *area, *ref;
+   int closed, err = 0;
+
+   for (int k = 0; k < n && !err; k++)
+   {
+      if ((area = malloc(2 * cl[k].n * sizeof(*area) + 1)) == NULL)
+         return -1;
+      ref = area + cl[k].n;
+      closed = cl[k].n > 1 && !poscmp(&cl[k].p[0], &cl[k].p[cl[k].n - 1]);
+      if (lod_areas(cl[k].p, cl[k].n, closed, area) == -1 || naive_areas(cl[k].p, cl[k].n, closed, ref) == -1)
+         err = -1;
+      for (int i = 0; i < cl[k].n && !err; i++)
+         if (area[i] != ref[i])
+         {
+            printf("FAIL lod/%s: contour %d, vertex %d: area %g, naive %g\n", name, k, i, area[i], ref[i]);
+            err = -1;
+         }
+      free(area);
+   }
+   return err;
+}
+
+
+/*! Distance of a point to a cubic Bezier curve, which is approximated by
+ * a polyline of BEZ_SAMPLES segments.
+ */
+static double bez_dist(const double *b, double x, double y)
+{
+   double px = b[0], py = b[1], qx, qy, t, s, dx, dy, u, min = HUGE_VAL;
+
+   for (int i = 1; i <= BEZ_SAMPLES; i++, px = qx, py = qy)
+   {
+      t = (double) i / BEZ_SAMPLES;
+      s = 1 - t;
+      qx = s * s * s * b[0] + 3 * s * s * t * b[2] + 3 * s * t * t * b[4] + t * t * t * b[6];
+      qy = s * s * s * b[1] + 3 * s * s * t * b[3] + 3 * s * t * t * b[5] + t * t * t * b[7];
+      dx = qx - px;
+      dy = qy - py;
+      u = dx * dx + dy * dy > 0 ? ((x - px) * dx + (y - py) * dy) / (dx * dx + dy * dy) : 0;
+      u = u < 0 ? 0 : u > 1 ? 1 : u;
+      min = fmin(min, hypot(px + u * dx - x, py + u * dy - y));
+   }
+   return min;
+}
+
+
+/*! Fit Bezier curves to the contours with bezier_fit(). The segments must
+ * end exactly at their vertices and all vertices in between must be within
+ * the error of the segment.
+ * @return 0 if the curves are correct, otherwise -1.
+ */
+static int check_bezier(const char *name, const contour_t *cl, int n)
+{
+   curve_t c;
+   double d;
+   int closed, err = 0;
+
+   for (int k = 0; k < n && !err; k++)
+   {
+      closed = cl[k].n > 1 && !poscmp(&cl[k].p[0], &cl[k].p[cl[k].n - 1]);
+      if (bezier_fit(cl[k].p, cl[k].n, closed, BEZ_ERR, &c) == -1)
+         return -1;
+      if (c.n && (c.p[0] != cl[k].p[0].xf || c.p[1] != cl[k].p[0].yf || c.idx[c.n - 1] != cl[k].n - 1))
+      {
+         printf("FAIL bezier/%s: contour %d is not covered\n", name, k);
+         err = -1;
+      }
+      for (int s = 0, first = 0; s < c.n && !err; first = c.idx[s++])
+      {
+         if (c.idx[s] <= first || c.p[6 * s + 6] != cl[k].p[c.idx[s]].xf || c.p[6 * s + 7] != cl[k].p[c.idx[s]].yf)
+         {
+            printf("FAIL bezier/%s: contour %d, segment %d does not end at vertex %d\n", name, k, s, c.idx[s]);
+            err = -1;
+         }
+         for (int i = first + 1; i < c.idx[s] && !err; i++)
+            if ((d = bez_dist(&c.p[6 * s], cl[k].p[i].xf, cl[k].p[i].yf)) > BEZ_ERR + 0.05)
+            {
+               printf("FAIL bezier/%s: contour %d, vertex %d: distance %g\n", name, k, i, d);
+               err = -1;
+            }
+      }
+      curve_free(&c);
+   }
+   return err;
+}
+
+
+/*! Count the pixels which differ in two images.
+ * @return The number of pixels, -1 if the sizes differ.
+ */
+static long diff_pixels(const memimg_t *a, const memimg_t *b)
+{
+   long n = 0;
+
+   if (a->width != b->width || a->height != b->height)
+      return -1;
+   for (long i = 0; i < (long) a->width * a->height; i++)
+      n += a->mem[i] != b->mem[i];
+   return n;
+}
+
+
+/*! Decode a PNG file with pngmem() and compare it to the values of the
+ * cairo decoder.
+ * @param src Image decoded by cairomem() and prepared with memprep().
+ * @return 0 if the values are equal, otherwise -1.
+ */
+static int check_decode(const char *name, const memimg_t *src)
+{
+   memimg_t mem;
+   long n;
+
+   if (pngmem(&mem, name, c2grey, NULL, NULL, NULL) == -1)
+   {
+      printf("FAIL pngmem/%s: pngmem() failed\n", name);
+      return -1;
+   }
+
+   n = diff_pixels(&mem, src);
+   memimg_free(&mem);
+
+   if (n)
+   {
+      printf("FAIL pngmem/%s: %ld pixels differ\n", name, n);
+      return -1;
+   }
+   return 0;
+}
+
+
+//! vertices of a feature of the exports, see features()
+typedef struct feature
+{
+   int n;
+   double ele;
+   double *xy;
+   int used;
+} feature_t;
+
+//! protobuf wire types
+enum {PB_VARINT, PB_I64, PB_LEN};
+//! geometry types and commands of MVT
+enum {MVT_POINT = 1, MVT_LINESTRING};
+enum {MVT_MOVETO = 1, MVT_LINETO};
+
+//! decoded vector tiles, see check_mvt()
+static struct
+{
+   feature_t *ft;
+   int cnt;
+   long tiles, features, moveto, lineto;
+   const char *err;
+} mvt_;
+
+
+static uint64_t get_le(const uint8_t *b, int n)
+{
+   uint64_t v = 0;
+
+   for (int i = n - 1; i >= 0; i--)
+      v = v << 8 | b[i];
+   return v;
+}
+
+
+static uint64_t get_be(const uint8_t *b, int n)
+{
+   uint64_t v = 0;
+
+   for (int i = 0; i < n; i++)
+      v = v << 8 | b[i];
+   return v;
+}
+
+
+static double get_dbl(uint64_t v)
+{
+   double d;
+
+   memcpy(&d, &v, sizeof(d));
+   return d;
+}
+
+
+static void free_features(feature_t *ft, int n)
+{
+   for (int i = 0; ft != NULL && i < n; i++)
+      free(ft[i].xy);
+   free(ft);
+}
+
+
+/*! Collect the features of all layers in the order of the layers with the
+ * vertices of geo_next().
+ * @return The number of features, or -1 on error.
+ */
+static int features(const layer_t *l, int nlayers, const memimg_t *mem, feature_t **ft)
+{
+   geo_iter_t g;
+   feature_t *f;
+   int cnt = 0, n;
+
+   for (int j = 0; j < nlayers; j++)
+      cnt += l[j].plist_cnt;
+   if ((*ft = f = calloc(cnt + 1, sizeof(*f))) == NULL)
+      return -1;
+
+   for (int j = 0; j < nlayers; j++)
+      for (int k = 0; k < l[j].plist_cnt; k++)
+      {
+         if (!(n = geo_iter(&g, &l[j], k, mem)))
+            continue;
+         if ((f->xy = malloc(2 * n * sizeof(*f->xy))) == NULL)
+         {
+            free_features(*ft, f - *ft);
+            return -1;
+         }
+         f->n = n;
+         f->ele = geo_ele(&l[j], k, n, mem);
+         for (int i = 0; geo_next(&g, &f->xy[2 * i], &f->xy[2 * i + 1]); i++);
+         f++;
+      }
+
+   return f - *ft;
+}
+
+
+/*! Read a file into memory.
+ * @param len Pointer to a variable which receives the size of the file.
+ * @return The contents of the file, or NULL on error.
+ */
+static uint8_t *read_file(const char *name, long *len)
+{
+   uint8_t *b;
+   FILE *f;
+
+   if ((f = fopen(name, "r")) == NULL)
+      return NULL;
+   fseek(f, 0, SEEK_END);
+   *len = ftell(f);
+   rewind(f);
+   if ((b = malloc(*len + 1)) != NULL && fread(b, 1, *len, f) != (size_t) *len)
+   {
+      free(b);
+      b = NULL;
+   }
+   fclose(f);
+   return b;
+}
+
+
+/*! Export all layers into a temporary file and read it back.
+ * @param len Pointer to a variable which receives the size of the file.
+ * @return The contents of the file, or NULL on error.
+ */
+static uint8_t *export_read(int (*export)(const layer_t*, const char*, int, memimg_t*), const layer_t *l, int nlayers, memimg_t *mem, long *len)
+{
+   char name[] = "/tmp/difftestXXXXXX";
+   uint8_t *b = NULL;
+   int fd;
+
+   if ((fd = mkstemp(name)) == -1)
+      return NULL;
+   close(fd);
+
+   if (export(l, name, nlayers, mem) != -1)
+      b = read_file(name, len);
+   unlink(name);
+   return b;
+}
+
+
+/*! Return the position of field id of the flatbuffer table at t in the
+ * buffer b of len bytes, or 0 if it is not present.
+ */
+static long fb_field(const uint8_t *b, long len, long t, int id)
+{
+   long vt;
+
+   if (t <= 0 || t + 4 > len || (vt = t - (int32_t) get_le(b + t, 4)) < 0 || vt + 4 > len)
+      return 0;
+   if (4 + 2 * id >= (long) get_le(b + vt, 2) || vt + 6 + 2 * id > len)
+      return 0;
+   return get_le(b + vt + 4 + 2 * id, 2) ? t + (long) get_le(b + vt + 4 + 2 * id, 2) : 0;
+}
+
+
+/*! Follow the offset of a table or vector at position p, the number of
+ * elements of a vector is at the returned position.
+ * @return The position or 0 if it is outside of the buffer.
+ */
+static long fb_deref(const uint8_t *b, long len, long p)
+{
+   if (p <= 0 || p + 4 > len || (p += get_le(b + p, 4)) + 4 > len)
+      return 0;
+   return p;
+}
+
+
+/*! Find the unused feature with the vertices xy.
+ */
+static feature_t *find_feature(feature_t *ft, int cnt, const uint8_t *xy, int n, double ele)
+{
+   for (int i = 0; i < cnt; i++)
+   {
+      if (ft[i].used || ft[i].n != n || ft[i].ele != ele)
+         continue;
+      for (int k = 0; k < 2 * n; k++)
+         if (get_dbl(get_le(xy + 8 * k, 8)) != ft[i].xy[k])
+            goto next;
+      ft[i].used = 1;
+      return &ft[i];
+next:
+      ;
+   }
+   return NULL;
+}
+
+
+/*! Parse a FlatGeobuf file of export_fgb() and compare its header, the
+ * leaves of its index, and its features to the vertices of geo_next().
+ * @return NULL on success, otherwise a message.
+ */
+static const char *parse_fgb(const uint8_t *b, long len, feature_t *ft, int cnt)
+{
+   static const uint8_t magic[] = {'f', 'g', 'b', 3, 'f', 'g', 'b', 1};
+   double env[4] = {INFINITY, INFINITY, -INFINITY, -INFINITY}, bb[4];
+   long h, p, v, ty, idx, pos, nn = 0, np, off;
+   int n;
+
+   if (len < 12 || memcmp(b, magic, sizeof(magic)))
+      return "bad magic";
+   if (!(h = fb_deref(b, len, 12)))
+      return "bad header";
+   if (!(p = fb_field(b, len, h, 8)) || (long) get_le(b + p, 8) != cnt)
+      return "wrong features_count";
+   if (!(p = fb_field(b, len, h, 9)) || get_le(b + p, 2) != (cnt ? 16U : 0U))
+      return "wrong index_node_size";
+   if (!(p = fb_field(b, len, h, 7)) || !(v = fb_deref(b, len, p)) || get_le(b + v, 4) != 1
+         || !(p = fb_deref(b, len, v + 4)) || !(v = fb_field(b, len, p, 0)) || !(v = fb_deref(b, len, v))
+         || get_le(b + v, 4) != 3 || memcmp(b + v + 4, "ele", 3)
+         || !(v = fb_field(b, len, p, 1)) || b[v] != 10)
+      return "wrong column";
+
+   for (int i = 0; i < cnt; i++)
+      for (int k = 0; k < 2 * ft[i].n; k++)
+      {
+         env[k & 1] = fmin(env[k & 1], ft[i].xy[k]);
+         env[2 + (k & 1)] = fmax(env[2 + (k & 1)], ft[i].xy[k]);
+      }
+   if (!(p = fb_field(b, len, h, 1)) || !(v = fb_deref(b, len, p)) || get_le(b + v, 4) != 4 || v + 36 > len)
+      return "missing envelope";
+   for (int i = 0; cnt && i < 4; i++)
+      if (get_dbl(get_le(b + v + 4 + 8 * i, 8)) != env[i])
+         return "wrong envelope";
+
+   // number of nodes of the index, there is at least one level above the
+   // leaves
+   if (cnt)
+   {
+      nn = np = cnt;
+      do
+      {
+         np = (np + 15) / 16;
+         nn += np;
+      }
+      while (np != 1);
+   }
+   idx = 12 + get_le(b + 8, 4);
+   pos = idx + 40 * nn;
+
+   for (long i = 0; i < cnt; i++)
+   {
+      // the leaves are the last nodes
+      off = idx + 40 * (nn - cnt + i);
+      if (pos + 8 > len || off + 40 > len || (long) get_le(b + off + 32, 8) != pos - idx - 40 * nn)
+         return "wrong offset of a leaf";
+      if (!(h = fb_deref(b, len, pos + 4)) || !(p = fb_field(b, len, h, 0)) || !(p = fb_deref(b, len, p))
+            || !(v = fb_field(b, len, p, 1)) || !(v = fb_deref(b, len, v)) || !(ty = fb_field(b, len, p, 6)))
+         return "bad feature";
+      n = get_le(b + v, 4) / 2;
+      if (b[ty] != (n == 1 ? 1 : 2))
+         return "wrong geometry type";
+      if (v + 4 + 16L * n > len || !(p = fb_field(b, len, h, 1)) || !(p = fb_deref(b, len, p))
+            || get_le(b + p, 4) != 10 || get_le(b + p + 4, 2))
+         return "bad properties";
+      if (find_feature(ft, cnt, b + v + 4, n, get_dbl(get_le(b + p + 6, 8))) == NULL)
+         return "feature not found";
+
+      for (int k = 0; k < 4; k++)
+         bb[k] = k < 2 ? INFINITY : -INFINITY;
+      for (int k = 0; k < 2 * n; k++)
+      {
+         bb[k & 1] = fmin(bb[k & 1], get_dbl(get_le(b + v + 4 + 8 * k, 8)));
+         bb[2 + (k & 1)] = fmax(bb[2 + (k & 1)], get_dbl(get_le(b + v + 4 + 8 * k, 8)));
+      }
+      for (int k = 0; k < 4; k++)
+         if (get_dbl(get_le(b + off + 8 * k, 8)) != bb[k])
+            return "wrong bounding box of a leaf";
+
+      pos += 4 + get_le(b + pos, 4);
+   }
+
+   return pos != len ? "trailing bytes" : NULL;
+}
+
+
+/*! Parse the binary COPY of export_wkb() and the text COPY of
+ * export_hexwkb() and compare their rows to the vertices of geo_next().
+ * @return NULL on success, otherwise a message.
+ */
+static const char *parse_wkb(const uint8_t *b, long len, const uint8_t *t, long tlen, const feature_t *ft, int cnt)
+{
+   static const char dig[] = "0123456789ABCDEF";
+   long pos = 19, wlen, i;
+   char ele[32];
+   const uint8_t *e;
+   int n;
+
+   if (len < 21 || memcmp(b, "PGCOPY\n\xff\r\n\0", 11))
+      return "bad signature";
+
+   for (int k = 0; k < cnt; k++, pos += wlen)
+   {
+      n = ft[k].n;
+      wlen = n == 1 ? 21 : 9 + 16 * n;
+      if (pos + 18 + wlen > len || get_be(b + pos, 2) != 2 || get_be(b + pos + 2, 4) != 8
+            || (long) get_be(b + pos + 14, 4) != wlen)
+         return "wrong length of a row";
+      if (get_dbl(get_be(b + pos + 6, 8)) != ft[k].ele)
+         return "wrong ele";
+      pos += 18;
+      if (b[pos] != 1 || get_le(b + pos + 1, 4) != (n == 1 ? 1U : 2U) || (n > 1 && get_le(b + pos + 5, 4) != (unsigned) n))
+         return "bad WKB";
+      for (i = 0; i < 2 * n; i++)
+         if (get_dbl(get_le(b + pos + wlen - 16 * n + 8 * i, 8)) != ft[k].xy[i])
+            return "wrong vertex";
+
+      // the same row as text
+      snprintf(ele, sizeof(ele), "%g\t", ft[k].ele);
+      if (tlen < (long) strlen(ele) + 2 * wlen + 1 || memcmp(t, ele, strlen(ele)))
+         return "wrong ele of the text";
+      t += strlen(ele);
+      tlen -= strlen(ele) + 2 * wlen + 1;
+      for (i = 0, e = b + pos; i < wlen; i++, e++, t += 2)
+         if (t[0] != dig[*e >> 4] || t[1] != dig[*e & 15])
+            return "wrong hex WKB";
+      if (*t++ != '\n')
+         return "wrong length of a text row";
+   }
+
+   if (pos + 2 != len || get_be(b + pos, 2) != 0xffff)
+      return "wrong trailer";
+   return tlen ? "trailing text" : NULL;
+}
+
+
+/*! Read a varint of a protobuf message at *pos.
+ * @return 0 on success, -1 if the message ends.
+ */
+static int pb_get(const uint8_t *b, long len, long *pos, uint64_t *v)
+{
+   *v = 0;
+   for (int s = 0; *pos < len && s < 64; s += 7)
+   {
+      *v |= (uint64_t) (b[*pos] & 0x7f) << s;
+      if (!(b[(*pos)++] & 0x80))
+         return 0;
+   }
+   return -1;
+}
+
+
+/*! Read the next field of a protobuf message at *pos. A varint is returned
+ * in v, the contents of a field of the wire type PB_I64 or PB_LEN start at
+ * *d and have *dlen bytes.
+ * @return The key (number and wire type) of the field, 0 at the end of the
+ * message, or -1 on error.
+ */
+static int pb_field(const uint8_t *b, long len, long *pos, uint64_t *v, long *d, long *dlen)
+{
+   uint64_t key;
+
+   if (*pos >= len)
+      return 0;
+   if (pb_get(b, len, pos, &key) == -1 || key >> 3 == 0)
+      return -1;
+
+   switch (key & 7)
+   {
+      case PB_VARINT:
+         return pb_get(b, len, pos, v) == -1 ? -1 : (int) key;
+
+      case PB_I64:
+         *dlen = 8;
+         break;
+
+      case PB_LEN:
+         if (pb_get(b, len, pos, v) == -1)
+            return -1;
+         *dlen = *v;
+         break;
+
+      default:
+         return -1;
+   }
+
+   if (*dlen < 0 || *dlen > len - *pos)
+      return -1;
+   *d = *pos;
+   *pos += *dlen;
+   return key;
+}
+
+
+/*! Check a value of the layer of a vector tile, it must be the ele of a
+ * feature.
+ * @return NULL on success, otherwise a message.
+ */
+static const char *parse_value(const uint8_t *b, long len)
+{
+   long pos = 0, d, dlen;
+   uint64_t v;
+   double ele;
+   int found = 0;
+
+   if (pb_field(b, len, &pos, &v, &d, &dlen) != (3 << 3 | PB_I64) || pos != len)
+      return "bad value";
+   ele = get_dbl(get_le(b + d, 8));
+   for (int i = 0; i < mvt_.cnt; i++)
+      if (mvt_.ft[i].ele == ele)
+         found = mvt_.ft[i].used = 1;
+   return found ? NULL : "unknown ele";
+}
+
+
+/*! Decode a feature of a vector tile. The geometry of a line consists of
+ * parts of a MoveTo and a LineTo command, the one of a point of a MoveTo.
+ * The coordinates must be within the tile and its buffer.
+ * @param nval Number of values of the layer.
+ * @return NULL on success, otherwise a message.
+ */
+static const char *parse_feature(const uint8_t *b, long len, long nval)
+{
+   long pos = 0, d, dlen, g = -1, glen = 0, tp;
+   int key, type = 0, tags = 0, cmd, n, expect = MVT_MOVETO, x = 0, y = 0;
+   uint64_t v, t[2];
+
+   while ((key = pb_field(b, len, &pos, &v, &d, &dlen)) > 0)
+      switch (key)
+      {
+         case 2 << 3 | PB_LEN:
+            // the key ele and the index of its value
+            tp = d;
+            if (pb_get(b, d + dlen, &tp, &t[0]) == -1 || pb_get(b, d + dlen, &tp, &t[1]) == -1
+                  || tp != d + dlen || t[0] || t[1] >= (uint64_t) nval)
+               return "bad tags";
+            tags = 1;
+            break;
+
+         case 3 << 3 | PB_VARINT:
+            type = v;
+            break;
+
+         case 4 << 3 | PB_LEN:
+            g = d;
+            glen = dlen;
+            break;
+
+         default:
+            return "unknown field of a feature";
+      }
+   if (key == -1 || !tags || g == -1 || (type != MVT_POINT && type != MVT_LINESTRING))
+      return "bad feature";
+
+   for (pos = g; pos < g + glen;)
+   {
+      if (pb_get(b, g + glen, &pos, &v) == -1)
+         return "bad geometry";
+      cmd = v & 7;
+      n = v >> 3;
+      if (cmd != expect || n < 1 || (cmd == MVT_MOVETO && n != 1))
+         return "wrong command";
+      if (cmd == MVT_MOVETO)
+         mvt_.moveto++;
+      else
+         mvt_.lineto++;
+      // a point has just one MoveTo
+      expect = type == MVT_POINT ? 0 : cmd == MVT_MOVETO ? MVT_LINETO : MVT_MOVETO;
+
+      for (int i = 0; i < n; i++)
+      {
+         if (pb_get(b, g + glen, &pos, &t[0]) == -1 || pb_get(b, g + glen, &pos, &t[1]) == -1)
+            return "bad geometry";
+         x += (int) (t[0] >> 1) ^ -(int) (t[0] & 1);
+         y += (int) (t[1] >> 1) ^ -(int) (t[1] & 1);
+         if (x < -MVT_BUFFER || x > MVT_EXTENT + MVT_BUFFER || y < -MVT_BUFFER || y > MVT_EXTENT + MVT_BUFFER)
+            return "coordinates out of range";
+      }
+   }
+
+   if (expect != (type == MVT_POINT ? 0 : MVT_MOVETO))
+      return "incomplete geometry";
+   mvt_.features++;
+   return NULL;
+}
+
+
+/*! Decode a vector tile of export_mvt(). It has one layer with the version,
+ * name, extent, and key of the writer.
+ * @return NULL on success, otherwise a message.
+ */
+static const char *parse_tile(const uint8_t *b, long len)
+{
+   long pos = 0, lp, l, llen, d, dlen, nval;
+   int key, nlayers = 0, nkeys, version, extent, named;
+   const char *err;
+   uint64_t v;
+
+   while ((key = pb_field(b, len, &pos, &v, &l, &llen)) > 0)
+   {
+      if (key != (3 << 3 | PB_LEN))
+         return "unknown field of the tile";
+      nlayers++;
+
+      // the values are needed to check the tags of the features
+      version = extent = named = nkeys = nval = 0;
+      for (lp = 0; (key = pb_field(b + l, llen, &lp, &v, &d, &dlen)) > 0;)
+         switch (key)
+         {
+            case 15 << 3 | PB_VARINT:
+               version = v;
+               break;
+
+            case 1 << 3 | PB_LEN:
+               named = dlen == 8 && !memcmp(b + l + d, "contours", 8);
+               break;
+
+            case 3 << 3 | PB_LEN:
+               if (dlen != 3 || memcmp(b + l + d, "ele", 3))
+                  return "unknown key";
+               nkeys++;
+               break;
+
+            case 4 << 3 | PB_LEN:
+               if ((err = parse_value(b + l + d, dlen)) != NULL)
+                  return err;
+               nval++;
+               break;
+
+            case 5 << 3 | PB_VARINT:
+               extent = v;
+               break;
+         }
+      if (key == -1)
+         return "bad layer";
+      if (version != 2 || extent != MVT_EXTENT || !named || nkeys != 1)
+         return "wrong version, name, extent, or keys of the layer";
+
+      for (lp = 0; (key = pb_field(b + l, llen, &lp, &v, &d, &dlen)) > 0;)
+         if (key == (2 << 3 | PB_LEN) && (err = parse_feature(b + l + d, dlen, nval)) != NULL)
+            return err;
+   }
+
+   if (key == -1)
+      return "bad tile";
+   return nlayers != 1 ? "wrong number of layers" : NULL;
+}
+
+
+/*! Decode all tiles of the directory tree of export_mvt() and remove the
+ * tree.
+ */
+static void mvt_walk(const char *path)
+{
+   char buf[PATH_MAX];
+   struct dirent *de;
+   size_t len = strlen(path);
+   uint8_t *b;
+   long n;
+   DIR *dir;
+
+   if ((dir = opendir(path)) != NULL)
+   {
+      while ((de = readdir(dir)) != NULL)
+         if (strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+         {
+            snprintf(buf, sizeof(buf), "%s/%s", path, de->d_name);
+            mvt_walk(buf);
+         }
+      closedir(dir);
+   }
+   else if (len > 4 && !strcmp(path + len - 4, ".pbf") && mvt_.err == NULL)
+   {
+      mvt_.tiles++;
+      if ((b = read_file(path, &n)) == NULL)
+         mvt_.err = "cannot read tile";
+      else
+         mvt_.err = parse_tile(b, n);
+      free(b);
+   }
+   remove(path);
+}
+
+
+/*! Export all layers as vector tiles into a temporary directory and decode
+ * all tiles. Each feature must be in a tile at the maximum zoom level and
+ * each ele must be a value of a tile.
+ * @return NULL on success, otherwise a message.
+ */
+static const char *check_mvt(const layer_t *l, int nlayers, memimg_t *mem, feature_t *ft, int cnt)
+{
+   char dir[] = "/tmp/difftestXXXXXX";
+   int err;
+
+   if (mkdtemp(dir) == NULL)
+      return "cannot create directory";
+
+   memset(&mvt_, 0, sizeof(mvt_));
+   mvt_.ft = ft;
+   mvt_.cnt = cnt;
+   for (int i = 0; i < cnt; i++)
+      ft[i].used = 0;
+   err = export_mvt(l, dir, nlayers, mem);
+   mvt_walk(dir);
+
+   if (err == -1)
+      return "export failed";
+   if (mvt_.err != NULL)
+      return mvt_.err;
+   if (mvt_.features < cnt)
+      return "missing features";
+   for (int i = 0; i < cnt; i++)
+      if (!ft[i].used)
+         return "missing ele";
+   return NULL;
+}
+
+
+/*! Trace an image, export it as FlatGeobuf, as COPY, and as vector tiles
+ * and decode them.
+ * @return 0 on success, otherwise -1.
+ */
+static int check_gis(const char *name, const memimg_t *src, int nlayers)
+{
+   layer_t l[MAXL];
+   memimg_t mem;
+   feature_t *ft = NULL;
+   uint8_t *b = NULL, *t = NULL;
+   const char *fmt = "fgb", *err = NULL;
+   long len, tlen;
+   int cnt = -1;
+
+   if (memimg_copy((memimg_t*) src, &mem) == -1)
+      return -1;
+   set_levels(l, nlayers);
+   if (eng_scan_layer(l, nlayers, &mem) == -1 || (cnt = features(l, nlayers, &mem, &ft)) == -1)
+      err = "tracing failed";
+   else if ((b = export_read(export_fgb, l, nlayers, &mem, &len)) == NULL)
+      err = "export failed";
+   else if ((err = parse_fgb(b, len, ft, cnt)) == NULL)
+   {
+      fmt = "wkb";
+      free(b);
+      if ((b = export_read(export_wkb, l, nlayers, &mem, &len)) == NULL
+            || (t = export_read(export_hexwkb, l, nlayers, &mem, &tlen)) == NULL)
+         err = "export failed";
+      else if ((err = parse_wkb(b, len, t, tlen, ft, cnt)) == NULL)
+      {
+         fmt = "mvt";
+         err = check_mvt(l, nlayers, &mem, ft, cnt);
+      }
+   }
+   if (err != NULL)
+      printf("FAIL %s/%s: %s\n", fmt, name, err);
+   else if (verbose_)
+      printf("ok   gis/%s: %d features, %ld tiles, %ld MoveTo, %ld LineTo\n", name, cnt, mvt_.tiles, mvt_.moveto, mvt_.lineto);
+
+   free(b);
+   free(t);
+   free_features(ft, cnt);
+   free_layers(l, nlayers);
+   memimg_free(&mem);
+   return err != NULL ? -1 : 0;
+}
+
+
+/*! Trace a raster of known blobs with a minimum area. The area is the one
+ * of the polygon through the centres of the border pixels, thus a pixel and
+ * a line of pixels have an area of 0 and a 3x3 square has an area of 4.
+ * @return 0 if the expected contours are discarded, otherwise -1.
+ */
+static int check_minarea(void)
+{
+   // blobs x, y, w, h: pixel, 2 pixels, line, 3x3 and 5x5 square, each in
+   // rows of its own because the search for seeds continues on the next row
+   // after a contour
+   static const int blob[][4] = {{1, 1, 1, 1}, {3, 3, 2, 1}, {6, 5, 8, 1}, {1, 7, 3, 3}, {6, 11, 5, 5}};
+   memimg_t mem;
+   layer_t l;
+   long discarded;
+   int err;
+
+   mem.width = 20;
+   mem.height = 17;
+   if (memimg_init(&mem) == -1)
+      return -1;
+   for (unsigned i = 0; i < sizeof(blob) / sizeof(*blob); i++)
+      for (int y = blob[i][1]; y < blob[i][1] + blob[i][3]; y++)
+         for (int x = blob[i][0]; x < blob[i][0] + blob[i][2]; x++)
+            memimg_put(&mem, x, y, maxval_);
+
+   set_levels(&l, 1);
+   l.min_area = 4;
+   err = scan_layer(&l, &mem);
+   discarded = stats_.nlayers ? stats_.layer[stats_.nlayers - 1].discarded : -1;
+   memimg_free(&mem);
+
+   if (err == -1 || l.plist_cnt != 2 || discarded != 3)
+   {
+      printf("FAIL minarea: %d contours kept, %ld discarded, expected 2 and 3\n", l.plist_cnt, discarded);
+      free_layers(&l, 1);
+      return -1;
+   }
+   free_layers(&l, 1);
+   return 0;
+}
+
+
+/*! Write an image into a temporary file and load it with rawmem().
+ * @param hdr Header of a PGM/PPM file, or NULL if the file is written as
+ * raw raster of 16 bit values in the format fmt.
+ * @param dst Pointer to the image which is loaded.
+ * @return 0 on success, -1 on error.
+ */
+static int raw_load(const memimg_t *src, const char *hdr, const rawfmt_t *fmt, memimg_t *dst)
+{
+   char name[] = "/tmp/difftestXXXXXX";
+   FILE *f;
+   int fd, c, err = -1;
+
+   if ((fd = mkstemp(name)) == -1)
+      return -1;
+   if ((f = fdopen(fd, "w")) == NULL)
+   {
+      close(fd);
+      unlink(name);
+      return -1;
+   }
+
+   if (hdr != NULL)
+      fprintf(f, hdr, src->width, src->height);
+   for (long i = 0; i < (long) src->width * src->height; i++)
+   {
+      c = src->mem[i];
+      if (hdr == NULL)
+      {
+         fputc(c & 0xff, f);
+         fputc(c >> 8 & 0xff, f);
+      }
+      else if (hdr[1] == '5')
+         fputc(c >> 16 & 0xff, f);
+      else
+      {
+         fputc(c >> 16 & 0xff, f);
+         fputc(c >> 8 & 0xff, f);
+         fputc(c & 0xff, f);
+      }
+   }
+
+   if (fclose(f) != EOF)
+      err = rawmem(dst, name, hdr == NULL ? fmt : NULL, c2grey, NULL);
+   unlink(name);
+   return err;
+}
+
+
+/*! Write an image of ARGB values as binary PGM (if it is grey) or PPM, and
+ * its 16 bit values as raw raster, load them with rawmem() and compare them
+ * to the values of memprep(). The values of memprep() are those of
+ * pngmem(), see check_decode().
+ * @param src ARGB image, e.g. of rastergen().
+ * @return 0 if the values are equal, otherwise -1.
+ */
+static int check_raw(const char *name, const memimg_t *src)
+{
+   const char *hdr = "P5\n%d %d\n255\n", *type;
+   memimg_t ref, mem;
+   rawfmt_t fmt;
+   char buf[32];
+   long n = 0;
+   int max = maxval_;
+
+   for (long i = 0; i < (long) src->width * src->height; i++)
+      if ((src->mem[i] >> 16 & 0xff) != (src->mem[i] & 0xff) || (src->mem[i] >> 8 & 0xff) != (src->mem[i] & 0xff))
+      {
+         hdr = "P6\n%d %d\n255\n";
+         break;
+      }
+
+   for (int k = 0; k < 2 && !n; k++)
+   {
+      // 16 bit values are loaded linearly
+      maxval_ = k ? MAXVAL16 : MAXVAL;
+      n = -1;
+      if (memimg_copy((memimg_t*) src, &ref) == -1)
+         break;
+      memprep(&ref, c2grey, NULL);
+      snprintf(buf, sizeof(buf), "%dx%d:u16", src->width, src->height);
+      if (raw_parse(buf, &fmt) != -1 && raw_load(k ? &ref : src, k ? NULL : hdr, &fmt, &mem) != -1)
+      {
+         n = diff_pixels(&mem, &ref);
+         memimg_free(&mem);
+      }
+      memimg_free(&ref);
+      type = k ? "raw16" : hdr[1] == '5' ? "pgm" : "ppm";
+      if (n)
+         printf("FAIL %s/%s: %ld pixels differ\n", type, name, n);
+      else if (verbose_)
+         printf("ok   %s/%s\n", type, name);
+   }
+   maxval_ = max;
+
+   return n ? -1 : 0;
+}
+
+
+/*! Run all engines on an image and compare them to the reference.
+ *  @param name Name of the test case.
+ *  @param src Image with traceable values.
+ *  @param nlayers Number of layers.
+ *  @return Number of failed engines.
+ */
+static int run_case(const char *name, const memimg_t *src, int nlayers)
+{
+   layer_t ref[MAXL], l[MAXL];
+   contour_t *rcl, *cl;
+   memimg_t mem;
+   char buf[256];
+   int nref, n, fail = 0;
+
+   if (memimg_copy((memimg_t*) src, &mem) == -1)
+      return 1;
+
+   set_levels(ref, nlayers);
+   if (ref_trace(ref, nlayers, &mem) == -1 || (nref = canonicalize(ref, nlayers, &rcl)) == -1)
+   {
+      printf("FAIL %s: reference failed\n", name);
+      memimg_free(&mem);
+      return 1;
+   }
+   ref_free(ref, nlayers);
+
+   for (const engine_t *e = engine_; e->name != NULL; e++)
+   {
+      snprintf(buf, sizeof(buf), "%s/%s", e->name, name);
+      set_levels(l, nlayers);
+      memcpy(mem.mem, src->mem, (size_t) src->width * src->height * sizeof(*mem.mem));
+      if (e->trace(l, nlayers, &mem) == -1 || (n = canonicalize(l, nlayers, &cl)) == -1)
+      {
+         printf("FAIL %s: engine failed\n", buf);
+         fail++;
+         free_layers(l, nlayers);
+         continue;
+      }
+      if (compare(buf, rcl, nref, cl, n, e->tol > tol_ ? e->tol : tol_))
+         fail++;
+      else if (verbose_)
+         printf("ok   %s: %d contours\n", buf, n);
+      free_contours(cl, n);
+      free_layers(l, nlayers);
+   }
+
+   if (check_lod(name, rcl, nref))
+      fail++;
+   else if (verbose_)
+      printf("ok   lod/%s\n", name);
+
+   if (check_bezier(name, rcl, nref))
+      fail++;
+   else if (verbose_)
+      printf("ok   bezier/%s\n", name);
+
+   free_contours(rcl, nref);
+   memimg_free(&mem);
+
+   if (check_maxtree(name, src, nlayers))
+      fail++;
+   else if (verbose_)
+      printf("ok   maxtree/%s\n", name);
+
+   return fail;
+}
+
+
+static uint32_t xrnd(uint32_t *state)
+{
+   *state ^= *state << 13;
+   *state ^= *state >> 17;
+   *state ^= *state << 5;
+   return *state;
+}
+
+
+/*! Generate a random image with a few distinct values. Small images with
+ * few values contain many degenerated contours (single pixels, one pixel
+ * wide lines, contours at the image edges).
+ */
+static int fuzz_image(memimg_t *mem, uint32_t *state)
+{
+   int k, x, y;
+
+   mem->width = 1 + xrnd(state) % FUZZ_MAXSIZE;
+   mem->height = 1 + xrnd(state) % FUZZ_MAXSIZE;
+   if (memimg_init(mem) == -1)
+      return -1;
+
+   k = 2 + xrnd(state) % 5;
+   for (y = 0; y < mem->height; y++)
+      for (x = 0; x < mem->width; x++)
+         memimg_put(mem, x, y, MAXVAL * (xrnd(state) % k) / (k - 1));
+
+   return 0;
+}
+
+
+static void usage(const char *s)
+{
+   printf("usage: %s [OPTIONS] [<png file> ...]\n"
+          "   OPTIONS\n"
+          "      -e <tol> ...... Tolerance of subpixel coordinates (default = %g).\n"
+          "      -f <n> ........ Number of fuzzed images (default = %d).\n"
+          "      -h ............ Print this message.\n"
+          "      -s <seed> ..... Seed of the fuzzer.\n"
+          "      -v ............ Verbose output.\n", s, TOLERANCE, FUZZ_CNT);
+}
+
+
+int main(int argc, char **argv)
+{
+   static const int size[][2] = {{17, 23}, {64, 64}, {200, 120}};
+   uint32_t state = 0x1234567;
+   int fuzz = FUZZ_CNT, fail = 0, cases = 0, n;
+   memimg_t mem;
+   char buf[256];
+
+   init_log("stderr", LOG_WARN);
+
+   while ((n = getopt(argc, argv, "e:f:hs:v")) != -1)
+      switch (n)
+      {
+         case 'e':
+            tol_ = atof(optarg);
+            break;
+
+         case 'f':
+            fuzz = atoi(optarg);
+            break;
+
+         case 's':
+            state = strtoul(optarg, NULL, 0) | 1;
+            break;
+
+         case 'v':
+            verbose_ = 1;
+            break;
+
+         case 'h':
+            usage(argv[0]);
+            exit(EXIT_SUCCESS);
+      }
+
+   for (int t = 0; t < RG_MAX; t++)
+      for (unsigned s = 0; s < sizeof(size) / sizeof(*size); s++)
+      {
+         if (rastergen(&mem, t, size[s][0], size[s][1], 1) == -1)
+            return EXIT_FAILURE;
+         snprintf(buf, sizeof(buf), "%s_%dx%d", rastergen_name(t), size[s][0], size[s][1]);
+         if (s == 1)
+            fail += check_raw(buf, &mem) == -1;
+         memprep(&mem, c2grey, NULL);
+         fail += run_case(buf, &mem, 16);
+         if (s == 1)
+            fail += check_gis(buf, &mem, 16) == -1;
+         cases++;
+         memimg_free(&mem);
+      }
+
+   // 16 bit values, the levels are scaled like the values
+   maxval_ = MAXVAL16;
+   for (int t = 0; t < RG_MAX; t++)
+   {
+      if (rastergen(&mem, t, size[2][0], size[2][1], 1) == -1)
+         return EXIT_FAILURE;
+      memprep(&mem, c2grey, NULL);
+      snprintf(buf, sizeof(buf), "%s_%dx%d_16bit", rastergen_name(t), size[2][0], size[2][1]);
+      fail += run_case(buf, &mem, 16);
+      cases++;
+      memimg_free(&mem);
+   }
+   maxval_ = MAXVAL;
+
+   for (int i = 0; i < fuzz; i++)
+   {
+      if (fuzz_image(&mem, &state) == -1)
+         return EXIT_FAILURE;
+      snprintf(buf, sizeof(buf), "fuzz%d_%dx%d", i, mem.width, mem.height);
+      fail += run_case(buf, &mem, 1 + xrnd(&state) % 16);
+      cases++;
+      memimg_free(&mem);
+   }
+
+   fail += check_minarea() == -1;
+   cases++;
+
+   for (; optind < argc; optind++)
+   {
+      if (cairomem(&mem, argv[optind]) == -1)
+      {
+         printf("FAIL %s: cannot read image\n", argv[optind]);
+         fail++;
+         continue;
+      }
+      fail += check_raw(argv[optind], &mem) == -1;
+      memprep(&mem, c2grey, NULL);
+      fail += check_decode(argv[optind], &mem) == -1;
+      fail += run_case(argv[optind], &mem, 16);
+      cases++;
+      memimg_free(&mem);
+   }
+
+   printf("%d cases, %d failures\n", cases, fail);
+   return fail ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
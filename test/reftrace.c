@@ -0,0 +1,597 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file reftrace.c
+ * This file contains a frozen copy of the original scalar tracer (the
+ * functions of tracer.c and scan_layer() as of version 0.2). It is used as
+ * the reference by difftest.c to validate optimized tracing engines. Do not
+ * change or optimize this code, its output is the specification.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "reftrace.h"
+
+#define REF_VLEFT (1 << 30)
+#define REF_VRIGHT (1 << 29)
+#define REF_VDOWN (1 << 28)
+#define REF_VUP (1 << 27)
+#define REF_VALL (REF_VLEFT | REF_VDOWN | REF_VRIGHT | REF_VUP)
+#define REF_MAXW 10000
+#define REF_REDUCE 5
+
+#define ref_get0(a, b, c) (ref_get(a, b, c) & ~REF_VALL)
+
+
+static int ref_get(const memimg_t *mi, int x, int y)
+{
+   if (x < 0 || x >= mi->width || y < 0 || y >= mi->height)
+   {
+      errno = EFAULT;
+      return -1;
+   }
+
+   return mi->mem[y * mi->width + x];
+}
+
+
+static int ref_or(memimg_t *mi, int x, int y, int f)
+{
+   int tf;
+
+   if (x < 0 || x >= mi->width || y < 0 || y >= mi->height)
+   {
+      errno = EFAULT;
+      return -1;
+   }
+
+   tf = mi->mem[y * mi->width + x];
+   mi->mem[y * mi->width + x] = tf | f;
+   return tf;
+}
+
+
+static int ref_and(memimg_t *mi, int x, int y, int f)
+{
+   int tf;
+
+   if (x < 0 || x >= mi->width || y < 0 || y >= mi->height)
+   {
+      errno = EFAULT;
+      return -1;
+   }
+
+   tf = mi->mem[y * mi->width + x];
+   mi->mem[y * mi->width + x] = tf & f;
+   return tf;
+}
+
+
+
+static int ref_next_unvisited(const memimg_t *mem, pos_t *p, int v)
+{
+   int c, in;
+
+   for (; p->y < mem->height; p->y++)
+   {
+      in = 0;
+      for (; p->x < mem->width; p->x++)
+      {
+         c = ref_get(mem, p->x, p->y);
+         if ((c & ~REF_VALL) < v)
+         {
+            in = 0;
+            continue;
+         }
+
+         if (c & REF_VALL)
+         {
+            in = 1;
+            continue;
+         }
+
+         if (!in)
+            return 1;
+      }
+      p->x = 0;
+   }
+   return 0;
+}
+
+
+static int ref_is_inside(const memimg_t *mem, int v, const pos_t *pos)
+{
+   return ref_get(mem, pos->x, pos->y) >= v;
+}
+
+
+static void ref_set_dir(int *dirp, int dir)
+{
+   if (dirp != NULL)
+      *dirp = dir;
+}
+
+
+static void ref_clear_marks(memimg_t *mem)
+{
+   int x, y;
+
+   for (y = 0; y < mem->height; y++)
+      for (x = 0; x < mem->width; x++)
+         ref_and(mem, x, y, ~REF_VALL);
+}
+
+
+static int ref_scan_inside_down0(const memimg_t *mem, int v, pos_t *pos, int *dir, int mark)
+{
+   int c;
+
+   ref_set_dir(dir, LEFT);
+
+   for (; pos->y > 0; pos->y--)
+   {
+      if (mark)
+         ref_or((memimg_t*) mem, pos->x, pos->y, REF_VRIGHT);
+
+      if ((c = ref_get(mem, pos->x, pos->y - 1)) < v)
+      {
+         pos->yf = pos->y - (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->y;
+      }
+   }
+
+   pos->yf = pos->y;
+   return pos->y;
+}
+
+
+static int ref_scan_inside_down(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   return ref_scan_inside_down0(mem, v, pos, dir, 1);
+}
+
+
+static int ref_scan_inside_left(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   int c;
+
+   ref_set_dir(dir, UP);
+
+   for (; pos->x > 0; pos->x--)
+   {
+      ref_or((memimg_t*) mem, pos->x, pos->y, REF_VUP);
+
+      if ((c = ref_get(mem, pos->x - 1, pos->y)) < v)
+      {
+         pos->xf = pos->x - (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->x;
+      }
+   }
+
+   pos->xf = pos->x;
+   return pos->x;
+}
+
+
+static int ref_scan_sideway_down(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   int c;
+
+   if (pos->x >= mem->width - 1)
+      return ref_scan_inside_down(mem, v, pos, dir);
+
+   ref_set_dir(dir, LEFT);
+   for (; pos->y > 0; pos->y--)
+   {
+      ref_or((memimg_t*) mem, pos->x, pos->y, REF_VRIGHT);
+
+      if ((c = ref_get(mem, pos->x, pos->y - 1)) < v)
+      {
+         pos->yf = pos->y - (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->y;
+      }
+      if ((c = ref_get(mem, pos->x + 1, pos->y - 1)) >= v)
+      {
+         pos->yf = pos->y - (double) (v - c) / (ref_get0(mem, pos->x + 1, pos->y) - c);
+         ref_set_dir(dir, RIGHT);
+         return --pos->y;
+      }
+   }
+
+   pos->yf = pos->y;
+   return pos->y;
+}
+
+
+static int ref_sqdist(int a, int b)
+{
+   return a * a + b * b;
+}
+
+
+static int ref_reduce(pos_t *pos, int n, int m)
+{
+   int i;
+
+   for (i = 0; i < n - 2 && n > 4;)
+   {
+      if (ref_sqdist(pos[i].x - pos[i + 1].x, pos[i].y - pos[i + 1].y) < m * m)
+      {
+         memmove(&pos[i + 1], &pos[i + 2], (n - i - 2) * sizeof(*pos));
+         n--;
+      }
+      else
+         i++;
+   }
+
+   return n;
+}
+
+
+static int ref_scan_sideway_left0(const memimg_t *mem, int v, pos_t *pos, int *dir, int mark)
+{
+   int c;
+
+   if (!pos->y)
+      return ref_scan_inside_left(mem, v, pos, dir);
+
+   ref_set_dir(dir, UP);
+   for (; pos->x > 0; pos->x--)
+   {
+      if (mark)
+         ref_or((memimg_t*) mem, pos->x, pos->y, REF_VUP);
+
+      if ((c = ref_get(mem, pos->x - 1, pos->y)) < v)
+      {
+         pos->xf = pos->x - (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->x;
+      }
+      if ((c = ref_get(mem, pos->x - 1, pos->y - 1)) >= v)
+      {
+         pos->xf = pos->x - (double) (v - c) / (ref_get0(mem, pos->x, pos->y - 1) - c);
+         ref_set_dir(dir, DOWN);
+         return --pos->x;
+      }
+   }
+
+   pos->xf = pos->x;
+   return pos->x;
+}
+
+
+static int ref_scan_sideway_left(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   return ref_scan_sideway_left0(mem, v, pos, dir, 1);
+}
+
+
+static int ref_scan_inside_up(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   int c;
+
+   ref_set_dir(dir, RIGHT);
+
+   for (; pos->y < mem->height - 1; pos->y++)
+   {
+      ref_or((memimg_t*) mem, pos->x, pos->y, REF_VLEFT);
+
+      if ((c = ref_get(mem, pos->x, pos->y + 1)) < v)
+      {
+         pos->yf = pos->y + (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->y;
+      }
+   }
+
+   pos->yf = pos->y;
+   return pos->y;
+}
+
+
+static int ref_scan_inside_right(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   int c;
+
+   ref_set_dir(dir, DOWN);
+
+   for (; pos->x < mem->width - 1; pos->x++)
+   {
+      ref_or((memimg_t*) mem, pos->x, pos->y, REF_VDOWN);
+
+      if ((c = ref_get(mem, pos->x + 1, pos->y)) < v)
+      {
+         pos->xf = pos->x + (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->x;
+      }
+   }
+
+   pos->xf = pos->x;
+   return pos->x;
+}
+
+
+static int ref_scan_sideway_up(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   int c;
+
+   if (!pos->x)
+      return ref_scan_inside_up(mem, v, pos, dir);
+
+   ref_set_dir(dir, RIGHT);
+   for (; pos->y < mem->height - 1; pos->y++)
+   {
+      ref_or((memimg_t*) mem, pos->x, pos->y, REF_VLEFT);
+
+      if ((c = ref_get(mem, pos->x, pos->y + 1)) < v)
+      {
+         pos->yf = pos->y + (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->y;
+      }
+      if ((c = ref_get(mem, pos->x - 1, pos->y + 1)) >= v)
+      {
+         pos->yf = pos->y + (double) (v - c) / (ref_get0(mem, pos->x - 1, pos->y) - c);
+         ref_set_dir(dir, LEFT);
+         return ++pos->y;
+      }
+   }
+
+   pos->yf = pos->y;
+   return pos->y;
+}
+
+
+static int ref_scan_sideway_right(const memimg_t *mem, int v, pos_t *pos, int *dir)
+{
+   int c;
+
+   if (pos->y >= mem->height- 1)
+      return ref_scan_inside_right(mem, v, pos, dir);
+
+   ref_set_dir(dir, DOWN);
+   for (; pos->x < mem->width - 1; pos->x++)
+   {
+      ref_or((memimg_t*) mem, pos->x, pos->y, REF_VDOWN);
+
+      if ((c = ref_get(mem, pos->x + 1, pos->y)) < v)
+      {
+         pos->xf = pos->x + (double) (v - c) / (ref_get0(mem, pos->x, pos->y) - c);
+         return pos->x;
+      }
+      if ((c = ref_get(mem, pos->x + 1, pos->y + 1)) >= v)
+      {
+         pos->xf = pos->x + (double) (v - c) / (ref_get0(mem, pos->x, pos->y + 1) - c);
+         ref_set_dir(dir, UP);
+         return ++pos->x;
+      }
+   }
+
+   pos->xf = pos->x;
+   return pos->x;
+}
+
+
+static void ref_find_lowercorner(const memimg_t *mem, int v, pos_t *pos, int *scan_dir)
+{
+   // find 1st corner point
+   ref_scan_inside_down0(mem, v, pos, scan_dir, 0);
+   ref_scan_sideway_left0(mem, v, pos, scan_dir, 0);
+}
+
+
+static int ref_poscmp(const pos_t *a, const pos_t *b)
+{
+   return !(a->x == b->x && a->y == b->y);
+}
+
+
+static int ref_scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist)
+{
+   int i, n;
+   int scan_dir;
+
+   // make sure point is inside
+   if (!ref_is_inside(mem, v, pos))
+      return -1;
+
+   ref_find_lowercorner(mem, v, pos, &scan_dir);
+   if ((ref_get(mem, pos->x, pos->y) & REF_VALL))
+   {
+      // too much debugging
+      //log_debug("edge %d/%d already visited", pos->x, pos->y);
+      return 0;
+   }
+
+   // reserver memory for the 1st 2 pos elements
+   if ((*plist = malloc(sizeof(**plist))) == NULL)
+      return -1;
+
+   (*plist)[0] = *pos;
+
+   for (n = 1, i = 0; ; i++)
+   {
+
+      // make sure point is inside
+      if (!ref_is_inside(mem, v, pos))
+      {
+         log_msg(LOG_ERR, "something went wrong...");
+         //return -1;
+      }
+
+      // break endless loop
+      if (i >= 4 && n == 1)
+      {
+         log_debug("seems to be a single point");
+         break;
+      }
+
+      // break if polygon is closed
+      if (n > 1 && !ref_poscmp(&(*plist)[0], &(*plist)[n - 1]))
+      {
+         log_debug("closed");
+         break;
+      }
+
+      switch (scan_dir)
+      {
+         case LEFT:
+            ref_scan_sideway_left(mem, v, pos, &scan_dir);
+            break;
+
+         case RIGHT:
+            ref_scan_sideway_right(mem, v, pos, &scan_dir);
+            break;
+
+         case UP:
+            ref_scan_sideway_up(mem, v, pos, &scan_dir);
+            break;
+
+         case DOWN:
+            ref_scan_sideway_down(mem, v, pos, &scan_dir);
+            break;
+
+         default:
+            log_msg(LOG_EMERG, "This should never happen...");
+            exit(1);
+      } // switch (scan_dir)
+
+      // ignore duplicates
+      if (ref_poscmp(&(*plist)[n - 1], pos))
+      {
+         pos_t *tpos;
+         if ((tpos = realloc(*plist, sizeof(*tpos) * (n + 1))) == NULL)
+         {
+            log_errno(LOG_ERR, "realloc()");
+            return n;
+         }
+         *plist = tpos;
+         (*plist)[n] = *pos;
+         n++;
+      }
+   } // for (n = 1, i = 0; ; i++)
+
+   log_debug("%d iterations, %d points", i + 1, n);
+
+   if (n == 1)
+      ref_or(mem, (*plist)[0].x, (*plist)[0].y, REF_VALL);
+
+   return n;
+}
+
+
+static int ref_add_plist(layer_t *l)
+{
+   pos_t **plist;
+   int *n;
+
+   if ((plist = realloc(l->plist, (l->plist_cnt + 1) * sizeof(*plist))) == NULL)
+      return -1;
+   l->plist = plist;
+
+   if ((n = realloc(l->n, (l->plist_cnt + 1) * sizeof(*n))) == NULL)
+      return -1;
+   l->n = n;
+
+   l->plist_cnt++;
+   return l->plist_cnt;
+}
+
+
+static int ref_scan_layer(layer_t *l, memimg_t *mem)
+{
+   pos_t p, scan_pos;
+   int i;
+
+   scan_pos.x = scan_pos.y = 0;
+   for (i = l->plist_cnt; i < REF_MAXW; i++)
+   {
+      if (!ref_next_unvisited(mem, &scan_pos, l->v))
+         break;
+
+      if (ref_add_plist(l) == -1)
+         return -1;
+
+      p = scan_pos;
+      if ((l->n[i] = ref_scan(mem, l->v, &p, &l->plist[i])) == -1)
+      {
+         l->plist_cnt--;
+         return -1;
+      }
+
+      if (!l->n[i])
+      {
+         // reuse current plist
+         i--;
+         l->plist_cnt--;
+
+         scan_pos.x++;
+         if (scan_pos.x >= mem->width)
+         {
+            scan_pos.x = 0;
+            scan_pos.y++;
+         }
+         continue;
+      }
+      scan_pos.x = 0;
+      scan_pos.y++;
+
+      l->n[i] = ref_reduce(l->plist[i], l->n[i], REF_REDUCE);
+   }
+   ref_clear_marks(mem);
+
+   return 0;
+}
+
+
+/*! Trace all layers with the reference implementation.
+ *  @param l Array of nlayers layers. The values l[].v must be set.
+ *  @param nlayers Number of layers.
+ *  @param mem Memory image, the pixels must already be converted to values.
+ *  @return 0 on success, otherwise -1.
+ */
+int ref_trace(layer_t *l, int nlayers, memimg_t *mem)
+{
+   for (int j = 0; j < nlayers; j++)
+      if (ref_scan_layer(&l[j], mem) == -1)
+         return -1;
+
+   return 0;
+}
+
+
+/*! Free the contours of layers traced with ref_trace().
+ */
+void ref_free(layer_t *l, int nlayers)
+{
+   for (int j = 0; j < nlayers; j++)
+   {
+      for (int i = 0; i < l[j].plist_cnt; i++)
+         free(l[j].plist[i]);
+      free(l[j].plist);
+      free(l[j].n);
+      l[j].plist = NULL;
+      l[j].n = NULL;
+      l[j].plist_cnt = 0;
+   }
+}
+
@@ -0,0 +1,35 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file reftrace.h
+ * This file contains the declarations of the reference tracer.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#ifndef REFTRACE_H
+#define REFTRACE_H
+
+#include "scan.h"
+
+
+int ref_trace(layer_t *l, int nlayers, memimg_t *mem);
+void ref_free(layer_t *l, int nlayers);
+
+#endif
+
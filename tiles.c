@@ -0,0 +1,126 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file tiles.c
+ * This file contains the tile map which is used for incremental tracing.
+ * The image is divided into square tiles and each tile has a flag which is
+ * set if any of its pixels changed between two versions of the image.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+
+/*! Initialize an empty tile map.
+ * @param tm Pointer to the tile map.
+ * @param width Width of the image.
+ * @param height Height of the image.
+ * @param size Edge length of a tile in pixels.
+ * @return 0 on success, -1 on error.
+ */
+int tiles_init(tilemap_t *tm, int width, int height, int size)
+{
+   tm->size = size;
+   tm->tw = (width + size - 1) / size;
+   tm->th = (height + size - 1) / size;
+   if ((tm->t = mt_calloc(MT_OTHER, (size_t) tm->tw * tm->th + 1, 1)) == NULL)
+      return -1;
+   return 0;
+}
+
+
+void tiles_free(tilemap_t *tm)
+{
+   mt_free(tm->t);
+   memset(tm, 0, sizeof(*tm));
+}
+
+
+/*! Clip the pixel rectangle x0/y0 - x1/y1 (inclusive) to the image and
+ * convert it to tile coordinates.
+ * @return 0 if the rectangle is outside of the image, otherwise 1.
+ */
+static int tile_rect(const tilemap_t *tm, int *x0, int *y0, int *x1, int *y1)
+{
+   *x0 = *x0 < 0 ? 0 : *x0 / tm->size;
+   *y0 = *y0 < 0 ? 0 : *y0 / tm->size;
+   *x1 = *x1 / tm->size;
+   *y1 = *y1 / tm->size;
+   if (*x1 >= tm->tw)
+      *x1 = tm->tw - 1;
+   if (*y1 >= tm->th)
+      *y1 = tm->th - 1;
+   return *x0 <= *x1 && *y0 <= *y1;
+}
+
+
+/*! Test if any tile which intersects a pixel rectangle is set.
+ * @return 1 if a tile is set, otherwise 0.
+ */
+int tiles_hit(const tilemap_t *tm, int x0, int y0, int x1, int y1)
+{
+   if (!tile_rect(tm, &x0, &y0, &x1, &y1))
+      return 0;
+
+   for (int ty = y0; ty <= y1; ty++)
+      for (int tx = x0; tx <= x1; tx++)
+         if (tm->t[ty * tm->tw + tx])
+            return 1;
+   return 0;
+}
+
+
+/*! Set the tiles in which two images of the same size differ. The images
+ * must not contain any marks.
+ * @param tm Pointer to a tile map initialized for the size of the images.
+ * @return The number of changed tiles or -1 if the images differ in size.
+ */
+int tiles_diff(tilemap_t *tm, const memimg_t *a, const memimg_t *b)
+{
+   const int *pa, *pb;
+   int n = 0, w;
+
+   if (a->width != b->width || a->height != b->height)
+      return -1;
+
+   for (int ty = 0; ty < tm->th; ty++)
+      for (int tx = 0; tx < tm->tw; tx++)
+      {
+         w = (tx + 1) * tm->size <= a->width ? tm->size : a->width - tx * tm->size;
+         for (int y = ty * tm->size; y < (ty + 1) * tm->size && y < a->height; y++)
+         {
+            pa = a->mem + (size_t) y * a->width + tx * tm->size;
+            pb = b->mem + (size_t) y * b->width + tx * tm->size;
+            if (memcmp(pa, pb, w * sizeof(*pa)))
+            {
+               tm->t[ty * tm->tw + tx] = 1;
+               n++;
+               break;
+            }
+         }
+      }
+
+   return n;
+}
@@ -25,21 +25,444 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "scan.h"
 #include "smlog.h"
+#include "stats.h"
+#include "memtrack.h"
+
+//! initial number of journal entries
+#define JOURNAL_INIT 1024
+//! number of vertices interpolated at once
+#define IBLOCK 64
+
+
+//! journal of the current thread, NULL if the walkers are not journaled
+static __thread journal_t *journal_;
+//! recipes of the subpixel coordinates of the current walker position
+static __thread crossing_t cur_;
+//! rows of the fragments of the current thread, see tracer_fragment()
+static __thread int frag_y0_ = INT_MIN, frag_y1_ = INT_MAX;
+//! set if the walkers of the current thread must not change the image
+static __thread int dry_;
+//! set if a walker stopped at the border of the rows of the fragments
+static __thread int midrun_;
+
+
+/*! Set the journal of the current thread. All marks set by the walkers and
+ * all values of inside pixels which are used for the interpolation are
+ * recorded in the journal until it is set to NULL again. The latter is
+ * necessary because these values include the marks of other contours, thus
+ * the subpixel coordinates depend on the order in which the contours are
+ * traced.
+ * @param j Pointer to journal or NULL.
+ */
+void tracer_journal(journal_t *j)
+{
+   journal_ = j;
+}
+
+
+/*! Limit the walkers of the current thread to the rows y0 to y1 - 1, i.e.
+ * trace_step() stops a vertical step in the middle at the first row outside
+ * (see there). In this mode the walkers neither set marks nor journal
+ * anything, thus several threads can walk on the same image at the same
+ * time. They rely on the threshold mask. tracer_fragment(0, 0) switches back
+ * to normal tracing.
+ */
+void tracer_fragment(int y0, int y1)
+{
+   dry_ = y0 < y1;
+   frag_y0_ = dry_ ? y0 : INT_MIN;
+   frag_y1_ = dry_ ? y1 : INT_MAX;
+}
+
+
+/*! Replay a part of the journal, i.e. set the marks again. This has the same
+ * effect on the image as the original trace only if all recorded pixel
+ * values are the same as during the original trace. If one of them differs,
+ * the image is restored.
+ * @param j Pointer to journal.
+ * @param from Index of the first entry.
+ * @param n Number of entries.
+ * @return 0 on success, -1 if a pixel value differs.
+ */
+int journal_replay(journal_t *j, long from, long n)
+{
+   jentry_t *e;
+   long i;
+
+   for (i = from, e = &j->e[from]; i < from + n; i++, e++)
+   {
+      if (!e->f)
+      {
+         if (*e->p != e->c)
+         {
+            journal_undo(j, from, i - from);
+            return -1;
+         }
+         continue;
+      }
+      e->c = *e->p;
+      *e->p |= e->f;
+   }
+
+   return 0;
+}
+
+
+/*! Undo journal_replay(), i.e. restore the pixels.
+ * @param j Pointer to journal.
+ * @param from Index of the first entry.
+ * @param n Number of entries.
+ */
+void journal_undo(journal_t *j, long from, long n)
+{
+   for (long i = from + n - 1; i >= from; i--)
+      if (j->e[i].f)
+         *j->e[i].p = j->e[i].c;
+}
+
+
+/*! Append a part of the journal src to the journal dst.
+ * @param dst Pointer to destination journal or NULL.
+ * @param src Pointer to source journal.
+ * @param from Index of the first entry of src.
+ * @param n Number of entries.
+ */
+void journal_copy(journal_t *dst, const journal_t *src, long from, long n)
+{
+   jentry_t *e;
+   long size;
+
+   if (dst == NULL || n <= 0)
+      return;
+
+   if (dst->n + n > dst->size)
+   {
+      for (size = dst->size ? dst->size : JOURNAL_INIT; size < dst->n + n; size *= 2);
+      if ((e = mt_realloc(MT_OTHER, dst->e, size * sizeof(*e))) == NULL)
+      {
+         dst->err = -1;
+         return;
+      }
+      dst->e = e;
+      dst->size = size;
+   }
 
-#define memimg_get0(a, b, c) (memimg_get(a, b, c) & ~VALL)
+   memcpy(&dst->e[dst->n], &src->e[from], n * sizeof(*e));
+   dst->n += n;
+}
+
+
+/*! Move the pixel pointers of a journal from one image to another image of
+ * the same size.
+ */
+void journal_rebase(journal_t *j, const int *from, int *to)
+{
+   for (long i = 0; i < j->n; i++)
+      j->e[i].p = to + (j->e[i].p - from);
+}
+
+
+void journal_free(journal_t *j)
+{
+   mt_free(j->e);
+   memset(j, 0, sizeof(*j));
+}
+
+
+static void journal_add(const memimg_t *mem, int x, int y, int f, int c)
+{
+   jentry_t *e;
+
+   if (journal_->n >= journal_->size)
+   {
+      if ((e = mt_realloc(MT_OTHER, journal_->e, (journal_->size ? journal_->size * 2 : JOURNAL_INIT) * sizeof(*e))) == NULL)
+      {
+         journal_->err = -1;
+         return;
+      }
+      journal_->e = e;
+      journal_->size = journal_->size ? journal_->size * 2 : JOURNAL_INIT;
+   }
+
+   e = &journal_->e[journal_->n++];
+   e->p = &mem->mem[y * mem->width + x];
+   e->f = f;
+   e->c = c;
+}
+
+
+/*! Mark a pixel as visited.
+ */
+static void set_mark(const memimg_t *mem, int x, int y, int f)
+{
+   if (dry_)
+      return;
+
+   if (memimg_or((memimg_t*) mem, x, y, f) != -1 && journal_ != NULL)
+      journal_add(mem, x, y, f, 0);
+}
+
+
+/*! Record the value c of an inside pixel which is used for interpolation.
+ */
+static void used_inside(const memimg_t *mem, int x, int y, int c)
+{
+   if (journal_ != NULL)
+      journal_add(mem, x, y, 0, c);
+}
+
+
+/*! Test if a vertical walker reached row y which is outside of the rows of
+ * the fragments, see tracer_fragment().
+ */
+static inline int leave_rows(int y)
+{
+   if (y >= frag_y0_ && y < frag_y1_)
+      return 0;
+
+   midrun_ = 1;
+   return 1;
+}
+
+
+/*! Test if pixel x/y is inside, i.e. >= v. The threshold mask is used if it
+ * is valid for v.
+ */
+static inline int inside(const memimg_t *mem, int v, int x, int y)
+{
+   if (mem->mask_v == v)
+      return memimg_mask_get(mem, x, y);
+
+   return memimg_get(mem, x, y) >= v;
+}
+
+
+/*! Record the crossing of the contour between the outside pixel cx/cy and
+ * the inside pixel gx/gy. Both pixels are read not before interpolate(),
+ * which is possible because the marks are never set on outside pixels and
+ * are removed from the inside pixel.
+ * @param ip Pointer to the recipe of the coordinate.
+ * @param base Integer coordinate.
+ * @param sign Direction of the crossing relative to base, -1 or 1.
+ */
+static inline void defer(interp_t *ip, const memimg_t *mem, int base, int sign, int cx, int cy, int gx, int gy)
+{
+   ip->base = base;
+   ip->sign = sign;
+   ip->cval = 0;
+   ip->c = (long) cy * mem->width + cx;
+   ip->g = (long) gy * mem->width + gx;
+}
+
+
+/*! Same as defer() but the value c of the diagonal inside pixel is recorded
+ * immediately because it includes the marks at the time of the trace.
+ */
+static inline void defer_val(interp_t *ip, const memimg_t *mem, int base, int sign, int c, int gx, int gy)
+{
+   ip->base = base;
+   ip->sign = sign;
+   ip->cval = 1;
+   ip->c = c;
+   ip->g = (long) gy * mem->width + gx;
+}
+
+
+//! The coordinate is base, the walker reached the border of the image.
+static inline void defer_none(interp_t *ip, int base)
+{
+   ip->base = base;
+   ip->sign = 0;
+}
+
+
+/*! Get numerator and denominator of the fraction of a recipe.
+ */
+static inline void interp_args(const memimg_t *mem, int v, const interp_t *ip, int *num, int *den)
+{
+   int c;
+
+   if (!ip->sign)
+   {
+      *num = 0;
+      *den = 1;
+      return;
+   }
+
+   c = ip->cval ? (int) ip->c : mem->mem[ip->c];
+   *num = v - c;
+   *den = (mem->mem[ip->g] & ~VALL) - c;
+}
+
+
+/*! Calculate f[i] = base[i] + sign[i] * num[i] / den[i], two at a time with
+ * SSE2. The results are the same as with the scalar code.
+ */
+static void interp_div(const int *num, const int *den, const double *base, const double *sign, double *f, int n)
+{
+   int i = 0;
+
+#ifdef __SSE2__
+   __m128d q;
+
+   for (; i + 1 < n; i += 2)
+   {
+      q = _mm_div_pd(_mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*) &num[i])),
+            _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i*) &den[i])));
+      _mm_storeu_pd(&f[i], _mm_add_pd(_mm_loadu_pd(&base[i]), _mm_mul_pd(_mm_loadu_pd(&sign[i]), q)));
+   }
+#endif
+   for (; i < n; i++)
+      f[i] = base[i] + sign[i] * ((double) num[i] / den[i]);
+}
+
+
+/*! Calculate the subpixel coordinates of vertices traced by scan0(). This
+ * is done in blocks of IBLOCK vertices, thus only the vertices which survive
+ * reduce() are interpolated.
+ * @param mem Pointer to image. It must still have the same pixel values, the
+ * marks don't matter.
+ * @param v Layer value.
+ * @param p Pointer to the vertices. Member xf has to contain the index of
+ * the vertex into cross as set by scan0().
+ * @param n Number of vertices.
+ * @param cross Recipes of the vertices as returned by scan0().
+ */
+void interpolate(const memimg_t *mem, int v, pos_t *p, int n, const crossing_t *cross)
+{
+   int num[2 * IBLOCK], den[2 * IBLOCK];
+   double base[2 * IBLOCK], sign[2 * IBLOCK], f[2 * IBLOCK];
+   const crossing_t *cr;
+   int i, k, m;
+
+   for (i = 0; i < n; i += IBLOCK)
+   {
+      m = n - i < IBLOCK ? n - i : IBLOCK;
+      for (k = 0; k < m; k++)
+      {
+         cr = &cross[(long) p[i + k].xf];
+         interp_args(mem, v, &cr->x, &num[2 * k], &den[2 * k]);
+         interp_args(mem, v, &cr->y, &num[2 * k + 1], &den[2 * k + 1]);
+         base[2 * k] = cr->x.base;
+         base[2 * k + 1] = cr->y.base;
+         sign[2 * k] = cr->x.sign;
+         sign[2 * k + 1] = cr->y.sign;
+      }
+
+      interp_div(num, den, base, sign, f, 2 * m);
+
+      for (k = 0; k < m; k++)
+      {
+         p[i + k].xf = f[2 * k];
+         p[i + k].yf = f[2 * k + 1];
+      }
+   }
+}
+
+
+/*! Find the next set (or cleared) bit in a row of the threshold mask.
+ * @param row Pointer to the first word of the row.
+ * @param x Position to start at.
+ * @param width Number of pixels of the row.
+ * @param set 1 to find a set bit, 0 to find a cleared bit.
+ * @return The position of the bit or width if there is none.
+ */
+static int mask_find(const uint64_t *row, int x, int width, int set)
+{
+   int i = x >> 6, nw = (width + 63) >> 6;
+   uint64_t w;
+
+   if (x >= width)
+      return width;
+   w = (set ? row[i] : ~row[i]) & (~(uint64_t) 0 << (x & 63));
+   while (!w)
+   {
+      if (++i >= nw)
+         return width;
+      w = set ? row[i] : ~row[i];
+   }
+
+   x = (i << 6) + __builtin_ctzll(w);
+   return x < width ? x : width;
+}
+
+
+/*! Find the previous cleared bit in a row of the threshold mask, i.e. the
+ * first outside pixel left of x.
+ * @param row Pointer to the first word of the row.
+ * @param x Position to start at, the bit at x is not tested.
+ * @return The position of the bit or -1 if there is none.
+ */
+static int mask_rfind0(const uint64_t *row, int x)
+{
+   int i;
+   uint64_t w;
+
+   if (--x < 0)
+      return -1;
+   i = x >> 6;
+   w = ~row[i] & (~(uint64_t) 0 >> (63 - (x & 63)));
+   while (!w)
+   {
+      if (--i < 0)
+         return -1;
+      w = ~row[i];
+   }
+
+   return (i << 6) + 63 - __builtin_clzll(w);
+}
+
+
+/*! This is next_unvisited() on the threshold mask. Within a run of inside
+ * pixels only the first one can be a seed, because all following pixels are
+ * "in" if it is marked. Thus the marks are read only once per run.
+ */
+static int next_unvisited_mask(const memimg_t *mem, pos_t *p)
+{
+   const uint64_t *row;
+   long cnt = 0;
+   int x;
+
+   for (; p->y < mem->height; p->y++, p->x = 0)
+   {
+      row = mem->mask + (size_t) p->y * mem->mstride;
+      for (x = p->x; (x = mask_find(row, x, mem->width, 1)) < mem->width; x = mask_find(row, x, mem->width, 0))
+      {
+         if (!(memimg_get(mem, x, p->y) & VALL))
+         {
+            if (stats_cur_ != NULL)
+               stats_cur_->pixels += cnt + x - p->x + 1;
+            p->x = x;
+            return 1;
+         }
+      }
+      cnt += mem->width - p->x;
+   }
+   if (stats_cur_ != NULL)
+      stats_cur_->pixels += cnt;
+   return 0;
+}
 
 
 int next_unvisited(const memimg_t *mem, pos_t *p, int v)
 {
+   long cnt = 0;
    int c, in;
 
+   if (mem->mask_v == v)
+      return next_unvisited_mask(mem, p);
+
    for (; p->y < mem->height; p->y++)
    {
       in = 0;
-      for (; p->x < mem->width; p->x++)
+      for (; p->x < mem->width; p->x++, cnt++)
       {
          c = memimg_get(mem, p->x, p->y);
          if ((c & ~VALL) < v)
@@ -55,17 +478,23 @@ int next_unvisited(const memimg_t *mem, pos_t *p, int v)
          }
 
          if (!in)
+         {
+            if (stats_cur_ != NULL)
+               stats_cur_->pixels += cnt + 1;
             return 1;
+         }
       }
       p->x = 0;
    }
+   if (stats_cur_ != NULL)
+      stats_cur_->pixels += cnt;
    return 0;
 }
 
 
 int is_inside(const memimg_t *mem, int v, const pos_t *pos)
 {
-   return memimg_get(mem, pos->x, pos->y) >= v;
+   return inside(mem, v, pos->x, pos->y);
 }
 
 
@@ -78,33 +507,37 @@ void set_dir(int *dirp, int dir)
 
 void clear_marks(memimg_t *mem)
 {
-   int x, y;
+   int *p = mem->mem + (size_t) mem->y0 * mem->width;
+   int *e = mem->mem + (size_t) mem->height * mem->width;
 
-   for (y = 0; y < mem->height; y++)
-      for (x = 0; x < mem->width; x++)
-         memimg_and(mem, x, y, ~VALL);
+   // this runs once per layer over the whole image, thus the bounds checks
+   // of memimg_and() are avoided
+   for (; p < e; p++)
+      *p &= ~VALL;
 }
 
 
 int scan_inside_down0(const memimg_t *mem, int v, pos_t *pos, int *dir, int mark)
 {
-   int c;
-
    set_dir(dir, LEFT);
 
-   for (; pos->y > 0; pos->y--)
+   for (; pos->y > mem->y0; pos->y--)
    {
       if (mark)
-         memimg_or((memimg_t*) mem, pos->x, pos->y, VRIGHT);
+      {
+         if (leave_rows(pos->y))
+            return pos->y;
+         set_mark(mem, pos->x, pos->y, VRIGHT);
+      }
 
-      if ((c = memimg_get(mem, pos->x, pos->y - 1)) < v)
+      if (!inside(mem, v, pos->x, pos->y - 1))
       {
-         pos->yf = pos->y - (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.y, mem, pos->y, -1, pos->x, pos->y - 1, pos->x, pos->y);
          return pos->y;
       }
    }
 
-   pos->yf = pos->y;
+   defer_none(&cur_.y, pos->y);
    return pos->y;
 }
 
@@ -115,24 +548,40 @@ int scan_inside_down(const memimg_t *mem, int v, pos_t *pos, int *dir)
 }
 
 
+/*! Walk left on the lowest row. This is the only walker which sets VUP on
+ * this row (see scan_sideway_left0()), and it always walks to the left end
+ * of the run, thus if a pixel has VUP, all pixels up to the end have it as
+ * well. This is the case for every seed above the run which is not the
+ * first one, because find_lowercorner() walks here from all of them. Then
+ * the marks are not set again, unless they are journaled.
+ */
 int scan_inside_left(const memimg_t *mem, int v, pos_t *pos, int *dir)
 {
-   int c;
-
    set_dir(dir, UP);
 
    for (; pos->x > 0; pos->x--)
    {
-      memimg_or((memimg_t*) mem, pos->x, pos->y, VUP);
+      if (journal_ == NULL && (memimg_get(mem, pos->x, pos->y) & VUP))
+      {
+         if (mem->mask_v == v)
+            pos->x = mask_rfind0(mem->mask + (size_t) pos->y * mem->mstride, pos->x) + 1;
+         else
+            for (; pos->x > 0 && inside(mem, v, pos->x - 1, pos->y); pos->x--);
+         if (!pos->x)
+            break;
+         defer(&cur_.x, mem, pos->x, -1, pos->x - 1, pos->y, pos->x, pos->y);
+         return pos->x;
+      }
+      set_mark(mem, pos->x, pos->y, VUP);
 
-      if ((c = memimg_get(mem, pos->x - 1, pos->y)) < v)
+      if (!inside(mem, v, pos->x - 1, pos->y))
       {
-         pos->xf = pos->x - (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.x, mem, pos->x, -1, pos->x - 1, pos->y, pos->x, pos->y);
          return pos->x;
       }
    }
 
-   pos->xf = pos->x;
+   defer_none(&cur_.x, pos->x);
    return pos->x;
 }
 
@@ -145,24 +594,28 @@ int scan_sideway_down(const memimg_t *mem, int v, pos_t *pos, int *dir)
       return scan_inside_down(mem, v, pos, dir);
 
    set_dir(dir, LEFT);
-   for (; pos->y > 0; pos->y--)
+   for (; pos->y > mem->y0; pos->y--)
    {
-      memimg_or((memimg_t*) mem, pos->x, pos->y, VRIGHT);
+      if (leave_rows(pos->y))
+         return pos->y;
+      set_mark(mem, pos->x, pos->y, VRIGHT);
 
-      if ((c = memimg_get(mem, pos->x, pos->y - 1)) < v)
+      if (!inside(mem, v, pos->x, pos->y - 1))
       {
-         pos->yf = pos->y - (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.y, mem, pos->y, -1, pos->x, pos->y - 1, pos->x, pos->y);
          return pos->y;
       }
-      if ((c = memimg_get(mem, pos->x + 1, pos->y - 1)) >= v)
+      if (inside(mem, v, pos->x + 1, pos->y - 1))
       {
-         pos->yf = pos->y - (double) (v - c) / (memimg_get0(mem, pos->x + 1, pos->y) - c);
+         c = memimg_get(mem, pos->x + 1, pos->y - 1);
+         used_inside(mem, pos->x + 1, pos->y - 1, c);
+         defer_val(&cur_.y, mem, pos->y, -1, c, pos->x + 1, pos->y);
          set_dir(dir, RIGHT);
          return --pos->y;
       }
    }
 
-   pos->yf = pos->y;
+   defer_none(&cur_.y, pos->y);
    return pos->y;
 }
 
@@ -196,29 +649,31 @@ int scan_sideway_left0(const memimg_t *mem, int v, pos_t *pos, int *dir, int mar
 {
    int c;
 
-   if (!pos->y)
+   if (pos->y == mem->y0)
       return scan_inside_left(mem, v, pos, dir);
 
    set_dir(dir, UP);
    for (; pos->x > 0; pos->x--)
    {
       if (mark)
-         memimg_or((memimg_t*) mem, pos->x, pos->y, VUP);
+         set_mark(mem, pos->x, pos->y, VUP);
 
-      if ((c = memimg_get(mem, pos->x - 1, pos->y)) < v)
+      if (!inside(mem, v, pos->x - 1, pos->y))
       {
-         pos->xf = pos->x - (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.x, mem, pos->x, -1, pos->x - 1, pos->y, pos->x, pos->y);
          return pos->x;
       }
-      if ((c = memimg_get(mem, pos->x - 1, pos->y - 1)) >= v)
+      if (inside(mem, v, pos->x - 1, pos->y - 1))
       {
-         pos->xf = pos->x - (double) (v - c) / (memimg_get0(mem, pos->x, pos->y - 1) - c);
+         c = memimg_get(mem, pos->x - 1, pos->y - 1);
+         used_inside(mem, pos->x - 1, pos->y - 1, c);
+         defer_val(&cur_.x, mem, pos->x, -1, c, pos->x, pos->y - 1);
          set_dir(dir, DOWN);
          return --pos->x;
       }
    }
 
-   pos->xf = pos->x;
+   defer_none(&cur_.x, pos->x);
    return pos->x;
 }
 
@@ -231,44 +686,42 @@ int scan_sideway_left(const memimg_t *mem, int v, pos_t *pos, int *dir)
 
 int scan_inside_up(const memimg_t *mem, int v, pos_t *pos, int *dir)
 {
-   int c;
-
    set_dir(dir, RIGHT);
 
    for (; pos->y < mem->height - 1; pos->y++)
    {
-      memimg_or((memimg_t*) mem, pos->x, pos->y, VLEFT);
+      if (leave_rows(pos->y))
+         return pos->y;
+      set_mark(mem, pos->x, pos->y, VLEFT);
 
-      if ((c = memimg_get(mem, pos->x, pos->y + 1)) < v)
+      if (!inside(mem, v, pos->x, pos->y + 1))
       {
-         pos->yf = pos->y + (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.y, mem, pos->y, 1, pos->x, pos->y + 1, pos->x, pos->y);
          return pos->y;
       }
    }
 
-   pos->yf = pos->y;
+   defer_none(&cur_.y, pos->y);
    return pos->y;
 }
 
 
 int scan_inside_right(const memimg_t *mem, int v, pos_t *pos, int *dir)
 {
-   int c;
-
    set_dir(dir, DOWN);
 
    for (; pos->x < mem->width - 1; pos->x++)
    {
-      memimg_or((memimg_t*) mem, pos->x, pos->y, VDOWN);
+      set_mark(mem, pos->x, pos->y, VDOWN);
 
-      if ((c = memimg_get(mem, pos->x + 1, pos->y)) < v)
+      if (!inside(mem, v, pos->x + 1, pos->y))
       {
-         pos->xf = pos->x + (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.x, mem, pos->x, 1, pos->x + 1, pos->y, pos->x, pos->y);
          return pos->x;
       }
    }
 
-   pos->xf = pos->x;
+   defer_none(&cur_.x, pos->x);
    return pos->x;
 }
 
@@ -283,22 +736,26 @@ int scan_sideway_up(const memimg_t *mem, int v, pos_t *pos, int *dir)
    set_dir(dir, RIGHT);
    for (; pos->y < mem->height - 1; pos->y++)
    {
-      memimg_or((memimg_t*) mem, pos->x, pos->y, VLEFT);
+      if (leave_rows(pos->y))
+         return pos->y;
+      set_mark(mem, pos->x, pos->y, VLEFT);
 
-      if ((c = memimg_get(mem, pos->x, pos->y + 1)) < v)
+      if (!inside(mem, v, pos->x, pos->y + 1))
       {
-         pos->yf = pos->y + (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.y, mem, pos->y, 1, pos->x, pos->y + 1, pos->x, pos->y);
          return pos->y;
       }
-      if ((c = memimg_get(mem, pos->x - 1, pos->y + 1)) >= v)
+      if (inside(mem, v, pos->x - 1, pos->y + 1))
       {
-         pos->yf = pos->y + (double) (v - c) / (memimg_get0(mem, pos->x - 1, pos->y) - c);
+         c = memimg_get(mem, pos->x - 1, pos->y + 1);
+         used_inside(mem, pos->x - 1, pos->y + 1, c);
+         defer_val(&cur_.y, mem, pos->y, 1, c, pos->x - 1, pos->y);
          set_dir(dir, LEFT);
          return ++pos->y;
       }
    }
 
-   pos->yf = pos->y;
+   defer_none(&cur_.y, pos->y);
    return pos->y;
 }
 
@@ -313,22 +770,24 @@ int scan_sideway_right(const memimg_t *mem, int v, pos_t *pos, int *dir)
    set_dir(dir, DOWN);
    for (; pos->x < mem->width - 1; pos->x++)
    {
-      memimg_or((memimg_t*) mem, pos->x, pos->y, VDOWN);
+      set_mark(mem, pos->x, pos->y, VDOWN);
 
-      if ((c = memimg_get(mem, pos->x + 1, pos->y)) < v)
+      if (!inside(mem, v, pos->x + 1, pos->y))
       {
-         pos->xf = pos->x + (double) (v - c) / (memimg_get0(mem, pos->x, pos->y) - c);
+         defer(&cur_.x, mem, pos->x, 1, pos->x + 1, pos->y, pos->x, pos->y);
          return pos->x;
       }
-      if ((c = memimg_get(mem, pos->x + 1, pos->y + 1)) >= v)
+      if (inside(mem, v, pos->x + 1, pos->y + 1))
       {
-         pos->xf = pos->x + (double) (v - c) / (memimg_get0(mem, pos->x, pos->y + 1) - c);
+         c = memimg_get(mem, pos->x + 1, pos->y + 1);
+         used_inside(mem, pos->x + 1, pos->y + 1, c);
+         defer_val(&cur_.x, mem, pos->x, 1, c, pos->x, pos->y + 1);
          set_dir(dir, UP);
          return ++pos->x;
       }
    }
 
-   pos->xf = pos->x;
+   defer_none(&cur_.x, pos->x);
    return pos->x;
 }
 
@@ -341,15 +800,260 @@ void find_lowercorner(const memimg_t *mem, int v, pos_t *pos, int *scan_dir)
 }
 
 
+/*! Same as find_lowercorner() but the walk down is skipped because the
+ * lowest row of the vertical run of inside pixels at pos is known already.
+ * @param bottom Lowest row of the run, see column_bottom().
+ */
+void find_lowercorner_at(const memimg_t *mem, int v, pos_t *pos, int *scan_dir, int bottom)
+{
+   pos->y = bottom;
+   if (bottom > mem->y0)
+      defer(&cur_.y, mem, bottom, -1, pos->x, bottom - 1, pos->x, bottom);
+   else
+      defer_none(&cur_.y, bottom);
+   scan_sideway_left0(mem, v, pos, scan_dir, 0);
+}
+
+
+/*! Update the lowest rows of the vertical runs of inside pixels. After the
+ * call, bot[x] is the lowest row of the run which contains pixel x of row
+ * y1 - 1, if this pixel is inside. The rows have to be passed in ascending
+ * order, starting at mem->y0, and the threshold mask has to be valid.
+ * @param bot Array of mem->width rows.
+ * @param y0 First row to update.
+ * @param y1 Row after the last row to update.
+ */
+void column_bottom(const memimg_t *mem, int *bot, int y0, int y1)
+{
+   const uint64_t *row;
+   uint64_t w;
+
+   for (int y = y0; y < y1; y++)
+   {
+      row = mem->mask + (size_t) y * mem->mstride;
+      for (int i = 0; i < mem->mstride; i++)
+      {
+         // inside pixels above an outside pixel
+         w = y > mem->y0 ? row[i] & ~row[i - mem->mstride] : row[i];
+         for (; w; w &= w - 1)
+            bot[(i << 6) + __builtin_ctzll(w)] = y;
+      }
+   }
+}
+
+
+/*! Find the next run of inside pixels of row p->y which starts at p->x or
+ * right of it. The threshold mask has to be valid.
+ * @param end Set to the pixel after the run.
+ * @return 1 if there is a run, p->x is set to its first pixel, otherwise 0.
+ */
+int next_run(const memimg_t *mem, pos_t *p, int *end)
+{
+   const uint64_t *row = mem->mask + (size_t) p->y * mem->mstride;
+
+   if ((p->x = mask_find(row, p->x, mem->width, 1)) >= mem->width)
+      return 0;
+   *end = mask_find(row, p->x, mem->width, 0);
+   return 1;
+}
+
+
+/*! Move the walker by one step into direction *dir, i.e. call the walker
+ * function of the direction. If the walkers are limited to the rows of
+ * fragments (see tracer_fragment()), a vertical step may be stopped at the
+ * first row outside of them. It is continued by calling trace_step() with
+ * the same direction at the returned position, which does exactly the same
+ * as the uninterrupted step.
+ * @param ip Pointer to a variable which receives the recipe of the
+ * coordinate which was changed by the step, may be NULL. It is not set if
+ * the step was stopped.
+ * @return 1 if the step was stopped, otherwise 0.
+ */
+int trace_step(const memimg_t *mem, int v, pos_t *pos, int *dir, interp_t *ip)
+{
+   int kind = *dir;
+
+   midrun_ = 0;
+   switch (kind)
+   {
+      case LEFT:
+         scan_sideway_left(mem, v, pos, dir);
+         break;
+
+      case RIGHT:
+         scan_sideway_right(mem, v, pos, dir);
+         break;
+
+      case UP:
+         scan_sideway_up(mem, v, pos, dir);
+         break;
+
+      case DOWN:
+         scan_sideway_down(mem, v, pos, dir);
+         break;
+
+      default:
+         log_msg(LOG_EMERG, "This should never happen...");
+         exit(1);
+   }
+
+   if (midrun_)
+   {
+      *dir = kind;
+      return 1;
+   }
+
+   if (ip != NULL)
+      *ip = kind == LEFT || kind == RIGHT ? cur_.x : cur_.y;
+   return 0;
+}
+
+
+/*! Repeat a step which was recorded with trace_step() by another thread in
+ * fragment mode. The marks are set and the pixel diagonal to a turn is read
+ * for the recipe, exactly as trace_step() would do it at this time, but no
+ * pixel is tested.
+ * @param mem Pointer to image.
+ * @param dir Direction of the step.
+ * @param from Position before the step.
+ * @param to Position after the step.
+ * @param midrun 1 if the step was stopped by trace_step().
+ * @param ip Recipe of the step, unused if midrun is set.
+ */
+void replay_step(memimg_t *mem, int dir, const pos_t *from, const pos_t *to, int midrun, const interp_t *ip)
+{
+   int dx = 0, dy = 0, f, n, c;
+   int *p;
+
+   switch (dir)
+   {
+      case LEFT:
+         dx = -1;
+         f = VUP;
+         break;
+
+      case RIGHT:
+         dx = 1;
+         f = VDOWN;
+         break;
+
+      case UP:
+         dy = 1;
+         f = VLEFT;
+         break;
+
+      default:
+         dy = -1;
+         f = VRIGHT;
+   }
+
+   // the end position is marked only if the walker stopped at an outside
+   // pixel, after a turn it is already one pixel further
+   n = abs(to->x - from->x) + abs(to->y - from->y) + (!midrun && ip->sign && !ip->cval);
+   if (journal_ != NULL)
+      for (int i = 0; i < n; i++)
+         set_mark(mem, from->x + i * dx, from->y + i * dy, f);
+   else
+      for (p = &mem->mem[(long) from->y * mem->width + from->x]; n; n--, p += dx + dy * mem->width)
+         *p |= f;
+
+   if (midrun)
+      return;
+
+   if (dx)
+      cur_.x = *ip;
+   else
+      cur_.y = *ip;
+
+   if (ip->sign && ip->cval)
+   {
+      c = memimg_get(mem, to->x - dy, to->y + dx);
+      used_inside(mem, to->x - dy, to->y + dx, c);
+      if (dx)
+         cur_.x.c = c;
+      else
+         cur_.y.c = c;
+   }
+}
+
+
 static int poscmp(const pos_t *a, const pos_t *b)
 {
    return !(a->x == b->x && a->y == b->y);
 }
 
 
-int scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist)
+/*! Append the current position and its recipes to the vertex list. The
+ * index of the vertex is stored in xf for interpolate().
+ * @return 0 on success, -1 on error.
+ */
+static int add_vertex(const pos_t *pos, pos_t **plist, crossing_t **cross, int n, int *size)
+{
+   crossing_t *tcr;
+   pos_t *tpos;
+
+   if (n >= *size)
+   {
+      if ((tpos = mt_realloc(MT_CONTOUR, *plist, sizeof(*tpos) * *size * 2)) == NULL)
+         return -1;
+      *plist = tpos;
+      if ((tcr = mt_realloc(MT_CONTOUR, *cross, sizeof(*tcr) * *size * 2)) == NULL)
+         return -1;
+      *cross = tcr;
+      *size *= 2;
+   }
+
+   (*plist)[n] = *pos;
+   (*plist)[n].xf = n;
+   (*plist)[n].yf = 0;
+   (*cross)[n] = cur_;
+   return 0;
+}
+
+
+/*! Add vertex n to the shape of the contour.
+ */
+static void add_shape(shape_t *sh, const pos_t *p, int n)
+{
+   if (sh == NULL)
+      return;
+
+   if (!n)
+   {
+      sh->x0 = sh->x1 = p[0].x;
+      sh->y0 = sh->y1 = p[0].y;
+      sh->area2 = sh->perim = 0;
+      return;
+   }
+
+   if (p[n].x < sh->x0)
+      sh->x0 = p[n].x;
+   if (p[n].x > sh->x1)
+      sh->x1 = p[n].x;
+   if (p[n].y < sh->y0)
+      sh->y0 = p[n].y;
+   if (p[n].y > sh->y1)
+      sh->y1 = p[n].y;
+
+   sh->area2 += (long) p[n - 1].x * p[n].y - (long) p[n].x * p[n - 1].y;
+   // the walkers move along one axis only
+   sh->perim += abs(p[n].x - p[n - 1].x) + abs(p[n].y - p[n - 1].y);
+}
+
+
+/*! Trace a contour like scan() but without calculating the subpixel
+ * coordinates. Instead, a recipe is recorded for each vertex, which has to
+ * be passed to interpolate() after the vertex list was reduced.
+ * @param cross Pointer to a variable which receives the recipes. They have
+ * to be freed with mt_free() after interpolate(). It is set only if the
+ * return value is greater than 0.
+ * @param sh Pointer to a variable which receives the shape of the contour,
+ * may be NULL.
+ * @return The number of vertices, 0 if the contour was visited already, or
+ * -1 on error.
+ */
+int scan0(memimg_t *mem, int v, pos_t *pos, pos_t **plist, crossing_t **cross, shape_t *sh)
 {
-   int i, n;
    int scan_dir;
 
    // make sure point is inside
@@ -364,11 +1068,36 @@ int scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist)
       return 0;
    }
 
-   // reserver memory for the 1st 2 pos elements
-   if ((*plist = malloc(sizeof(**plist))) == NULL)
+   return scan_corner(mem, v, pos, scan_dir, NULL, NULL, plist, cross, sh);
+}
+
+
+/*! Trace a contour from its lower corner, i.e. this is scan0() after
+ * find_lowercorner() (or find_lowercorner_at()), which has to be called
+ * before by the same thread.
+ * @param pos Position of the lower corner.
+ * @param scan_dir Direction returned by find_lowercorner().
+ * @param step Function which moves the walker, NULL for trace_step(). If it
+ * returns 1, the step is continued by calling it again.
+ * @param arg Argument passed to step.
+ * @return The number of vertices or -1 on error, see scan0().
+ */
+int scan_corner(memimg_t *mem, int v, pos_t *pos, int scan_dir, step_func_t step, void *arg, pos_t **plist, crossing_t **cross, shape_t *sh)
+{
+   int i, n, size;
+
+   size = 16;
+   *plist = mt_malloc(MT_CONTOUR, size * sizeof(**plist));
+   *cross = mt_malloc(MT_CONTOUR, size * sizeof(**cross));
+   if (*plist == NULL || *cross == NULL)
+   {
+      mt_free(*plist);
+      mt_free(*cross);
       return -1;
+   }
 
-   (*plist)[0] = *pos;
+   add_vertex(pos, plist, cross, 0, &size);
+   add_shape(sh, *plist, 0);
 
    for (n = 1, i = 0; ; i++)
    {
@@ -394,40 +1123,20 @@ int scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist)
          break;
       }
 
-      switch (scan_dir)
-      {
-         case LEFT:
-            scan_sideway_left(mem, v, pos, &scan_dir);
-            break;
-
-         case RIGHT:
-            scan_sideway_right(mem, v, pos, &scan_dir);
-            break;
-
-         case UP:
-            scan_sideway_up(mem, v, pos, &scan_dir);
-            break;
-
-         case DOWN:
-            scan_sideway_down(mem, v, pos, &scan_dir);
-            break;
-
-         default:
-            log_msg(LOG_EMERG, "This should never happen...");
-            exit(1);
-      } // switch (scan_dir)
+      if (step == NULL)
+         trace_step(mem, v, pos, &scan_dir, NULL);
+      else
+         while (step(mem, v, pos, &scan_dir, arg) == 1);
 
       // ignore duplicates
       if (poscmp(&(*plist)[n - 1], pos))
       {
-         pos_t *tpos;
-         if ((tpos = realloc(*plist, sizeof(*tpos) * (n + 1))) == NULL)
+         if (add_vertex(pos, plist, cross, n, &size) == -1)
          {
             log_errno(LOG_ERR, "realloc()");
             return n;
          }
-         *plist = tpos;
-         (*plist)[n] = *pos;
+         add_shape(sh, *plist, n);
          n++;
       }
    } // for (n = 1, i = 0; ; i++)
@@ -435,8 +1144,22 @@ int scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist)
    log_debug("%d iterations, %d points", i + 1, n);
 
    if (n == 1)
-      memimg_or(mem, (*plist)[0].x, (*plist)[0].y, VALL);
+      set_mark(mem, (*plist)[0].x, (*plist)[0].y, VALL);
 
    return n;
 }
 
+
+int scan(memimg_t *mem, int v, pos_t *pos, pos_t **plist)
+{
+   crossing_t *cross;
+   int n;
+
+   if ((n = scan0(mem, v, pos, plist, &cross, NULL)) > 0)
+   {
+      interpolate(mem, v, *plist, n, cross);
+      mt_free(cross);
+   }
+   return n;
+}
+
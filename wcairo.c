@@ -29,6 +29,7 @@
 #include "scan.h"
 #include "memimg.h"
 #include "smlog.h"
+#include "memtrack.h"
 
 
 uint32_t color(int c)
@@ -182,6 +183,7 @@ void memcairo(const memimg_t *mem, const char *s)
 int cairomem(memimg_t *mem, const char *s)
 {
    cairo_surface_t *sfc;
+   long size;
 
    // safety check
    if (mem == NULL || s == NULL)
@@ -193,15 +195,22 @@ int cairomem(memimg_t *mem, const char *s)
 
    mem->width = cairo_image_surface_get_width(sfc);
    mem->height = cairo_image_surface_get_height(sfc);
+   size = (long) cairo_image_surface_get_stride(sfc) * mem->height;
+   mt_account(MT_CAIRO, size);
 
    if (memimg_init(mem) == -1)
+   {
+      cairo_surface_destroy(sfc);
+      mt_account(MT_CAIRO, -size);
       return -1;
+   }
 
    for (int y = 0; y < mem->height; y++)
       for (int x = 0; x < mem->width; x++)
          memimg_put(mem, x, y, cairo_smr_get_pixel(sfc, x, y));
 
    cairo_surface_destroy(sfc);
+   mt_account(MT_CAIRO, -size);
    return 0;
 }
 
@@ -0,0 +1,650 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file wgis.c
+ * This file contains the writers of GeoJSON sequences, WKB for COPY into
+ * PostGIS, and FlatGeobuf files. Each contour is a LineString with the
+ * attribute ele, a contour of a single vertex (a summit) is a Point with the
+ * value of its pixel. The vertices and their coordinates are those of the
+ * OSM output (see osm_coord()). The features are written while the contours
+ * are decoded, only the index of a FlatGeobuf file is kept in memory.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include "scan.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! number of children of a node of the FlatGeobuf index
+#define FGB_NODESIZE 16
+//! bytes of a node of the FlatGeobuf index
+#define FGB_NODEBYTES 40
+//! bytes of the header and of a feature without coordinates, each
+//! including its size prefix, see fgb_header() and fgb_feature()
+#define FGB_HDRBYTES 160
+#define FGB_FEATBYTES 80
+//! FlatGeobuf column type of doubles
+#define FGB_DOUBLE 10
+//! number of vertices written at once
+#define GEO_CHUNK 256
+
+//! geometry types of WKB and FlatGeobuf
+enum {GEO_UNKNOWN, GEO_POINT, GEO_LINESTRING};
+
+
+//! entry of the FlatGeobuf index
+typedef struct fgb_node
+{
+   //! bounding box
+   double x0, y0, x1, y1;
+   //! offset of the feature (leaves) or index of the first child
+   uint64_t off;
+} fgb_node_t;
+
+//! feature of a FlatGeobuf file
+typedef struct fgb_item
+{
+   fgb_node_t nd;
+   //! layer, contour, and number of vertices
+   int j, k, n;
+   uint32_t h;
+} fgb_item_t;
+
+
+/*! Start to iterate over the vertices of contour k of layer l. The
+ * vertices are those of the OSM way, i.e. the first vertex of a closed
+ * contour is repeated at the end.
+ * @return The number of vertices, 1 if the feature is a point, or 0 if the
+ * contour has no vertices.
+ */
+int geo_iter(geo_iter_t *g, const layer_t *l, int k, const memimg_t *mem)
+{
+   contour_iter(&g->it, l, k);
+   g->mem = mem;
+   g->i = 0;
+   g->m = l->n[k] - contour_closed(l, k);
+   g->n = g->m > 1 ? l->n[k] : g->m == 1;
+   return g->n;
+}
+
+
+/*! Get the geo coordinates of the next vertex.
+ * @return 1 on success, 0 if there are no more vertices.
+ */
+int geo_next(geo_iter_t *g, double *x, double *y)
+{
+   pos_t p;
+
+   if (g->i >= g->n)
+      return 0;
+
+   if (g->i < g->m)
+   {
+      if (!contour_next(&g->it, &p))
+         return 0;
+      if (!g->i)
+         g->first = p;
+   }
+   else
+      p = g->first;
+
+   g->i++;
+   osm_coord(&p, g->mem, x, y);
+   return 1;
+}
+
+
+/*! Return the elevation of a feature with n vertices in real units. The
+ * elevation of a point is the value of its pixel.
+ */
+double geo_ele(const layer_t *l, int k, int n, const memimg_t *mem)
+{
+   chain_iter_t it;
+   pos_t p;
+
+   contour_iter(&it, l, k);
+   if (n == 1 && contour_next(&it, &p))
+      return val_real(memimg_get(mem, p.x, p.y) & ~VALL);
+   return val_real(l->v);
+}
+
+
+static uint64_t dbits(double d)
+{
+   uint64_t v;
+
+   memcpy(&v, &d, sizeof(v));
+   return v;
+}
+
+
+static uint8_t *put_le(uint8_t *b, uint64_t v, int n)
+{
+   for (int i = 0; i < n; i++, v >>= 8)
+      *b++ = v;
+   return b;
+}
+
+
+static uint8_t *put_be(uint8_t *b, uint64_t v, int n)
+{
+   for (int i = n - 1; i >= 0; i--)
+      *b++ = v >> 8 * i;
+   return b;
+}
+
+
+/*! Write bytes to a file, or their hex digits if hex is set.
+ */
+static void geo_bytes(FILE *f, const uint8_t *b, size_t len, int hex)
+{
+   static const char dig[] = "0123456789ABCDEF";
+   char buf[GEO_CHUNK * 2];
+   size_t n;
+
+   if (!hex)
+   {
+      fwrite(b, 1, len, f);
+      return;
+   }
+
+   while (len)
+   {
+      for (n = 0; n < sizeof(buf) / 2 && len; n++, len--, b++)
+      {
+         buf[2 * n] = dig[*b >> 4];
+         buf[2 * n + 1] = dig[*b & 15];
+      }
+      fwrite(buf, 1, 2 * n, f);
+   }
+}
+
+
+/*! Write the remaining vertices of a feature as little endian doubles x, y.
+ */
+static void geo_coords(FILE *f, geo_iter_t *g, int hex)
+{
+   uint8_t buf[GEO_CHUNK * 16], *b = buf;
+   double x, y;
+
+   while (geo_next(g, &x, &y))
+   {
+      b = put_le(b, dbits(x), 8);
+      b = put_le(b, dbits(y), 8);
+      if (b == buf + sizeof(buf))
+      {
+         geo_bytes(f, buf, b - buf, hex);
+         b = buf;
+      }
+   }
+   geo_bytes(f, buf, b - buf, hex);
+}
+
+
+static void geojson_feature(FILE *f, const layer_t *l, int k, const memimg_t *mem)
+{
+   geo_iter_t g;
+   double x, y;
+   int n;
+
+   if (!(n = geo_iter(&g, l, k, mem)))
+      return;
+
+   fprintf(f, "{\"type\":\"Feature\",\"properties\":{\"ele\":%g},\"geometry\":{\"type\":\"%s\",\"coordinates\":",
+         geo_ele(l, k, n, mem), n == 1 ? "Point" : "LineString");
+   for (int i = 0; geo_next(&g, &x, &y); i++)
+      fprintf(f, "%s[%f,%f]", n == 1 ? "" : i ? "," : "[", x, y);
+   fprintf(f, "%s}}\n", n == 1 ? "" : "]");
+}
+
+
+/*! Write all contours as newline-delimited GeoJSON features.
+ * @return 0 on success, -1 on error.
+ */
+int export_geojson(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
+{
+   FILE *f;
+
+   if ((f = out_open(s)) == NULL)
+      return -1;
+
+   for (int j = 0; j < nlayers; j++)
+      for (int i = 0; i < l[j].plist_cnt; i++)
+         geojson_feature(f, &l[j], i, mem);
+
+   return fclose(f) == EOF ? -1 : 0;
+}
+
+
+/*! Write a contour as row of COPY. The columns are ele (double precision)
+ * and the geometry as WKB, in binary format or in text format with the WKB
+ * in hex.
+ */
+static void wkb_feature(FILE *f, const layer_t *l, int k, const memimg_t *mem, int hex)
+{
+   uint8_t buf[32], *b = buf;
+   geo_iter_t g;
+   double ele;
+   int n;
+
+   if (!(n = geo_iter(&g, l, k, mem)))
+      return;
+
+   ele = geo_ele(l, k, n, mem);
+   if (hex)
+      fprintf(f, "%g\t", ele);
+   else
+   {
+      b = put_be(b, 2, 2);
+      b = put_be(b, sizeof(ele), 4);
+      b = put_be(b, dbits(ele), 8);
+      b = put_be(b, n == 1 ? 21 : 9 + 16 * n, 4);
+      fwrite(buf, 1, b - buf, f);
+      b = buf;
+   }
+
+   // little endian WKB
+   *b++ = 1;
+   b = put_le(b, n == 1 ? GEO_POINT : GEO_LINESTRING, 4);
+   if (n > 1)
+      b = put_le(b, n, 4);
+   geo_bytes(f, buf, b - buf, hex);
+   geo_coords(f, &g, hex);
+
+   if (hex)
+      fputc('\n', f);
+}
+
+
+static int wkb_write(const layer_t *l, const char *s, int nlayers, memimg_t *mem, int hex)
+{
+   static const uint8_t sig[] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', 0xff, '\r', '\n', 0, 0, 0, 0, 0, 0, 0, 0, 0};
+   FILE *f;
+
+   if ((f = out_open(s)) == NULL)
+      return -1;
+
+   // signature, flags, and length of the header extension
+   if (!hex)
+      fwrite(sig, 1, sizeof(sig), f);
+
+   for (int j = 0; j < nlayers; j++)
+      for (int i = 0; i < l[j].plist_cnt; i++)
+         wkb_feature(f, &l[j], i, mem, hex);
+
+   // trailer
+   if (!hex)
+      fwrite("\xff\xff", 1, 2, f);
+
+   return fclose(f) == EOF ? -1 : 0;
+}
+
+
+/*! Write all contours in the binary format of COPY, e.g.
+ * COPY contours (ele, geom) FROM 'file' (FORMAT binary).
+ * @return 0 on success, -1 on error.
+ */
+int export_wkb(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
+{
+   return wkb_write(l, s, nlayers, mem, 0);
+}
+
+
+/*! Write all contours in the text format of COPY, i.e. the ele and the hex
+ * WKB separated by a tab.
+ * @return 0 on success, -1 on error.
+ */
+int export_hexwkb(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
+{
+   return wkb_write(l, s, nlayers, mem, 1);
+}
+
+
+/*! Hilbert index of x/y on a 2^16 x 2^16 grid, the algorithm is that of
+ * the reference implementation of FlatGeobuf.
+ */
+static uint32_t hilbert(uint32_t x, uint32_t y)
+{
+   uint32_t a = x ^ y, b = 0xffff ^ a, c = 0xffff ^ (x | y), d = x & (y ^ 0xffff);
+   uint32_t A = a | (b >> 1), B = (a >> 1) ^ a, C = ((c >> 1) ^ (b & (d >> 1))) ^ c, D = ((a & (c >> 1)) ^ (d >> 1)) ^ d;
+   uint32_t i0, i1;
+
+   a = A; b = B; c = C; d = D;
+   A = (a & (a >> 2)) ^ (b & (b >> 2));
+   B = (a & (b >> 2)) ^ (b & ((a ^ b) >> 2));
+   C ^= (a & (c >> 2)) ^ (b & (d >> 2));
+   D ^= (b & (c >> 2)) ^ ((a ^ b) & (d >> 2));
+
+   a = A; b = B; c = C; d = D;
+   A = (a & (a >> 4)) ^ (b & (b >> 4));
+   B = (a & (b >> 4)) ^ (b & ((a ^ b) >> 4));
+   C ^= (a & (c >> 4)) ^ (b & (d >> 4));
+   D ^= (b & (c >> 4)) ^ ((a ^ b) & (d >> 4));
+
+   a = A; b = B; c = C; d = D;
+   C ^= (a & (c >> 8)) ^ (b & (d >> 8));
+   D ^= (b & (c >> 8)) ^ ((a ^ b) & (d >> 8));
+
+   a = C ^ (C >> 1);
+   b = D ^ (D >> 1);
+   i0 = x ^ y;
+   i1 = b | (0xffff ^ (i0 | a));
+
+   i0 = (i0 | (i0 << 8)) & 0x00ff00ff;
+   i0 = (i0 | (i0 << 4)) & 0x0f0f0f0f;
+   i0 = (i0 | (i0 << 2)) & 0x33333333;
+   i0 = (i0 | (i0 << 1)) & 0x55555555;
+   i1 = (i1 | (i1 << 8)) & 0x00ff00ff;
+   i1 = (i1 | (i1 << 4)) & 0x0f0f0f0f;
+   i1 = (i1 | (i1 << 2)) & 0x33333333;
+   i1 = (i1 | (i1 << 1)) & 0x55555555;
+
+   return (i1 << 1) | i0;
+}
+
+
+/*! Sort the features by descending Hilbert index of the center of their
+ * bounding box like the reference implementation.
+ */
+static int fgb_cmp(const void *a, const void *b)
+{
+   const fgb_item_t *x = a, *y = b;
+
+   if (x->h != y->h)
+      return x->h < y->h ? 1 : -1;
+   if (x->j != y->j)
+      return x->j - y->j;
+   return x->k - y->k;
+}
+
+
+static void fgb_expand(fgb_node_t *nd, const fgb_node_t *c)
+{
+   nd->x0 = fmin(nd->x0, c->x0);
+   nd->y0 = fmin(nd->y0, c->y0);
+   nd->x1 = fmax(nd->x1, c->x1);
+   nd->y1 = fmax(nd->y1, c->y1);
+}
+
+
+/*! Collect the bounding boxes of all features.
+ * @param cnt Pointer to a variable which receives the number of features.
+ * @param env Bounding box of all features.
+ * @param type Pointer to a variable which receives the geometry type of the
+ * file, GEO_UNKNOWN if there are points and lines.
+ * @return Array of features sorted by their Hilbert index, or NULL on error.
+ */
+static fgb_item_t *fgb_items(const layer_t *l, int nlayers, const memimg_t *mem, long *cnt, fgb_node_t *env, int *type)
+{
+   fgb_item_t *it, *p;
+   geo_iter_t g;
+   double x, y, w, h;
+   long n = 0;
+   int t;
+
+   for (int j = 0; j < nlayers; j++)
+      n += l[j].plist_cnt;
+   if ((it = mt_malloc(MT_EXPORT, (n + 1) * sizeof(*it))) == NULL)
+      return NULL;
+
+   *env = (fgb_node_t) {INFINITY, INFINITY, -INFINITY, -INFINITY, 0};
+   *type = -1;
+   *cnt = 0;
+   for (int j = 0; j < nlayers; j++)
+      for (int k = 0; k < l[j].plist_cnt; k++)
+      {
+         if (!geo_iter(&g, &l[j], k, mem))
+            continue;
+         p = &it[(*cnt)++];
+         p->nd = (fgb_node_t) {INFINITY, INFINITY, -INFINITY, -INFINITY, 0};
+         p->j = j;
+         p->k = k;
+         p->n = g.n;
+         while (geo_next(&g, &x, &y))
+            fgb_expand(&p->nd, &(fgb_node_t) {x, y, x, y, 0});
+         fgb_expand(env, &p->nd);
+         t = g.n == 1 ? GEO_POINT : GEO_LINESTRING;
+         *type = *type == -1 || *type == t ? t : GEO_UNKNOWN;
+      }
+
+   // empty file
+   if (*type == -1)
+   {
+      *env = (fgb_node_t) {0, 0, 0, 0, 0};
+      *type = GEO_LINESTRING;
+   }
+
+   w = env->x1 - env->x0;
+   h = env->y1 - env->y0;
+   for (long i = 0; i < *cnt; i++)
+   {
+      p = &it[i];
+      p->h = hilbert(w > 0 ? floor(0xffff * ((p->nd.x0 + p->nd.x1) / 2 - env->x0) / w) : 0,
+            h > 0 ? floor(0xffff * ((p->nd.y0 + p->nd.y1) / 2 - env->y0) / h) : 0);
+   }
+   qsort(it, *cnt, sizeof(*it), fgb_cmp);
+
+   return it;
+}
+
+
+/*! Write the header of a FlatGeobuf file. The flatbuffer is built with a
+ * fixed layout, the offsets of its vectors are aligned with respect to the
+ * size prefix like those of the reference implementation.
+ */
+static void fgb_header(FILE *f, const fgb_node_t *env, int type, long cnt)
+{
+   static const uint8_t magic[] = {'f', 'g', 'b', 3, 'f', 'g', 'b', 1};
+   // offsets of name, envelope, geometry_type, has_z/m/t/tm, columns,
+   // features_count, and index_node_size in the table
+   static const uint16_t field[] = {4, 8, 16, 0, 0, 0, 0, 12, 24, 18};
+   uint8_t buf[FGB_HDRBYTES], *b;
+
+   memset(buf, 0, sizeof(buf));
+   b = put_le(buf, FGB_HDRBYTES - 4, 4);
+
+   // root table, its vtable, and the table
+   b = put_le(b, 28, 4);
+   b = put_le(b, 24, 2);
+   b = put_le(b, 32, 2);
+   for (int i = 0; i < 10; i++)
+      b = put_le(b, field[i], 2);
+   b = put_le(b, 24, 4);
+   b = put_le(b, 60 - 32, 4);
+   b = put_le(b, 80 - 36, 4);
+   b = put_le(b, 116 - 40, 4);
+   *b = type;
+   // an empty file has no index
+   b = put_le(b + 2, cnt ? FGB_NODESIZE : 0, 2);
+   b = put_le(b + 4, cnt, 8);
+
+   // name
+   b = put_le(b, 8, 4);
+   memcpy(b, "contours", 8);
+   b += 12 + 4;
+
+   // envelope
+   b = put_le(b, 4, 4);
+   b = put_le(b, dbits(env->x0), 8);
+   b = put_le(b, dbits(env->y0), 8);
+   b = put_le(b, dbits(env->x1), 8);
+   b = put_le(b, dbits(env->y1), 8);
+
+   // columns, the vtable and the table of column "ele"
+   b = put_le(b, 1, 4);
+   b = put_le(b, 12, 4);
+   b = put_le(b, 8, 2);
+   b = put_le(b, 12, 2);
+   b = put_le(b, 4, 2);
+   b = put_le(b, 8, 2);
+   b = put_le(b, 8, 4);
+   b = put_le(b, 8, 4);
+   *b = FGB_DOUBLE;
+   b = put_le(b + 4, 3, 4);
+   memcpy(b, "ele", 3);
+
+   fwrite(magic, 1, sizeof(magic), f);
+   fwrite(buf, 1, sizeof(buf), f);
+}
+
+
+/*! Write the packed Hilbert R-tree of the features. The nodes are stored
+ * top down, the leaves are the features in the order of the file.
+ * @return 0 on success, -1 on error.
+ */
+static int fgb_index(FILE *f, fgb_item_t *it, long cnt)
+{
+   uint8_t buf[FGB_NODEBYTES], *b;
+   long lcnt[32], loff[32], pos, end, np, nn, off;
+   fgb_node_t *nd;
+   int nl = 0;
+
+   // number of nodes of each level bottom up, there is at least one level
+   // above the leaves
+   nn = lcnt[nl++] = np = cnt;
+   do
+   {
+      lcnt[nl++] = np = (np + FGB_NODESIZE - 1) / FGB_NODESIZE;
+      nn += np;
+   }
+   while (np != 1);
+   for (int i = 0; i < nl; i++)
+      loff[i] = (i ? loff[i - 1] : nn) - lcnt[i];
+
+   if ((nd = mt_malloc(MT_EXPORT, nn * sizeof(*nd))) == NULL)
+      return -1;
+
+   off = 0;
+   for (long i = 0; i < cnt; i++)
+   {
+      nd[loff[0] + i] = it[i].nd;
+      nd[loff[0] + i].off = off;
+      off += FGB_FEATBYTES + 16L * it[i].n;
+   }
+   for (int i = 0; i < nl - 1; i++)
+      for (pos = loff[i], end = loff[i] + lcnt[i], off = loff[i + 1]; pos < end; off++)
+      {
+         nd[off] = (fgb_node_t) {INFINITY, INFINITY, -INFINITY, -INFINITY, pos};
+         for (int j = 0; j < FGB_NODESIZE && pos < end; j++, pos++)
+            fgb_expand(&nd[off], &nd[pos]);
+      }
+
+   for (long i = 0; i < nn; i++)
+   {
+      b = put_le(buf, dbits(nd[i].x0), 8);
+      b = put_le(b, dbits(nd[i].y0), 8);
+      b = put_le(b, dbits(nd[i].x1), 8);
+      b = put_le(b, dbits(nd[i].y1), 8);
+      put_le(b, nd[i].off, 8);
+      fwrite(buf, 1, sizeof(buf), f);
+   }
+
+   mt_free(nd);
+   return 0;
+}
+
+
+/*! Write a feature of a FlatGeobuf file. Like the header, the flatbuffer
+ * has a fixed layout, just the number of coordinates varies.
+ */
+static void fgb_feature(FILE *f, const layer_t *l, int k, const memimg_t *mem)
+{
+   uint8_t buf[FGB_FEATBYTES], *b;
+   geo_iter_t g;
+   int n;
+
+   n = geo_iter(&g, l, k, mem);
+   memset(buf, 0, sizeof(buf));
+   b = put_le(buf, FGB_FEATBYTES - 4 + 16L * n, 4);
+
+   // root table, vtable and table of the feature
+   b = put_le(b, 12, 4);
+   b = put_le(b, 8, 2);
+   b = put_le(b, 12, 2);
+   b = put_le(b, 4, 2);
+   b = put_le(b, 8, 2);
+   b = put_le(b, 8, 4);
+   b = put_le(b, 44 - 16, 4);
+   b = put_le(b, 56 - 20, 4);
+
+   // vtable and table of the geometry with the fields xy and type
+   b = put_le(b, 18, 2);
+   b = put_le(b, 12, 2);
+   for (int i = 0; i < 7; i++)
+      b = put_le(b, i == 1 ? 4 : i == 6 ? 8 : 0, 2);
+   b = put_le(b + 2, 20, 4);
+   b = put_le(b, 72 - 48, 4);
+   *b = n == 1 ? GEO_POINT : GEO_LINESTRING;
+   b += 4;
+
+   // properties, column 0 is ele
+   b = put_le(b, 10, 4);
+   b = put_le(b, 0, 2);
+   b = put_le(b, dbits(geo_ele(l, k, n, mem)), 8);
+   b = put_le(b + 2, 2 * n, 4);
+
+   fwrite(buf, 1, sizeof(buf), f);
+   geo_coords(f, &g, 0);
+}
+
+
+/*! Write all contours as FlatGeobuf file with a spatial index. The
+ * features are sorted by the Hilbert index of their bounding boxes.
+ * @return 0 on success, -1 on error.
+ */
+int export_fgb(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
+{
+   fgb_item_t *it;
+   fgb_node_t env;
+   FILE *f;
+   long cnt;
+   int type, ret = 0;
+
+   if ((it = fgb_items(l, nlayers, mem, &cnt, &env, &type)) == NULL)
+   {
+      log_msg(LOG_ERR, "cannot allocate index");
+      return -1;
+   }
+
+   if ((f = out_open(s)) == NULL)
+   {
+      mt_free(it);
+      return -1;
+   }
+
+   fgb_header(f, &env, type, cnt);
+   if (cnt && fgb_index(f, it, cnt) == -1)
+   {
+      log_msg(LOG_ERR, "cannot allocate index");
+      ret = -1;
+   }
+   for (long i = 0; !ret && i < cnt; i++)
+      fgb_feature(f, &l[it[i].j], it[i].k, mem);
+
+   mt_free(it);
+   if (fclose(f) == EOF)
+      ret = -1;
+   return ret;
+}
@@ -0,0 +1,1065 @@
+/* Copyright 2020 Bernhard R. Fischer, 4096R/8E24F29D <bf@abenteuerland.at>
+ *
+ * This file is part of tracer.
+ *
+ * Tracer is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, version 3 of the License.
+ *
+ * Tracer is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with tracer. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*! \file wmvt.c
+ * This file contains the writer of Mapbox Vector Tiles. The features are
+ * those of wgis.c, their geo coordinates are projected to Web Mercator.
+ * Each zoom level is processed separately: every segment of a line is
+ * binned into the tiles which its bounding box touches (including the
+ * buffer around the tiles), then the tiles are encoded in parallel. A
+ * worker clips just the segments of its tile, thus the effort is
+ * proportional to the number of segments and not to the number of tiles.
+ * The tiles are written into a directory tree <dir>/<z>/<x>/<y>.pbf or, if
+ * the name ends with .mbtiles, gzip compressed into an MBTiles file.
+ * If the effective areas of the vertices are calculated (see lod.c), each
+ * zoom level gets just the vertices with an area of at least one square
+ * unit of the tile.
+ *
+ * @author Bernhard R. Fischer
+ * @version 2020/02/26
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <math.h>
+#include <limits.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_SQLITE
+#include <sqlite3.h>
+#endif
+#ifdef WITH_THREADS
+#include <pthread.h>
+#endif
+
+#include "scan.h"
+#include "stats.h"
+#include "smlog.h"
+#include "memtrack.h"
+
+//! coordinate range of a tile
+#define MVT_EXTENT 4096
+//! width of the border around a tile in which lines are kept
+#define MVT_BUFFER 64
+#define MVT_MAXZOOM 22
+//! maximum number of worker threads
+#define MVT_MAXTHREADS 16
+//! latitude limit of the Web Mercator projection
+#define MVT_MAXLAT 85.0511287798
+//! name of the layer of the tiles
+#define MVT_LAYER "contours"
+
+//! geometry types and commands of MVT
+enum {MVT_POINT = 1, MVT_LINESTRING};
+enum {MVT_MOVETO = 1, MVT_LINETO};
+
+
+int mvt_minzoom_ = 0;
+//! -1 means that the maximum zoom level is derived from the image size
+int mvt_maxzoom_ = -1;
+
+
+//! growing buffer of a protobuf message
+typedef struct pbuf
+{
+   uint8_t *b;
+   size_t len, size;
+   int err;
+} pbuf_t;
+
+//! feature with its vertices in world coordinates (0 - 1)
+typedef struct mvt_feat
+{
+   double ele;
+   //! index of the first vertex and number of vertices
+   long off;
+   int n;
+} mvt_feat_t;
+
+//! segment s of feature f touches the tile key = x << 32 | y
+typedef struct mvt_ref
+{
+   uint64_t key;
+   uint32_t f, s;
+} mvt_ref_t;
+
+//! tiles of one zoom level which are shared by the workers
+typedef struct mvt_job
+{
+   const mvt_feat_t *feat;
+   long nfeat;
+   const double *xy;
+   const mvt_ref_t *ref;
+   //! index of the first reference of each tile, ntiles + 1 entries
+   const long *tile;
+   long ntiles;
+   int z;
+   //! destination directory, NULL if the tiles are written to db
+   const char *dir;
+#ifdef HAVE_SQLITE
+   sqlite3_stmt *ins;
+#endif
+   //! next tile, number of tiles written and their size
+   long next, count, bytes;
+   int err;
+#ifdef WITH_THREADS
+   pthread_mutex_t mutex;
+#endif
+} mvt_job_t;
+
+typedef struct mvt_worker
+{
+   mvt_job_t *job;
+   //! features of the layer, one feature, its geometry, the layer, and the
+   //! tile
+   pbuf_t feat, fmsg, geom, layer, tile;
+   //! values of the attribute ele in the tile
+   double *val;
+   int nval, vsize;
+   //! vertices of the current part in tile coordinates
+   int *pt;
+   long npt, ptsize;
+   //! cursor of the geometry commands
+   int cx, cy;
+#ifdef WITH_THREADS
+   pthread_t th;
+   int running;
+#endif
+} mvt_worker_t;
+
+
+static uint8_t *pb_grow(pbuf_t *b, size_t n)
+{
+   uint8_t *p;
+   size_t size;
+
+   if (b->err)
+      return NULL;
+
+   if (b->len + n > b->size)
+   {
+      for (size = b->size ? b->size : 256; size < b->len + n; size *= 2);
+      if ((p = mt_realloc(MT_EXPORT, b->b, size)) == NULL)
+      {
+         b->err = -1;
+         return NULL;
+      }
+      b->b = p;
+      b->size = size;
+   }
+   return b->b + b->len;
+}
+
+
+static void pb_varint(pbuf_t *b, uint64_t v)
+{
+   uint8_t *p;
+
+   if ((p = pb_grow(b, 10)) == NULL)
+      return;
+   for (; v >= 0x80; v >>= 7)
+      *p++ = v | 0x80;
+   *p++ = v;
+   b->len = p - b->b;
+}
+
+
+static void pb_bytes(pbuf_t *b, const void *d, size_t n)
+{
+   uint8_t *p;
+
+   if ((p = pb_grow(b, n)) == NULL)
+      return;
+   memcpy(p, d, n);
+   b->len += n;
+}
+
+
+//! wire types of protobuf
+enum {PB_VARINT, PB_I64, PB_LEN};
+
+static void pb_key(pbuf_t *b, int field, int wire)
+{
+   pb_varint(b, field << 3 | wire);
+}
+
+
+static void pb_msg(pbuf_t *b, int field, const void *d, size_t n)
+{
+   pb_key(b, field, PB_LEN);
+   pb_varint(b, n);
+   pb_bytes(b, d, n);
+}
+
+
+static void pb_double(pbuf_t *b, int field, double d)
+{
+   uint8_t v[8];
+   uint64_t u;
+
+   memcpy(&u, &d, sizeof(u));
+   for (int i = 0; i < 8; i++, u >>= 8)
+      v[i] = u;
+   pb_key(b, field, PB_I64);
+   pb_bytes(b, v, sizeof(v));
+}
+
+
+static void pb_free(pbuf_t *b)
+{
+   mt_free(b->b);
+   memset(b, 0, sizeof(*b));
+}
+
+
+static unsigned zigzag(int v)
+{
+   return ((unsigned) v << 1) ^ (unsigned) (v >> 31);
+}
+
+
+/*! Project geo coordinates to world coordinates of Web Mercator (0 - 1,
+ * y points south).
+ */
+static void mvt_project(double lon, double lat, double *x, double *y)
+{
+   lat = fmax(fmin(lat, MVT_MAXLAT), -MVT_MAXLAT) * M_PI / 180;
+   *x = (lon + 180) / 360;
+   *y = (1 - asinh(tan(lat)) / M_PI) / 2;
+}
+
+
+/*! Collect all features and project their vertices.
+ * @param cnt Pointer to a variable which receives the number of features.
+ * @param xy Pointer to a variable which receives the vertices.
+ * @param area Pointer to a variable which receives the effective areas of
+ * the vertices, or NULL if they were not calculated.
+ * @param bounds Bounding box of the features in geo coordinates (west,
+ * south, east, north).
+ * @return Array of features or NULL on error.
+ */
+static mvt_feat_t *mvt_features(const layer_t *l, int nlayers, const memimg_t *mem, long *cnt, double **xy, float **area, double *bounds)
+{
+   mvt_feat_t *feat, *f;
+   geo_iter_t g;
+   double lon, lat;
+   long nf = 0, nv = 0;
+   int n, lod = 1;
+
+   for (int j = 0; j < nlayers; j++)
+   {
+      lod &= !l[j].plist_cnt || l[j].lod != NULL;
+      for (int k = 0; k < l[j].plist_cnt; k++)
+         if ((n = geo_iter(&g, &l[j], k, mem)))
+         {
+            nf++;
+            nv += n;
+         }
+   }
+
+   *area = NULL;
+   if ((feat = mt_malloc(MT_EXPORT, (nf + 1) * sizeof(*feat))) == NULL)
+      return NULL;
+   if ((*xy = mt_malloc(MT_EXPORT, (2 * nv + 1) * sizeof(**xy))) == NULL
+         || (lod && (*area = mt_malloc(MT_EXPORT, (nv + 1) * sizeof(**area))) == NULL))
+   {
+      mt_free(*xy);
+      mt_free(feat);
+      return NULL;
+   }
+
+   bounds[0] = bounds[1] = INFINITY;
+   bounds[2] = bounds[3] = -INFINITY;
+   nv = 0;
+   *cnt = 0;
+   for (int j = 0; j < nlayers; j++)
+      for (int k = 0; k < l[j].plist_cnt; k++)
+      {
+         if (!(n = geo_iter(&g, &l[j], k, mem)))
+            continue;
+         f = &feat[(*cnt)++];
+         f->ele = geo_ele(&l[j], k, n, mem);
+         f->off = nv;
+         // the vertices are those of the contour in the same order
+         for (int i = 0; geo_next(&g, &lon, &lat); i++)
+         {
+            if (*area != NULL)
+               (*area)[nv] = l[j].lod[k][i];
+            mvt_project(lon, lat, &(*xy)[2 * nv], &(*xy)[2 * nv + 1]);
+            bounds[0] = fmin(bounds[0], lon);
+            bounds[1] = fmin(bounds[1], lat);
+            bounds[2] = fmax(bounds[2], lon);
+            bounds[3] = fmax(bounds[3], lat);
+            nv++;
+         }
+         f->n = nv - f->off;
+      }
+
+   // the offset behind the last feature is the number of vertices
+   feat[*cnt].off = nv;
+   feat[*cnt].n = 0;
+   if (!*cnt)
+      bounds[0] = bounds[1] = bounds[2] = bounds[3] = 0;
+   return feat;
+}
+
+
+/*! Copy the features with just the vertices of an effective area >= tol.
+ * @param dst Pointer to nf features which receive the copies.
+ * @param dxy Pointer to the vertices of the copies, it must be as large as
+ * xy.
+ */
+static void mvt_lod(const mvt_feat_t *feat, long nf, const double *xy, const float *area, double tol, mvt_feat_t *dst, double *dxy)
+{
+   long nv = 0;
+
+   for (long f = 0; f < nf; f++)
+   {
+      dst[f] = feat[f];
+      dst[f].off = nv;
+      for (long i = feat[f].off; i < feat[f].off + feat[f].n; i++)
+         if (area[i] >= tol)
+         {
+            dxy[2 * nv] = xy[2 * i];
+            dxy[2 * nv + 1] = xy[2 * i + 1];
+            nv++;
+         }
+      dst[f].n = nv - dst[f].off;
+   }
+}
+
+
+static int ref_cmp(const void *a, const void *b)
+{
+   const mvt_ref_t *x = a, *y = b;
+
+   if (x->key != y->key)
+      return x->key < y->key ? -1 : 1;
+   if (x->f != y->f)
+      return x->f < y->f ? -1 : 1;
+   return x->s < y->s ? -1 : x->s > y->s;
+}
+
+
+static int tile_clamp(double v, int max)
+{
+   return v < 0 ? 0 : v >= max ? max - 1 : (int) v;
+}
+
+
+/*! Bin the segments of all features into the tiles of zoom level z.
+ * @param ref Pointer to a variable which receives the array of references
+ * sorted by tile, feature, and segment, NULL if there are none.
+ * @param cnt Pointer to a variable which receives the number of references.
+ * @return 0 on success, -1 on error.
+ */
+static int mvt_bin(const mvt_feat_t *feat, long nf, const double *xy, int z, mvt_ref_t **ref, long *cnt)
+{
+   double sc = ldexp(1, z), b = (double) MVT_BUFFER / MVT_EXTENT;
+   const double *p;
+   mvt_ref_t *r;
+   long size = 0;
+   int max = 1 << z, tx0, ty0, tx1, ty1;
+
+   *ref = NULL;
+   *cnt = 0;
+   for (long f = 0; f < nf; f++)
+      for (int s = 0; s < (feat[f].n > 1 ? feat[f].n - 1 : 1); s++)
+      {
+         p = xy + 2 * (feat[f].off + s);
+         // a point is just in the tile which contains it
+         if (feat[f].n == 1)
+         {
+            tx0 = tx1 = tile_clamp(p[0] * sc, max);
+            ty0 = ty1 = tile_clamp(p[1] * sc, max);
+         }
+         else
+         {
+            tx0 = tile_clamp(fmin(p[0], p[2]) * sc - b, max);
+            tx1 = tile_clamp(fmax(p[0], p[2]) * sc + b, max);
+            ty0 = tile_clamp(fmin(p[1], p[3]) * sc - b, max);
+            ty1 = tile_clamp(fmax(p[1], p[3]) * sc + b, max);
+         }
+
+         for (int tx = tx0; tx <= tx1; tx++)
+            for (int ty = ty0; ty <= ty1; ty++)
+            {
+               if (*cnt >= size)
+               {
+                  size = size ? size * 2 : 4096;
+                  if ((r = mt_realloc(MT_EXPORT, *ref, size * sizeof(*r))) == NULL)
+                  {
+                     mt_free(*ref);
+                     *ref = NULL;
+                     return -1;
+                  }
+                  *ref = r;
+               }
+               (*ref)[(*cnt)++] = (mvt_ref_t) {(uint64_t) tx << 32 | ty, f, s};
+            }
+      }
+
+   if (*ref != NULL)
+      qsort(*ref, *cnt, sizeof(**ref), ref_cmp);
+   return 0;
+}
+
+
+/*! Clip the segment a - b to the tile including its buffer with the
+ * algorithm of Liang-Barsky.
+ * @param t Receives the parameters of the start and end of the clipped
+ * segment (0 - 1).
+ * @return 1 if a part of the segment is inside, otherwise 0.
+ */
+static int mvt_clip(const double *a, const double *b, double *t)
+{
+   double d[2] = {b[0] - a[0], b[1] - a[1]}, p, q, r;
+
+   t[0] = 0;
+   t[1] = 1;
+   for (int i = 0; i < 4; i++)
+   {
+      // p * t <= q for the borders left, right, top, bottom
+      p = i & 1 ? d[i >> 1] : -d[i >> 1];
+      q = i & 1 ? MVT_EXTENT + MVT_BUFFER - a[i >> 1] : a[i >> 1] + MVT_BUFFER;
+
+      if (p == 0)
+      {
+         if (q < 0)
+            return 0;
+         continue;
+      }
+      r = q / p;
+      if (p < 0)
+         t[0] = fmax(t[0], r);
+      else
+         t[1] = fmin(t[1], r);
+   }
+   return t[0] <= t[1];
+}
+
+
+static void pt_add(mvt_worker_t *w, int x, int y)
+{
+   long size;
+   int *p;
+
+   if (w->npt && w->pt[2 * w->npt - 2] == x && w->pt[2 * w->npt - 1] == y)
+      return;
+   if (w->npt >= w->ptsize)
+   {
+      size = 2 * w->ptsize + 256;
+      if ((p = mt_realloc(MT_EXPORT, w->pt, 2 * size * sizeof(*p))) == NULL)
+      {
+         w->geom.err = -1;
+         return;
+      }
+      w->pt = p;
+      w->ptsize = size;
+   }
+   w->pt[2 * w->npt] = x;
+   w->pt[2 * w->npt + 1] = y;
+   w->npt++;
+}
+
+
+/*! Encode the vertices of the current part as geometry commands.
+ */
+static void pt_flush(mvt_worker_t *w, int type)
+{
+   if (w->npt >= (type == MVT_POINT ? 1 : 2))
+      for (long i = 0; i < w->npt; i++)
+      {
+         if (i < 2)
+            pb_varint(&w->geom, !i ? MVT_MOVETO | 1 << 3 : MVT_LINETO | (w->npt - 1) << 3);
+         pb_varint(&w->geom, zigzag(w->pt[2 * i] - w->cx));
+         pb_varint(&w->geom, zigzag(w->pt[2 * i + 1] - w->cy));
+         w->cx = w->pt[2 * i];
+         w->cy = w->pt[2 * i + 1];
+      }
+   w->npt = 0;
+}
+
+
+/*! Add the clipped geometry of feature f to the tile.
+ * @param ref References of the segments of f in the tile.
+ * @param n Number of references.
+ */
+static void mvt_feature(mvt_worker_t *w, const mvt_ref_t *ref, long n, int tx, int ty)
+{
+   const mvt_job_t *job = w->job;
+   const mvt_feat_t *f = &job->feat[ref->f];
+   double sc = ldexp(MVT_EXTENT, job->z), a[2], b[2], t[2], t1 = 0;
+   const double *p;
+   int type = f->n == 1 ? MVT_POINT : MVT_LINESTRING, vi;
+
+   w->geom.len = 0;
+   w->cx = w->cy = 0;
+   w->npt = 0;
+
+   for (long i = 0; i < n; i++)
+   {
+      p = job->xy + 2 * (f->off + ref[i].s);
+      a[0] = p[0] * sc - (double) tx * MVT_EXTENT;
+      a[1] = p[1] * sc - (double) ty * MVT_EXTENT;
+      if (type == MVT_POINT)
+      {
+         if (a[0] >= 0 && a[0] < MVT_EXTENT && a[1] >= 0 && a[1] < MVT_EXTENT)
+            pt_add(w, lround(a[0]), lround(a[1]));
+         break;
+      }
+
+      b[0] = p[2] * sc - (double) tx * MVT_EXTENT;
+      b[1] = p[3] * sc - (double) ty * MVT_EXTENT;
+      if (!mvt_clip(a, b, t))
+      {
+         pt_flush(w, type);
+         t1 = 0;
+         continue;
+      }
+      // a new part starts unless the previous segment left the tile where
+      // this one enters
+      if (!i || ref[i].s != ref[i - 1].s + 1 || t1 < 1 || t[0] > 0)
+      {
+         pt_flush(w, type);
+         pt_add(w, lround(a[0] + t[0] * (b[0] - a[0])), lround(a[1] + t[0] * (b[1] - a[1])));
+      }
+      pt_add(w, lround(a[0] + t[1] * (b[0] - a[0])), lround(a[1] + t[1] * (b[1] - a[1])));
+      t1 = t[1];
+   }
+   pt_flush(w, type);
+
+   if (!w->geom.len)
+      return;
+
+   for (vi = 0; vi < w->nval && w->val[vi] != f->ele; vi++);
+   if (vi >= w->nval)
+   {
+      if (w->nval >= w->vsize)
+      {
+         double *v;
+
+         if ((v = mt_realloc(MT_EXPORT, w->val, (w->vsize + 64) * sizeof(*v))) == NULL)
+         {
+            w->feat.err = -1;
+            return;
+         }
+         w->val = v;
+         w->vsize += 64;
+      }
+      w->val[w->nval++] = f->ele;
+   }
+
+   // tags (key 0 = ele), type, and geometry
+   w->fmsg.len = 0;
+   pb_key(&w->fmsg, 2, PB_LEN);
+   pb_varint(&w->fmsg, 2 + (vi >= 0x80) + (vi >= 0x4000) + (vi >= 0x200000));
+   pb_varint(&w->fmsg, 0);
+   pb_varint(&w->fmsg, vi);
+   pb_key(&w->fmsg, 3, PB_VARINT);
+   pb_varint(&w->fmsg, type);
+   pb_msg(&w->fmsg, 4, w->geom.b, w->geom.len);
+   pb_msg(&w->feat, 2, w->fmsg.b, w->fmsg.len);
+}
+
+
+/*! Store a tile in the directory tree or in the MBTiles file.
+ * @return 0 on success, -1 on error.
+ */
+static int mvt_put(mvt_worker_t *w, int tx, int ty)
+{
+   mvt_job_t *job = w->job;
+   char path[PATH_MAX];
+   const uint8_t *data = w->tile.b;
+   size_t len = w->tile.len;
+   int fd, err = 0;
+   ssize_t n;
+
+   if (job->dir != NULL)
+   {
+      snprintf(path, sizeof(path), "%s/%d/%d/%d.pbf", job->dir, job->z, tx, ty);
+      if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) == -1)
+      {
+         log_errno(LOG_ERR, "open()");
+         return -1;
+      }
+      for (size_t pos = 0; pos < len; pos += n)
+         if ((n = write(fd, data + pos, len - pos)) == -1)
+         {
+            log_errno(LOG_ERR, "write()");
+            err = -1;
+            break;
+         }
+      if (close(fd) == -1)
+         err = -1;
+   }
+#ifdef HAVE_SQLITE
+   else
+   {
+      z_stream zs;
+      uint8_t *z;
+
+      // MBTiles contain gzip compressed tiles
+      memset(&zs, 0, sizeof(zs));
+      if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+         return -1;
+      if ((z = mt_malloc(MT_EXPORT, deflateBound(&zs, len))) == NULL)
+      {
+         deflateEnd(&zs);
+         return -1;
+      }
+      zs.next_in = (uint8_t*) data;
+      zs.avail_in = len;
+      zs.next_out = z;
+      zs.avail_out = deflateBound(&zs, len);
+      if (deflate(&zs, Z_FINISH) != Z_STREAM_END)
+         err = -1;
+      len = zs.total_out;
+      deflateEnd(&zs);
+
+#ifdef WITH_THREADS
+      pthread_mutex_lock(&job->mutex);
+#endif
+      // the rows of MBTiles are numbered from south to north
+      sqlite3_bind_int(job->ins, 1, job->z);
+      sqlite3_bind_int(job->ins, 2, tx);
+      sqlite3_bind_int(job->ins, 3, (1 << job->z) - 1 - ty);
+      sqlite3_bind_blob(job->ins, 4, z, len, SQLITE_STATIC);
+      if (!err && sqlite3_step(job->ins) != SQLITE_DONE)
+      {
+         log_msg(LOG_ERR, "cannot insert tile: %s", sqlite3_errmsg(sqlite3_db_handle(job->ins)));
+         err = -1;
+      }
+      sqlite3_reset(job->ins);
+#ifdef WITH_THREADS
+      pthread_mutex_unlock(&job->mutex);
+#endif
+      mt_free(z);
+   }
+#endif
+
+#ifdef WITH_THREADS
+   pthread_mutex_lock(&job->mutex);
+#endif
+   job->count++;
+   job->bytes += len;
+#ifdef WITH_THREADS
+   pthread_mutex_unlock(&job->mutex);
+#endif
+   return err;
+}
+
+
+/*! Encode and store tile t of the job.
+ * @return 0 on success, -1 on error.
+ */
+static int mvt_tile(mvt_worker_t *w, long t)
+{
+   const mvt_job_t *job = w->job;
+   const mvt_ref_t *ref = job->ref + job->tile[t];
+   long n = job->tile[t + 1] - job->tile[t], m;
+   int tx = ref->key >> 32, ty = ref->key & 0xffffffff;
+
+   w->feat.len = 0;
+   w->nval = 0;
+   for (long i = 0; i < n; i += m)
+   {
+      for (m = 1; i + m < n && ref[i + m].f == ref[i].f; m++);
+      mvt_feature(w, ref + i, m, tx, ty);
+   }
+   if (w->feat.err || w->geom.err || w->fmsg.err)
+      return -1;
+   // tiles in which all segments are within the buffer are empty
+   if (!w->feat.len)
+      return 0;
+
+   w->layer.len = 0;
+   pb_key(&w->layer, 15, PB_VARINT);
+   pb_varint(&w->layer, 2);
+   pb_msg(&w->layer, 1, MVT_LAYER, strlen(MVT_LAYER));
+   pb_bytes(&w->layer, w->feat.b, w->feat.len);
+   pb_msg(&w->layer, 3, "ele", 3);
+   for (int i = 0; i < w->nval; i++)
+   {
+      pb_key(&w->layer, 4, PB_LEN);
+      pb_varint(&w->layer, 9);
+      pb_double(&w->layer, 3, w->val[i]);
+   }
+   pb_key(&w->layer, 5, PB_VARINT);
+   pb_varint(&w->layer, MVT_EXTENT);
+
+   w->tile.len = 0;
+   pb_msg(&w->tile, 3, w->layer.b, w->layer.len);
+   if (w->layer.err || w->tile.err)
+      return -1;
+
+   return mvt_put(w, tx, ty);
+}
+
+
+static void *mvt_worker(void *p)
+{
+   mvt_worker_t *w = p;
+   mvt_job_t *job = w->job;
+   long t;
+
+   for (;;)
+   {
+#ifdef WITH_THREADS
+      pthread_mutex_lock(&job->mutex);
+#endif
+      t = job->next < job->ntiles && !job->err ? job->next++ : -1;
+#ifdef WITH_THREADS
+      pthread_mutex_unlock(&job->mutex);
+#endif
+      if (t == -1)
+         break;
+
+      if (mvt_tile(w, t) == -1)
+      {
+#ifdef WITH_THREADS
+         pthread_mutex_lock(&job->mutex);
+#endif
+         job->err = -1;
+#ifdef WITH_THREADS
+         pthread_mutex_unlock(&job->mutex);
+#endif
+      }
+   }
+
+   return NULL;
+}
+
+
+/*! Create the directories of a zoom level, they are created before the
+ * workers start because several workers may write into the same directory.
+ * @return 0 on success, -1 on error.
+ */
+static int mvt_mkdir(const mvt_job_t *job)
+{
+   char path[PATH_MAX];
+   int x = -1;
+
+   for (long t = 0; t < job->ntiles; t++)
+   {
+      if ((int) (job->ref[job->tile[t]].key >> 32) == x)
+         continue;
+      x = job->ref[job->tile[t]].key >> 32;
+      for (int i = 0; i < 2; i++)
+      {
+         if (!i)
+            snprintf(path, sizeof(path), "%s/%d", job->dir, job->z);
+         else
+            snprintf(path, sizeof(path), "%s/%d/%d", job->dir, job->z, x);
+         if (mkdir(path, 0777) == -1 && errno != EEXIST)
+         {
+            log_errno(LOG_ERR, "mkdir()");
+            return -1;
+         }
+      }
+   }
+   return 0;
+}
+
+
+/*! Encode all tiles of zoom level z with a set of workers.
+ * @return 0 on success, -1 on error.
+ */
+static int mvt_zoom(mvt_job_t *job, int nth)
+{
+   mvt_worker_t w[MVT_MAXTHREADS];
+   mvt_ref_t *ref;
+   long *tile, cnt;
+   int err;
+
+   if (mvt_bin(job->feat, job->nfeat, job->xy, job->z, &ref, &cnt) == -1)
+   {
+      log_msg(LOG_ERR, "cannot allocate the tiles of zoom level %d", job->z);
+      return -1;
+   }
+   // no features
+   if (ref == NULL)
+      return 0;
+
+   // index of the first reference of each tile
+   if ((tile = mt_malloc(MT_EXPORT, (cnt + 1) * sizeof(*tile))) == NULL)
+   {
+      mt_free(ref);
+      return -1;
+   }
+   job->ntiles = 0;
+   for (long i = 0; i < cnt; i++)
+      if (!i || ref[i].key != ref[i - 1].key)
+         tile[job->ntiles++] = i;
+   tile[job->ntiles] = cnt;
+   job->ref = ref;
+   job->tile = tile;
+   job->next = 0;
+
+   if (job->dir != NULL && mvt_mkdir(job) == -1)
+      job->err = -1;
+
+   memset(w, 0, sizeof(w));
+   for (int i = 0; i < nth; i++)
+   {
+      w[i].job = job;
+#ifdef WITH_THREADS
+      if (i)
+         w[i].running = !pthread_create(&w[i].th, NULL, mvt_worker, &w[i]);
+#endif
+   }
+   // the calling thread is the first worker
+   mvt_worker(&w[0]);
+
+   for (int i = 0; i < nth; i++)
+   {
+#ifdef WITH_THREADS
+      if (w[i].running)
+         pthread_join(w[i].th, NULL);
+#endif
+      pb_free(&w[i].feat);
+      pb_free(&w[i].fmsg);
+      pb_free(&w[i].geom);
+      pb_free(&w[i].layer);
+      pb_free(&w[i].tile);
+      mt_free(w[i].val);
+      mt_free(w[i].pt);
+   }
+
+   err = job->err;
+   mt_free(tile);
+   mt_free(ref);
+   return err;
+}
+
+
+/*! Write the metadata of the tiles, a TileJSON file into the directory or
+ * the table metadata of the MBTiles file.
+ * @return 0 on success, -1 on error.
+ */
+static int mvt_metadata(const char *dir, void *db, const double *bounds, int minz, int maxz)
+{
+   char val[4][256];
+   const char *key[] = {"name", "format", "bounds", "minzoom", "maxzoom", "json"};
+   FILE *f;
+   int err = 0;
+
+   snprintf(val[0], sizeof(val[0]), "%f,%f,%f,%f", bounds[0], bounds[1], bounds[2], bounds[3]);
+   snprintf(val[1], sizeof(val[1]), "%d", minz);
+   snprintf(val[2], sizeof(val[2]), "%d", maxz);
+   snprintf(val[3], sizeof(val[3]), "{\"vector_layers\":[{\"id\":\"%s\",\"fields\":{\"ele\":\"Number\"},\"minzoom\":%d,\"maxzoom\":%d}]}",
+         MVT_LAYER, minz, maxz);
+
+   if (dir != NULL)
+   {
+      char path[PATH_MAX];
+
+      snprintf(path, sizeof(path), "%s/metadata.json", dir);
+      if ((f = fopen(path, "w")) == NULL)
+      {
+         log_errno(LOG_ERR, "fopen()");
+         return -1;
+      }
+      fprintf(f, "{\"tilejson\":\"3.0.0\",\"name\":\"%s\",\"format\":\"pbf\",\"tiles\":[\"{z}/{x}/{y}.pbf\"],"
+            "\"bounds\":[%s],\"minzoom\":%s,\"maxzoom\":%s,%s\n", MVT_LAYER, val[0], val[1], val[2], val[3] + 1);
+      return fclose(f) == EOF ? -1 : 0;
+   }
+
+#ifdef HAVE_SQLITE
+   sqlite3_stmt *st;
+
+   if (sqlite3_prepare_v2(db, "INSERT INTO metadata VALUES (?, ?)", -1, &st, NULL) != SQLITE_OK)
+      return -1;
+   for (int i = 0; i < 6 && !err; i++)
+   {
+      sqlite3_bind_text(st, 1, key[i], -1, SQLITE_STATIC);
+      sqlite3_bind_text(st, 2, !i ? MVT_LAYER : i == 1 ? "pbf" : val[i - 2], -1, SQLITE_STATIC);
+      if (sqlite3_step(st) != SQLITE_DONE)
+         err = -1;
+      sqlite3_reset(st);
+   }
+   sqlite3_finalize(st);
+#else
+   (void) db;
+   (void) key;
+#endif
+   return err;
+}
+
+
+#ifdef HAVE_SQLITE
+/*! Create an MBTiles file.
+ * @return The database or NULL on error.
+ */
+static sqlite3 *mbt_open(const char *s, sqlite3_stmt **ins)
+{
+   sqlite3 *db;
+
+   if (unlink(s) == -1 && errno != ENOENT)
+   {
+      log_errno(LOG_ERR, "unlink()");
+      return NULL;
+   }
+   if (sqlite3_open(s, &db) != SQLITE_OK
+         || sqlite3_exec(db, "PRAGMA synchronous = OFF; PRAGMA journal_mode = OFF;"
+            "CREATE TABLE metadata (name text, value text);"
+            "CREATE TABLE tiles (zoom_level integer, tile_column integer, tile_row integer, tile_data blob);"
+            "CREATE UNIQUE INDEX tile_index ON tiles (zoom_level, tile_column, tile_row);"
+            "BEGIN;", NULL, NULL, NULL) != SQLITE_OK
+         || sqlite3_prepare_v2(db, "INSERT INTO tiles VALUES (?, ?, ?, ?)", -1, ins, NULL) != SQLITE_OK)
+   {
+      log_msg(LOG_ERR, "cannot create %s: %s", s, sqlite3_errmsg(db));
+      sqlite3_close(db);
+      return NULL;
+   }
+   return db;
+}
+#endif
+
+
+/*! Write all contours as vector tiles of the zoom levels mvt_minzoom_ to
+ * mvt_maxzoom_.
+ * @param s Name of the directory, or of the MBTiles file if it ends with
+ * .mbtiles.
+ * @return 0 on success, -1 on error.
+ */
+int export_mvt(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
+{
+   size_t len = strlen(s);
+   int mbt = len > 8 && !strcasecmp(s + len - 8, ".mbtiles"), nth = 1, minz = mvt_minzoom_, maxz = mvt_maxzoom_;
+   mvt_feat_t *feat, *zfeat = NULL;
+   mvt_job_t job;
+   double *xy, *zxy = NULL, bounds[4], u;
+   float *area;
+   long nf;
+   void *db = NULL;
+
+   if (!strcmp(s, "-"))
+   {
+      log_msg(LOG_ERR, "cannot write tiles to standard output");
+      return -1;
+   }
+#ifndef HAVE_SQLITE
+   if (mbt)
+   {
+      log_msg(LOG_ERR, "compiled without SQLite support, cannot write %s", s);
+      return -1;
+   }
+#endif
+
+   // about 256 pixels of the image per tile at the maximum zoom level
+   if (maxz < 0)
+      maxz = ceil(log2(360.0 * mem->width / (osm_scale_ * 256)));
+   if (maxz > MVT_MAXZOOM)
+      maxz = MVT_MAXZOOM;
+   if (maxz < minz)
+      maxz = minz;
+
+   if ((feat = mvt_features(l, nlayers, mem, &nf, &xy, &area, bounds)) == NULL)
+   {
+      log_msg(LOG_ERR, "cannot allocate features");
+      return -1;
+   }
+
+   memset(&job, 0, sizeof(job));
+   job.feat = feat;
+   job.nfeat = nf;
+   job.xy = xy;
+   if (area != NULL)
+   {
+      if ((zfeat = mt_malloc(MT_EXPORT, (nf + 1) * sizeof(*zfeat))) == NULL
+            || (zxy = mt_malloc(MT_EXPORT, (2 * feat[nf].off + 1) * sizeof(*zxy))) == NULL)
+      {
+         log_msg(LOG_ERR, "cannot allocate features");
+         job.err = -1;
+      }
+      job.feat = zfeat;
+      job.xy = zxy;
+   }
+   if (mbt)
+   {
+#ifdef HAVE_SQLITE
+      if ((db = mbt_open(s, &job.ins)) == NULL)
+         job.err = -1;
+#endif
+   }
+   else if (mkdir(s, 0777) == -1 && errno != EEXIST)
+   {
+      log_errno(LOG_ERR, "mkdir()");
+      job.err = -1;
+   }
+   else
+      job.dir = s;
+
+#ifdef WITH_THREADS
+   pthread_mutex_init(&job.mutex, NULL);
+   if ((nth = sysconf(_SC_NPROCESSORS_ONLN)) < 1)
+      nth = 1;
+   if (nth > MVT_MAXTHREADS)
+      nth = MVT_MAXTHREADS;
+#endif
+
+   for (int z = minz; z <= maxz && !job.err; z++)
+   {
+      job.z = z;
+      job.count = 0;
+      if (area != NULL)
+      {
+         // size of a unit of the tile in pixels
+         u = 360.0 * mem->width / (osm_scale_ * ldexp(MVT_EXTENT, z));
+         mvt_lod(feat, nf, xy, area, u * u, zfeat, zxy);
+      }
+      if (mvt_zoom(&job, nth) == -1)
+         job.err = -1;
+      else
+         log_msg(LOG_INFO, "zoom level %d: %ld tiles", z, job.count);
+      if (job.dir != NULL)
+         stats_add_bytes(ST_EXPORT_MVT, job.bytes);
+      job.bytes = 0;
+   }
+
+   if (!job.err && mvt_metadata(job.dir, db, bounds, minz, maxz) == -1)
+      job.err = -1;
+
+#ifdef HAVE_SQLITE
+   if (db != NULL)
+   {
+      sqlite3_finalize(job.ins);
+      if (sqlite3_exec(db, "COMMIT;", NULL, NULL, NULL) != SQLITE_OK || sqlite3_close(db) != SQLITE_OK)
+      {
+         log_msg(LOG_ERR, "cannot write %s", s);
+         job.err = -1;
+      }
+   }
+#endif
+#ifdef WITH_THREADS
+   pthread_mutex_destroy(&job.mutex);
+#endif
+
+   mt_free(zxy);
+   mt_free(zfeat);
+   mt_free(area);
+   mt_free(xy);
+   mt_free(feat);
+   return job.err;
+}
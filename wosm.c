@@ -38,16 +38,16 @@ static int64_t node_id(int i, int n)
 }
 
 
-static void osmway(FILE *f, const pos_t *p, int n, int id, int v)
+static void osmway(FILE *f, const layer_t *l, int k, int id)
 {
-   int c = 0;
+   int c, n = l->n[k];
 
    if (n <= 1)
       return;
 
-   c = p[0].x == p[n - 1].x && p[0].y == p[n - 1].y;
+   c = contour_closed(l, k);
 
-   fprintf(f, "<way id='%d' action='modify' visible='true'>\n<tag k=\"ele\" v=\"%d\"/>\n", -id, v);
+   fprintf(f, "<way id='%d' action='modify' visible='true'>\n<tag k=\"ele\" v=\"%g\"/>\n", -id, val_real(l->v));
 
    for (int i = 0; i < n - c; i++)
       fprintf(f, "<nd ref=\"%ld\"/>\n", -node_id(i + 1, id));
@@ -59,23 +59,40 @@ static void osmway(FILE *f, const pos_t *p, int n, int id, int v)
 }
 
 
+/*! Transform the position of a vertex to geo coordinates.
+ */
+void osm_coord(const pos_t *p, const memimg_t *mem, double *lon, double *lat)
+{
+   *lon = (double) p->xf / mem->width * osm_scale_;
+   *lat = (double) (mem->height - p->yf - 1) / mem->height * osm_scale_;
+}
+
+
 static void osmnode(FILE *f, const pos_t *p, int64_t id, int peak, memimg_t *mem)
 {
-   fprintf(f, "<node id=\"%ld\" action=\"modify\" lon=\"%f\" lat=\"%f\" visible=\"true\">\n", id, (double) p->xf / mem->width * osm_scale_, (double) (mem->height - p->yf - 1) / mem->height * osm_scale_);
+   double lon, lat;
+
+   osm_coord(p, mem, &lon, &lat);
+   fprintf(f, "<node id=\"%ld\" action=\"modify\" lon=\"%f\" lat=\"%f\" visible=\"true\">\n", id, lon, lat);
    fprintf(f, "<tag k=\"random\" v=\"%f\"/>\n", (double) random() / RAND_MAX);
    if (peak)
-      fprintf(f, "<tag k=\"summit\" v=\"yes\"/>\n<tag k=\"ele\" v=\"%d\"/>\n", peak);
+      fprintf(f, "<tag k=\"summit\" v=\"yes\"/>\n<tag k=\"ele\" v=\"%g\"/>\n", val_real(peak));
    fprintf(f, "</node>");
 }
 
 
-static void osmnodelist(FILE *f, const pos_t *p, int n, int id, memimg_t *mem)
+static void osmnodelist(FILE *f, const layer_t *l, int k, int id, memimg_t *mem)
 {
-   if (n > 1 && p[0].x == p[n - 1].x && p[0].y == p[n - 1].y)
+   chain_iter_t it;
+   pos_t p;
+   int n = l->n[k];
+
+   if (contour_closed(l, k))
       n--;
 
-   for (int i = 0; i < n; i++)
-      osmnode(f, &p[i], -node_id(i + 1, id), n == 1 ? memimg_get(mem, p[0].x, p[0].y) & ~VALL : 0, mem);
+   contour_iter(&it, l, k);
+   for (int i = 0; i < n && contour_next(&it, &p); i++)
+      osmnode(f, &p, -node_id(i + 1, id), n == 1 ? memimg_get(mem, p.x, p.y) & ~VALL : 0, mem);
 }
 
 
@@ -96,7 +113,7 @@ int export_osm(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
    FILE *f;
    int i, j;
 
-   if ((f = fopen(s, "w")) == NULL)
+   if ((f = out_open(s)) == NULL)
       return -1;
 
    startosm(f);
@@ -104,18 +121,17 @@ int export_osm(const layer_t *l, const char *s, int nlayers, memimg_t *mem)
    for (j = 0; j < nlayers; j++)
    {
       for (i = 0; i < l[j].plist_cnt; i++)
-         osmnodelist(f, l[j].plist[i], l[j].n[i], (i + 1) | (j << 16), mem);
+         osmnodelist(f, &l[j], i, (i + 1) | (j << 16), mem);
    }
 
    for (j = 0; j < nlayers; j++)
    {
       for (i = 0; i < l[j].plist_cnt; i++)
-         osmway(f, l[j].plist[i], l[j].n[i], (i + 1) | (j << 16), l[j].v);
+         osmway(f, &l[j], i, (i + 1) | (j << 16));
    }
 
    endosm(f);
-   fclose(f);
 
-   return 0;
+   return fclose(f) == EOF ? -1 : 0;
 }
 